@@ -6,8 +6,13 @@
  */
 
 #include "Messaging.h"
+#include "Timer.h"
 #include "TRACE.h"
 #include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <algorithm>
 
 #define mSleep(x) (usleep(x*1000))
 
@@ -17,13 +22,114 @@
 CMessaging::CMessaging() {
     m_uSendRetry = SEND_RETRY;
     m_uSendRetryDelay = SEND_RETRY_DELAY;
+    m_uSendDeadlineMs = 0;
+    m_pMessageCallback = NULL;
+    m_pMessageUser = NULL;
+    m_pViewCallback = NULL;
+    m_pBatchCallback = NULL;
+    m_pBatchUser = NULL;
+    m_pViewUser = NULL;
+    m_bReceiveStaged = false;
+    m_uViewFill = 0;
+    m_DecodeState = DecodeHeader;
+    m_pMessagePool = NULL;
+    m_pReceiveRing = NULL;
+    m_pSendStack = NULL;
+    m_bCoalescing = false;
+    m_uCoalescedMessages = 0;
+    m_uCoalesceStartUs = 0;
+    m_uCoalesceBytes = DEFAULT_COALESCE_BYTES;
+    m_uCoalesceMessages = DEFAULT_COALESCE_MESSAGES;
+    m_uCoalesceDelayUs = DEFAULT_COALESCE_DELAY_US;
+    m_uCoalesceFlushes = 0;
+    m_uDecodeOffset = 0;
+    m_uDecodeSkip = 0;
+    m_bFragmentSkip = false;
+    m_uDecodeIndex = 0;
+    m_uLastReceiveUs = CTimer::getMonotonicUs();
+    m_uLastSendUs = m_uLastReceiveUs;
+    m_uLastRttUs = 0;
+    m_uSmoothedRttUs = 0;
+    m_bPeerDead = false;
+    m_uBatchLimit = DEFAULT_BATCH_LIMIT;
+    m_uLocalCapabilities = 0;
+    m_uPeerCapabilities = 0;
+    m_bNegotiate = false;
+    m_nUrgentWaiting = 0;
+    m_uFragmentSize = DEFAULT_FRAGMENT_SIZE;
+    m_Fragmented.pData = NULL;
+    m_Fragmented.uMsgLength = 0;
+    m_uFragmentOffset = 0;
+    m_pTaggedCallback = NULL;
+    m_pTaggedUser = NULL;
+    m_pMuxCallback = NULL;
+    m_pMuxUser = NULL;
+    m_pStreamCallback = NULL;
+    m_pStreamUser = NULL;
+    m_uStreamThreshold = DEFAULT_STREAM_THRESHOLD;
+    m_uMaxMessageSize = 0;
+    m_bStreamFrame = false;
+    m_bStreamIn = false;
+    m_bStreamOut = false;
+    m_uStreamTotal = 0;
+    m_uStreamSent = 0;
+    m_uStreamInLength = 0;
+    m_bCreditLimited = false;
+    m_bCreditBacklog = false;
+    m_nSendCreditMessages = 0;
+    m_nSendCreditBytes = 0;
+    m_uSendWindowBytes = 0;
+    m_CreditPolicy = CreditBlock;
+    m_uCreditTimeoutMs = DEFAULT_CREDIT_TIMEOUT_MS;
+    m_bCreditDraining = false;
+    m_bReceiveCredit = false;
+    m_uReceiveCreditMessages = 0;
+    m_uReceiveCreditBytes = 0;
+    m_uConsumedMessages = 0;
+    m_uConsumedBytes = 0;
+    pthread_mutex_init(&m_CreditMutex,NULL);
+    pthread_cond_init(&m_CreditCond,NULL);
+    pthread_mutex_init(&m_BulkMutex,NULL);
+    pthread_mutex_init(&m_UrgentMutex,NULL);
+    pthread_cond_init(&m_UrgentCond,NULL);
+    m_bCombining = false;
+    pthread_mutex_init(&m_CombineMutex,NULL);
+    pthread_cond_init(&m_CombineCond,NULL);
+    //recursive, so a transport can send control frames while it sends a frame
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr,PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&m_FrameMutex,&attr);
+    pthread_mutexattr_destroy(&attr);
 }
 
 /**
  * Class destructor
  */
 CMessaging::~CMessaging() {
-
+    //the owner of the stream callback may be gone already
+    m_pStreamCallback=NULL;
+    //the transport is gone, so no more credit can be granted
+    m_bReceiveCredit=false;
+    resetDecoder();
+    while(peekReceived() != NULL){
+        freeMessage(peekReceived()->pData);
+        popReceived();
+    }
+    resetFragments();
+    while(!m_CreditQueue.empty()){
+        delete[] m_CreditQueue.front().msg.pData;
+        m_CreditQueue.pop();
+    }
+    delete m_pReceiveRing;
+    pthread_cond_destroy(&m_CreditCond);
+    pthread_mutex_destroy(&m_CreditMutex);
+    pthread_mutex_destroy(&m_BulkMutex);
+    pthread_cond_destroy(&m_UrgentCond);
+    pthread_mutex_destroy(&m_UrgentMutex);
+    pthread_cond_destroy(&m_CombineCond);
+    pthread_mutex_destroy(&m_CombineMutex);
+    pthread_mutex_destroy(&m_FrameMutex);
 }
 
 /**
@@ -40,20 +146,25 @@ CMessaging::~CMessaging() {
  *  @retval false if the message cannot be queued
  **/
 bool CMessaging::xmitWithRetry(const unsigned char *pBuffer, unsigned uLength) {
+    unsigned long long uStartUs=CTimer::getMonotonicUs();
     unsigned bytesSent = 0;
     unsigned retryCounter;
     int results;
 
     retryCounter=0;
-    while(retryCounter < m_uSendRetry){
+    for(;;){
         results = xmitMsg(pBuffer + bytesSent, uLength - bytesSent);
         if(results < 0){
             PTRACE("Failed to transmit\n");
             return false;
         }
         if (results == 0) {
-            retryCounter++;
-            mSleep(m_uSendRetryDelay);
+            if(!waitToRetry(retryCounter,uStartUs)){
+                if(bytesSent > 0){
+                    sendCutShort();
+                }
+                break;
+            }
         }
         else{
             //if we a single packet through
@@ -69,134 +180,2656 @@ bool CMessaging::xmitWithRetry(const unsigned char *pBuffer, unsigned uLength) {
     return false;
 }
 
+/**
+ * Waits before retrying a transmit that did not take any data. Without a
+ * send deadline this sleeps the retry delay and gives up after the retry
+ * count. With a deadline (see setSendDeadline()) it waits until the
+ * transport can take data again and gives up once the deadline has passed.
+ * @param[in,out] retryCounter Number of retries without progress so far
+ * @param uStartUs Monotonic time at which the send started
+ * @retval true Try again
+ * @retval false Give up
+ */
+bool CMessaging::waitToRetry(unsigned &retryCounter, unsigned long long uStartUs) {
+    unsigned long long uElapsedMs;
+
+    if(m_uSendDeadlineMs == 0){
+        retryCounter++;
+        mSleep(m_uSendRetryDelay);
+        return retryCounter < m_uSendRetry;
+    }
+    uElapsedMs=(CTimer::getMonotonicUs()-uStartUs)/1000;
+    if(uElapsedMs >= m_uSendDeadlineMs){
+        return false;
+    }
+    return waitWritable((unsigned)(m_uSendDeadlineMs-uElapsedMs)) >= 0;
+}
+
+/**
+ * Waits until the transport can take more data. This default has no way of
+ * knowing, so it sleeps the retry delay. Transports with a descriptor to
+ * poll should override it.
+ * @param uTimeoutMs Longest time to wait in milliseconds
+ * @retval 1 The transport may take more data
+ * @retval 0 The wait timed out
+ * @retval -1 The transport failed
+ */
+int CMessaging::waitWritable(unsigned uTimeoutMs) {
+    mSleep(std::min(uTimeoutMs,m_uSendRetryDelay));
+    return 1;
+}
+
+/**
+ * Replaces the fixed retry delay with readiness waiting. A send that finds
+ * the transport full waits until it can take data again, and resumes as
+ * soon as it can, but gives up once the whole send took longer than the
+ * deadline. A send that gives up after part of a frame went out leaves the
+ * remote end in the middle of that frame, so sendCutShort() is called to
+ * take the connection down.
+ * @param uDeadlineMs Longest time a send may take in milliseconds. 0 goes
+ *        back to retrying SEND_RETRY times with a fixed delay.
+ */
+void CMessaging::setSendDeadline(unsigned uDeadlineMs) {
+    m_uSendDeadlineMs=uDeadlineMs;
+}
+
+/**
+ * Default vectored transmit function. Calls xmitMsg for every buffer in the
+ * list and stops at the first buffer that is not sent completely.
+ * @param pVector list of buffers to be sent in order
+ * @param uCount number of buffers in the list
+ * @return number bytes that were successfully transmitted (can be zero)
+ * @retval -1 if nothing could be sent due to an error
+ */
+int CMessaging::xmitMsgV(const struct iovec *pVector, unsigned uCount) {
+    int nSent=0;
+    int results;
+
+    for(unsigned i=0; i < uCount; i++){
+        if(pVector[i].iov_len == 0){
+            continue;
+        }
+        results=xmitMsg((const unsigned char*)pVector[i].iov_base,(unsigned)pVector[i].iov_len);
+        if(results < 0){
+            return (nSent > 0) ? nSent : -1;
+        }
+        nSent+=results;
+        if((unsigned)results < pVector[i].iov_len){
+            break;
+        }
+    }
+    return nSent;
+}
+
+/**
+ * Vectored version of xmitWithRetry(). Sends the buffers with xmitMsgV and
+ * continues where a partial write left off, so a frame normally takes a
+ * single call to the transport.
+ *  @param pVector list of buffers to be sent. The list is updated as data
+ *         goes out and holds what is left to send when the function fails.
+ *  @param uCount number of buffers in the list
+ *  @param[out] puSent receives the number of bytes sent when not NULL
+ *  @retval true success
+ *  @retval false if the data cannot be queued
+ */
+bool CMessaging::xmitVectorWithRetry(struct iovec *pVector, unsigned uCount, unsigned long *puSent) {
+    unsigned long long uStartUs=CTimer::getMonotonicUs();
+    unsigned long uSent=0;
+    unsigned retryCounter=0;
+    unsigned uFirst=0;
+    unsigned long uResults;
+    int results;
+    bool bResults=false;
+
+    for(;;){
+        //skip what was sent already
+        while(uFirst < uCount && pVector[uFirst].iov_len == 0){
+            uFirst++;
+        }
+        if(uFirst == uCount){
+            bResults=true;
+            break;
+        }
+        results=xmitMsgV(pVector+uFirst,uCount-uFirst);
+        if(results < 0){
+            PTRACE("Failed to transmit\n");
+            break;
+        }
+        if(results == 0){
+            if(!waitToRetry(retryCounter,uStartUs)){
+                PTRACE("Xmit Retry timeout\n");
+                if(uSent > 0){
+                    sendCutShort();
+                }
+                break;
+            }
+            continue;
+        }
+        retryCounter=0;
+        uSent+=(unsigned)results;
+        for(uResults=(unsigned)results; uResults > 0; uFirst++){
+            if(uResults < pVector[uFirst].iov_len){
+                pVector[uFirst].iov_base=(unsigned char*)pVector[uFirst].iov_base+uResults;
+                pVector[uFirst].iov_len-=uResults;
+                break;
+            }
+            uResults-=pVector[uFirst].iov_len;
+            pVector[uFirst].iov_len=0;
+        }
+    }
+
+    if(puSent != NULL){
+        *puSent=uSent;
+    }
+    return bResults;
+}
+
+/**
+ * Fills in the frame header that precedes a message
+ * @param[out] pHeader Buffer of at least HEADER_SIZE bytes that receives the header
+ * @param uLength Number of bytes in the message
+ * @param uStart Start of frame character (STX for messages)
+ */
+void CMessaging::buildHeader(unsigned char *pHeader,unsigned uLength,unsigned char uStart) {
+    pHeader[0] = uStart;
+    putLength(pHeader+1,uLength);
+}
+
+/**
+ * Writes a 4 byte big endian number
+ * @param[out] pBuffer receives the number
+ * @param uValue The number
+ */
+void CMessaging::putLength(unsigned char *pBuffer,unsigned uValue) {
+    pBuffer[3] = (uValue>>0)  & 0xFF;
+    pBuffer[2] = (uValue>>8)  & 0xFF;
+    pBuffer[1] = (uValue>>16) & 0xFF;
+    pBuffer[0] = (uValue>>24) & 0xFF;
+}
+
+/**
+ * Reads a 4 byte big endian number
+ * @param pBuffer Pointer to the number
+ * @return the number
+ */
+unsigned CMessaging::getLength(const unsigned char *pBuffer) {
+    return (unsigned)(pBuffer[0]) << 24 |
+           (unsigned)(pBuffer[1]) << 16 |
+           (unsigned)(pBuffer[2]) << 8  |
+           (unsigned)(pBuffer[3]);
+}
+
 /**
  * Sends a message using the low level transmit class.
  * It will retry until the entire message can be queued
  * @param pBuffer Pointer to the buffer to be sent
  * @param uLength Number of bytes included in the message
+ * @param priority PriorityHigh frames go out ahead of the next fragment of
+ *        a bulk message and skip the coalescing buffer. They do not overtake
+ *        any other frame. PriorityBulk messages larger than the fragment
+ *        size are split into fragments once both ends enabled fragment
+ *        frames (see enableFragmentFrames()), so they never hold up other
+ *        frames for more than one fragment.
+ * @retval true Message was sent successfully
+ * @retval false Message was not sent successfully
+ */
+bool CMessaging::sendMessage(const unsigned char* pBuffer, unsigned uLength, Priority_t priority) {
+    struct iovec piece;
+
+    if(needsCredit()){
+        piece.iov_base=(void*)pBuffer;
+        piece.iov_len=uLength;
+        switch(takeCredit(uLength,&piece,1,priority)){
+        case CreditQueued:
+            return true;
+        case CreditRefused:
+            return false;
+        default:
+            break;
+        }
+    }
+    return sendUncounted(pBuffer,uLength,priority);
+}
+
+/**
+ * Sends a message without taking credit for it. See sendMessage().
+ * @param pBuffer Pointer to the buffer to be sent
+ * @param uLength Number of bytes included in the message
+ * @param priority Priority of the message
  * @retval true Message was sent successfully
  * @retval false Message was not sent successfully
  */
-bool CMessaging::sendMessage(const unsigned char* pBuffer, unsigned uLength) {
+bool CMessaging::sendUncounted(const unsigned char* pBuffer, unsigned uLength, Priority_t priority) {
     unsigned char header[HEADER_SIZE];
     unsigned char trailer[TRAILER_SIZE]={ETX};
+    struct iovec piece;
+    bool bResults;
 
-    header[4] = (uLength>>0)  & 0xFF;
-    header[3] = (uLength>>8)  & 0xFF;
-    header[2] = (uLength>>16) & 0xFF;
-    header[1] = (uLength>>24) & 0xFF;
-    header[0] = STX;
-
-    //send the size
-    if(!xmitWithRetry(header,HEADER_SIZE)){
-        return false;
+    piece.iov_base=(void*)pBuffer;
+    piece.iov_len=uLength;
+    if(priority == PriorityBulk && uLength > m_uFragmentSize && isFragmentFramesActive()){
+        return sendFragments(pBuffer,uLength);
     }
-    //send the contents
-    if(!xmitWithRetry(pBuffer,uLength)){
-            return false;
+    if(priority != PriorityHigh){
+        return sendPieces(&piece,1);
     }
-    //send the contents
-    if(!xmitWithRetry(trailer,TRAILER_SIZE)){
-            return false;
+
+    buildHeader(header,uLength);
+    lockUrgent();
+    bResults=xmitFrame(header,&piece,1,trailer);
+    if(!flushCoalesced()){
+        bResults=false;
     }
+    m_uLastSendUs=CTimer::getMonotonicUs();
+    pthread_mutex_unlock(&m_FrameMutex);
 
-    return true;
+    return bResults;
 }
 
 /**
- * Processes a chunk of data received from the remote end
- * @param pBuffer The buffer containing partial,entire. or multiple messages
- * @param uLength The length of the buffer
- * @retval true At least one message was received after processing chunk
- * @retval false No complete message was received after processing chunk
+ * Sends a message in a tagged frame:
+ *   TTX | length | kind | tag | message | ETX
+ * The kind and the tag travel in the frame header, so the remote end can
+ * route the message (see registerTaggedCallback()) without looking into it.
+ * This is what request/response layers such as CRpcChannel use to carry
+ * correlation ids.
+ * @param uKind Kind of frame
+ * @param uTag Tag of the frame
+ * @param pBuffer Pointer to the message
+ * @param uLength Number of bytes in the message
+ * @retval true Message was sent successfully
+ * @retval false Message was not sent successfully
  */
-bool CMessaging::processChunk(unsigned char* pBuffer, unsigned uLength) {
+bool CMessaging::sendTaggedMessage(unsigned char uKind, unsigned uTag, const unsigned char *pBuffer, unsigned uLength) {
+    return sendPrefixed(TTX,uKind,uTag,pBuffer,uLength);
+}
+
+/**
+ * Sends a frame of a multiplexed stream:
+ *   MUX | length | kind | stream id | message | ETX
+ * Mux frames are laid out like tagged frames but have a callback of their
+ * own (see registerMuxCallback()), so a stream multiplexer and a tagged
+ * frame user such as CRpcChannel can share a connection.
+ * @param uKind Kind of frame, chosen by the multiplexer
+ * @param uStreamId Stream the frame belongs to
+ * @param pBuffer Pointer to the message
+ * @param uLength Number of bytes in the message
+ * @retval true Frame was sent successfully
+ * @retval false Frame was not sent successfully
+ */
+bool CMessaging::sendMuxFrame(unsigned char uKind, unsigned uStreamId, const unsigned char *pBuffer, unsigned uLength) {
+    return sendPrefixed(MUX,uKind,uStreamId,pBuffer,uLength);
+}
+
+/**
+ * Sends a frame whose payload starts with a kind and a tag
+ * @param uStart Start character of the frame
+ * @param uKind Kind of frame
+ * @param uTag Tag of the frame
+ * @param pBuffer Pointer to the message
+ * @param uLength Number of bytes in the message
+ * @retval true Frame was sent successfully
+ * @retval false Frame was not sent successfully
+ */
+bool CMessaging::sendPrefixed(unsigned char uStart, unsigned char uKind, unsigned uTag, const unsigned char *pBuffer, unsigned uLength) {
     unsigned char header[HEADER_SIZE];
-    unsigned char trailer[TRAILER_SIZE];
-    unsigned uMsgLength;
-    Message_t msg;
-    bool bResults=false;
+    unsigned char prefix[TAG_PREFIX_SIZE];
+    unsigned char trailer[TRAILER_SIZE]={ETX};
+    struct iovec pieces[2];
+    bool bResults;
+
+    prefix[0]=uKind;
+    putLength(prefix+1,uTag);
+    pieces[0].iov_base=prefix;
+    pieces[0].iov_len=TAG_PREFIX_SIZE;
+    pieces[1].iov_base=(void*)pBuffer;
+    pieces[1].iov_len=uLength;
+    buildHeader(header,TAG_PREFIX_SIZE+uLength,uStart);
+
+    pthread_mutex_lock(&m_FrameMutex);
+    bResults=xmitFrame(header,pieces,2,trailer);
+    m_uLastSendUs=CTimer::getMonotonicUs();
+    pthread_mutex_unlock(&m_FrameMutex);
+
+    return bResults;
+}
+
+/**
+ * Registers the function that receives tagged frames. Tagged frames never
+ * reach the received queue; without a function they are dropped.
+ * @param pCallback Pointer to Callback function
+ * @param pUser Pointer to user provided pointer passed back into the callback function
+ */
+void CMessaging::registerTaggedCallback(TaggedCallback_t pCallback, void *pUser) {
+    m_pTaggedCallback=pCallback;
+    m_pTaggedUser=pUser;
+}
+
+/**
+ * Registers the function that receives multiplexed stream frames. Like
+ * tagged frames, they never reach the received queue.
+ * @param pCallback Pointer to Callback function
+ * @param pUser Pointer to user provided pointer passed back into the callback function
+ */
+void CMessaging::registerMuxCallback(TaggedCallback_t pCallback, void *pUser) {
+    m_pMuxCallback=pCallback;
+    m_pMuxUser=pUser;
+}
+
+/**
+ * Grants the remote end credit: from then on it may only have uMessages
+ * messages and uBytes bytes in flight towards us, and it gets more credit
+ * as the messages are consumed, i.e. taken off the receive queue or handed
+ * to a callback. A single message larger than uBytes still goes through
+ * once nothing else is in flight. A remote end that does not know credit
+ * frames ignores them and sends without limits. The grants go out as this
+ * end consumes messages, so the remote end stalls while nobody receives
+ * here (see setCreditPolicy()).
+ * @param uMessages Number of messages the remote end may have in flight
+ * @param uBytes Number of bytes the remote end may have in flight
+ * @retval true The credit was granted
+ * @retval false A limit is zero, credit was granted already, or the
+ *         control frame could not be sent
+ */
+bool CMessaging::enableReceiveCredit(unsigned uMessages, unsigned long uBytes) {
+    unsigned char body[2*BATCH_ENTRY_SIZE];
+
+    if(uMessages == 0 || uBytes == 0 || uBytes > 0xFFFFFFFFUL || m_bReceiveCredit){
+        PTRACE("Invalid receive credit\n");
+        return false;
+    }
+    pthread_mutex_lock(&m_CreditMutex);
+    m_uReceiveCreditMessages=uMessages;
+    m_uReceiveCreditBytes=uBytes;
+    m_uConsumedMessages=0;
+    m_uConsumedBytes=0;
+    m_bReceiveCredit=true;
+    pthread_mutex_unlock(&m_CreditMutex);
+    putLength(body,uMessages);
+    putLength(body+BATCH_ENTRY_SIZE,(unsigned)uBytes);
+    return sendControlFrame(CONTROL_CREDIT,body,sizeof(body));
+}
 
-    //put the chunk on the list
-    m_assembler.Append(pBuffer,uLength);
+/**
+ * Sets what a send does once the remote end limits our sends with credit
+ * (see enableReceiveCredit()) and the credit is used up:
+ *   CreditBlock: waits for the credit, at most uTimeoutMs, then fails
+ *   CreditFail: fails right away
+ *   CreditQueue: copies the message and sends it once the credit comes in
+ * Credit comes in with the received data. In the CreditBlock policy a send
+ * only gets it if another thread receives while it waits. A thread that
+ * both sends and receives, e.g. with CTcpMessaging::runOnce() or
+ * receiveMessage(), waits out the timeout instead; use CreditFail or
+ * CreditQueue there.
+ * Sends keep their order in every policy.
+ * @param policy What a send does without credit
+ * @param uTimeoutMs Time to wait in the CreditBlock policy. 0 waits for ever.
+ */
+void CMessaging::setCreditPolicy(CreditPolicy_t policy, unsigned uTimeoutMs) {
+    pthread_mutex_lock(&m_CreditMutex);
+    m_CreditPolicy=policy;
+    m_uCreditTimeoutMs=uTimeoutMs;
+    pthread_mutex_unlock(&m_CreditMutex);
+}
+
+/**
+ * Returns the number of messages queued by the CreditQueue policy
+ * @return number of messages waiting for credit
+ */
+unsigned CMessaging::getCreditQueueSize() {
+    unsigned uSize;
+
+    pthread_mutex_lock(&m_CreditMutex);
+    uSize=(unsigned)m_CreditQueue.size();
+    pthread_mutex_unlock(&m_CreditMutex);
+    return uSize;
+}
+
+/**
+ * Returns true if there is send credit for a message. A message larger than
+ * the window goes through once the whole window is available. Without a
+ * grant of the remote end every message may be sent.
+ * Called with m_CreditMutex held.
+ * @param uBytes Number of bytes in the message
+ * @return true if the message may be sent
+ */
+bool CMessaging::hasCredit(unsigned long uBytes) const {
+    if(!m_bCreditLimited){
+        return true;
+    }
+    return m_nSendCreditMessages > 0 &&
+           (m_nSendCreditBytes >= (long long)uBytes || m_nSendCreditBytes >= (long long)m_uSendWindowBytes);
+}
+
+/**
+ * Takes the send credit for one message. Without credit the message waits,
+ * fails or is queued according to the credit policy. Messages queued
+ * earlier go first, so a send never overtakes them.
+ * @param uBytes Number of bytes in the message
+ * @param pPieces Buffers that make up the message, copied in the
+ *        CreditQueue policy. NULL makes the CreditQueue policy wait.
+ * @param uPieces Number of buffers
+ * @param priority Priority the queued message is sent with
+ * @retval CreditGranted The credit was taken and the message may be sent
+ * @retval CreditQueued The message was queued and will be sent later
+ * @retval CreditRefused There is no credit
+ */
+CMessaging::CreditResult_t CMessaging::takeCredit(unsigned long uBytes, const struct iovec *pPieces,
+                                                  unsigned uPieces, Priority_t priority) {
+    CreditQueued_t queued;
+    struct timespec deadline;
+    unsigned char *pCopy;
+    bool bDeadline=false;
 
+    pthread_mutex_lock(&m_CreditMutex);
     for(;;){
-        if(m_assembler.Size() < HEADER_SIZE){
-            //not enough data for header
-            break;
+        if(!m_bCreditLimited && !m_CreditQueue.empty() && !m_bCreditDraining){
+            //left over from a previous peer. They go out first to keep the order.
+            pthread_mutex_unlock(&m_CreditMutex);
+            sendCreditQueue();
+            pthread_mutex_lock(&m_CreditMutex);
+            continue;
         }
-        //see if we can process the header
-        m_assembler.Peek(header,HEADER_SIZE,0);
-        if(header[0]!=STX){
-            //bad message or partial message
-            //dump everything in the assember in an attempt to recover
-            PTRACE("Bad Start of message\n");
-            m_assembler.Clear();
+        if(m_CreditQueue.empty() && !m_bCreditDraining && hasCredit(uBytes)){
+            if(m_bCreditLimited){
+                m_nSendCreditMessages--;
+                m_nSendCreditBytes-=uBytes;
+            }
+            pthread_mutex_unlock(&m_CreditMutex);
+            return CreditGranted;
+        }
+        if(m_CreditPolicy == CreditQueue && pPieces != NULL){
+            pCopy=new unsigned char[uBytes > 0 ? uBytes : 1];
+            queued.msg.pData=pCopy;
+            queued.msg.uMsgLength=uBytes;
+            queued.priority=priority;
+            for(unsigned i=0; i < uPieces; i++){
+                memcpy(pCopy,pPieces[i].iov_base,pPieces[i].iov_len);
+                pCopy+=pPieces[i].iov_len;
+            }
+            m_CreditQueue.push(queued);
+            pthread_mutex_unlock(&m_CreditMutex);
+            return CreditQueued;
+        }
+        if(m_CreditPolicy == CreditFail){
             break;
         }
-        uMsgLength= (unsigned)(header[1]) << 24 |
-                    (unsigned)(header[2]) << 16 |
-                    (unsigned)(header[3]) << 8  |
-                    (unsigned)(header[4]);
-        //do we have a complete message?
-        if(m_assembler.Size() < uMsgLength+HEADER_SIZE+TRAILER_SIZE){
+        if(m_uCreditTimeoutMs == 0){
+            pthread_cond_wait(&m_CreditCond,&m_CreditMutex);
+            continue;
+        }
+        if(!bDeadline){
+            CTimer::getTime(deadline);
+            deadline.tv_sec+=m_uCreditTimeoutMs/1000;
+            deadline.tv_nsec+=(m_uCreditTimeoutMs%1000)*1000000L;
+            if(deadline.tv_nsec >= BILLION){
+                deadline.tv_sec++;
+                deadline.tv_nsec-=BILLION;
+            }
+            bDeadline=true;
+        }
+        if(pthread_cond_timedwait(&m_CreditCond,&m_CreditMutex,&deadline) == ETIMEDOUT){
+            PTRACE("Timed out waiting for send credit\n");
             break;
         }
-        //everything is here. Start pulling things off the assembler
-        m_assembler.Trim(HEADER_SIZE);
-        msg.pData=new unsigned char[uMsgLength];
-        msg.uMsgLength=uMsgLength;
-        m_assembler.Pop(msg.pData,msg.uMsgLength);
+    }
+    pthread_mutex_unlock(&m_CreditMutex);
+    return CreditRefused;
+}
 
-        //pull the trailer
-        m_assembler.Pop(trailer,TRAILER_SIZE);
-        //check the trailer
-        if(trailer[0] != ETX){
-            //oops! The trailer was not valid
-            //dump the message
-            delete[] msg.pData;
-            PTRACE("Found bad trailer\n");
-            break;
+/**
+ * Sends the messages queued by the CreditQueue policy, oldest first, as far
+ * as the credit goes. Only one thread drains the queue at a time, and new
+ * sends wait until it is done so that the order is kept.
+ */
+void CMessaging::sendCreditQueue() {
+    CreditQueued_t queued;
+
+    pthread_mutex_lock(&m_CreditMutex);
+    if(m_bCreditDraining){
+        pthread_mutex_unlock(&m_CreditMutex);
+        return;
+    }
+    m_bCreditDraining=true;
+    while(!m_CreditQueue.empty() && hasCredit(m_CreditQueue.front().msg.uMsgLength)){
+        queued=m_CreditQueue.front();
+        m_CreditQueue.pop();
+        if(m_bCreditLimited){
+            m_nSendCreditMessages--;
+            m_nSendCreditBytes-=queued.msg.uMsgLength;
         }
-        //put the message in the queue
-        m_MsgQueue.push(msg);
-        bResults=true;
+        pthread_mutex_unlock(&m_CreditMutex);
+        if(!sendUncounted(queued.msg.pData,(unsigned)queued.msg.uMsgLength,queued.priority)){
+            PTRACE("Could not send a message that waited for credit\n");
+        }
+        delete[] queued.msg.pData;
+        pthread_mutex_lock(&m_CreditMutex);
+    }
+    m_bCreditDraining=false;
+    if(m_CreditQueue.empty()){
+        m_bCreditBacklog=false;
+    }
+    pthread_cond_broadcast(&m_CreditCond);
+    pthread_mutex_unlock(&m_CreditMutex);
+}
+
+/**
+ * Accounts for consumed messages. Once half the messages or half the bytes
+ * granted to the remote end are consumed, they are granted again.
+ * @param uMessages Number of messages consumed
+ * @param uBytes Number of bytes in them
+ */
+void CMessaging::returnCredit(unsigned uMessages, unsigned long uBytes) {
+    unsigned char body[2*BATCH_ENTRY_SIZE];
+
+    if(!m_bReceiveCredit){
+        return;
+    }
+    pthread_mutex_lock(&m_CreditMutex);
+    m_uConsumedMessages+=uMessages;
+    m_uConsumedBytes+=uBytes;
+    if(m_uConsumedMessages*2 < m_uReceiveCreditMessages && m_uConsumedBytes*2 < m_uReceiveCreditBytes){
+        pthread_mutex_unlock(&m_CreditMutex);
+        return;
+    }
+    putLength(body,m_uConsumedMessages);
+    putLength(body+BATCH_ENTRY_SIZE,(unsigned)m_uConsumedBytes);
+    m_uConsumedMessages=0;
+    m_uConsumedBytes=0;
+    pthread_mutex_unlock(&m_CreditMutex);
+    if(!sendControlFrame(CONTROL_CREDIT,body,sizeof(body))){
+        PTRACE("Could not grant credit\n");
+    }
+}
+
+/**
+ * Hands the message of a tagged or mux frame to its callback
+ * @param uStart Start character of the frame
+ * @param uKind Kind of frame
+ * @param uTag Tag of the frame
+ * @param msg The message. The receiver takes ownership of msg.pData.
+ */
+void CMessaging::deliverTagged(unsigned char uStart, unsigned char uKind, unsigned uTag, const Message_t &msg) {
+    TaggedCallback_t pCallback=(uStart == MUX) ? m_pMuxCallback : m_pTaggedCallback;
+    void *pUser=(uStart == MUX) ? m_pMuxUser : m_pTaggedUser;
+
+    if(pCallback == NULL){
+        PTRACE("Dropping a tagged frame\n");
+        freeMessage(msg.pData);
+        return;
+    }
+    pCallback(uKind,uTag,toHeapMessage(msg),pUser);
+}
+
+/**
+ * Takes the frame mutex for a high priority frame. A bulk message being
+ * fragmented lets these go before its next fragment.
+ */
+void CMessaging::lockUrgent() {
+    pthread_mutex_lock(&m_UrgentMutex);
+    m_nUrgentWaiting++;
+    pthread_mutex_unlock(&m_UrgentMutex);
+
+    pthread_mutex_lock(&m_FrameMutex);
+
+    //the fragment sender now queues up behind this frame on the frame mutex
+    pthread_mutex_lock(&m_UrgentMutex);
+    if(--m_nUrgentWaiting == 0){
+        pthread_cond_broadcast(&m_UrgentCond);
+    }
+    pthread_mutex_unlock(&m_UrgentMutex);
+}
+
+/**
+ * Sends a bulk message as a series of fragment frames:
+ *   FRG | length | flags | message length | fragment | ETX
+ * The frame mutex is given up after every fragment, and high priority
+ * frames that are waiting for it go first. Only one bulk message is
+ * fragmented at a time, so the receiver never has to interleave two.
+ * @param pMsg Message to be sent
+ * @param uLength Number of bytes in the message
+ * @retval true Message was sent successfully
+ * @retval false Message was not sent successfully
+ */
+bool CMessaging::sendFragments(const unsigned char *pMsg, unsigned uLength) {
+    unsigned uOffset,uChunk;
+    bool bResults=true;
+
+    pthread_mutex_lock(&m_BulkMutex);
+    for(uOffset=0; uOffset < uLength && bResults; uOffset+=uChunk){
+        uChunk=std::min(m_uFragmentSize,uLength-uOffset);
+        bResults=xmitFragment((uOffset == 0 ? FRAGMENT_FIRST : 0) | (uOffset+uChunk == uLength ? FRAGMENT_LAST : 0),
+                              uLength,pMsg+uOffset,uChunk);
     }
+    pthread_mutex_unlock(&m_BulkMutex);
 
     return bResults;
 }
 
 /**
- * Returns the size of the message at the beginning of the queue
- * @return The size of the message at the beginning of the queue
- * @retval 0 If no messages are pending
+ * Sends one fragment frame. High priority frames waiting for the frame
+ * mutex go first; this sleeps until they all have the mutex.
+ * @param uFlags FRAGMENT_FIRST and/or FRAGMENT_LAST
+ * @param uTotal Number of bytes in the whole message
+ * @param pChunk Bytes of the message carried by this fragment
+ * @param uChunk Number of bytes in the fragment
+ * @retval true Fragment was sent successfully
+ * @retval false Fragment was not sent successfully
  */
-unsigned CMessaging::getMsgSize() {
-    if(!m_MsgQueue.empty()){
-        return m_MsgQueue.front().uMsgLength;
+bool CMessaging::xmitFragment(unsigned char uFlags, unsigned uTotal, const unsigned char *pChunk, unsigned uChunk) {
+    unsigned char header[HEADER_SIZE];
+    unsigned char prefix[FRAGMENT_PREFIX_SIZE];
+    unsigned char trailer[TRAILER_SIZE]={ETX};
+    struct iovec pieces[2];
+    bool bResults;
+
+    prefix[0]=uFlags;
+    putLength(prefix+1,uTotal);
+    pieces[0].iov_base=prefix;
+    pieces[0].iov_len=FRAGMENT_PREFIX_SIZE;
+    pieces[1].iov_base=(void*)pChunk;
+    pieces[1].iov_len=uChunk;
+    buildHeader(header,FRAGMENT_PREFIX_SIZE+uChunk,FRG);
+
+    pthread_mutex_lock(&m_UrgentMutex);
+    while(m_nUrgentWaiting > 0){
+        pthread_cond_wait(&m_UrgentCond,&m_UrgentMutex);
     }
-    return 0;
+    pthread_mutex_unlock(&m_UrgentMutex);
+    pthread_mutex_lock(&m_FrameMutex);
+    bResults=xmitFrame(header,pieces,2,trailer);
+    m_uLastSendUs=CTimer::getMonotonicUs();
+    pthread_mutex_unlock(&m_FrameMutex);
+
+    return bResults;
 }
 
 /**
- * Pops the message first message from the received
- * message queue
- * @return First message in the queue
- * @note This pointer must be deleted by the caller after the message is
- * successfully processed.
+ * Starts sending a message whose contents are produced piece by piece, so
+ * it never has to be in memory as a whole. The pieces go out as fragment
+ * frames (see enableFragmentFrames()) as soon as sendStreamData() gets
+ * them, and other messages still go out between them. The thread that
+ * calls this has to finish the message with endStream(); other bulk
+ * messages wait until then.
+ * @param uTotal Number of bytes in the whole message
+ * @retval true The message was started
+ * @retval false The remote end does not take fragment frames, or a frame
+ *         could not be sent
  */
-CMessaging::Message_t CMessaging::getMsg() {
-    Message_t msg;
+bool CMessaging::beginStream(unsigned uTotal) {
+    if(!isFragmentFramesActive()){
+        PTRACE("The remote end does not take streamed messages\n");
+        return false;
+    }
+    //the pieces cannot be held back, so wait for the credit even in the CreditQueue policy
+    if(needsCredit() && takeCredit(uTotal,NULL,0,PriorityBulk) != CreditGranted){
+        return false;
+    }
+    pthread_mutex_lock(&m_BulkMutex);
+    m_bStreamOut=true;
+    m_uStreamTotal=uTotal;
+    m_uStreamSent=0;
+    //no data will follow, so the only frame opens and closes the message
+    if(uTotal == 0 && !xmitFragment(FRAGMENT_FIRST|FRAGMENT_LAST,0,NULL,0)){
+        m_bStreamOut=false;
+        pthread_mutex_unlock(&m_BulkMutex);
+        return false;
+    }
+    return true;
+}
 
-    msg.pData=0;
-    msg.uMsgLength=0;
+/**
+ * Sends the next piece of the message started by beginStream(). Pieces
+ * larger than the fragment size are split.
+ * @param pBuffer Pointer to the piece
+ * @param uLength Number of bytes in the piece
+ * @retval true The piece was sent successfully
+ * @retval false No message was started, the piece runs past its end, or
+ *         the piece was not sent successfully
+ */
+bool CMessaging::sendStreamData(const unsigned char *pBuffer, unsigned uLength) {
+    unsigned uChunk;
+    unsigned char uFlags;
 
-    if(!m_MsgQueue.empty()){
-        msg=m_MsgQueue.front();
-        m_MsgQueue.pop();
+    if(!m_bStreamOut || uLength > m_uStreamTotal-m_uStreamSent){
+        PTRACE("Piece does not fit the streamed message\n");
+        return false;
+    }
+    while(uLength > 0){
+        uChunk=std::min(m_uFragmentSize,uLength);
+        uFlags=(m_uStreamSent == 0 ? FRAGMENT_FIRST : 0) | (m_uStreamSent+uChunk == m_uStreamTotal ? FRAGMENT_LAST : 0);
+        if(!xmitFragment(uFlags,m_uStreamTotal,pBuffer,uChunk)){
+            return false;
+        }
+        m_uStreamSent+=uChunk;
+        pBuffer+=uChunk;
+        uLength-=uChunk;
     }
+    return true;
+}
 
-    return msg;
+/**
+ * Finishes the message started by beginStream() and lets other bulk
+ * messages go. A message that is short is closed with an empty last
+ * fragment, which makes the remote end drop it.
+ * @retval true The whole message was sent
+ * @retval false No message was started, or the message was short
+ */
+bool CMessaging::endStream() {
+    bool bResults;
+
+    if(!m_bStreamOut){
+        return false;
+    }
+    bResults=(m_uStreamSent == m_uStreamTotal);
+    if(!bResults){
+        PTRACE("Streamed message is short\n");
+        if(m_uStreamSent > 0){
+            xmitFragment(FRAGMENT_LAST,m_uStreamTotal,NULL,0);
+        }
+    }
+    m_bStreamOut=false;
+    pthread_mutex_unlock(&m_BulkMutex);
+    return bResults;
 }
 
+/**
+ * Sends a message made of several pieces. The pieces are framed as one
+ * message and handed to the transmit function in a single gather list, so
+ * the caller does not need to copy them into one buffer first.
+ * @param pPieces List of buffers that make up the message
+ * @param uPieces Number of buffers in the list
+ * @retval true Message was sent successfully
+ * @retval false Message was not sent successfully
+ */
+bool CMessaging::sendMessage(const struct iovec *pPieces, unsigned uPieces) {
+    unsigned long uLength=0;
+
+    if(needsCredit()){
+        for(unsigned i=0; i < uPieces; i++){
+            uLength+=pPieces[i].iov_len;
+        }
+        switch(takeCredit(uLength,pPieces,uPieces,PriorityNormal)){
+        case CreditQueued:
+            return true;
+        case CreditRefused:
+            return false;
+        default:
+            break;
+        }
+    }
+    return sendPieces(pPieces,uPieces);
+}
 
+/**
+ * Frames the pieces of a message without taking credit for them. See
+ * sendMessage().
+ * @param pPieces List of buffers that make up the message
+ * @param uPieces Number of buffers in the list
+ * @retval true Message was sent successfully
+ * @retval false Message was not sent successfully
+ */
+bool CMessaging::sendPieces(const struct iovec *pPieces, unsigned uPieces) {
+    unsigned char header[HEADER_SIZE];
+    unsigned char trailer[TRAILER_SIZE]={ETX};
+    unsigned long uLength=0;
+    bool bResults;
+
+    for(unsigned i=0; i < uPieces; i++){
+        uLength+=pPieces[i].iov_len;
+    }
+    buildHeader(header,(unsigned)uLength);
+
+    pthread_mutex_lock(&m_FrameMutex);
+    bResults=xmitFrame(header,pPieces,uPieces,trailer);
+    m_uLastSendUs=CTimer::getMonotonicUs();
+    pthread_mutex_unlock(&m_FrameMutex);
+
+    return bResults;
+}
+
+/**
+ * Sends a batch of messages. The messages are framed into gather lists of
+ * up to the batch limit (see setBatchLimit()) and each list is handed to
+ * the transmit function at once, so a burst of small messages takes a few
+ * calls instead of one per message. A message larger than the limit goes
+ * out in a list of its own. When both ends enabled batch frames (see
+ * enableBatchFrames()), each list is sent as a single batch frame.
+ * @param pMsgs Messages to be sent in order
+ * @param uCount Number of messages
+ * @param[out] puSent receives the number of messages, from the start of the
+ *        batch, that were sent completely. If the link fails in the middle
+ *        of a message, that message is not counted. For batch frames, none
+ *        of the messages of a frame that was cut off are counted.
+ * @retval true All the messages were sent
+ * @retval false The link failed before the whole batch was sent
+ */
+bool CMessaging::sendMessages(const Message_t *pMsgs, unsigned uCount, unsigned *puSent) {
+    const unsigned char trailer[TRAILER_SIZE]={ETX};
+    unsigned uDone=0;
+    unsigned uFirst,uLast,uVectorCount,i;
+    unsigned long uBytes,uSent;
+    bool bBatchFrames=isBatchFramesActive();
+    unsigned uOverhead=bBatchFrames ? BATCH_ENTRY_SIZE : HEADER_SIZE+TRAILER_SIZE;
+    bool bResults=true;
+
+    //every message needs its own credit, so they go out one by one
+    if(needsCredit()){
+        while(uDone < uCount && sendMessage(pMsgs[uDone].pData,(unsigned)pMsgs[uDone].uMsgLength)){
+            uDone++;
+        }
+        if(puSent != NULL){
+            *puSent=uDone;
+        }
+        return uDone == uCount;
+    }
+    pthread_mutex_lock(&m_FrameMutex);
+    m_BatchHeaders.resize(HEADER_SIZE+BATCH_ENTRY_SIZE+MAX_BATCH_MESSAGES*HEADER_SIZE);
+    m_BatchVector.resize(MAX_BATCH_MESSAGES*3);
+    //the batch is already gathered, but must not overtake earlier frames
+    bResults=flushCoalesced();
+    while(uDone < uCount && bResults){
+        //frame as many messages as fit in the limit, but at least one
+        uFirst=uDone;
+        uBytes=0;
+        for(uLast=uFirst; uLast < uCount && uLast-uFirst < MAX_BATCH_MESSAGES; uLast++){
+            unsigned long uFrameSize=uOverhead+pMsgs[uLast].uMsgLength;
+            if(uLast > uFirst && uBytes+uFrameSize > m_uBatchLimit){
+                break;
+            }
+            uBytes+=uFrameSize;
+        }
+        if(bBatchFrames){
+            uVectorCount=buildBatchFrame(pMsgs+uFirst,uLast-uFirst,trailer);
+        } else {
+            for(i=uFirst; i < uLast; i++){
+                unsigned char *pHeader=&m_BatchHeaders[(i-uFirst)*HEADER_SIZE];
+                struct iovec *pVector=&m_BatchVector[(i-uFirst)*3];
+
+                buildHeader(pHeader,(unsigned)pMsgs[i].uMsgLength);
+                pVector[0].iov_base=pHeader;
+                pVector[0].iov_len=HEADER_SIZE;
+                pVector[1].iov_base=pMsgs[i].pData;
+                pVector[1].iov_len=pMsgs[i].uMsgLength;
+                pVector[2].iov_base=(void*)trailer;
+                pVector[2].iov_len=TRAILER_SIZE;
+            }
+            uVectorCount=(uLast-uFirst)*3;
+        }
+
+        uSent=0;
+        bResults=xmitBatch(&m_BatchVector[0],uVectorCount,&uSent);
+        if(bResults){
+            uDone=uLast;
+        } else if(!bBatchFrames){
+            //count the messages that made it out completely
+            for(i=uFirst; i < uLast; i++){
+                unsigned long uFrameSize=HEADER_SIZE+pMsgs[i].uMsgLength+TRAILER_SIZE;
+                if(uSent < uFrameSize){
+                    break;
+                }
+                uSent-=uFrameSize;
+                uDone++;
+            }
+        }
+    }
+    m_uLastSendUs=CTimer::getMonotonicUs();
+    pthread_mutex_unlock(&m_FrameMutex);
+
+    if(puSent != NULL){
+        *puSent=uDone;
+    }
+    return bResults;
+}
+
+/**
+ * Sends a message while other threads may be sending on the same
+ * connection. The frame is posted to a lock free list and then one thread,
+ * whichever gets hold of the connection first, sends all the posted frames
+ * of every thread in a single gather list. The other threads do not queue
+ * up behind the send in progress; their frames simply go out with the next
+ * combined write. Frames are never interleaved, and the messages of one
+ * thread go out in the order it sent them. The call returns once the
+ * message was sent (or failed), so the buffer is not copied. A thread
+ * whose frame is not out after a few yields sleeps until the combiner
+ * signals, or on the frame mutex when no thread is combining.
+ * @param pBuffer Pointer to the message
+ * @param uLength Length of the message
+ * @retval true Message was sent successfully
+ * @retval false Message was not sent successfully
+ */
+bool CMessaging::sendMessageConcurrent(const unsigned char *pBuffer, unsigned uLength) {
+    SendRequest_t request;
+    unsigned uSpins;
+
+    //credit is taken one message at a time, so there is nothing to combine
+    if(needsCredit()){
+        return sendMessage(pBuffer,uLength);
+    }
+
+    request.pData=pBuffer;
+    request.uLength=uLength;
+    buildHeader(request.header,uLength);
+    request.nState=SEND_PENDING;
+    do {
+        request.pNext=m_pSendStack;
+    } while(!__sync_bool_compare_and_swap(&m_pSendStack,request.pNext,&request));
+
+    for(uSpins=0; request.nState == SEND_PENDING; uSpins++){
+        if(pthread_mutex_trylock(&m_FrameMutex) == 0){
+            combineSends();
+            pthread_mutex_unlock(&m_FrameMutex);
+        } else if(uSpins < COMBINE_SPINS){
+            //another thread is sending and will likely pick up this frame
+            sched_yield();
+        } else {
+            pthread_mutex_lock(&m_CombineMutex);
+            if(m_bCombining){
+                while(request.nState == SEND_PENDING && m_bCombining){
+                    pthread_cond_wait(&m_CombineCond,&m_CombineMutex);
+                }
+                pthread_mutex_unlock(&m_CombineMutex);
+                continue;
+            }
+            pthread_mutex_unlock(&m_CombineMutex);
+            //a plain send holds the frame mutex, wait for it
+            pthread_mutex_lock(&m_FrameMutex);
+            if(request.nState == SEND_PENDING){
+                combineSends();
+            }
+            pthread_mutex_unlock(&m_FrameMutex);
+        }
+    }
+    return request.nState == SEND_DONE;
+}
+
+/**
+ * Takes every frame posted by sendMessageConcurrent() and sends them in
+ * gather lists of up to MAX_BATCH_MESSAGES frames, until no more frames
+ * are posted. The threads sleeping on their frames are woken after every
+ * gather list and once no more frames are posted. Called with
+ * m_FrameMutex held.
+ */
+void CMessaging::combineSends() {
+    static const unsigned char trailer[TRAILER_SIZE]={ETX};
+    SendRequest_t *pRequest;
+    unsigned uFirst,uLast,i;
+    unsigned long uSent,uFrameSize;
+    int nState;
+    bool bResults;
+
+    pthread_mutex_lock(&m_CombineMutex);
+    m_bCombining=true;
+    pthread_mutex_unlock(&m_CombineMutex);
+    m_BatchVector.resize(MAX_BATCH_MESSAGES*3);
+    //gathered frames go first; a failing link fails the posted frames as well
+    flushCoalesced();
+    while((pRequest=__sync_lock_test_and_set(&m_pSendStack,(SendRequest_t *)NULL)) != NULL){
+        //the list is newest first
+        m_CombineList.clear();
+        for(; pRequest != NULL; pRequest=pRequest->pNext){
+            m_CombineList.push_back(pRequest);
+        }
+        std::reverse(m_CombineList.begin(),m_CombineList.end());
+
+        for(uFirst=0; uFirst < m_CombineList.size(); uFirst=uLast){
+            uLast=std::min((unsigned)m_CombineList.size(),uFirst+(unsigned)MAX_BATCH_MESSAGES);
+            for(i=uFirst; i < uLast; i++){
+                struct iovec *pVector=&m_BatchVector[(i-uFirst)*3];
+
+                pRequest=m_CombineList[i];
+                pVector[0].iov_base=pRequest->header;
+                pVector[0].iov_len=HEADER_SIZE;
+                pVector[1].iov_base=(void*)pRequest->pData;
+                pVector[1].iov_len=pRequest->uLength;
+                pVector[2].iov_base=(void*)trailer;
+                pVector[2].iov_len=TRAILER_SIZE;
+            }
+            uSent=0;
+            bResults=xmitBatch(&m_BatchVector[0],(uLast-uFirst)*3,&uSent);
+
+            //a request may vanish as soon as its state is set
+            for(i=uFirst; i < uLast; i++){
+                pRequest=m_CombineList[i];
+                uFrameSize=HEADER_SIZE+pRequest->uLength+TRAILER_SIZE;
+                nState=SEND_DONE;
+                if(!bResults){
+                    //only the frames that made it out completely were sent
+                    if(uSent >= uFrameSize){
+                        uSent-=uFrameSize;
+                    } else {
+                        uSent=0;
+                        nState=SEND_FAILED;
+                    }
+                }
+                __sync_synchronize();
+                pRequest->nState=nState;
+            }
+            pthread_mutex_lock(&m_CombineMutex);
+            pthread_cond_broadcast(&m_CombineCond);
+            pthread_mutex_unlock(&m_CombineMutex);
+        }
+        m_uLastSendUs=CTimer::getMonotonicUs();
+    }
+    //frames posted from now on are sent by their own threads
+    pthread_mutex_lock(&m_CombineMutex);
+    m_bCombining=false;
+    pthread_cond_broadcast(&m_CombineCond);
+    pthread_mutex_unlock(&m_CombineMutex);
+}
+
+/**
+ * Gathers outgoing frames in a buffer instead of handing each one to the
+ * transport, and sends them together once enough bytes or frames were
+ * gathered or the oldest frame waited long enough. Many small messages then
+ * take a few large writes instead of one write (and one packet) each, at
+ * the cost of up to uMaxDelayUs of extra latency. The delay is checked
+ * whenever a frame is sent; an idle connection needs serviceCoalescing()
+ * (CTcpMessaging::runOnce() does this) or flush() to send the last frames.
+ * A send that is only gathered reports success; a failing flush is reported
+ * by the send or flush that triggered it. Control frames flush right away.
+ * @param uMaxBytes Flush once this many bytes are gathered. Larger messages
+ *        are sent right away.
+ * @param uMaxMessages Flush once this many frames are gathered
+ * @param uMaxDelayUs Flush once the oldest frame waited this many microseconds
+ */
+void CMessaging::enableCoalescing(unsigned uMaxBytes, unsigned uMaxMessages, unsigned uMaxDelayUs) {
+    pthread_mutex_lock(&m_FrameMutex);
+    m_uCoalesceBytes=uMaxBytes;
+    m_uCoalesceMessages=uMaxMessages;
+    m_uCoalesceDelayUs=uMaxDelayUs;
+    m_CoalesceBuffer.reserve(uMaxBytes);
+    m_bCoalescing=true;
+    pthread_mutex_unlock(&m_FrameMutex);
+}
+
+/**
+ * Sends the gathered frames and goes back to sending every frame right away
+ * @retval true The gathered frames were sent
+ * @retval false The link failed
+ */
+bool CMessaging::disableCoalescing() {
+    bool bResults;
+
+    pthread_mutex_lock(&m_FrameMutex);
+    bResults=flushCoalesced();
+    m_bCoalescing=false;
+    pthread_mutex_unlock(&m_FrameMutex);
+    return bResults;
+}
+
+/**
+ * Sends the gathered frames now. Use this after a message that must not
+ * wait (see enableCoalescing()).
+ * @retval true The gathered frames were sent (or there were none)
+ * @retval false The link failed
+ */
+bool CMessaging::flush() {
+    bool bResults;
+
+    pthread_mutex_lock(&m_FrameMutex);
+    bResults=flushCoalesced();
+    pthread_mutex_unlock(&m_FrameMutex);
+    return bResults;
+}
+
+/**
+ * Sends the gathered frames if the oldest one waited for the delay set in
+ * enableCoalescing(). Call this from the loop that drives the connection.
+ * @param uNowUs Current monotonic time in microseconds
+ * @retval true Nothing was due or the frames were sent
+ * @retval false The link failed
+ */
+bool CMessaging::serviceCoalescing(unsigned long long uNowUs) {
+    if(getCoalesceTimeoutUs(uNowUs) != 0){
+        return true;
+    }
+    return flush();
+}
+
+/**
+ * Returns how long the gathered frames may still wait
+ * @param uNowUs Current monotonic time in microseconds
+ * @return number of microseconds until the frames are due (0 if they are)
+ * @retval -1 Nothing is waiting
+ */
+long long CMessaging::getCoalesceTimeoutUs(unsigned long long uNowUs) {
+    unsigned long long uDueUs;
+
+    //a racy read is fine, the caller only uses it to decide when to look again
+    if(!m_bCoalescing || m_uCoalescedMessages == 0){
+        return -1;
+    }
+    uDueUs=m_uCoalesceStartUs+m_uCoalesceDelayUs;
+    return uNowUs >= uDueUs ? 0 : (long long)(uDueUs-uNowUs);
+}
+
+/**
+ * Sends the gathered frames with a single transmit. Called with
+ * m_FrameMutex held.
+ * @retval true The frames were sent (or there were none)
+ * @retval false The link failed. The frames are dropped.
+ */
+bool CMessaging::flushCoalesced() {
+    bool bResults;
+
+    if(m_CoalesceBuffer.empty()){
+        return true;
+    }
+    bResults=xmitWithRetry(&m_CoalesceBuffer[0],m_CoalesceBuffer.size());
+    m_CoalesceBuffer.clear();
+    m_uCoalescedMessages=0;
+    m_uCoalesceFlushes++;
+    return bResults;
+}
+
+/**
+ * Fills in the gather list for a batch frame. A batch frame carries several
+ * messages behind a single header:
+ *   BTX | length | message count | length of each message | messages | ETX
+ * with all the numbers sent as 4 byte big endian values.
+ * Must be called with the frame mutex held.
+ * @param pMsgs Messages to put in the frame
+ * @param uCount Number of messages (up to MAX_BATCH_MESSAGES)
+ * @param pTrailer The frame trailer
+ * @return number of buffers in the gather list
+ */
+unsigned CMessaging::buildBatchFrame(const Message_t *pMsgs,unsigned uCount,const unsigned char *pTrailer) {
+    unsigned char *pIndex=&m_BatchHeaders[HEADER_SIZE];
+    unsigned uIndexSize=BATCH_ENTRY_SIZE*(uCount+1);
+    unsigned long uLength=uIndexSize;
+
+    putLength(pIndex,uCount);
+    for(unsigned i=0; i < uCount; i++){
+        putLength(pIndex+BATCH_ENTRY_SIZE*(i+1),(unsigned)pMsgs[i].uMsgLength);
+        uLength+=pMsgs[i].uMsgLength;
+        m_BatchVector[i+1].iov_base=pMsgs[i].pData;
+        m_BatchVector[i+1].iov_len=pMsgs[i].uMsgLength;
+    }
+    buildHeader(&m_BatchHeaders[0],(unsigned)uLength,BTX);
+    m_BatchVector[0].iov_base=&m_BatchHeaders[0];
+    m_BatchVector[0].iov_len=HEADER_SIZE+uIndexSize;
+    m_BatchVector[uCount+1].iov_base=(void*)pTrailer;
+    m_BatchVector[uCount+1].iov_len=TRAILER_SIZE;
+
+    return uCount+2;
+}
+
+/**
+ * Lets this end announce its optional features, now and whenever
+ * enableBatchFrames() or enableFragmentFrames() adds one. The announcement
+ * is a control frame, and a peer that predates control frames drops all
+ * the data it holds when it sees one. Only enable this when the remote end
+ * is known to run this version; without it the optional features are never
+ * used and the remote end only ever gets STX frames. A remote end that
+ * announces its features is always answered.
+ * @param bEnable true to announce, false to stop announcing. Nothing is
+ *        sent when negotiation is disabled.
+ */
+void CMessaging::enableCapabilityNegotiation(bool bEnable) {
+    m_bNegotiate=bEnable;
+    if(bEnable){
+        advertiseCapabilities(CONTROL_CAPABILITIES);
+    }
+}
+
+/**
+ * Enables or disables batch frames. Batch frames are only sent once the
+ * remote end announced that it understands them, so peers that do not
+ * know about batch frames keep getting one frame per message. Enabling
+ * announces the capability if capability negotiation is on (see
+ * enableCapabilityNegotiation()). Disabling sends nothing: this end stops
+ * sending batch frames but still decodes the ones it receives.
+ * @param bEnable true to enable batch frames
+ */
+void CMessaging::enableBatchFrames(bool bEnable) {
+    setLocalCapability(CAPABILITY_BATCH,bEnable);
+}
+
+/**
+ * Allows messages sent with PriorityBulk to be split into fragment frames.
+ * Like batch frames, fragments are only used once the remote end announced
+ * it understands them, and only enabling is announced.
+ * @param bEnable true to announce and use fragment frames
+ * @param uFragmentSize Largest number of message bytes in one fragment
+ */
+void CMessaging::enableFragmentFrames(bool bEnable, unsigned uFragmentSize) {
+    m_uFragmentSize=std::max(uFragmentSize,1U);
+    setLocalCapability(CAPABILITY_FRAGMENTS,bEnable);
+}
+
+/**
+ * Adds or removes an optional feature of this end. Adding one that was
+ * not there yet is announced to the remote end if negotiation is on.
+ * @param uCapability CAPABILITY_BATCH or CAPABILITY_FRAGMENTS
+ * @param bEnable true to add the feature
+ */
+void CMessaging::setLocalCapability(unsigned uCapability,bool bEnable) {
+    bool bAdded=bEnable && (m_uLocalCapabilities & uCapability) == 0;
+
+    if(bEnable){
+        m_uLocalCapabilities|=uCapability;
+    } else {
+        m_uLocalCapabilities&=~uCapability;
+    }
+    if(bAdded && m_bNegotiate){
+        advertiseCapabilities(CONTROL_CAPABILITIES);
+    }
+}
+
+/**
+ * Tells the remote end which optional features this end understands
+ * @param uType CONTROL_CAPABILITIES to ask for an answer or
+ *        CONTROL_CAPABILITIES_ACK to answer
+ */
+void CMessaging::advertiseCapabilities(unsigned char uType) {
+    unsigned char body[BATCH_ENTRY_SIZE];
+
+    putLength(body,m_uLocalCapabilities);
+    sendControlFrame(uType,body,sizeof(body));
+}
+
+/**
+ * Forgets what the remote end supports, e.g. after connecting to a new peer
+ */
+void CMessaging::resetPeerCapabilities() {
+    m_uPeerCapabilities=0;
+}
+
+/**
+ * Forgets the credit granted in both directions, e.g. after connecting to a
+ * new peer. Sends are no longer limited until the new peer grants credit.
+ * Messages queued by the CreditQueue policy stay queued and go out ahead of
+ * the next message. The credit granted to the remote end is withdrawn, so
+ * it has to be granted again with enableReceiveCredit().
+ */
+void CMessaging::resetCredit() {
+    pthread_mutex_lock(&m_CreditMutex);
+    m_bCreditLimited=false;
+    m_nSendCreditMessages=0;
+    m_nSendCreditBytes=0;
+    m_uSendWindowBytes=0;
+    m_bCreditBacklog=!m_CreditQueue.empty();
+    m_bReceiveCredit=false;
+    m_uConsumedMessages=0;
+    m_uConsumedBytes=0;
+    //senders waiting for credit of the old peer may go now
+    pthread_cond_broadcast(&m_CreditCond);
+    pthread_mutex_unlock(&m_CreditMutex);
+}
+
+/**
+ * Sends a control frame. Control frames start with CTL instead of STX and
+ * are consumed by the messaging layer of the remote end instead of being
+ * delivered as messages.
+ * @param uType Control frame type
+ * @param pBody Pointer to the control frame body
+ * @param uLength Number of bytes in the body (up to MAX_CONTROL_SIZE)
+ * @param bWait When false, the frame is not sent if another frame is being sent
+ * @retval true Frame was sent successfully
+ * @retval false Frame was not sent
+ */
+bool CMessaging::sendControlFrame(unsigned char uType,const unsigned char *pBody,unsigned uLength,bool bWait) {
+    unsigned char header[HEADER_SIZE];
+    unsigned char trailer[TRAILER_SIZE]={ETX};
+    unsigned char payload[1+MAX_CONTROL_SIZE];
+    struct iovec piece;
+    bool bResults;
+
+    if(uLength > MAX_CONTROL_SIZE){
+        return false;
+    }
+    payload[0]=uType;
+    if(uLength > 0){
+        memcpy(payload+1,pBody,uLength);
+    }
+    buildHeader(header,uLength+1,CTL);
+
+    if(bWait){
+        lockUrgent();
+    } else if(pthread_mutex_trylock(&m_FrameMutex) != 0){
+        return false;
+    }
+    piece.iov_base=payload;
+    piece.iov_len=uLength+1;
+    bResults=xmitFrame(header,&piece,1,trailer);
+    //control frames are timing sensitive, so they never wait for more frames
+    if(!flushCoalesced()){
+        bResults=false;
+    }
+    m_uLastSendUs=CTimer::getMonotonicUs();
+    pthread_mutex_unlock(&m_FrameMutex);
+
+    return bResults;
+}
+
+/**
+ * Handles a control frame received from the remote end. Heartbeats are
+ * echoed back and heartbeat acknowledgments update the round trip time.
+ * Derived classes that add control frame types should pass the types they
+ * do not know about to this function.
+ * @param uType Control frame type
+ * @param pBody Pointer to the control frame body
+ * @param uLength Number of bytes in the body
+ */
+void CMessaging::handleControlFrame(unsigned char uType,const unsigned char *pBody,unsigned uLength) {
+    unsigned long long uSentUs;
+    unsigned long uRttUs;
+
+    switch(uType){
+    case CONTROL_HEARTBEAT:
+        sendControlFrame(CONTROL_HEARTBEAT_ACK,pBody,uLength);
+        break;
+    case CONTROL_HEARTBEAT_ACK:
+        if(uLength != sizeof(uSentUs)){
+            break;
+        }
+        memcpy(&uSentUs,pBody,sizeof(uSentUs));
+        uRttUs=(unsigned long)(CTimer::getMonotonicUs()-uSentUs);
+        m_uLastRttUs=uRttUs;
+        if(m_uSmoothedRttUs == 0){
+            m_uSmoothedRttUs=uRttUs;
+        } else {
+            m_uSmoothedRttUs=(m_uSmoothedRttUs*(RTT_SMOOTHING-1)+uRttUs)/RTT_SMOOTHING;
+        }
+        break;
+    case CONTROL_CAPABILITIES:
+    case CONTROL_CAPABILITIES_ACK:
+        if(uLength < BATCH_ENTRY_SIZE){
+            break;
+        }
+        m_uPeerCapabilities=getLength(pBody);
+        if(uType == CONTROL_CAPABILITIES){
+            advertiseCapabilities(CONTROL_CAPABILITIES_ACK);
+        }
+        break;
+    case CONTROL_CREDIT:
+        if(uLength < 2*BATCH_ENTRY_SIZE){
+            break;
+        }
+        pthread_mutex_lock(&m_CreditMutex);
+        if(!m_bCreditLimited){
+            //what was sent before the first grant is not counted
+            m_uSendWindowBytes=getLength(pBody+BATCH_ENTRY_SIZE);
+            m_bCreditLimited=true;
+        }
+        m_nSendCreditMessages+=getLength(pBody);
+        m_nSendCreditBytes+=getLength(pBody+BATCH_ENTRY_SIZE);
+        pthread_cond_broadcast(&m_CreditCond);
+        pthread_mutex_unlock(&m_CreditMutex);
+        sendCreditQueue();
+        break;
+    default:
+        PTRACE1("Unknown control frame %u\n",(unsigned)uType);
+        break;
+    }
+}
+
+/**
+ * Sends a heartbeat when nothing was sent for a heartbeat interval and
+ * declares the peer dead once nothing was received for uMissedLimit
+ * intervals. This is normally called periodically by CHeartbeatMonitor.
+ * The heartbeat is skipped if another frame is being sent at the time.
+ * @param uNowUs Current time as returned by CTimer::getMonotonicUs()
+ * @param uIntervalMs Heartbeat interval
+ * @param uMissedLimit Number of intervals without data before the peer is dead
+ * @retval true The peer is alive
+ * @retval false The peer is dead
+ */
+bool CMessaging::serviceHeartbeat(unsigned long long uNowUs,unsigned uIntervalMs,unsigned uMissedLimit) {
+    unsigned long long uIntervalUs=(unsigned long long)uIntervalMs*1000;
+
+    if(m_bPeerDead){
+        return false;
+    }
+    if(uNowUs > m_uLastReceiveUs && uNowUs-m_uLastReceiveUs >= uIntervalUs*uMissedLimit){
+        PTRACE("Peer missed too many heartbeats\n");
+        m_bPeerDead=true;
+        peerDead();
+        return false;
+    }
+    if(uNowUs > m_uLastSendUs && uNowUs-m_uLastSendUs >= uIntervalUs){
+        //the time stamp is echoed back by the peer
+        unsigned long long uSentUs=CTimer::getMonotonicUs();
+        sendControlFrame(CONTROL_HEARTBEAT,(const unsigned char *)&uSentUs,sizeof(uSentUs),false);
+    }
+    return true;
+}
+
+/**
+ * Restarts the dead peer detection, e.g. after reconnecting
+ */
+void CMessaging::resetHeartbeat() {
+    m_uLastReceiveUs=CTimer::getMonotonicUs();
+    m_bPeerDead=false;
+}
+
+/**
+ * Transmits a complete frame. The header, the pieces of the message and
+ * the trailer go to the transmit function as one gather list, which lets a
+ * stream transport put the whole frame on the wire with a single call.
+ * Derived classes can override this to hold frames back, e.g. while
+ * reconnecting.
+ * @param pHeader The frame header
+ * @param pPieces List of buffers that make up the message
+ * @param uPieces Number of buffers in the list
+ * @param pTrailer The frame trailer
+ * @retval true Frame was sent successfully
+ * @retval false Frame was not sent
+ */
+bool CMessaging::xmitFrame(const unsigned char *pHeader,const struct iovec *pPieces,unsigned uPieces,const unsigned char *pTrailer) {
+    struct iovec stackVector[MAX_STACK_PIECES+2];
+    struct iovec *pVector=stackVector;
+    unsigned long uFrameSize=HEADER_SIZE+TRAILER_SIZE;
+    bool bResults;
+
+    if(m_bCoalescing){
+        for(unsigned i=0; i < uPieces; i++){
+            uFrameSize+=pPieces[i].iov_len;
+        }
+        //frames at least as big as the limit gain nothing from waiting
+        if(uFrameSize >= m_uCoalesceBytes){
+            if(!flushCoalesced()){
+                return false;
+            }
+        } else {
+            if(m_uCoalescedMessages == 0){
+                m_uCoalesceStartUs=CTimer::getMonotonicUs();
+            }
+            m_CoalesceBuffer.insert(m_CoalesceBuffer.end(),pHeader,pHeader+HEADER_SIZE);
+            for(unsigned i=0; i < uPieces; i++){
+                const unsigned char *pData=(const unsigned char *)pPieces[i].iov_base;
+                m_CoalesceBuffer.insert(m_CoalesceBuffer.end(),pData,pData+pPieces[i].iov_len);
+            }
+            m_CoalesceBuffer.insert(m_CoalesceBuffer.end(),pTrailer,pTrailer+TRAILER_SIZE);
+            m_uCoalescedMessages++;
+            if(m_CoalesceBuffer.size() >= m_uCoalesceBytes || m_uCoalescedMessages >= m_uCoalesceMessages ||
+               CTimer::getMonotonicUs()-m_uCoalesceStartUs >= m_uCoalesceDelayUs){
+                return flushCoalesced();
+            }
+            return true;
+        }
+    }
+
+    if(uPieces > MAX_STACK_PIECES){
+        pVector=new struct iovec[uPieces+2];
+    }
+    pVector[0].iov_base=(void*)pHeader;
+    pVector[0].iov_len=HEADER_SIZE;
+    for(unsigned i=0; i < uPieces; i++){
+        pVector[i+1]=pPieces[i];
+    }
+    pVector[uPieces+1].iov_base=(void*)pTrailer;
+    pVector[uPieces+1].iov_len=TRAILER_SIZE;
+
+    bResults=xmitVectorWithRetry(pVector,uPieces+2);
+
+    if(pVector != stackVector){
+        delete[] pVector;
+    }
+    return bResults;
+}
+
+/**
+ * Transmits a gather list made of several complete frames. Derived classes
+ * can override this to react to a failing link.
+ * @param pVector The gather list. It is updated as data goes out.
+ * @param uCount Number of buffers in the list
+ * @param[out] puSent receives the number of bytes sent
+ * @retval true All the frames were sent
+ * @retval false The link failed part way
+ */
+bool CMessaging::xmitBatch(struct iovec *pVector, unsigned uCount, unsigned long *puSent) {
+    return xmitVectorWithRetry(pVector,uCount,puSent);
+}
+
+/**
+ * Hands a complete message to the message callback or puts it in the
+ * queue. With a batch callback it is held until the chunk is done.
+ * @param msg The message. The receiver takes ownership of msg.pData.
+ */
+void CMessaging::deliverMessage(const Message_t &msg) {
+    if(m_pBatchCallback != NULL){
+        m_Completed.push_back(msg);
+        returnCredit(1,msg.uMsgLength);
+    } else if(m_pMessageCallback != NULL){
+        returnCredit(1,msg.uMsgLength);
+        m_pMessageCallback(toHeapMessage(msg),m_pMessageUser);
+    } else if(m_pReceiveRing != NULL){
+        //a full ring holds up the receiving thread until the consumer catches up
+        while(!m_pReceiveRing->push(msg)){
+            m_pReceiveRing->waitForSpace(RING_WAIT_MS);
+        }
+    } else {
+        m_MsgQueue.push(msg);
+    }
+}
+
+/**
+ * Hands out the messages of a frame that is contiguous in memory as views.
+ * Control frames are handled and batch frames are split in place.
+ * @param uStart Start of frame character
+ * @param pPayload Pointer to the frame contents (after the header)
+ * @param uLength Number of bytes in the frame contents
+ * @retval true At least one message was handed out
+ * @retval false The frame was a control frame or was bad
+ */
+bool CMessaging::dispatchView(unsigned char uStart,const unsigned char *pPayload,unsigned uLength) {
+    unsigned long long uTotal;
+    const unsigned char *pData;
+    unsigned uCount;
+
+    if(uStart == STX){
+        m_pViewCallback(pPayload,uLength,m_pViewUser);
+        returnCredit(1,uLength);
+        return true;
+    }
+    if(uStart == FRG){
+        return dispatchFragmentView(pPayload,uLength);
+    }
+    if(uStart == TTX || uStart == MUX){
+        Message_t msg;
+
+        if(uLength < TAG_PREFIX_SIZE){
+            PTRACE("Bad tagged frame\n");
+            return false;
+        }
+        //the callback keeps the message, so it cannot be a view
+        msg.uMsgLength=uLength-TAG_PREFIX_SIZE;
+        msg.pData=allocMessage(msg.uMsgLength);
+        memcpy(msg.pData,pPayload+TAG_PREFIX_SIZE,msg.uMsgLength);
+        deliverTagged(uStart,pPayload[0],getLength(pPayload+1),msg);
+        return false;
+    }
+    if(uStart == CTL){
+        if(uLength == 0 || uLength > 1+MAX_CONTROL_SIZE){
+            PTRACE("Bad control frame\n");
+            return false;
+        }
+        handleControlFrame(pPayload[0],pPayload+1,uLength-1);
+        return false;
+    }
+
+    //batch frame: check the lengths once, then hand out every message
+    if(uLength < BATCH_ENTRY_SIZE){
+        PTRACE("Bad batch frame\n");
+        return false;
+    }
+    uCount=getLength(pPayload);
+    uTotal=(unsigned long long)BATCH_ENTRY_SIZE*(uCount+1);
+    if(uCount == 0 || uTotal > uLength){
+        PTRACE("Bad batch frame\n");
+        return false;
+    }
+    for(unsigned i=0; i < uCount; i++){
+        uTotal+=getLength(pPayload+BATCH_ENTRY_SIZE*(i+1));
+    }
+    if(uTotal != uLength){
+        PTRACE("Batch frame lengths do not add up\n");
+        return false;
+    }
+    pData=pPayload+BATCH_ENTRY_SIZE*(uCount+1);
+    for(unsigned i=0; i < uCount; i++){
+        unsigned uMsgLength=getLength(pPayload+BATCH_ENTRY_SIZE*(i+1));
+        m_pViewCallback(pData,uMsgLength,m_pViewUser);
+        returnCredit(1,uMsgLength);
+        pData+=uMsgLength;
+    }
+    return true;
+}
+
+/**
+ * Copies the part of a frame that a chunk holds into the view buffer, for a
+ * frame cut off by the end of a chunk. The header comes first and is
+ * checked before anything else is buffered, then the buffer is sized for
+ * the whole frame and filled by the chunks that follow. A bad frame drops
+ * the rest of the chunk, as decode() does.
+ * @param pBuffer Received data
+ * @param uLength Number of bytes received
+ * @param bResults Set when a message is handed out
+ * @return Number of bytes taken from the chunk
+ */
+unsigned CMessaging::fillView(const unsigned char *pBuffer,unsigned uLength,bool &bResults) {
+    unsigned long long uFrameSize;
+    unsigned uMsgLength,uTake;
+
+    if(m_uViewFill < HEADER_SIZE){
+        uTake=(unsigned)std::min((unsigned long)uLength,HEADER_SIZE-m_uViewFill);
+        if(m_ViewBuffer.size() < HEADER_SIZE){
+            m_ViewBuffer.resize(HEADER_SIZE);
+        }
+        memcpy(&m_ViewBuffer[m_uViewFill],pBuffer,uTake);
+        m_uViewFill+=uTake;
+        if(m_uViewFill < HEADER_SIZE){
+            return uTake;
+        }
+        if(!isFrameStart(m_ViewBuffer[0])){
+            PTRACE("Bad Start of message\n");
+            m_uViewFill=0;
+            return uLength;
+        }
+        uMsgLength=getLength(&m_ViewBuffer[1]);
+        uFrameSize=(unsigned long long)HEADER_SIZE+uMsgLength+TRAILER_SIZE;
+        if(isTooLong(uMsgLength)){
+            PTRACE("Frame is longer than the limit\n");
+            m_uViewFill=0;
+            m_uDecodeSkip=uFrameSize-HEADER_SIZE;
+            return uTake;
+        }
+        m_ViewBuffer.resize((size_t)uFrameSize);
+        return uTake;
+    }
+    uTake=(unsigned)std::min((unsigned long)uLength,(unsigned long)(m_ViewBuffer.size()-m_uViewFill));
+    memcpy(&m_ViewBuffer[m_uViewFill],pBuffer,uTake);
+    m_uViewFill+=uTake;
+    if(m_uViewFill < m_ViewBuffer.size()){
+        return uTake;
+    }
+    m_uViewFill=0;
+    uMsgLength=(unsigned)(m_ViewBuffer.size()-HEADER_SIZE-TRAILER_SIZE);
+    if(m_ViewBuffer[HEADER_SIZE+uMsgLength] != ETX){
+        PTRACE("Found bad trailer\n");
+        return uLength;
+    }
+    if(dispatchView(m_ViewBuffer[0],&m_ViewBuffer[HEADER_SIZE],uMsgLength)){
+        bResults=true;
+    }
+    return uTake;
+}
+
+/**
+ * Processes a chunk in view mode. The frames within the chunk are handed
+ * out in place. A frame cut off by the end of the chunk is copied once into
+ * the view buffer and completed by the chunks that follow, and a frame over
+ * the size limit is passed over without buffering any of it.
+ * @param pBuffer The buffer containing partial,entire. or multiple messages
+ * @param uLength The length of the buffer
+ * @retval true At least one message was handed out
+ * @retval false No complete message was found
+ */
+bool CMessaging::processChunkView(const unsigned char *pBuffer,unsigned uLength) {
+    unsigned long long uFrameSize;
+    unsigned uMsgLength,uTake;
+    bool bResults=false;
+
+    while(uLength > 0){
+        if(m_uDecodeSkip > 0){
+            //the rest of a frame over the limit
+            uTake=(unsigned)std::min((unsigned long long)uLength,m_uDecodeSkip);
+            m_uDecodeSkip-=uTake;
+        } else if(m_uViewFill > 0 || uLength < HEADER_SIZE){
+            uTake=fillView(pBuffer,uLength,bResults);
+        } else {
+            if(!isFrameStart(pBuffer[0])){
+                PTRACE("Bad Start of message\n");
+                return bResults;
+            }
+            uMsgLength=getLength(pBuffer+1);
+            uFrameSize=(unsigned long long)HEADER_SIZE+uMsgLength+TRAILER_SIZE;
+            if(isTooLong(uMsgLength)){
+                //pass over the frame, whatever part of it is in this chunk
+                PTRACE("Frame is longer than the limit\n");
+                uTake=(unsigned)std::min((unsigned long long)uLength,uFrameSize);
+                m_uDecodeSkip=uFrameSize-uTake;
+            } else if(uFrameSize > uLength){
+                uTake=fillView(pBuffer,uLength,bResults);
+            } else {
+                if(pBuffer[HEADER_SIZE+uMsgLength] != ETX){
+                    //dump the rest of the chunk, as decode() does
+                    PTRACE("Found bad trailer\n");
+                    return bResults;
+                }
+                if(dispatchView(pBuffer[0],pBuffer+HEADER_SIZE,uMsgLength)){
+                    bResults=true;
+                }
+                uTake=(unsigned)uFrameSize;
+            }
+        }
+        pBuffer+=uTake;
+        uLength-=uTake;
+    }
+    return bResults;
+}
+
+/**
+ * Processes a chunk of data received from the remote end
+ * @param pBuffer The buffer containing partial,entire. or multiple messages
+ * @param uLength The length of the buffer
+ * @retval true At least one message was received after processing chunk
+ * @retval false No complete message was received after processing chunk
+ */
+bool CMessaging::processChunk(unsigned char* pBuffer, unsigned uLength) {
+    bool bResults;
+
+    m_uLastReceiveUs=CTimer::getMonotonicUs();
+    if(m_pViewCallback != NULL){
+        return processChunkView(pBuffer,uLength);
+    }
+    bResults=decode(pBuffer,uLength);
+    flushCompleted();
+    return bResults;
+}
+
+/**
+ * Hands the messages completed by the chunk just processed to the batch
+ * callback in one call, then frees the ones the callback did not keep
+ */
+void CMessaging::flushCompleted() {
+    if(m_Completed.empty()){
+        return;
+    }
+    if(m_pBatchCallback != NULL){
+        m_pBatchCallback(&m_Completed[0],m_Completed.size(),m_pBatchUser);
+    }
+    for(unsigned i=0; i < m_Completed.size(); i++){
+        if(m_Completed[i].pData != NULL){
+            freeMessage(m_Completed[i].pData);
+        }
+    }
+    m_Completed.clear();
+}
+
+/**
+ * Returns a buffer that received data can be written into directly. In view
+ * mode this is a buffer that is reused for every receive, so the frames in
+ * it can be handed out in place. Otherwise it is the end of the assembler.
+ * @param uSize Number of bytes the caller may write
+ * @return The buffer. It is valid until processReceived() is called.
+ */
+unsigned char *CMessaging::getReceiveBuffer(unsigned uSize) {
+    m_bReceiveStaged=(m_pViewCallback != NULL);
+    if(m_bReceiveStaged){
+        if(m_ReceiveBuffer.size() < uSize+1){
+            m_ReceiveBuffer.resize(uSize+1);
+        }
+        return &m_ReceiveBuffer[0];
+    }
+    return m_assembler.Reserve(uSize);
+}
+
+/**
+ * Processes data that the caller received directly into the buffer
+ * returned by getReceiveBuffer(). This saves the copy made by processChunk.
+ * @param uLength Number of bytes written into the receive buffer
+ * @retval true At least one message was received
+ * @retval false No complete message was received
+ */
+bool CMessaging::processReceived(unsigned uLength) {
+    const unsigned char *pData;
+    unsigned uBlockLength;
+    bool bResults=false;
+
+    m_uLastReceiveUs=CTimer::getMonotonicUs();
+    if(m_bReceiveStaged){
+        //only a frame cut off at the end is copied
+        m_bReceiveStaged=false;
+        return processChunkView(&m_ReceiveBuffer[0],uLength);
+    }
+    m_assembler.Commit(uLength);
+    //the receive buffer is only a staging area for the decoder, or for
+    //views when they were turned on after the buffer was handed out
+    while((pData=m_assembler.Head(uBlockLength)) != NULL){
+        if(m_pViewCallback != NULL ? processChunkView(pData,uBlockLength) : decode(pData,uBlockLength)){
+            bResults=true;
+        }
+        m_assembler.Trim(uBlockLength);
+    }
+    flushCompleted();
+    return bResults;
+}
+
+/**
+ * Runs received data through the frame decoder. The decoder keeps its
+ * state between calls, so a frame can be split over any number of chunks.
+ * The message buffer is allocated as soon as the header is in and every
+ * payload byte is copied straight into it, once. A large message therefore
+ * never needs more memory than its own size.
+ * @param pBuffer Received data
+ * @param uLength Number of bytes received
+ * @retval true At least one message was received
+ * @retval false No complete message was received
+ */
+bool CMessaging::decode(const unsigned char *pBuffer, unsigned uLength) {
+    unsigned uTake=0;
+    bool bResults=false;
+
+    while(uLength > 0){
+        switch(m_DecodeState){
+        case DecodeHeader:
+            uTake=(unsigned)std::min((unsigned long)uLength,HEADER_SIZE-m_uDecodeOffset);
+            memcpy(m_DecodeHeader+m_uDecodeOffset,pBuffer,uTake);
+            m_uDecodeOffset+=uTake;
+            if(m_uDecodeOffset == HEADER_SIZE && !startFrame()){
+                //dump the rest of the chunk in an attempt to recover
+                resetDecoder();
+                return bResults;
+            }
+            break;
+        case DecodeIndex:
+            uTake=(unsigned)std::min((unsigned long)uLength,m_BatchIndex.size()-m_uDecodeOffset);
+            memcpy(&m_BatchIndex[m_uDecodeOffset],pBuffer,uTake);
+            m_uDecodeOffset+=uTake;
+            if(m_uDecodeOffset == m_BatchIndex.size() &&
+               !(m_DecodeHeader[0] == FRG ? startFragment() :
+                 m_DecodeHeader[0] == TTX || m_DecodeHeader[0] == MUX ? startTagged() : startBatch())){
+                resetDecoder();
+                return bResults;
+            }
+            break;
+        case DecodePayload: {
+            Message_t &msg=m_DecodeMessages[m_uDecodeIndex];
+            uTake=(unsigned)std::min((unsigned long)uLength,msg.uMsgLength-m_uDecodeOffset);
+            if(m_bStreamFrame){
+                //straight out of the chunk, nothing is buffered
+                streamEvent(StreamData,pBuffer,uTake);
+            } else {
+                memcpy(msg.pData+m_uDecodeOffset,pBuffer,uTake);
+            }
+            m_uDecodeOffset+=uTake;
+            if(m_uDecodeOffset == msg.uMsgLength){
+                m_uDecodeIndex++;
+                nextPayload();
+            }
+            break;
+        }
+        case DecodeSkip:
+            uTake=(unsigned)std::min((unsigned long long)uLength,m_uDecodeSkip);
+            m_uDecodeSkip-=uTake;
+            if(m_uDecodeSkip == 0){
+                m_DecodeState=DecodeHeader;
+            }
+            break;
+        case DecodeTrailer:
+            uTake=TRAILER_SIZE;
+            if(pBuffer[0] != ETX){
+                //oops! The trailer was not valid
+                //dump the message
+                PTRACE("Found bad trailer\n");
+                resetDecoder();
+                return bResults;
+            }
+            if(finishFrame()){
+                bResults=true;
+            }
+            break;
+        }
+        pBuffer+=uTake;
+        uLength-=uTake;
+    }
+    return bResults;
+}
+
+/**
+ * Sets up the destination of a frame once its header is complete
+ * @retval true The header is valid
+ * @retval false The header is bad
+ */
+bool CMessaging::startFrame() {
+    unsigned uLength=getLength(m_DecodeHeader+1);
+    Message_t msg;
+
+    m_uDecodeOffset=0;
+    m_uDecodeIndex=0;
+    switch(m_DecodeHeader[0]){
+    case STX:
+        msg.uMsgLength=uLength;
+        //pieces of two streamed messages must not interleave
+        if(m_pStreamCallback != NULL && uLength >= m_uStreamThreshold && !m_bStreamIn){
+            msg.pData=NULL;
+            m_bStreamFrame=true;
+            streamEvent(StreamBegin,NULL,uLength);
+            break;
+        }
+        if(isTooLong(uLength)){
+            PTRACE("Frame is longer than the limit\n");
+            skipFrame((unsigned long long)uLength+TRAILER_SIZE);
+            return true;
+        }
+        msg.pData=allocMessage(uLength);
+        break;
+    case CTL:
+        //control frames are handled here and never reach the queue
+        if(uLength == 0 || uLength > sizeof(m_DecodeControl)){
+            PTRACE("Bad control frame\n");
+            return false;
+        }
+        msg.pData=m_DecodeControl;
+        msg.uMsgLength=uLength;
+        break;
+    case BTX:
+        //the count comes first, the lengths follow
+        if(uLength < BATCH_ENTRY_SIZE){
+            PTRACE("Bad batch frame\n");
+            return false;
+        }
+        if(isTooLong(uLength)){
+            PTRACE("Frame is longer than the limit\n");
+            skipFrame((unsigned long long)uLength+TRAILER_SIZE);
+            return true;
+        }
+        m_BatchIndex.resize(BATCH_ENTRY_SIZE);
+        m_DecodeState=DecodeIndex;
+        return true;
+    case FRG:
+        //the flags and the message length come first
+        if(uLength < FRAGMENT_PREFIX_SIZE){
+            PTRACE("Bad fragment frame\n");
+            return false;
+        }
+        if(isTooLong(uLength)){
+            PTRACE("Frame is longer than the limit\n");
+            skipFrame((unsigned long long)uLength+TRAILER_SIZE);
+            return true;
+        }
+        m_BatchIndex.resize(FRAGMENT_PREFIX_SIZE);
+        m_DecodeState=DecodeIndex;
+        return true;
+    case TTX:
+    case MUX:
+        //the kind and the tag come first
+        if(uLength < TAG_PREFIX_SIZE){
+            PTRACE("Bad tagged frame\n");
+            return false;
+        }
+        if(isTooLong(uLength)){
+            PTRACE("Frame is longer than the limit\n");
+            skipFrame((unsigned long long)uLength+TRAILER_SIZE);
+            return true;
+        }
+        m_BatchIndex.resize(TAG_PREFIX_SIZE);
+        m_DecodeState=DecodeIndex;
+        return true;
+    default:
+        PTRACE("Bad Start of message\n");
+        return false;
+    }
+    m_DecodeMessages.push_back(msg);
+    nextPayload();
+    return true;
+}
+
+/**
+ * Sets up the messages of a batch frame. Called once with the message
+ * count and once with all the lengths, which are checked against the frame
+ * length in one go.
+ * @retval true The batch frame is valid so far
+ * @retval false The batch frame is bad
+ */
+bool CMessaging::startBatch() {
+    unsigned uLength=getLength(m_DecodeHeader+1);
+    unsigned uCount=getLength(&m_BatchIndex[0]);
+    unsigned long long uTotal=(unsigned long long)BATCH_ENTRY_SIZE*(uCount+1);
+    Message_t msg;
+
+    if(uCount == 0 || uTotal > uLength){
+        PTRACE("Bad batch frame\n");
+        return false;
+    }
+    if(m_BatchIndex.size() == BATCH_ENTRY_SIZE){
+        //only the count is in, read the lengths next
+        m_BatchIndex.resize((size_t)uTotal);
+        return true;
+    }
+    for(unsigned i=1; i <= uCount; i++){
+        uTotal+=getLength(&m_BatchIndex[i*BATCH_ENTRY_SIZE]);
+    }
+    if(uTotal != uLength){
+        PTRACE("Batch frame lengths do not add up\n");
+        return false;
+    }
+    m_DecodeMessages.reserve(uCount);
+    for(unsigned i=1; i <= uCount; i++){
+        msg.uMsgLength=getLength(&m_BatchIndex[i*BATCH_ENTRY_SIZE]);
+        msg.pData=allocMessage(msg.uMsgLength);
+        m_DecodeMessages.push_back(msg);
+    }
+    m_uDecodeIndex=0;
+    nextPayload();
+    return true;
+}
+
+/**
+ * Moves the decoder to the next message of the frame that still needs
+ * data, or to the trailer once all of them are complete
+ */
+void CMessaging::nextPayload() {
+    m_uDecodeOffset=0;
+    while(m_uDecodeIndex < m_DecodeMessages.size() &&
+            m_DecodeMessages[m_uDecodeIndex].uMsgLength == 0){
+        m_uDecodeIndex++;
+    }
+    m_DecodeState=(m_uDecodeIndex < m_DecodeMessages.size()) ? DecodePayload : DecodeTrailer;
+}
+
+/**
+ * Makes the decoder pass over the rest of a frame it does not take, e.g.
+ * one over the size limit. The length in the header is still good, so the
+ * frame that follows is found, and no byte of the skipped frame can be
+ * taken for a header.
+ * @param uBytes Number of bytes left in the frame, trailer included
+ */
+void CMessaging::skipFrame(unsigned long long uBytes) {
+    m_DecodeState=DecodeSkip;
+    m_uDecodeSkip=uBytes;
+    m_uDecodeOffset=0;
+}
+
+/**
+ * Hands the messages of a complete frame over and gets ready for the next
+ * frame
+ * @retval true At least one message was delivered
+ * @retval false The frame was a control frame
+ */
+bool CMessaging::finishFrame() {
+    bool bStreamFrame=m_bStreamFrame;
+    bool bResults=false;
+
+    //the messages belong to the receiver from here on, even if delivery is
+    //cut short (e.g. the thread is cancelled while waking the consumer)
+    m_DecodeState=DecodeHeader;
+    m_uDecodeOffset=0;
+    m_bStreamFrame=false;
+    if(bStreamFrame && m_DecodeHeader[0] == STX){
+        streamEvent(StreamEnd,NULL,0);
+    } else if(m_DecodeHeader[0] == CTL){
+        handleControlFrame(m_DecodeControl[0],m_DecodeControl+1,(unsigned)m_DecodeMessages[0].uMsgLength-1);
+    } else if(m_DecodeHeader[0] == FRG){
+        bResults=finishFragment();
+    } else if(m_DecodeHeader[0] == TTX || m_DecodeHeader[0] == MUX){
+        deliverTagged(m_DecodeHeader[0],m_BatchIndex[0],getLength(&m_BatchIndex[1]),m_DecodeMessages[0]);
+    } else {
+        for(unsigned i=0; i < m_DecodeMessages.size(); i++){
+            deliverMessage(m_DecodeMessages[i]);
+        }
+        bResults=true;
+    }
+    m_DecodeMessages.clear();
+    return bResults;
+}
+
+/**
+ * Drops the frame being decoded
+ */
+void CMessaging::resetDecoder() {
+    //control and fragment frames are decoded into buffers the frame does not own
+    if(m_DecodeState != DecodeHeader && m_DecodeHeader[0] != CTL && m_DecodeHeader[0] != FRG && !m_bStreamFrame){
+        for(unsigned i=0; i < m_DecodeMessages.size(); i++){
+            freeMessage(m_DecodeMessages[i].pData);
+        }
+    }
+    if(m_bStreamFrame && m_DecodeHeader[0] == STX){
+        streamEvent(StreamAbort,NULL,0);
+    }
+    m_bStreamFrame=false;
+    //a lost frame breaks the message being reassembled
+    if(m_DecodeState != DecodeHeader){
+        resetFragments();
+    }
+    m_DecodeMessages.clear();
+    m_DecodeState=DecodeHeader;
+    m_uDecodeOffset=0;
+    m_uDecodeSkip=0;
+}
+
+/**
+ * Drops the frame being decoded, the message being reassembled from
+ * fragments and the received bytes that were not decoded yet. Call this
+ * when the transport changes, so that the rest of a frame from the old
+ * connection does not take the first bytes of the new one.
+ */
+void CMessaging::resetReceiver() {
+    resetDecoder();
+    resetFragments();
+    m_assembler.Clear();
+    m_uViewFill=0;
+}
+
+/**
+ * Sets up a fragment frame once its flags and message length are in. The
+ * first fragment allocates the whole message, and every fragment is
+ * decoded straight into its place in it.
+ * @retval true The fragment fits the message being reassembled
+ * @retval false The fragment is bad or out of order
+ */
+bool CMessaging::startFragment() {
+    unsigned uLength=getLength(m_DecodeHeader+1)-FRAGMENT_PREFIX_SIZE;
+    unsigned char uFlags=m_BatchIndex[0];
+    unsigned uTotal=getLength(&m_BatchIndex[1]);
+    Message_t msg;
+
+    if(uFlags & FRAGMENT_FIRST){
+        if(m_Fragmented.pData != NULL || m_bStreamIn){
+            PTRACE("Dropping an incomplete fragmented message\n");
+        }
+        resetFragments();
+        m_Fragmented.uMsgLength=uTotal;
+        if(m_pStreamCallback != NULL && uTotal >= m_uStreamThreshold){
+            m_bStreamIn=true;
+            streamEvent(StreamBegin,NULL,uTotal);
+        } else if(isTooLong(uTotal)){
+            PTRACE("Fragmented message is longer than the limit\n");
+            m_bFragmentSkip=true;
+        } else {
+            m_Fragmented.pData=allocMessage(uTotal);
+        }
+    } else if((m_Fragmented.pData == NULL && !m_bStreamIn && !m_bFragmentSkip) || m_Fragmented.uMsgLength != uTotal){
+        PTRACE("Fragment does not belong to a message\n");
+        return false;
+    }
+    if(m_bFragmentSkip){
+        //every fragment of a message over the limit is passed over
+        if(uFlags & FRAGMENT_LAST){
+            resetFragments();
+        }
+        skipFrame((unsigned long long)uLength+TRAILER_SIZE);
+        return true;
+    }
+    if(m_uFragmentOffset+uLength > uTotal){
+        PTRACE("Fragment runs past the end of the message\n");
+        return false;
+    }
+    //a streamed fragment goes to the callback as it is decoded
+    m_bStreamFrame=m_bStreamIn;
+    msg.pData=m_bStreamIn ? NULL : m_Fragmented.pData+m_uFragmentOffset;
+    msg.uMsgLength=uLength;
+    m_DecodeMessages.push_back(msg);
+    m_uDecodeIndex=0;
+    nextPayload();
+    return true;
+}
+
+/**
+ * Sets up the message of a tagged frame once its kind and tag are in
+ * @retval true Always; the prefix was checked against the frame length
+ */
+bool CMessaging::startTagged() {
+    Message_t msg;
+
+    msg.uMsgLength=getLength(m_DecodeHeader+1)-TAG_PREFIX_SIZE;
+    msg.pData=allocMessage(msg.uMsgLength);
+    m_DecodeMessages.push_back(msg);
+    m_uDecodeIndex=0;
+    nextPayload();
+    return true;
+}
+
+/**
+ * Accounts for a complete fragment frame and delivers the message with
+ * the last one
+ * @retval true The message is complete and was delivered
+ * @retval false More fragments are needed, or the message was short
+ */
+bool CMessaging::finishFragment() {
+    Message_t msg;
+
+    m_uFragmentOffset+=m_DecodeMessages[0].uMsgLength;
+    if((m_BatchIndex[0] & FRAGMENT_LAST) == 0){
+        return false;
+    }
+    if(m_uFragmentOffset != m_Fragmented.uMsgLength){
+        PTRACE("Fragmented message is short\n");
+        resetFragments();
+        return false;
+    }
+    if(m_bStreamIn){
+        m_bStreamIn=false;
+        resetFragments();
+        streamEvent(StreamEnd,NULL,0);
+        return false;
+    }
+    msg=m_Fragmented;
+    m_Fragmented.pData=NULL;
+    resetFragments();
+    deliverMessage(msg);
+    return true;
+}
+
+/**
+ * Adds a fragment frame to the message being reassembled in view mode, and
+ * hands the message out with the last fragment
+ * @param pPayload The fragment frame contents
+ * @param uLength Number of bytes in the frame contents
+ * @retval true The message is complete and was handed out
+ * @retval false More fragments are needed, or the fragment was bad
+ */
+bool CMessaging::dispatchFragmentView(const unsigned char *pPayload, unsigned uLength) {
+    unsigned char uFlags;
+    unsigned uTotal;
+
+    if(uLength < FRAGMENT_PREFIX_SIZE){
+        PTRACE("Bad fragment frame\n");
+        return false;
+    }
+    uFlags=pPayload[0];
+    uTotal=getLength(pPayload+1);
+    pPayload+=FRAGMENT_PREFIX_SIZE;
+    uLength-=FRAGMENT_PREFIX_SIZE;
+    if((uFlags & FRAGMENT_FIRST) ? (m_pStreamCallback != NULL && uTotal >= m_uStreamThreshold) : m_bStreamIn){
+        return streamFragmentView(uFlags,uTotal,pPayload,uLength);
+    }
+    if(uFlags & FRAGMENT_FIRST){
+        resetFragments();
+        m_Fragmented.uMsgLength=uTotal;
+        if(isTooLong(uTotal)){
+            PTRACE("Fragmented message is longer than the limit\n");
+            m_bFragmentSkip=true;
+        } else {
+            m_FragmentView.reserve(uTotal);
+        }
+    } else if((m_FragmentView.empty() && !m_bFragmentSkip) || m_Fragmented.uMsgLength != uTotal){
+        PTRACE("Fragment does not belong to a message\n");
+        return false;
+    }
+    if(m_bFragmentSkip){
+        //every fragment of a message over the limit is passed over
+        if(uFlags & FRAGMENT_LAST){
+            resetFragments();
+        }
+        return false;
+    }
+    if(m_FragmentView.size()+uLength > uTotal){
+        PTRACE("Fragment runs past the end of the message\n");
+        resetFragments();
+        return false;
+    }
+    m_FragmentView.insert(m_FragmentView.end(),pPayload,pPayload+uLength);
+    if((uFlags & FRAGMENT_LAST) == 0){
+        return false;
+    }
+    if(m_FragmentView.size() != uTotal){
+        PTRACE("Fragmented message is short\n");
+        resetFragments();
+        return false;
+    }
+    m_pViewCallback(m_FragmentView.empty() ? NULL : &m_FragmentView[0],uTotal,m_pViewUser);
+    returnCredit(1,uTotal);
+    resetFragments();
+    return true;
+}
+
+/**
+ * Drops the message being reassembled from fragment frames
+ */
+void CMessaging::resetFragments() {
+    abortReceivedStream();
+    if(m_Fragmented.pData != NULL){
+        freeMessage(m_Fragmented.pData);
+    }
+    m_Fragmented.pData=NULL;
+    m_Fragmented.uMsgLength=0;
+    m_uFragmentOffset=0;
+    m_FragmentView.clear();
+    m_bFragmentSkip=false;
+}
+
+/**
+ * Hands a streamed fragment frame to the stream callback in view mode
+ * @param uFlags Flags of the fragment
+ * @param uTotal Number of bytes in the whole message
+ * @param pPayload The fragment
+ * @param uLength Number of bytes in the fragment
+ * @retval false Always; streamed messages never count as received
+ */
+bool CMessaging::streamFragmentView(unsigned char uFlags, unsigned uTotal, const unsigned char *pPayload, unsigned uLength) {
+    if(uFlags & FRAGMENT_FIRST){
+        resetFragments();
+        m_Fragmented.uMsgLength=uTotal;
+        m_bStreamIn=true;
+        streamEvent(StreamBegin,NULL,uTotal);
+    } else if(m_Fragmented.uMsgLength != uTotal){
+        PTRACE("Fragment does not belong to a message\n");
+        return false;
+    }
+    if(m_uFragmentOffset+uLength > uTotal){
+        PTRACE("Fragment runs past the end of the message\n");
+        resetFragments();
+        return false;
+    }
+    if(uLength > 0){
+        streamEvent(StreamData,pPayload,uLength);
+    }
+    m_uFragmentOffset+=uLength;
+    if((uFlags & FRAGMENT_LAST) == 0){
+        return false;
+    }
+    if(m_uFragmentOffset != uTotal){
+        PTRACE("Fragmented message is short\n");
+        resetFragments();
+        return false;
+    }
+    m_bStreamIn=false;
+    resetFragments();
+    streamEvent(StreamEnd,NULL,0);
+    return false;
+}
+
+/**
+ * Hands an event of a streamed message to the stream callback
+ * @param event What happened
+ * @param pData Piece of the message for StreamData
+ * @param uLength Number of bytes in the piece, or in the message for StreamBegin
+ */
+void CMessaging::streamEvent(StreamEvent_t event, const unsigned char *pData, unsigned long uLength) {
+    if(event == StreamBegin){
+        m_uStreamInLength=uLength;
+    }
+    if(m_pStreamCallback != NULL){
+        m_pStreamCallback(event,pData,uLength,m_pStreamUser);
+    }
+    //the message is used up, whether it made it or not
+    if(event == StreamEnd || event == StreamAbort){
+        returnCredit(1,m_uStreamInLength);
+    }
+}
+
+/**
+ * Ends the fragmented message being streamed to the callback, if any, with
+ * StreamAbort
+ */
+void CMessaging::abortReceivedStream() {
+    if(m_bStreamIn){
+        m_bStreamIn=false;
+        streamEvent(StreamAbort,NULL,0);
+    }
+}
+
+/**
+ * Returns the size of the message at the beginning of the queue
+ * @return The size of the message at the beginning of the queue
+ * @retval 0 If no messages are pending
+ */
+unsigned CMessaging::getMsgSize() {
+    const Message_t *pFront=peekReceived();
+
+    if(pFront != NULL){
+        return pFront->uMsgLength;
+    }
+    return 0;
+}
+
+/**
+ * Returns the number of fully received messages available
+ */
+unsigned CMessaging::getMessageCount() {
+    if(m_pReceiveRing != NULL){
+        return m_pReceiveRing->size();
+    }
+    return m_MsgQueue.size();
+}
+
+/**
+ * Returns the first message of the received queue or ring
+ * @return pointer to the message or NULL if there is none. Valid until popReceived().
+ */
+CMessaging::Message_t *CMessaging::peekReceived() {
+    if(m_pReceiveRing != NULL){
+        return m_pReceiveRing->front();
+    }
+    if(m_MsgQueue.empty()){
+        return NULL;
+    }
+    return &m_MsgQueue.front();
+}
+
+/**
+ * Removes the first message of the received queue or ring
+ */
+void CMessaging::popReceived() {
+    Message_t *pMsg=peekReceived();
+    unsigned long uLength;
+
+    if(pMsg == NULL){
+        return;
+    }
+    uLength=pMsg->uMsgLength;
+    if(m_pReceiveRing != NULL){
+        m_pReceiveRing->pop();
+    } else {
+        m_MsgQueue.pop();
+    }
+    returnCredit(1,uLength);
+}
+
+/**
+ * Hands received messages from the thread that calls processChunk() to
+ * the thread that calls getMsg() through a lock free ring instead of the
+ * unsynchronized queue. Each side must only ever be used from one thread.
+ * When the ring is full the receiving thread waits for the consumer. Call
+ * this before any data is received.
+ * @param uCapacity Number of messages the ring holds (rounded up to a power of two)
+ * @retval true The ring is in use
+ * @retval false Messages are already queued
+ */
+bool CMessaging::enableReceiveRing(unsigned uCapacity) {
+    if(m_pReceiveRing != NULL){
+        return true;
+    }
+    if(!m_MsgQueue.empty()){
+        PTRACE("Cannot switch to a receive ring with messages queued\n");
+        return false;
+    }
+    m_pReceiveRing=new CSpscRing<Message_t>(uCapacity);
+    return true;
+}
+
+/**
+ * Waits for a message to arrive. The wait needs a receive ring (see
+ * enableReceiveRing()); without one this only checks the queue.
+ * @param nTimeoutMs Time to wait in milliseconds. -1 waits for ever.
+ * @retval true A message is available
+ * @retval false The wait timed out
+ */
+bool CMessaging::waitForMessage(int nTimeoutMs) {
+    if(m_pReceiveRing != NULL){
+        return m_pReceiveRing->waitForData(nTimeoutMs);
+    }
+    return !m_MsgQueue.empty();
+}
+
+/**
+ * Pops the message first message from the received
+ * message queue
+ * @return First message in the queue
+ * @note This pointer must be deleted by the caller after the message is
+ * successfully processed.
+ */
+CMessaging::Message_t CMessaging::getMsg() {
+    Message_t msg;
+
+    msg.pData=0;
+    msg.uMsgLength=0;
+
+    if(peekReceived() != NULL){
+        msg=toHeapMessage(*peekReceived());
+        popReceived();
+    }
+
+    return msg;
+}
+
+/**
+ * Takes the first message off the received queue as an owning handle. The
+ * buffer goes back to the pool when the last handle is destroyed.
+ * @param[out] msg receives the message
+ * @retval true A message was taken off the queue
+ * @retval false The queue is empty
+ */
+bool CMessaging::getMsg(CMessage &msg) {
+    Message_t front;
+
+    if(peekReceived() == NULL){
+        return false;
+    }
+    front=*peekReceived();
+    popReceived();
+    if(m_pMessagePool != NULL){
+        msg.attach(front.pData,front.uMsgLength);
+    } else {
+        CMessage copy(front.uMsgLength);
+        memcpy(copy.data(),front.pData,front.uMsgLength);
+        delete[] front.pData;
+        msg=copy;
+    }
+    return true;
+}
+
+/**
+ * Copies the first message on the received queue into a buffer owned by
+ * the caller. With a message pool set (see setMessagePool()), receiving
+ * this way does not touch the heap once the pool is warm.
+ * @param pBuffer Buffer that receives the message
+ * @param uSize Number of bytes the buffer can hold
+ * @param[out] uLength receives the size of the message, also when it does
+ *        not fit
+ * @retval true The message was copied and taken off the queue
+ * @retval false The queue is empty (uLength is 0) or the message does not
+ *         fit and was left on the queue
+ */
+bool CMessaging::getMsgInto(unsigned char *pBuffer, unsigned long uSize, unsigned long &uLength) {
+    Message_t front;
+
+    uLength=0;
+    if(peekReceived() == NULL){
+        return false;
+    }
+    front=*peekReceived();
+    uLength=front.uMsgLength;
+    if(uLength > uSize){
+        return false;
+    }
+    memcpy(pBuffer,front.pData,uLength);
+    freeMessage(front.pData);
+    popReceived();
+    return true;
+}
+
+/**
+ * Makes received messages come out of a pool of recycled buffers instead
+ * of the heap. Messages are then best taken with getMsg(CMessage&) or
+ * getMsgInto(); getMsg() and the message callback still hand out buffers
+ * that are deleted with delete[], at the cost of a copy. Set the pool
+ * before any data is received.
+ * @param pPool Pool to use (e.g. CBufferPool::getDefault()). NULL goes back
+ *        to the heap.
+ */
+void CMessaging::setMessagePool(CBufferPool *pPool) {
+    m_pMessagePool=pPool;
+}
+
+/**
+ * Allocates the buffer for a received message
+ * @param uLength Number of bytes in the message
+ */
+unsigned char *CMessaging::allocMessage(unsigned long uLength) {
+    if(m_pMessagePool != NULL){
+        return m_pMessagePool->allocate(uLength);
+    }
+    return new unsigned char[uLength];
+}
+
+/**
+ * Frees the buffer of a received message
+ * @param pData Buffer returned by allocMessage()
+ */
+void CMessaging::freeMessage(unsigned char *pData) {
+    if(m_pMessagePool != NULL){
+        CBufferPool::release(pData);
+    } else {
+        delete[] pData;
+    }
+}
+
+/**
+ * Turns a received message into one that the caller deletes with delete[]
+ * @param msg Message with a buffer returned by allocMessage()
+ * @return the same message when it already lives on the heap, or a copy
+ */
+CMessaging::Message_t CMessaging::toHeapMessage(const Message_t &msg) {
+    Message_t copy;
+
+    if(m_pMessagePool == NULL){
+        return msg;
+    }
+    copy.uMsgLength=msg.uMsgLength;
+    copy.pData=new unsigned char[copy.uMsgLength];
+    memcpy(copy.pData,msg.pData,copy.uMsgLength);
+    CBufferPool::release(msg.pData);
+    return copy;
+}
+
+
+
+/**
+ * Registers a function that is called for every complete message instead of
+ * placing it on the received queue
+ * @param pCallback Pointer to Callback function. NULL goes back to queuing messages.
+ * @param pUser Pointer to user provided pointer passed back into the callback function
+ */
+void CMessaging::registerMessageCallback(MessageCallback_t pCallback,void *pUser) {
+    m_pMessageCallback=pCallback;
+    m_pMessageUser=pUser;
+}
+
+/**
+ * Registers a function that is handed every complete message as a view
+ * instead of a copy. A frame that lies entirely within the chunk passed to
+ * processChunk(), or within one processReceived() call, is handed out in
+ * place, without any allocation or copy.
+ * Only frames that span chunks are copied once into an internal buffer.
+ * The view is only valid until the callback returns. This takes precedence
+ * over registerMessageCallback() and the received queue.
+ * @param pCallback Pointer to Callback function. NULL turns views off.
+ * @param pUser Pointer to user provided pointer passed back into the callback function
+ */
+void CMessaging::registerMessageViewCallback(MessageViewCallback_t pCallback,void *pUser) {
+    m_pViewCallback=pCallback;
+    m_pViewUser=pUser;
+}
+
+/**
+ * Registers a function that is handed all the messages completed by a call
+ * to processChunk() or processReceived() in one contiguous span, instead of
+ * one at a time through the queue or registerMessageCallback(). The span is
+ * reused between chunks, so a steady stream of messages is delivered
+ * without any per message bookkeeping, and the callback can take a lock or
+ * start a batch of work once per span. Views take precedence over this.
+ * @param pCallback Pointer to Callback function. NULL turns batch delivery off.
+ * @param pUser Pointer to user provided pointer passed back into the callback function
+ */
+void CMessaging::registerMessageBatchCallback(MessageBatchCallback_t pCallback,void *pUser) {
+    m_pBatchCallback=pCallback;
+    m_pBatchUser=pUser;
+}
+
+/**
+ * Registers a function that is handed large messages in pieces, as the
+ * pieces arrive, instead of complete messages. The receiver can start
+ * working on a message right away, and a message never has to be buffered
+ * as a whole, whatever its size. Smaller messages are delivered as usual.
+ * Messages sent with beginStream() or as bulk fragments are streamed from
+ * their fragment frames; other messages are streamed from the frame as it
+ * is decoded, unless a fragmented message is being streamed already. In
+ * view mode only fragmented messages are streamed.
+ * @param pCallback Pointer to Callback function. NULL turns streaming off.
+ * @param pUser Pointer to user provided pointer passed back into the callback function
+ * @param uThreshold Messages of this many bytes or more are streamed
+ */
+void CMessaging::registerStreamCallback(StreamCallback_t pCallback,void *pUser,unsigned long uThreshold) {
+    m_pStreamCallback=pCallback;
+    m_pStreamUser=pUser;
+    m_uStreamThreshold=uThreshold;
+}
+
+/**
+ * Limits the size of what the remote end may send. The buffer of a message
+ * is allocated as soon as its header is in, so without a limit a bad or
+ * hostile header can make this end allocate up to 4GB. There is no limit
+ * by default; set one to harden a connection to an untrusted peer. A frame
+ * over the limit is passed over without buffering any of it, and decoding
+ * goes on with the frame that follows. Streamed messages are not buffered
+ * and may be of any size.
+ * @param uMaxBytes Longest frame or message in bytes. 0 removes the limit.
+ */
+void CMessaging::setMaxMessageSize(unsigned long uMaxBytes) {
+    m_uMaxMessageSize=uMaxBytes;
+}
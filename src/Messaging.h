@@ -9,8 +9,13 @@
 #define MESSAGING_H
 #include <string>
 #include <queue>
+#include <vector>
+#include <pthread.h>
+#include <sys/uio.h>
 
 #include "assembler.h"
+#include "message_pool.h"
+#include "spsc_ring.h"
 /**
  * This class encapsulates the task of sending
  * and receiving messages over a streaming interface.
@@ -19,26 +24,210 @@
  */
 class CMessaging {
 public:
+    /** optional features announced to the remote end */
+    enum {CAPABILITY_BATCH=1,CAPABILITY_FRAGMENTS=2};
+    /** send priorities. See sendMessage(). */
+    typedef enum {PriorityHigh,PriorityNormal,PriorityBulk} Priority_t;
+    /** what a send does when the remote end granted no credit. See setCreditPolicy(). */
+    typedef enum {CreditBlock,CreditFail,CreditQueue} CreditPolicy_t;
+    /** default time a send waits for credit in the CreditBlock policy */
+    enum {DEFAULT_CREDIT_TIMEOUT_MS=5000};
+    /** default size of the fragments bulk messages are split into */
+    enum {DEFAULT_FRAGMENT_SIZE=16*1024};
+    /** default size from which received messages are streamed */
+    enum {DEFAULT_STREAM_THRESHOLD=64*1024};
+    /** default number of messages held by a receive ring */
+    enum {DEFAULT_RING_SIZE=1024};
+    /** default limits of the coalescing mode (see enableCoalescing()) */
+    enum {DEFAULT_COALESCE_BYTES=16*1024,DEFAULT_COALESCE_MESSAGES=64,DEFAULT_COALESCE_DELAY_US=200};
     /** used to hold complete messages */
     typedef struct {
         unsigned char * pData;
         unsigned long uMsgLength;
     } Message_t;
+    /**
+     * Called for every complete message when registered
+     *   msg: the message. The callee owns msg.pData and must delete[] it.
+     *   pUser: pointer passed in during registration
+     **/
+    typedef void (*MessageCallback_t)(Message_t msg,void *pUser);
+    /**
+     * Called for every complete message when registered for views
+     *   pData: the message contents. Only valid until the callback returns.
+     *   uLength: number of bytes in the message
+     *   pUser: pointer passed in during registration
+     **/
+    typedef void (*MessageViewCallback_t)(const unsigned char *pData,unsigned long uLength,void *pUser);
+    /**
+     * Called once per processed chunk with the messages it completed
+     *   pMessages: the messages, in the order received. They are freed when
+     *              the callback returns; to keep one set its pData to NULL and
+     *              free it later with delete[], or CBufferPool::release() when
+     *              a message pool is set.
+     *   uCount: number of messages (at least one)
+     *   pUser: pointer passed in during registration
+     **/
+    typedef void (*MessageBatchCallback_t)(Message_t *pMessages,unsigned uCount,void *pUser);
+    /**
+     * Called for every tagged frame (see sendTaggedMessage()) when registered
+     *   uKind: kind of frame, chosen by the sender
+     *   uTag: tag of the frame, e.g. a correlation id
+     *   msg: the message. The callee owns msg.pData and must delete[] it.
+     *   pUser: pointer passed in during registration
+     **/
+    typedef void (*TaggedCallback_t)(unsigned char uKind,unsigned uTag,Message_t msg,void *pUser);
+    /** events of a streamed message. See registerStreamCallback(). */
+    typedef enum {StreamBegin,StreamData,StreamEnd,StreamAbort} StreamEvent_t;
+    /**
+     * Called with the pieces of every large message when registered
+     *   event: StreamBegin, then StreamData for every piece in order, then
+     *          StreamEnd, or StreamAbort when the message is cut short
+     *   pData: the piece for StreamData, NULL otherwise. Only valid until the
+     *          callback returns.
+     *   uLength: number of bytes in the piece, or in the whole message for
+     *            StreamBegin
+     *   pUser: pointer passed in during registration
+     **/
+    typedef void (*StreamCallback_t)(StreamEvent_t event,const unsigned char *pData,unsigned long uLength,void *pUser);
 
 protected:
     enum {SEND_RETRY=5};
     enum {SEND_RETRY_DELAY= 10};
     enum {STX=2,ETX=3}; //start of text, end of text characters
+    enum {CTL=0x10};    //start of a control frame (data link escape)
+    enum {BTX=0x11};    //start of a batch frame (device control 1)
+    enum {FRG=0x12};    //start of a fragment frame (device control 2)
+    enum {TTX=0x13};    //start of a tagged frame (device control 3)
+    enum {MUX=0x14};    //start of a multiplexed stream frame (device control 4)
+    /** tagged frames start with the kind and the tag */
+    enum {TAG_PREFIX_SIZE=5};
+    /** fragment frames start with the flags and the length of the whole message */
+    enum {FRAGMENT_PREFIX_SIZE=5,FRAGMENT_FIRST=1,FRAGMENT_LAST=2};
+    /** control frame types, carried in the first byte of a control frame */
+    enum {CONTROL_HEARTBEAT=1,CONTROL_HEARTBEAT_ACK=2,CONTROL_CAPABILITIES=3,CONTROL_CAPABILITIES_ACK=4,CONTROL_CREDIT=5};
+    enum {BATCH_ENTRY_SIZE=4};  //size of the count and of each length in a batch frame
+    enum {MAX_CONTROL_SIZE=64}; //largest control frame body
+    enum {RTT_SMOOTHING=8};     //weight of the history in the smoothed round trip time
     enum {HEADER_SIZE=5};
     enum {TRAILER_SIZE=1};
+    enum {MAX_STACK_PIECES=16}; //frames with more pieces allocate their gather list
+    enum {MAX_BATCH_MESSAGES=256};      //largest number of messages framed into one gather list
+    enum {DEFAULT_BATCH_LIMIT=64*1024}; //default number of bytes framed into one gather list
+    enum {RING_WAIT_MS=100};            //how long a full receive ring is waited on at a time
+    enum {COMBINE_SPINS=64};            //yields before a concurrent send blocks
 
     /** message queue */
     typedef std::queue <Message_t> MessageQueue_t;
+    /** outcome of taking send credit */
+    typedef enum {CreditGranted,CreditQueued,CreditRefused} CreditResult_t;
+    /** message waiting for send credit */
+    typedef struct {
+        Message_t  msg;
+        Priority_t priority;
+    } CreditQueued_t;
+    /** decoder states */
+    typedef enum {DecodeHeader,DecodeIndex,DecodePayload,DecodeTrailer,DecodeSkip} DecodeState_t;
+    /** outcome of a concurrent send */
+    enum {SEND_PENDING=0,SEND_DONE=1,SEND_FAILED=-1};
+    /** a frame waiting to be sent by whichever thread combines the sends */
+    typedef struct SendRequest_s {
+        struct SendRequest_s *pNext;   /**< next request, newer first */
+        const unsigned char *pData;    /**< message contents */
+        unsigned      uLength;         /**< number of bytes in the message */
+        unsigned char header[HEADER_SIZE];
+        volatile int  nState;          /**< SEND_PENDING until the combiner is done with it */
+    } SendRequest_t;
 
     CAssembler     m_assembler;       /**< used to assemble data fragments */
     unsigned       m_uSendRetry;      /**< number of times to retry before giving up on sends */
     unsigned       m_uSendRetryDelay; /**< number of milliseconds to delay between send retries */
+    unsigned       m_uSendDeadlineMs; /**< when set, sends wait for the transport for up to this long instead of retrying */
     MessageQueue_t m_MsgQueue;        /**< hold a list of completely received messages */
+    pthread_mutex_t m_FrameMutex;     /**< keeps the bytes of a frame together on the stream */
+    volatile unsigned long long m_uLastReceiveUs; /**< time data was last received from the peer */
+    volatile unsigned long long m_uLastSendUs;    /**< time a frame was last sent to the peer */
+    unsigned long  m_uLastRttUs;      /**< last heartbeat round trip time */
+    unsigned long  m_uSmoothedRttUs;  /**< smoothed heartbeat round trip time */
+    bool           m_bPeerDead;       /**< set once the peer missed too many heartbeats */
+    unsigned       m_uBatchLimit;     /**< number of bytes sendMessages() puts in one gather list */
+    std::vector<struct iovec> m_BatchVector;    /**< gather list reused by sendMessages() */
+    std::vector<unsigned char> m_BatchHeaders;  /**< frame headers reused by sendMessages() */
+    SendRequest_t * volatile m_pSendStack;      /**< frames posted by sendMessageConcurrent() */
+    pthread_mutex_t m_CombineMutex;   /**< protects m_bCombining */
+    pthread_cond_t m_CombineCond;     /**< signalled when the combiner completed requests or stopped */
+    bool           m_bCombining;      /**< a thread is in combineSends() */
+    bool           m_bCoalescing;     /**< frames are gathered in m_CoalesceBuffer before they go out */
+    std::vector<unsigned char> m_CoalesceBuffer; /**< frames waiting for the next flush */
+    unsigned       m_uCoalescedMessages; /**< number of frames in m_CoalesceBuffer */
+    unsigned long long m_uCoalesceStartUs; /**< when the oldest frame in m_CoalesceBuffer was added */
+    unsigned       m_uCoalesceBytes;    /**< flush once this many bytes are gathered */
+    unsigned       m_uCoalesceMessages; /**< flush once this many frames are gathered */
+    unsigned       m_uCoalesceDelayUs;  /**< flush once the oldest frame waited this long */
+    unsigned long  m_uCoalesceFlushes;  /**< number of times gathered frames went out */
+    pthread_mutex_t m_BulkMutex;      /**< one bulk message is fragmented at a time */
+    int            m_nUrgentWaiting;  /**< high priority frames waiting for the frame mutex */
+    pthread_mutex_t m_UrgentMutex;    /**< protects m_nUrgentWaiting */
+    pthread_cond_t m_UrgentCond;      /**< signalled when no high priority frame is waiting */
+    unsigned       m_uFragmentSize;   /**< bulk messages are split into fragments of this many bytes */
+    Message_t      m_Fragmented;      /**< message being reassembled from fragment frames */
+    unsigned long  m_uFragmentOffset; /**< number of bytes of m_Fragmented received so far */
+    std::vector<unsigned char> m_FragmentView; /**< message being reassembled in view mode */
+    TaggedCallback_t m_pTaggedCallback; /**< receives the tagged frames */
+    void *         m_pTaggedUser;     /**< user pointer passed back to the tagged callback */
+    TaggedCallback_t m_pMuxCallback;  /**< receives the multiplexed stream frames */
+    void *         m_pMuxUser;        /**< user pointer passed back to the mux callback */
+    StreamCallback_t m_pStreamCallback; /**< when set, large messages are handed out in pieces */
+    void *         m_pStreamUser;     /**< user pointer passed back to the stream callback */
+    unsigned long  m_uStreamThreshold; /**< messages of this many bytes or more are streamed */
+    unsigned long  m_uMaxMessageSize; /**< longest frame or message accepted from the remote end. 0 for no limit. */
+    bool           m_bStreamFrame;    /**< the payload of the frame being decoded is streamed */
+    bool           m_bStreamIn;       /**< a fragmented message is being streamed to the callback */
+    bool           m_bStreamOut;      /**< beginStream() was called and endStream() was not */
+    unsigned       m_uStreamTotal;    /**< length of the message being streamed out */
+    unsigned       m_uStreamSent;     /**< bytes of the message being streamed out so far */
+    unsigned long  m_uStreamInLength; /**< length of the message being streamed to the callback */
+    pthread_mutex_t m_CreditMutex;    /**< protects the credit in both directions */
+    pthread_cond_t m_CreditCond;      /**< signalled when send credit comes in */
+    volatile bool  m_bCreditLimited;  /**< the remote end granted credit, so sends need it */
+    volatile bool  m_bCreditBacklog;  /**< messages queued for the credit of a previous peer wait to go out */
+    long long      m_nSendCreditMessages; /**< messages we may still send */
+    long long      m_nSendCreditBytes;    /**< bytes we may still send */
+    unsigned long  m_uSendWindowBytes;    /**< bytes granted by the first grant of the remote end */
+    CreditPolicy_t m_CreditPolicy;    /**< what a send does without credit */
+    unsigned       m_uCreditTimeoutMs; /**< time a send waits for credit in the CreditBlock policy */
+    std::queue<CreditQueued_t> m_CreditQueue; /**< messages waiting for credit in the CreditQueue policy */
+    bool           m_bCreditDraining; /**< a thread is sending the messages that waited for credit */
+    volatile bool  m_bReceiveCredit;  /**< we grant the remote end credit */
+    unsigned       m_uReceiveCreditMessages; /**< messages the remote end may have in flight */
+    unsigned long  m_uReceiveCreditBytes;    /**< bytes the remote end may have in flight */
+    unsigned       m_uConsumedMessages; /**< messages consumed and not granted again yet */
+    unsigned long  m_uConsumedBytes;    /**< bytes consumed and not granted again yet */
+    std::vector<SendRequest_t*> m_CombineList;  /**< requests being sent by the combiner, oldest first */
+    std::vector<unsigned char> m_BatchIndex;    /**< message lengths of a received batch frame */
+    unsigned       m_uLocalCapabilities; /**< features this end understands */
+    unsigned       m_uPeerCapabilities;  /**< features the remote end announced */
+    bool           m_bNegotiate;         /**< the remote end is known to understand capability announcements */
+    MessageCallback_t m_pMessageCallback; /**< when set, complete messages are handed here instead of the queue */
+    void *         m_pMessageUser;    /**< user pointer passed back to the message callback */
+    DecodeState_t  m_DecodeState;     /**< part of the frame the decoder waits for */
+    unsigned char  m_DecodeHeader[HEADER_SIZE]; /**< header of the frame being decoded */
+    unsigned char  m_DecodeControl[1+MAX_CONTROL_SIZE]; /**< body of the control frame being decoded */
+    unsigned long  m_uDecodeOffset;   /**< bytes received of the current header, index or message */
+    unsigned long long m_uDecodeSkip; /**< bytes left of a frame that is passed over */
+    bool           m_bFragmentSkip;   /**< the message being fragmented is passed over */
+    unsigned       m_uDecodeIndex;    /**< message of the frame that receives the payload */
+    std::vector<Message_t> m_DecodeMessages; /**< destination of the frame being decoded */
+    CBufferPool *  m_pMessagePool;    /**< when set, received messages come from this pool */
+    CSpscRing<Message_t> *m_pReceiveRing; /**< when set, replaces m_MsgQueue between two threads */
+    MessageViewCallback_t m_pViewCallback; /**< when set, messages are handed out as views */
+    void *         m_pViewUser;       /**< user pointer passed back to the view callback */
+    std::vector<unsigned char> m_ViewBuffer; /**< holds frames that spanned chunks in view mode */
+    unsigned long  m_uViewFill;       /**< bytes of the frame in m_ViewBuffer received so far */
+    std::vector<unsigned char> m_ReceiveBuffer; /**< receive buffer handed out in view mode */
+    bool           m_bReceiveStaged;  /**< the last receive buffer was m_ReceiveBuffer */
+    MessageBatchCallback_t m_pBatchCallback; /**< when set, messages are handed out per chunk */
+    void *         m_pBatchUser;      /**< user pointer passed back to the batch callback */
+    std::vector<Message_t> m_Completed; /**< messages completed by the chunk being processed */
 
     /** low level transmit function
      *  @param pBuffer pointer to the message contents to be sent. If this is a
@@ -49,23 +238,244 @@ protected:
      *  @retval -1 if the message cannot be queued due to an error
      **/
     virtual int xmitMsg(const unsigned char *pBuffer, unsigned uLength)=0;
+    /** low level vectored transmit function. The default calls xmitMsg for
+     *  each buffer; derived classes should send the whole list at once.
+     *  @param pVector list of buffers to be sent in order
+     *  @param uCount number of buffers in the list
+     *  @return number bytes that were successfully transmitted (can be zero)
+     *  @retval -1 if the data cannot be queued due to an error
+     **/
+    virtual int xmitMsgV(const struct iovec *pVector, unsigned uCount);
 
     /** @brief calls the xmitMsg function and retries if it cannot queue the message */
     bool xmitWithRetry(const unsigned char *pBuffer, unsigned uLength);
+    /** @brief calls the xmitMsgV function and continues after partial writes */
+    bool xmitVectorWithRetry(struct iovec *pVector, unsigned uCount, unsigned long *puSent=NULL);
+    /** @brief waits before retrying a send that made no progress */
+    bool waitToRetry(unsigned &retryCounter, unsigned long long uStartUs);
+    /** @brief waits until the transport can take more data */
+    virtual int waitWritable(unsigned uTimeoutMs);
+    /** @brief transmits a complete frame */
+    virtual bool xmitFrame(const unsigned char *pHeader,const struct iovec *pPieces,unsigned uPieces,const unsigned char *pTrailer);
+    /** @brief transmits a gather list holding several complete frames */
+    virtual bool xmitBatch(struct iovec *pVector,unsigned uCount,unsigned long *puSent);
+    /** @brief fills in the frame header for a message of the given length */
+    static void buildHeader(unsigned char *pHeader,unsigned uLength,unsigned char uStart=STX);
+    /** @brief writes a 4 byte big endian number */
+    static void putLength(unsigned char *pBuffer,unsigned uValue);
+    /** @brief reads a 4 byte big endian number */
+    static unsigned getLength(const unsigned char *pBuffer);
+    /** @brief fills in the gather list for a batch frame */
+    unsigned buildBatchFrame(const Message_t *pMsgs,unsigned uCount,const unsigned char *pTrailer);
+    /** @brief tells the remote end which optional features this end understands */
+    void advertiseCapabilities(unsigned char uType);
+    /** @brief adds or removes an optional feature of this end */
+    void setLocalCapability(unsigned uCapability,bool bEnable);
+    /** @brief forgets what the remote end supports */
+    void resetPeerCapabilities();
+    /** @brief forgets the credit granted in both directions */
+    void resetCredit();
+    /** @brief returns true if a send has to go through takeCredit() */
+    bool needsCredit() const {return m_bCreditLimited || m_bCreditBacklog;}
+    /** @brief runs received data through the frame decoder */
+    bool decode(const unsigned char *pBuffer,unsigned uLength);
+    /** @brief sets up the destination of a frame once its header is in */
+    bool startFrame();
+    /** @brief sets up the messages of a batch frame once its index is in */
+    bool startBatch();
+    /** @brief moves the decoder to the next message that needs data */
+    void nextPayload();
+    /** @brief delivers the messages of a complete frame */
+    bool finishFrame();
+    /** @brief drops the frame being decoded */
+    void resetDecoder();
+    /** @brief returns true if a received frame or message is longer than the limit */
+    bool isTooLong(unsigned long uLength) const {return m_uMaxMessageSize != 0 && uLength > m_uMaxMessageSize;}
+    /** @brief makes the decoder pass over the rest of a frame */
+    void skipFrame(unsigned long long uBytes);
+    /** @brief drops everything received but not delivered yet */
+    void resetReceiver();
+    /** @brief allocates the buffer for a received message */
+    unsigned char *allocMessage(unsigned long uLength);
+    /** @brief frees the buffer of a received message */
+    void freeMessage(unsigned char *pData);
+    /** @brief returns true for a character that starts a frame */
+    static bool isFrameStart(unsigned char uStart) {
+        return uStart == STX || uStart == CTL || uStart == BTX || uStart == FRG || uStart == TTX || uStart == MUX;
+    }
+    /** @brief sets up the message of a tagged frame */
+    bool startTagged();
+    /** @brief sends a frame that starts with a kind and a tag */
+    bool sendPrefixed(unsigned char uStart,unsigned char uKind,unsigned uTag,const unsigned char *pBuffer,unsigned uLength);
+    /** @brief hands a tagged or mux frame to its callback */
+    void deliverTagged(unsigned char uStart,unsigned char uKind,unsigned uTag,const Message_t &msg);
+    /** @brief takes the frame mutex ahead of bulk fragments */
+    void lockUrgent();
+    /** @brief sends a message without taking credit for it */
+    bool sendUncounted(const unsigned char *pMsg,unsigned uLength,Priority_t priority);
+    /** @brief frames the pieces of a message without taking credit for them */
+    bool sendPieces(const struct iovec *pPieces,unsigned uPieces);
+    /** @brief takes the send credit for one message, waiting or queuing per the credit policy */
+    CreditResult_t takeCredit(unsigned long uBytes,const struct iovec *pPieces,unsigned uPieces,Priority_t priority);
+    /** @brief returns true if there is credit for a message. Called with m_CreditMutex held. */
+    bool hasCredit(unsigned long uBytes) const;
+    /** @brief sends the messages that waited for credit, as far as the credit goes */
+    void sendCreditQueue();
+    /** @brief accounts for consumed messages and grants the remote end more credit */
+    void returnCredit(unsigned uMessages,unsigned long uBytes);
+    /** @brief sends a bulk message as a series of fragment frames */
+    bool sendFragments(const unsigned char *pMsg,unsigned uLength);
+    /** @brief sends one fragment frame. Called with m_BulkMutex held. */
+    bool xmitFragment(unsigned char uFlags,unsigned uTotal,const unsigned char *pChunk,unsigned uChunk);
+    /** @brief hands an event of a streamed message to the stream callback */
+    void streamEvent(StreamEvent_t event,const unsigned char *pData,unsigned long uLength);
+    /** @brief ends the message being streamed to the callback with StreamAbort */
+    void abortReceivedStream();
+    /** @brief streams a fragment frame in view mode */
+    bool streamFragmentView(unsigned char uFlags,unsigned uTotal,const unsigned char *pPayload,unsigned uLength);
+    /** @brief sets up the reassembly of a fragment frame */
+    bool startFragment();
+    /** @brief adds a fragment frame to the message being reassembled */
+    bool finishFragment();
+    /** @brief adds a fragment frame to the message being reassembled in view mode */
+    bool dispatchFragmentView(const unsigned char *pPayload,unsigned uLength);
+    /** @brief drops the message being reassembled */
+    void resetFragments();
+    /** @brief sends the gathered frames. Called with m_FrameMutex held. */
+    bool flushCoalesced();
+    /** @brief sends all the posted frames. Called with m_FrameMutex held. */
+    void combineSends();
+    /** @brief hands the messages completed by a chunk to the batch callback */
+    void flushCompleted();
+    /** @brief returns the first received message or NULL */
+    Message_t *peekReceived();
+    /** @brief removes the first received message */
+    void popReceived();
+    /** @brief turns a received message into one owned through delete[] */
+    Message_t toHeapMessage(const Message_t &msg);
+    /** @brief hands a message to the callback or the queue */
+    void deliverMessage(const Message_t &msg);
+    /** @brief hands out the messages of a contiguous frame as views */
+    bool dispatchView(unsigned char uStart,const unsigned char *pPayload,unsigned uLength);
+    /** @brief buffers a frame that spans chunks in view mode */
+    unsigned fillView(const unsigned char *pBuffer,unsigned uLength,bool &bResults);
+    /** @brief processes a chunk in view mode */
+    bool processChunkView(const unsigned char *pBuffer,unsigned uLength);
+    /** @brief sends a control frame to the remote end */
+    bool sendControlFrame(unsigned char uType,const unsigned char *pBody,unsigned uLength,bool bWait=true);
+    /** @brief handles a control frame received from the remote end */
+    virtual void handleControlFrame(unsigned char uType,const unsigned char *pBody,unsigned uLength);
+    /** @brief called when the peer is declared dead */
+    virtual void peerDead() {}
+    /** @brief called when a send gives up part way through a frame */
+    virtual void sendCutShort() {}
 
 public:
     CMessaging();
     virtual ~CMessaging();
     /** @brief sends a message to remote end */
-    bool  sendMessage(const unsigned char *pMsg,unsigned uLength);
+    bool  sendMessage(const unsigned char *pMsg,unsigned uLength,Priority_t priority=PriorityNormal);
+    /** @brief sends a message made of several pieces to remote end */
+    bool  sendMessage(const struct iovec *pPieces,unsigned uPieces);
+    /** @brief sends a batch of messages with as few transmit calls as possible */
+    bool  sendMessages(const Message_t *pMsgs,unsigned uCount,unsigned *puSent=NULL);
+    /** @brief sends a message from any number of threads at once, combining their frames */
+    bool  sendMessageConcurrent(const unsigned char *pBuffer,unsigned uLength);
+    /** @brief sends a message with a kind and a tag in its frame header */
+    bool  sendTaggedMessage(unsigned char uKind,unsigned uTag,const unsigned char *pBuffer,unsigned uLength);
+    /** @brief registers the function that receives tagged frames */
+    void  registerTaggedCallback(TaggedCallback_t pCallback,void *pUser);
+    /** @brief sends a frame of a multiplexed stream (see CStreamMux) */
+    bool  sendMuxFrame(unsigned char uKind,unsigned uStreamId,const unsigned char *pBuffer,unsigned uLength);
+    /** @brief registers the function that receives multiplexed stream frames */
+    void  registerMuxCallback(TaggedCallback_t pCallback,void *pUser);
+    /** @brief grants the remote end credit, bounding what it may have in flight towards us */
+    bool  enableReceiveCredit(unsigned uMessages,unsigned long uBytes);
+    /** @brief sets what a send does when the remote end granted no credit */
+    void  setCreditPolicy(CreditPolicy_t policy,unsigned uTimeoutMs=DEFAULT_CREDIT_TIMEOUT_MS);
+    /** @brief returns true once the remote end limits our sends with credit */
+    bool  isCreditLimited() const {return m_bCreditLimited;}
+    /** @brief returns the number of messages waiting for credit */
+    unsigned getCreditQueueSize();
+    /** @brief makes sends wait for the transport up to an overall deadline */
+    void  setSendDeadline(unsigned uDeadlineMs);
+    /** @brief gathers outgoing frames and sends them together */
+    void  enableCoalescing(unsigned uMaxBytes=DEFAULT_COALESCE_BYTES,unsigned uMaxMessages=DEFAULT_COALESCE_MESSAGES,
+                           unsigned uMaxDelayUs=DEFAULT_COALESCE_DELAY_US);
+    /** @brief sends the gathered frames and goes back to sending every frame right away */
+    bool  disableCoalescing();
+    /** @brief sends the gathered frames now */
+    bool  flush();
+    /** @brief sends the gathered frames if the oldest one waited long enough */
+    bool  serviceCoalescing(unsigned long long uNowUs);
+    /** @brief returns the number of microseconds until the gathered frames are due, or -1 */
+    long long getCoalesceTimeoutUs(unsigned long long uNowUs);
+    /** @brief returns the number of times gathered frames were sent */
+    unsigned long getCoalesceFlushes() const {return m_uCoalesceFlushes;}
+    /** @brief sets the number of bytes sendMessages() puts in one gather list */
+    void  setBatchLimit(unsigned uBytes) {m_uBatchLimit=uBytes;}
+    /** @brief lets this end announce its optional features to the remote end */
+    void  enableCapabilityNegotiation(bool bEnable);
+    /** @brief enables or disables batch frames */
+    void  enableBatchFrames(bool bEnable);
+    /** @brief returns true when both ends agreed on batch frames */
+    bool  isBatchFramesActive() const {return (m_uLocalCapabilities & m_uPeerCapabilities & CAPABILITY_BATCH) != 0;}
+    /** @brief lets bulk messages be split into fragments once the remote end agrees */
+    void  enableFragmentFrames(bool bEnable,unsigned uFragmentSize=DEFAULT_FRAGMENT_SIZE);
+    /** @brief returns true if both ends agreed to use fragment frames */
+    bool  isFragmentFramesActive() const {return (m_uLocalCapabilities & m_uPeerCapabilities & CAPABILITY_FRAGMENTS) != 0;}
+    /** @brief returns the features announced by the remote end */
+    unsigned getPeerCapabilities() const {return m_uPeerCapabilities;}
     /** @brief adds a chunk of data to internal buffer in order to extract message */
     bool  processChunk(unsigned char *pBuffer, unsigned uLength);
+    /** @brief returns a buffer that received data can be written into directly */
+    unsigned char *getReceiveBuffer(unsigned uSize);
+    /** @brief processes data that was written into the receive buffer */
+    bool  processReceived(unsigned uLength);
+    /** @brief registers a function to be called for every complete message */
+    void  registerMessageCallback(MessageCallback_t pCallback,void *pUser);
+    /** @brief registers a function to be handed every complete message without a copy */
+    void  registerMessageViewCallback(MessageViewCallback_t pCallback,void *pUser);
+    /** @brief registers a function to be handed the messages completed by each chunk at once */
+    void  registerMessageBatchCallback(MessageBatchCallback_t pCallback,void *pUser);
+    /** @brief registers a function to be handed large messages in pieces as they arrive */
+    void  registerStreamCallback(StreamCallback_t pCallback,void *pUser,unsigned long uThreshold=DEFAULT_STREAM_THRESHOLD);
+    /** @brief limits the size of the frames and messages accepted from the remote end */
+    void  setMaxMessageSize(unsigned long uMaxBytes);
+    /** @brief returns the size limit of received frames and messages */
+    unsigned long getMaxMessageSize() const {return m_uMaxMessageSize;}
+    /** @brief starts sending a message in pieces */
+    bool  beginStream(unsigned uTotal);
+    /** @brief sends the next piece of the message started by beginStream() */
+    bool  sendStreamData(const unsigned char *pBuffer,unsigned uLength);
+    /** @brief finishes the message started by beginStream() */
+    bool  endStream();
     /** @brief returns the size of the current message */
     unsigned getMsgSize();
     /** @brief returns the first message from the received queue */
     Message_t getMsg();
+    /** @brief takes the first message from the received queue as an owning handle */
+    bool getMsg(CMessage &msg);
+    /** @brief copies the first message from the received queue into the caller's buffer */
+    bool getMsgInto(unsigned char *pBuffer,unsigned long uSize,unsigned long &uLength);
+    /** @brief makes received messages use recycled buffers from a pool */
+    void setMessagePool(CBufferPool *pPool);
     /** @brief returns the number of fully received messages available */
-    unsigned getMessageCount() {return m_MsgQueue.size();}
+    unsigned getMessageCount();
+    /** @brief hands received messages to another thread through a lock free ring */
+    bool enableReceiveRing(unsigned uCapacity=DEFAULT_RING_SIZE);
+    /** @brief waits for a received message */
+    bool waitForMessage(int nTimeoutMs);
+    /** @brief sends a heartbeat if the connection is idle and checks the peer is alive */
+    bool serviceHeartbeat(unsigned long long uNowUs,unsigned uIntervalMs,unsigned uMissedLimit);
+    /** @brief restarts the dead peer detection */
+    void resetHeartbeat();
+    /** @brief returns true once the peer missed too many heartbeats */
+    bool isPeerDead() const {return m_bPeerDead;}
+    /** @brief returns the last heartbeat round trip time in micro seconds */
+    unsigned long getHeartbeatRtt() const {return m_uLastRttUs;}
+    /** @brief returns the smoothed heartbeat round trip time in micro seconds */
+    unsigned long getSmoothedHeartbeatRtt() const {return m_uSmoothedRttUs;}
 };
 
 #endif /* MESSAGING_H */
@@ -15,7 +15,9 @@ const unsigned long CTimer::MAX_TIMER_INTERVAL=std::numeric_limits<unsigned long
 CTimer::CTimer(void):m_TimerList(MAX_TIMER_COUNT)
 {
     m_bStopTimerSvc=false;
-    m_bThreadExited=true;
+    //cleared here rather than by the thread so that the destructor waits
+    //for a thread that has not started yet
+    m_bThreadExited=false;
     pthread_mutex_init(&m_TimerListMutex,NULL);
     if(pthread_create(&m_timerServiceThreadId,NULL,CTimer_Thread_Helper,this)){
         throw "Could not start thread";
@@ -25,7 +27,11 @@ CTimer::CTimer(void):m_TimerList(MAX_TIMER_COUNT)
 CTimer::~CTimer(void)
 {
     unsigned counter=0;
+    //set the flag with the queue locked so that the service thread cannot
+    //miss the signal between testing the flag and waiting
+    m_ActiveTimerQueue.LockMutex();
     m_bStopTimerSvc=true;
+    m_ActiveTimerQueue.UnlockMutex();
     m_ActiveTimerQueue.Signal();
 
     while(m_bThreadExited == false && counter < 30){
@@ -76,6 +82,20 @@ void CTimer::getTime(struct timespec &time){
 #endif
 }
 
+/**
+ * Returns a time stamp in micro seconds that is not affected by changes
+ * to the wall clock. Use this to measure intervals.
+ */
+unsigned long long CTimer::getMonotonicUs(){
+    struct timespec now;
+#if defined(__linux__)
+    clock_gettime(CLOCK_MONOTONIC,&now);
+#else
+    getTime(now);
+#endif
+    return (unsigned long long)now.tv_sec*MILLION + now.tv_nsec/1000;
+}
+
 /**
  * Converts a timespec to a miliseconds
  * @param a timespec to convert
@@ -342,7 +362,6 @@ void* CTimer::timerServiceFunc(){
     bool   bQueueEmpty=false;
 
     PTRACE("Timer Handler Thread Started\n");
-    m_bThreadExited=false;
     //lock the timer list
     m_ActiveTimerQueue.LockMutex();
     while(!m_bStopTimerSvc){        
@@ -355,7 +374,9 @@ void* CTimer::timerServiceFunc(){
             PTRACE("Timer Queue is empty\n");
             //wait for wake signal
             m_ActiveTimerQueue.LockMutex();
-            m_ActiveTimerQueue.WaitOnObject();
+            if(!m_bStopTimerSvc){
+                m_ActiveTimerQueue.WaitOnObject();
+            }
             //if we are supposed to exit, get out
             if(m_bStopTimerSvc){
                 m_ActiveTimerQueue.UnlockMutex();
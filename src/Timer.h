@@ -54,6 +54,7 @@ public:
     static struct timespec add_timespec(const struct timespec &a, const struct timespec &b);
     static struct timespec diff_timespec(const struct timespec &a, const struct timespec &b);
     static unsigned long timespec2ms(const struct timespec &a);
+    static unsigned long long getMonotonicUs();
 
 protected:
     /** timer information */
@@ -41,11 +41,12 @@ void CAssembler::Clear() {
  * @note Data will be copied from the input data buffer into internal structures 
  **/
 unsigned CAssembler::Append(const unsigned char *pData,unsigned length) {
-    BlockInfo_t info={0};
+    BlockInfo_t info={0,NULL,NULL,0};
 
     info.pBuffer=new unsigned char[length];
     info.pData=info.pBuffer;
     info.length=length;
+    info.capacity=length;
 
     memcpy(info.pData,pData,length);
 
@@ -56,6 +57,49 @@ unsigned CAssembler::Append(const unsigned char *pData,unsigned length) {
     return m_Size;
 }
 
+/**
+ * Returns a buffer at the end of the block list that the caller can write
+ * data into (e.g. straight from a socket), avoiding the copy made by
+ * Append. Unused space at the end of the last block is reused when it is
+ * large enough, otherwise a new block is added.
+ * @param[in] size minimum number of bytes the caller wants to write
+ * @return pointer to at least size bytes of writable memory
+ * @note The data is not part of the list until Commit is called. The
+ *       pointer is only valid until the next call that modifies the list.
+ **/
+unsigned char *CAssembler::Reserve(unsigned size) {
+    BlockInfo_t info={0,NULL,NULL,0};
+
+    if(!m_Blocks.empty()) {
+        BlockInfo_t &last=m_Blocks.back();
+        unsigned char *pEnd=last.pData+last.length;
+        if((unsigned)(last.pBuffer+last.capacity-pEnd) >= size) {
+            return pEnd;
+        }
+    }
+
+    //empty block that the data will be committed to
+    info.pBuffer=new unsigned char[size];
+    info.pData=info.pBuffer;
+    info.length=0;
+    info.capacity=size;
+    m_Blocks.push_back(info);
+
+    return info.pBuffer;
+}
+
+/**
+ * Adds data written into the buffer returned by Reserve to the list
+ * @param[in] length number of bytes that were written
+ **/
+void CAssembler::Commit(unsigned length) {
+    if(m_Blocks.empty()) {
+        return;
+    }
+    m_Blocks.back().length+=length;
+    m_Size+=length;
+}
+
 /**
  * Retrieves data from the block list
  * @param[out] pBuffer pointer to buffer to receive the data
@@ -144,6 +188,26 @@ bool CAssembler::Pop(unsigned char *pBuffer,unsigned size) {
     return false;
 }
 
+/**
+ * Returns the data in the first block of the list without copying it
+ * @param[out] length number of contiguous bytes at the returned address
+ * @return pointer to the first byte held by this instance
+ * @retval NULL if the list is empty
+ **/
+const unsigned char *CAssembler::Head(unsigned &length) {
+    BlockList_t::iterator it;
+
+    for(it=m_Blocks.begin(); it != m_Blocks.end(); it++) {
+        //skip blocks that were reserved but never written to
+        if(it->length > 0) {
+            length=it->length;
+            return it->pData;
+        }
+    }
+    length=0;
+    return NULL;
+}
+
 /**
  * Removes data from the head of the blocks 
  * @param[in] size number of byte to remove form the head of the list
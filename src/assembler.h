@@ -24,12 +24,19 @@ public:
     bool Pop(unsigned char *pBuffer,unsigned size);
     /** @brief removes data from the head of the blocks */    
     void Trim(unsigned size);
+    /** @brief returns the contiguous data at the head of the list */
+    const unsigned char *Head(unsigned &length);
+    /** @brief returns a buffer at the end of the list that data can be written to */
+    unsigned char *Reserve(unsigned size);
+    /** @brief adds data written into the reserved buffer to the list */
+    void Commit(unsigned length);
 protected:
     /** information about each block */
     typedef struct {
         unsigned length;
         unsigned char *pData; ///< Pointer to the start of the data. This could be some bytes into the buffer
         unsigned char *pBuffer; ///< Pointer to the buffer
+        unsigned capacity;      ///< Number of bytes allocated for the buffer
     }
     BlockInfo_t;
     /** list of blocks we are holding */
@@ -0,0 +1,120 @@
+/**
+ * @file busy_poll_latency.cpp
+ *
+ * Measures the wake up to callback latency of the blocking CTcpServer loop
+ * and of its busy poll loop, and prints the medians.
+ *
+ * usage: busy_poll_latency [port] [samples]
+ */
+
+#include <algorithm>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "tcp_server.h"
+#include "tcp_messaging.h"
+#include "TRACE.h"
+
+#define uSleep(x) (usleep(x))
+
+/** collects the wake up to callback latency of the received samples */
+typedef struct {
+    std::vector<long> latencyNs;
+    unsigned uSamples;
+} LatencyInfo_t;
+
+/**
+ * Returns the current monotonic time in nano seconds
+ */
+static long long nowNs(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    return (long long)now.tv_sec*1000000000LL + now.tv_nsec;
+}
+
+/**
+ * Each chunk holds the time stamp taken right before it was sent
+ */
+static void latencyCallback(CTcpServer::Handle_t handle,unsigned char *pData, unsigned uLength,void *pUser){
+    LatencyInfo_t *pInfo=(LatencyInfo_t *) pUser;
+    long long sentNs;
+    long long now=nowNs();
+
+    UNUSED(handle);
+
+    for(unsigned offset=0; offset+sizeof(sentNs) <= uLength; offset+=sizeof(sentNs)){
+        memcpy(&sentNs,pData+offset,sizeof(sentNs));
+        pInfo->latencyNs.push_back((long)(now-sentNs));
+        __sync_fetch_and_add(&pInfo->uSamples,1);
+    }
+}
+
+/**
+ * Sends time stamped packets to a server and returns the median latency
+ * between the send and the data callback in nano seconds
+ */
+static long measureLatency(CTcpServer &server,unsigned uPort,unsigned uSamples){
+    CTcpMessaging client;
+    LatencyInfo_t info;
+    long long sentNs;
+    int socket;
+
+    info.uSamples=0;
+    info.latencyNs.reserve(uSamples);
+    server.RegisterDataCallback(latencyCallback,&info);
+    if(!server.Listen() || !server.StartSeverThread()){
+        return -1;
+    }
+    if(!client.connect("127.0.0.1",uPort)){
+        server.StopSeverThread();
+        return -1;
+    }
+    socket=client.getHandle();
+    //let the server accept the connection
+    uSleep(100*1000);
+
+    for(unsigned i=0; i < uSamples; i++){
+        //give the server time to go idle between samples
+        uSleep(500);
+        sentNs=nowNs();
+        send(socket,&sentNs,sizeof(sentNs),0);
+        //wait for the sample to be picked up
+        for(unsigned wait=0; wait < 1000 && info.uSamples <= i; wait++){
+            uSleep(100);
+        }
+    }
+    server.StopSeverThread();
+    uSleep(100*1000);
+
+    if(info.latencyNs.empty()){
+        return -1;
+    }
+    std::sort(info.latencyNs.begin(),info.latencyNs.end());
+    return info.latencyNs[info.latencyNs.size()/2];
+}
+
+int main(int argc,char **argv){
+    unsigned uPort=(argc > 1) ? (unsigned)atoi(argv[1]) : 9460;
+    unsigned uSamples=(argc > 2) ? (unsigned)atoi(argv[2]) : 500;
+    long blockingNs,busyPollNs;
+
+    {
+        CTcpServer server(uPort);
+        blockingNs=measureLatency(server,uPort,uSamples);
+    }
+    {
+        CTcpServer server(uPort+1);
+        //spin for up to a second after each packet, so the server never sleeps between samples
+        server.SetBusyPoll(1000*1000);
+        busyPollNs=measureLatency(server,uPort+1,uSamples);
+    }
+    if(blockingNs < 0 || busyPollNs < 0){
+        fprintf(stderr,"measurement failed\n");
+        return 1;
+    }
+    printf("blocking median latency:  %ld ns\n",blockingNs);
+    printf("busy poll median latency: %ld ns\n",busyPollNs);
+    return 0;
+}
@@ -0,0 +1,192 @@
+/**
+ * @file heartbeat_monitor.cpp
+ *
+ * @date   Oct 18, 2026
+ */
+
+#include "heartbeat_monitor.h"
+#include "TRACE.h"
+#include <vector>
+
+using namespace std;
+
+/**
+ * Class constructor. Nothing is sent until start() is called or service()
+ * is called from an external timer.
+ * @param uIntervalMs Number of milliseconds a connection may be idle before
+ *        a heartbeat is sent on it
+ * @param uMissedLimit Number of intervals without any data from the peer
+ *        before the peer is considered dead
+ */
+CHeartbeatMonitor::CHeartbeatMonitor(unsigned uIntervalMs,unsigned uMissedLimit) {
+    m_uIntervalMs=uIntervalMs;
+    m_uMissedLimit=uMissedLimit;
+    m_pDeadPeerCallback=NULL;
+    m_pDeadPeerUser=NULL;
+    m_hTimer=CTimer::INVALID_HANDLE;
+    m_bTicking=false;
+    m_uTicksInProgress=0;
+    pthread_mutex_init(&m_mutex,NULL);
+    pthread_cond_init(&m_TickCond,NULL);
+    m_pTimer=new CTimer();
+}
+
+/**
+ * Class destructor
+ */
+CHeartbeatMonitor::~CHeartbeatMonitor() {
+    stop();
+    //the timer thread may be about to call timerHelper(). Wait for it to exit.
+    delete m_pTimer;
+    pthread_cond_destroy(&m_TickCond);
+    pthread_mutex_destroy(&m_mutex);
+}
+
+/**
+ * Starts the periodic timer. The timer ticks a few times per interval so
+ * that heartbeats go out close to the time they are due.
+ * @retval true The timer is running
+ * @retval false The timer could not be created
+ */
+bool CHeartbeatMonitor::start() {
+    unsigned long uTickMs=m_uIntervalMs/TICKS_PER_INTERVAL;
+
+    if(m_hTimer != CTimer::INVALID_HANDLE){
+        return true;
+    }
+    if(uTickMs == 0){
+        uTickMs=1;
+    }
+    pthread_mutex_lock(&m_mutex);
+    m_bTicking=true;
+    pthread_mutex_unlock(&m_mutex);
+    m_hTimer=m_pTimer->CreateTimer(uTickMs,timerHelper,this);
+    if(m_hTimer == CTimer::INVALID_HANDLE){
+        PERROR("Failed to create the heartbeat timer\n");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Stops the periodic timer. A tick that is in progress, dead peer callbacks
+ * included, finishes before this returns. Do not call it from the dead peer
+ * callback.
+ */
+void CHeartbeatMonitor::stop() {
+    if(m_hTimer != CTimer::INVALID_HANDLE){
+        m_pTimer->DeleteTimer(m_hTimer);
+        m_hTimer=CTimer::INVALID_HANDLE;
+    }
+    pthread_mutex_lock(&m_mutex);
+    m_bTicking=false;
+    while(m_uTicksInProgress > 0){
+        pthread_cond_wait(&m_TickCond,&m_mutex);
+    }
+    pthread_mutex_unlock(&m_mutex);
+}
+
+/**
+ * Adds a connection to the monitor. The dead peer detection of the
+ * connection starts over.
+ * @param pConnection Connection to monitor
+ */
+void CHeartbeatMonitor::add(CMessaging *pConnection) {
+    pConnection->resetHeartbeat();
+    pthread_mutex_lock(&m_mutex);
+    m_Connections.insert(pConnection);
+    pthread_mutex_unlock(&m_mutex);
+}
+
+/**
+ * Removes a connection from the monitor. Once this returns the monitor no
+ * longer touches the connection and it can be deleted.
+ * @param pConnection Connection to remove
+ */
+void CHeartbeatMonitor::remove(CMessaging *pConnection) {
+    pthread_mutex_lock(&m_mutex);
+    m_Connections.erase(pConnection);
+    pthread_mutex_unlock(&m_mutex);
+}
+
+/**
+ * Registers a function to be called when a peer misses too many heartbeats.
+ * The connection has already been removed from the monitor when the
+ * function is called, so it may delete the connection or add it back.
+ * @param pCallback Function to call
+ * @param pUser Pointer passed back to the function
+ */
+void CHeartbeatMonitor::registerDeadPeerCallback(DeadPeerCallback_t pCallback,void *pUser) {
+    pthread_mutex_lock(&m_mutex);
+    m_pDeadPeerCallback=pCallback;
+    m_pDeadPeerUser=pUser;
+    pthread_mutex_unlock(&m_mutex);
+}
+
+/**
+ * Makes one pass over the connections, sending the heartbeats that are due
+ * and reporting the dead peers. Called on every tick of the timer started
+ * by start(); can also be called directly from an external event loop.
+ */
+void CHeartbeatMonitor::service() {
+    vector<CMessaging*> deadPeers;
+    ConnectionSet_t::iterator it;
+    unsigned long long uNowUs=CTimer::getMonotonicUs();
+    DeadPeerCallback_t pCallback;
+    void *pUser;
+
+    pthread_mutex_lock(&m_mutex);
+    for(it=m_Connections.begin(); it != m_Connections.end(); ){
+        if(!(*it)->serviceHeartbeat(uNowUs,m_uIntervalMs,m_uMissedLimit)){
+            deadPeers.push_back(*it);
+            m_Connections.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+    pCallback=m_pDeadPeerCallback;
+    pUser=m_pDeadPeerUser;
+    pthread_mutex_unlock(&m_mutex);
+
+    if(pCallback != NULL){
+        for(unsigned i=0; i < deadPeers.size(); i++){
+            pCallback(deadPeers[i],pUser);
+        }
+    }
+}
+
+/**
+ * Returns the number of connections being monitored
+ */
+unsigned CHeartbeatMonitor::getConnectionCount() {
+    unsigned uCount;
+
+    pthread_mutex_lock(&m_mutex);
+    uCount=(unsigned)m_Connections.size();
+    pthread_mutex_unlock(&m_mutex);
+    return uCount;
+}
+
+/**
+ * Timer call back
+ */
+void CHeartbeatMonitor::timerHelper(unsigned hTimer,void *pUser) {
+    CHeartbeatMonitor *pThis=(CHeartbeatMonitor*)pUser;
+
+    UNUSED(hTimer);
+
+    pthread_mutex_lock(&pThis->m_mutex);
+    if(!pThis->m_bTicking){
+        pthread_mutex_unlock(&pThis->m_mutex);
+        return;
+    }
+    pThis->m_uTicksInProgress++;
+    pthread_mutex_unlock(&pThis->m_mutex);
+
+    pThis->service();
+
+    pthread_mutex_lock(&pThis->m_mutex);
+    pThis->m_uTicksInProgress--;
+    pthread_cond_broadcast(&pThis->m_TickCond);
+    pthread_mutex_unlock(&pThis->m_mutex);
+}
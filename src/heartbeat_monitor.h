@@ -0,0 +1,74 @@
+/**
+ * @file heartbeat_monitor.h
+ *
+ * @date   Oct 18, 2026
+ */
+
+#ifndef HEARTBEATMONITOR_H
+#define HEARTBEATMONITOR_H
+
+#include "Messaging.h"
+#include "Timer.h"
+#include <pthread.h>
+#include <set>
+
+/**
+ * Sends heartbeats on idle connections and detects dead peers. All the
+ * connections share a single periodic timer, so the cost of a tick is one
+ * pass over the connection list no matter how many connections there are.
+ */
+class CHeartbeatMonitor {
+public:
+    /**
+     * Called when a peer missed too many heartbeats
+     *   pConnection: connection to the dead peer. It is no longer monitored.
+     *   pUser: pointer passed in during registration
+     **/
+    typedef void (*DeadPeerCallback_t)(CMessaging *pConnection,void *pUser);
+    /** default number of milliseconds between heartbeats */
+    enum {DEFAULT_INTERVAL=1000};
+    /** default number of missed heartbeats before a peer is dead */
+    enum {DEFAULT_MISSED_LIMIT=3};
+    /** number of timer ticks per heartbeat interval */
+    enum {TICKS_PER_INTERVAL=4};
+
+    CHeartbeatMonitor(unsigned uIntervalMs=DEFAULT_INTERVAL,unsigned uMissedLimit=DEFAULT_MISSED_LIMIT);
+    ~CHeartbeatMonitor();
+
+    /** @brief starts the periodic timer */
+    bool start();
+    /** @brief stops the periodic timer */
+    void stop();
+    /** @brief adds a connection to the monitor */
+    void add(CMessaging *pConnection);
+    /** @brief removes a connection from the monitor */
+    void remove(CMessaging *pConnection);
+    /** @brief registers a function to be called when a peer is dead */
+    void registerDeadPeerCallback(DeadPeerCallback_t pCallback,void *pUser);
+    /** @brief sends the heartbeats that are due and checks for dead peers */
+    void service();
+    /** @brief returns the number of monitored connections */
+    unsigned getConnectionCount();
+
+    unsigned getInterval()    const {  return m_uIntervalMs;   }
+    unsigned getMissedLimit() const {  return m_uMissedLimit;  }
+
+protected:
+    typedef std::set<CMessaging*> ConnectionSet_t;
+
+    unsigned           m_uIntervalMs;
+    unsigned           m_uMissedLimit;
+    ConnectionSet_t    m_Connections;
+    pthread_mutex_t    m_mutex;          /**< protects the connection set */
+    DeadPeerCallback_t m_pDeadPeerCallback;
+    void *             m_pDeadPeerUser;
+    CTimer *           m_pTimer;         /**< deleted before m_mutex so that no tick outlives the monitor */
+    unsigned           m_hTimer;
+    bool               m_bTicking;       /**< false once stop() was called. Protected by m_mutex. */
+    unsigned           m_uTicksInProgress;
+    pthread_cond_t     m_TickCond;       /**< signalled when a tick ends */
+
+    static void timerHelper(unsigned hTimer,void *pUser);
+};
+
+#endif /* HEARTBEATMONITOR_H */
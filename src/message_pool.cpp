@@ -0,0 +1,206 @@
+/**
+ * @file message_pool.cpp
+ *
+ * @date   Oct 18, 2026
+ */
+
+#include "message_pool.h"
+#include <stddef.h>
+
+/**
+ * Class constructor
+ * @param uMaxCached Number of free buffers kept per size class. Buffers
+ *        returned beyond that go back to the heap.
+ */
+CBufferPool::CBufferPool(unsigned uMaxCached) {
+    m_uMaxCached=uMaxCached;
+    m_uHeapAllocations=0;
+    pthread_mutex_init(&m_mutex,NULL);
+}
+
+/**
+ * Class destructor. Frees the cached buffers.
+ */
+CBufferPool::~CBufferPool() {
+    for(unsigned i=0; i < CLASS_COUNT; i++){
+        for(unsigned j=0; j < m_FreeLists[i].size(); j++){
+            delete[] (unsigned char *)m_FreeLists[i][j];
+        }
+        m_FreeLists[i].clear();
+    }
+    pthread_mutex_destroy(&m_mutex);
+}
+
+/**
+ * Returns the pool used by the messaging classes when no other pool is
+ * given. It is never destroyed, so buffers can outlive any object.
+ */
+CBufferPool &CBufferPool::getDefault() {
+    static CBufferPool *pDefault=new CBufferPool();
+
+    return *pDefault;
+}
+
+/**
+ * Hands out a buffer of at least the requested size. The buffer comes off
+ * the free list of its size class when one is available.
+ * @param uSize Number of bytes needed
+ * @return Pointer to the buffer, holding one reference
+ */
+unsigned char *CBufferPool::allocate(unsigned long uSize) {
+    BufferHeader_t *pHeader=NULL;
+    unsigned long uCapacity=1UL << MIN_CLASS_SHIFT;
+    int nClass=0;
+
+    while(uCapacity < uSize && nClass < CLASS_COUNT){
+        uCapacity<<=1;
+        nClass++;
+    }
+    if(nClass == CLASS_COUNT){
+        //too large to be worth keeping
+        nClass=-1;
+        uCapacity=uSize;
+    } else {
+        pthread_mutex_lock(&m_mutex);
+        if(!m_FreeLists[nClass].empty()){
+            pHeader=m_FreeLists[nClass].back();
+            m_FreeLists[nClass].pop_back();
+        }
+        pthread_mutex_unlock(&m_mutex);
+    }
+
+    if(pHeader == NULL){
+        pHeader=(BufferHeader_t *)new unsigned char[sizeof(BufferHeader_t)+uCapacity];
+        pHeader->pPool=this;
+        pHeader->uCapacity=uCapacity;
+        pHeader->nClass=nClass;
+        __sync_add_and_fetch(&m_uHeapAllocations,1);
+    }
+    pHeader->nRefs=1;
+
+    return (unsigned char *)(pHeader+1);
+}
+
+/**
+ * Adds a reference to a buffer returned by allocate()
+ * @param pData Pointer to the buffer
+ */
+void CBufferPool::addRef(unsigned char *pData) {
+    __sync_add_and_fetch(&getHeader(pData)->nRefs,1);
+}
+
+/**
+ * Drops a reference to a buffer returned by allocate(). The last reference
+ * gives the buffer back to its pool.
+ * @param pData Pointer to the buffer. NULL is ignored.
+ */
+void CBufferPool::release(unsigned char *pData) {
+    BufferHeader_t *pHeader;
+
+    if(pData == NULL){
+        return;
+    }
+    pHeader=getHeader(pData);
+    if(__sync_sub_and_fetch(&pHeader->nRefs,1) == 0){
+        pHeader->pPool->recycle(pHeader);
+    }
+}
+
+/**
+ * Returns the number of bytes a buffer returned by allocate() can hold
+ * @param pData Pointer to the buffer
+ */
+unsigned long CBufferPool::getCapacity(const unsigned char *pData) {
+    return getHeader(pData)->uCapacity;
+}
+
+/**
+ * Puts a buffer back on the free list of its size class, or frees it if
+ * the list is full or the buffer is too large to keep
+ * @param pHeader Header of the buffer
+ */
+void CBufferPool::recycle(BufferHeader_t *pHeader) {
+    if(pHeader->nClass >= 0){
+        pthread_mutex_lock(&m_mutex);
+        if(m_FreeLists[pHeader->nClass].size() < m_uMaxCached){
+            m_FreeLists[pHeader->nClass].push_back(pHeader);
+            pHeader=NULL;
+        }
+        pthread_mutex_unlock(&m_mutex);
+    }
+    if(pHeader != NULL){
+        delete[] (unsigned char *)pHeader;
+    }
+}
+
+/**
+ * Creates an empty handle
+ */
+CMessage::CMessage() {
+    m_pData=NULL;
+    m_uSize=0;
+}
+
+/**
+ * Creates a message with room for the given number of bytes
+ * @param uSize Number of bytes in the message
+ * @param pPool Pool to take the buffer from (NULL for the default pool)
+ */
+CMessage::CMessage(unsigned long uSize,CBufferPool *pPool) {
+    if(pPool == NULL){
+        pPool=&CBufferPool::getDefault();
+    }
+    m_pData=pPool->allocate(uSize);
+    m_uSize=uSize;
+}
+
+/**
+ * Copy constructor. Both handles share the buffer.
+ */
+CMessage::CMessage(const CMessage &other) {
+    m_pData=other.m_pData;
+    m_uSize=other.m_uSize;
+    if(m_pData != NULL){
+        CBufferPool::addRef(m_pData);
+    }
+}
+
+/**
+ * Class destructor. Gives the buffer back with the last handle.
+ */
+CMessage::~CMessage() {
+    reset();
+}
+
+/**
+ * Assignment operator. Both handles share the buffer.
+ */
+CMessage &CMessage::operator=(const CMessage &other) {
+    if(other.m_pData != NULL){
+        CBufferPool::addRef(other.m_pData);
+    }
+    reset();
+    m_pData=other.m_pData;
+    m_uSize=other.m_uSize;
+    return *this;
+}
+
+/**
+ * Lets go of the buffer. The handle is empty afterwards.
+ */
+void CMessage::reset() {
+    CBufferPool::release(m_pData);
+    m_pData=NULL;
+    m_uSize=0;
+}
+
+/**
+ * Takes over the reference held on a pooled buffer
+ * @param pData Buffer returned by CBufferPool::allocate()
+ * @param uSize Number of bytes in the message
+ */
+void CMessage::attach(unsigned char *pData,unsigned long uSize) {
+    reset();
+    m_pData=pData;
+    m_uSize=uSize;
+}
@@ -0,0 +1,100 @@
+/**
+ * @file message_pool.h
+ *
+ * @date   Oct 18, 2026
+ */
+
+#ifndef MESSAGEPOOL_H
+#define MESSAGEPOOL_H
+
+#include <pthread.h>
+#include <vector>
+
+/**
+ * Recycles message buffers. Buffers are rounded up to a power of two size
+ * class and returned buffers are kept on a free list per class, so a
+ * steady stream of messages is served without going to the heap. Buffers
+ * are reference counted and go back to the pool they came from when the
+ * last reference is released. A pool must outlive its buffers.
+ */
+class CBufferPool {
+public:
+    /** smallest size class is 2^MIN_CLASS_SHIFT bytes */
+    enum {MIN_CLASS_SHIFT=6};
+    /** largest size class is 2^MAX_CLASS_SHIFT bytes. Larger buffers are not recycled */
+    enum {MAX_CLASS_SHIFT=20};
+    enum {CLASS_COUNT=MAX_CLASS_SHIFT-MIN_CLASS_SHIFT+1};
+    /** default number of free buffers kept per size class */
+    enum {DEFAULT_CACHED_BUFFERS=64};
+
+    CBufferPool(unsigned uMaxCached=DEFAULT_CACHED_BUFFERS);
+    ~CBufferPool();
+
+    /** @brief returns a buffer of at least uSize bytes with one reference */
+    unsigned char *allocate(unsigned long uSize);
+    /** @brief adds a reference to a buffer */
+    static void addRef(unsigned char *pData);
+    /** @brief drops a reference and recycles the buffer with the last one */
+    static void release(unsigned char *pData);
+    /** @brief returns the number of bytes the buffer can hold */
+    static unsigned long getCapacity(const unsigned char *pData);
+    /** @brief returns the pool shared by the messaging classes */
+    static CBufferPool &getDefault();
+
+    /** returns the number of buffers taken from the heap so far */
+    unsigned long getHeapAllocations() const {return m_uHeapAllocations;}
+
+protected:
+    /** placed in front of every buffer */
+    typedef struct {
+        CBufferPool  *pPool;     /**< pool the buffer goes back to */
+        unsigned long uCapacity; /**< number of bytes after the header */
+        volatile int  nRefs;     /**< number of references */
+        int           nClass;    /**< size class or -1 if not recycled */
+    } BufferHeader_t;
+    typedef std::vector<BufferHeader_t*> FreeList_t;
+
+    FreeList_t      m_FreeLists[CLASS_COUNT];
+    unsigned        m_uMaxCached;
+    pthread_mutex_t m_mutex;            /**< protects the free lists */
+    volatile unsigned long m_uHeapAllocations;
+
+    /** @brief puts a buffer back on its free list or frees it */
+    void recycle(BufferHeader_t *pHeader);
+    static BufferHeader_t *getHeader(const unsigned char *pData) {
+        return (BufferHeader_t *)(pData-sizeof(BufferHeader_t));
+    }
+};
+
+/**
+ * Owning handle for a received message. The contents live in a pooled
+ * buffer that goes back to the pool when the last handle referring to it
+ * is destroyed, so messages can no longer be leaked by forgetting a
+ * delete[]. Copying a handle shares the buffer instead of copying it.
+ */
+class CMessage {
+public:
+    CMessage();
+    explicit CMessage(unsigned long uSize,CBufferPool *pPool=NULL);
+    CMessage(const CMessage &other);
+    ~CMessage();
+    CMessage &operator=(const CMessage &other);
+
+    /** @brief lets go of the buffer */
+    void reset();
+
+    unsigned char *data()  const {  return m_pData;        }
+    unsigned long  size()  const {  return m_uSize;        }
+    bool           empty() const {  return m_pData == NULL; }
+
+protected:
+    unsigned char *m_pData;
+    unsigned long  m_uSize;
+
+    /** @brief takes over the reference held on a pooled buffer */
+    void attach(unsigned char *pData,unsigned long uSize);
+
+    friend class CMessaging;
+};
+
+#endif /* MESSAGEPOOL_H */
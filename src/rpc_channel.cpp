@@ -0,0 +1,441 @@
+/**
+ * @file rpc_channel.cpp
+ *
+ * @date   Oct 18, 2026
+ */
+
+#include "rpc_channel.h"
+#include "TRACE.h"
+#include <errno.h>
+#include <time.h>
+
+using namespace std;
+
+/** state shared between callAndWait() and its response callback */
+typedef struct {
+    pthread_mutex_t         mutex;
+    pthread_cond_t          cond;
+    bool                    bDone;
+    CRpcChannel::Status_t   status;
+    vector<unsigned char> * pResponse;
+} WaitState_t;
+
+/**
+ * Class constructor. Takes over the tagged frames of the connection.
+ * @param link Connection the requests and responses travel on. It must
+ *        outlive the channel.
+ */
+CRpcChannel::CRpcChannel(CMessaging &link):m_link(link) {
+    m_uNextId=1;
+    m_pRequestHandler=NULL;
+    m_pRequestUser=NULL;
+    m_hTimer=CTimer::INVALID_HANDLE;
+    m_bTicking=false;
+    m_uTicksInProgress=0;
+    pthread_mutex_init(&m_mutex,NULL);
+    pthread_cond_init(&m_TickCond,NULL);
+    m_pTimer=new CTimer();
+    m_link.registerTaggedCallback(taggedHelper,this);
+}
+
+/**
+ * Class destructor. Calls that are still pending complete with RpcCancelled.
+ */
+CRpcChannel::~CRpcChannel() {
+    stop();
+    m_link.registerTaggedCallback(NULL,NULL);
+    cancelAll();
+    //the timer thread may be about to call timerHelper(). Wait for it to exit.
+    delete m_pTimer;
+    pthread_cond_destroy(&m_TickCond);
+    pthread_mutex_destroy(&m_mutex);
+}
+
+/**
+ * Starts the periodic timer that completes the calls whose deadline passed.
+ * Without it, deadlines are only checked when service() is called.
+ * @param uTickMs Number of milliseconds between checks. A deadline is met
+ *        to within one tick.
+ * @retval true The timer is running
+ * @retval false The timer could not be created
+ */
+bool CRpcChannel::start(unsigned uTickMs) {
+    if(m_hTimer != CTimer::INVALID_HANDLE){
+        return true;
+    }
+    pthread_mutex_lock(&m_mutex);
+    m_bTicking=true;
+    pthread_mutex_unlock(&m_mutex);
+    m_hTimer=m_pTimer->CreateTimer(uTickMs > 0 ? uTickMs : 1,timerHelper,this);
+    if(m_hTimer == CTimer::INVALID_HANDLE){
+        PERROR("Failed to create the rpc deadline timer\n");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Stops the deadline timer. A tick that is in progress finishes before this
+ * returns, so no callback comes from the timer afterwards. Do not call it
+ * from a response callback.
+ */
+void CRpcChannel::stop() {
+    if(m_hTimer != CTimer::INVALID_HANDLE){
+        m_pTimer->DeleteTimer(m_hTimer);
+        m_hTimer=CTimer::INVALID_HANDLE;
+    }
+    pthread_mutex_lock(&m_mutex);
+    m_bTicking=false;
+    while(m_uTicksInProgress > 0){
+        pthread_cond_wait(&m_TickCond,&m_mutex);
+    }
+    pthread_mutex_unlock(&m_mutex);
+}
+
+/**
+ * Registers the function that serves requests from the remote end. Requests
+ * that arrive without one are answered with an empty error.
+ * @param pHandler Function to call
+ * @param pUser Pointer passed back to the function
+ */
+void CRpcChannel::registerRequestHandler(RequestHandler_t pHandler,void *pUser) {
+    pthread_mutex_lock(&m_mutex);
+    m_pRequestHandler=pHandler;
+    m_pRequestUser=pUser;
+    pthread_mutex_unlock(&m_mutex);
+}
+
+/**
+ * Sends a request and returns right away. The callback is called exactly
+ * once, from the thread that receives the response, from the deadline
+ * timer, or from cancel(). The response may even arrive before this
+ * returns. Any number of calls can be in flight at once.
+ * @param pRequest Pointer to the request
+ * @param uLength Number of bytes in the request
+ * @param uTimeoutMs Milliseconds to wait for the response. 0 waits for ever.
+ * @param pCallback Function to call with the outcome
+ * @param pUser Pointer passed back to the function
+ * @param[out] puId receives the id of the call (optional)
+ * @retval true The request was sent
+ * @retval false The request could not be sent. The callback is not called.
+ */
+bool CRpcChannel::call(const unsigned char *pRequest,unsigned uLength,unsigned uTimeoutMs,
+                       ResponseCallback_t pCallback,void *pUser,unsigned *puId) {
+    Pending_t pending;
+    unsigned uId;
+
+    pending.pCallback=pCallback;
+    pending.pUser=pUser;
+    pending.uDeadlineUs=0;
+    if(uTimeoutMs > 0){
+        pending.uDeadlineUs=CTimer::getMonotonicUs()+(unsigned long long)uTimeoutMs*1000;
+    }
+
+    //register the call first, the response can beat the send back
+    pthread_mutex_lock(&m_mutex);
+    //after a wrap around, skip the ids of calls that are still pending
+    do {
+        uId=m_uNextId++;
+        if(m_uNextId == 0){
+            m_uNextId=1;
+        }
+    } while(m_Pending.find(uId) != m_Pending.end());
+    m_Pending[uId]=pending;
+    if(pending.uDeadlineUs != 0){
+        m_Deadlines.push(Deadline_t(pending.uDeadlineUs,uId));
+    }
+    pthread_mutex_unlock(&m_mutex);
+    if(puId != NULL){
+        *puId=uId;
+    }
+
+    if(!m_link.sendTaggedMessage(KIND_REQUEST,uId,pRequest,uLength)){
+        PTRACE("Failed to send the request\n");
+        pthread_mutex_lock(&m_mutex);
+        m_Pending.erase(uId);
+        pruneDeadlines();
+        pthread_mutex_unlock(&m_mutex);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Sends a request and waits for its response. The deadline is checked
+ * while waiting, so this works without start().
+ * @param pRequest Pointer to the request
+ * @param uLength Number of bytes in the request
+ * @param uTimeoutMs Milliseconds to wait for the response. 0 waits for ever.
+ * @param[out] response receives the response or the error reply
+ * @return how the call ended
+ */
+CRpcChannel::Status_t CRpcChannel::callAndWait(const unsigned char *pRequest,unsigned uLength,unsigned uTimeoutMs,
+                                               vector<unsigned char> &response) {
+    WaitState_t state;
+    struct timespec wakeup;
+    Status_t status;
+
+    pthread_mutex_init(&state.mutex,NULL);
+    pthread_cond_init(&state.cond,NULL);
+    state.bDone=false;
+    state.status=RpcCancelled;
+    state.pResponse=&response;
+    response.clear();
+
+    if(!call(pRequest,uLength,uTimeoutMs,waitHelper,&state)){
+        state.bDone=true;
+    }
+    pthread_mutex_lock(&state.mutex);
+    while(!state.bDone){
+        CTimer::getTime(wakeup);
+        wakeup.tv_nsec+=DEFAULT_TICK_MS*1000000L;
+        if(wakeup.tv_nsec >= BILLION){
+            wakeup.tv_sec++;
+            wakeup.tv_nsec-=BILLION;
+        }
+        if(pthread_cond_timedwait(&state.cond,&state.mutex,&wakeup) == ETIMEDOUT){
+            pthread_mutex_unlock(&state.mutex);
+            service();
+            pthread_mutex_lock(&state.mutex);
+        }
+    }
+    status=state.status;
+    pthread_mutex_unlock(&state.mutex);
+
+    pthread_cond_destroy(&state.cond);
+    pthread_mutex_destroy(&state.mutex);
+    return status;
+}
+
+/**
+ * Answers a request
+ * @param uId Id handed to the request handler
+ * @param pResponse Pointer to the response
+ * @param uLength Number of bytes in the response
+ * @retval true The response was sent
+ * @retval false The response could not be sent
+ */
+bool CRpcChannel::reply(unsigned uId,const unsigned char *pResponse,unsigned uLength) {
+    return m_link.sendTaggedMessage(KIND_RESPONSE,uId,pResponse,uLength);
+}
+
+/**
+ * Answers a request with an error. The caller's callback gets RpcError.
+ * @param uId Id handed to the request handler
+ * @param pError Pointer to a description of the error (can be empty)
+ * @param uLength Number of bytes in the description
+ * @retval true The error was sent
+ * @retval false The error could not be sent
+ */
+bool CRpcChannel::replyError(unsigned uId,const unsigned char *pError,unsigned uLength) {
+    return m_link.sendTaggedMessage(KIND_ERROR,uId,pError,uLength);
+}
+
+/**
+ * Completes a pending call with RpcCancelled. A response that still comes
+ * in for it is dropped.
+ * @param uId Id of the call
+ * @retval true The call was pending
+ * @retval false The call had completed already
+ */
+bool CRpcChannel::cancel(unsigned uId) {
+    return complete(uId,RpcCancelled,NULL,0);
+}
+
+/**
+ * Completes all the pending calls with RpcCancelled, e.g. when the
+ * connection is lost
+ */
+void CRpcChannel::cancelAll() {
+    vector<unsigned> ids;
+    PendingMap_t::iterator it;
+
+    pthread_mutex_lock(&m_mutex);
+    for(it=m_Pending.begin(); it != m_Pending.end(); ++it){
+        ids.push_back(it->first);
+    }
+    pthread_mutex_unlock(&m_mutex);
+    for(unsigned i=0; i < ids.size(); i++){
+        complete(ids[i],RpcCancelled,NULL,0);
+    }
+}
+
+/**
+ * Completes the calls whose deadline passed with RpcTimeout. Called on every
+ * tick of the timer started by start(); can also be called directly from an
+ * external event loop.
+ */
+void CRpcChannel::service() {
+    vector<unsigned> expired;
+    unsigned long long uNowUs=CTimer::getMonotonicUs();
+
+    pthread_mutex_lock(&m_mutex);
+    while(!m_Deadlines.empty() && m_Deadlines.top().first <= uNowUs){
+        Deadline_t deadline=m_Deadlines.top();
+
+        m_Deadlines.pop();
+        if(!isStale(deadline)){
+            expired.push_back(deadline.second);
+        }
+    }
+    pthread_mutex_unlock(&m_mutex);
+
+    for(unsigned i=0; i < expired.size(); i++){
+        complete(expired[i],RpcTimeout,NULL,0);
+    }
+}
+
+/**
+ * Returns the number of calls waiting for a response
+ */
+unsigned CRpcChannel::getPendingCount() {
+    unsigned uCount;
+
+    pthread_mutex_lock(&m_mutex);
+    uCount=(unsigned)m_Pending.size();
+    pthread_mutex_unlock(&m_mutex);
+    return uCount;
+}
+
+/**
+ * Returns true if a deadline belongs to a call that completed, including a
+ * call whose id was reused since. Called with m_mutex held.
+ * @param deadline Entry of the deadline heap
+ * @return true if the entry can be dropped
+ */
+bool CRpcChannel::isStale(const Deadline_t &deadline) const {
+    PendingMap_t::const_iterator it=m_Pending.find(deadline.second);
+
+    return it == m_Pending.end() || it->second.uDeadlineUs != deadline.first;
+}
+
+/**
+ * Drops the deadlines of calls that completed before their deadline. The
+ * stale entries on top of the heap go right away; once the heap holds more
+ * than MAX_STALE_DEADLINES entries besides those of the pending calls, it is
+ * rebuilt from the pending calls. The heap therefore stays in proportion to
+ * the calls in flight however long the timeouts are. Called with m_mutex held.
+ */
+void CRpcChannel::pruneDeadlines() {
+    vector<Deadline_t> live;
+
+    while(!m_Deadlines.empty() && isStale(m_Deadlines.top())){
+        m_Deadlines.pop();
+    }
+    if(m_Deadlines.size() <= m_Pending.size()+MAX_STALE_DEADLINES){
+        return;
+    }
+    live.reserve(m_Pending.size());
+    for(PendingMap_t::const_iterator it=m_Pending.begin(); it != m_Pending.end(); ++it){
+        if(it->second.uDeadlineUs != 0){
+            live.push_back(Deadline_t(it->second.uDeadlineUs,it->first));
+        }
+    }
+    m_Deadlines=DeadlineQueue_t(std::greater<Deadline_t>(),live);
+}
+
+/**
+ * Removes a pending call and reports its outcome to its callback. Only the
+ * first of the response, the deadline and a cancel gets through.
+ * @param uId Id of the call
+ * @param status Outcome of the call
+ * @param pData Response, if any
+ * @param uLength Number of bytes in the response
+ * @retval true The call was pending
+ * @retval false The call had completed already
+ */
+bool CRpcChannel::complete(unsigned uId,Status_t status,const unsigned char *pData,unsigned long uLength) {
+    PendingMap_t::iterator it;
+    Pending_t pending;
+
+    pthread_mutex_lock(&m_mutex);
+    it=m_Pending.find(uId);
+    if(it == m_Pending.end()){
+        pthread_mutex_unlock(&m_mutex);
+        return false;
+    }
+    pending=it->second;
+    m_Pending.erase(it);
+    pruneDeadlines();
+    pthread_mutex_unlock(&m_mutex);
+
+    if(pending.pCallback != NULL){
+        pending.pCallback(uId,status,pData,uLength,pending.pUser);
+    }
+    return true;
+}
+
+/**
+ * Receives the tagged frames of the connection
+ */
+void CRpcChannel::taggedHelper(unsigned char uKind,unsigned uTag,CMessaging::Message_t msg,void *pUser) {
+    CRpcChannel *pChannel=(CRpcChannel*)pUser;
+    RequestHandler_t pHandler;
+    void *pHandlerUser;
+
+    switch(uKind){
+    case KIND_REQUEST:
+        pthread_mutex_lock(&pChannel->m_mutex);
+        pHandler=pChannel->m_pRequestHandler;
+        pHandlerUser=pChannel->m_pRequestUser;
+        pthread_mutex_unlock(&pChannel->m_mutex);
+        if(pHandler != NULL){
+            pHandler(pChannel,uTag,msg.pData,msg.uMsgLength,pHandlerUser);
+        } else {
+            pChannel->replyError(uTag,NULL,0);
+        }
+        break;
+    case KIND_RESPONSE:
+        pChannel->complete(uTag,RpcOk,msg.pData,msg.uMsgLength);
+        break;
+    case KIND_ERROR:
+        pChannel->complete(uTag,RpcError,msg.pData,msg.uMsgLength);
+        break;
+    default:
+        PTRACE("Unknown rpc frame\n");
+        break;
+    }
+    delete[] msg.pData;
+}
+
+/**
+ * Timer call back
+ */
+void CRpcChannel::timerHelper(unsigned hTimer,void *pUser) {
+    CRpcChannel *pThis=(CRpcChannel*)pUser;
+
+    UNUSED(hTimer);
+
+    pthread_mutex_lock(&pThis->m_mutex);
+    if(!pThis->m_bTicking){
+        pthread_mutex_unlock(&pThis->m_mutex);
+        return;
+    }
+    pThis->m_uTicksInProgress++;
+    pthread_mutex_unlock(&pThis->m_mutex);
+
+    pThis->service();
+
+    pthread_mutex_lock(&pThis->m_mutex);
+    pThis->m_uTicksInProgress--;
+    pthread_cond_broadcast(&pThis->m_TickCond);
+    pthread_mutex_unlock(&pThis->m_mutex);
+}
+
+/**
+ * Response callback of callAndWait()
+ */
+void CRpcChannel::waitHelper(unsigned uId,Status_t status,const unsigned char *pData,unsigned long uLength,void *pUser) {
+    WaitState_t *pState=(WaitState_t*)pUser;
+
+    UNUSED(uId);
+
+    pthread_mutex_lock(&pState->mutex);
+    if(uLength > 0){
+        pState->pResponse->assign(pData,pData+uLength);
+    }
+    pState->status=status;
+    pState->bDone=true;
+    pthread_cond_signal(&pState->cond);
+    pthread_mutex_unlock(&pState->mutex);
+}
@@ -0,0 +1,120 @@
+/**
+ * @file rpc_channel.h
+ *
+ * @date   Oct 18, 2026
+ */
+
+#ifndef RPCCHANNEL_H
+#define RPCCHANNEL_H
+
+#include "Messaging.h"
+#include "Timer.h"
+#include <pthread.h>
+#include <functional>
+#include <map>
+#include <queue>
+#include <vector>
+
+/**
+ * Request/response layer on top of a CMessaging connection. Every request
+ * carries a correlation id in a tagged frame header (see
+ * CMessaging::sendTaggedMessage()), so any number of requests can be in
+ * flight on one connection and the responses may come back in any order.
+ * Each request can have a deadline; the deadlines are kept in a heap that
+ * a single periodic timer checks, so tracking them costs O(log n) per
+ * request no matter how many are pending.
+ */
+class CRpcChannel {
+public:
+    /** how a call ended */
+    typedef enum {RpcOk,RpcError,RpcTimeout,RpcCancelled} Status_t;
+    /**
+     * Called once when a call completes
+     *   uId: id returned by call()
+     *   status: RpcOk with the response, RpcError with the error reply, or
+     *           RpcTimeout/RpcCancelled without data
+     *   pData, uLength: the response. Only valid until the callback returns.
+     *   pUser: pointer passed to call()
+     **/
+    typedef void (*ResponseCallback_t)(unsigned uId,Status_t status,const unsigned char *pData,unsigned long uLength,void *pUser);
+    /**
+     * Called for every request from the remote end. The request is answered
+     * with reply() or replyError(), right away or later from any thread.
+     *   pChannel: channel the request came in on
+     *   uId: id to pass to reply()
+     *   pData, uLength: the request. Only valid until the handler returns.
+     *   pUser: pointer passed in during registration
+     **/
+    typedef void (*RequestHandler_t)(CRpcChannel *pChannel,unsigned uId,const unsigned char *pData,unsigned long uLength,void *pUser);
+    /** default number of milliseconds between deadline checks */
+    enum {DEFAULT_TICK_MS=10};
+    /** kinds of tagged frames used by the channel */
+    enum {KIND_REQUEST=1,KIND_RESPONSE=2,KIND_ERROR=3};
+
+    CRpcChannel(CMessaging &link);
+    ~CRpcChannel();
+
+    /** @brief starts the timer that expires the deadlines */
+    bool start(unsigned uTickMs=DEFAULT_TICK_MS);
+    /** @brief stops the deadline timer */
+    void stop();
+    /** @brief registers the function that serves requests from the remote end */
+    void registerRequestHandler(RequestHandler_t pHandler,void *pUser);
+    /** @brief sends a request and returns without waiting for the response */
+    bool call(const unsigned char *pRequest,unsigned uLength,unsigned uTimeoutMs,
+              ResponseCallback_t pCallback,void *pUser,unsigned *puId=NULL);
+    /** @brief sends a request and waits for the response */
+    Status_t callAndWait(const unsigned char *pRequest,unsigned uLength,unsigned uTimeoutMs,
+                         std::vector<unsigned char> &response);
+    /** @brief answers a request */
+    bool reply(unsigned uId,const unsigned char *pResponse,unsigned uLength);
+    /** @brief answers a request with an error */
+    bool replyError(unsigned uId,const unsigned char *pError,unsigned uLength);
+    /** @brief completes a pending call with RpcCancelled */
+    bool cancel(unsigned uId);
+    /** @brief completes all the pending calls with RpcCancelled */
+    void cancelAll();
+    /** @brief completes the calls whose deadline passed */
+    void service();
+    /** @brief returns the number of calls waiting for a response */
+    unsigned getPendingCount();
+
+protected:
+    /** a call waiting for its response */
+    typedef struct {
+        ResponseCallback_t pCallback;
+        void *             pUser;
+        unsigned long long uDeadlineUs;  /**< 0 if the call has no deadline */
+    } Pending_t;
+    typedef std::map<unsigned,Pending_t> PendingMap_t;
+    /** deadline and call id. Entries of completed calls are dropped by pruneDeadlines() or skipped when they come up. */
+    typedef std::pair<unsigned long long,unsigned> Deadline_t;
+    typedef std::priority_queue<Deadline_t,std::vector<Deadline_t>,std::greater<Deadline_t> > DeadlineQueue_t;
+    /** number of entries of completed calls the deadline heap may hold besides the pending ones */
+    enum {MAX_STALE_DEADLINES=64};
+
+    CMessaging &     m_link;
+    PendingMap_t     m_Pending;
+    DeadlineQueue_t  m_Deadlines;
+    unsigned         m_uNextId;
+    pthread_mutex_t  m_mutex;        /**< protects the pending calls and the deadlines */
+    RequestHandler_t m_pRequestHandler;
+    void *           m_pRequestUser;
+    CTimer *         m_pTimer;       /**< deleted before m_mutex so that no tick outlives the channel */
+    unsigned         m_hTimer;
+    bool             m_bTicking;     /**< false once stop() was called. Protected by m_mutex. */
+    unsigned         m_uTicksInProgress;
+    pthread_cond_t   m_TickCond;     /**< signalled when a tick ends */
+
+    /** @brief returns true if the deadline belongs to a call that is no longer pending. Called with m_mutex held. */
+    bool isStale(const Deadline_t &deadline) const;
+    /** @brief drops the deadlines of completed calls. Called with m_mutex held. */
+    void pruneDeadlines();
+    /** @brief removes a pending call and reports its outcome */
+    bool complete(unsigned uId,Status_t status,const unsigned char *pData,unsigned long uLength);
+    static void taggedHelper(unsigned char uKind,unsigned uTag,CMessaging::Message_t msg,void *pUser);
+    static void timerHelper(unsigned hTimer,void *pUser);
+    static void waitHelper(unsigned uId,Status_t status,const unsigned char *pData,unsigned long uLength,void *pUser);
+};
+
+#endif /* RPCCHANNEL_H */
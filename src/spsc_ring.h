@@ -0,0 +1,245 @@
+/**
+ * @file spsc_ring.h
+ *
+ * A lock free single producer, single consumer ring with optional blocking
+ * waits.
+ * @date   Oct 18, 2026
+ */
+
+#ifndef SPSCRING_H
+#define SPSCRING_H
+
+#include <poll.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include "TRACE.h"
+
+/**
+ * Fixed size ring that hands elements from exactly one producer thread to
+ * exactly one consumer thread without a lock. Each side only writes its own
+ * index, and the indexes live on separate cache lines so the two threads do
+ * not fight over them. A side that has to wait sleeps on an eventfd; the
+ * other side only makes a system call to wake it when it is actually
+ * asleep, so the common case costs no system calls at all.
+ */
+template<class T>
+class CSpscRing {
+public:
+    /**
+     * class constructor
+     * @param uCapacity Number of elements the ring holds. Rounded up to a
+     *        power of two.
+     */
+    CSpscRing(unsigned uCapacity) {
+        m_uCapacity=2;
+        while(m_uCapacity < uCapacity){
+            m_uCapacity<<=1;
+        }
+        m_uMask=m_uCapacity-1;
+        m_pSlots=new T[m_uCapacity];
+        m_uHead=0;
+        m_uTail=0;
+        m_uCachedHead=0;
+        m_uCachedTail=0;
+        m_bConsumerWaiting=0;
+        m_bProducerWaiting=0;
+        m_nDataEvent=eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+        m_nSpaceEvent=eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+        if(m_nDataEvent < 0 || m_nSpaceEvent < 0){
+            PERROR("eventfd");
+        }
+    }
+    /** destructor */
+    ~CSpscRing() {
+        delete[] m_pSlots;
+        if(m_nDataEvent >= 0){
+            close(m_nDataEvent);
+        }
+        if(m_nSpaceEvent >= 0){
+            close(m_nSpaceEvent);
+        }
+    }
+
+    /** returns the number of elements the ring holds */
+    unsigned capacity() const {return m_uCapacity;}
+    /** returns the number of elements in the ring. Exact only on the consumer or producer thread. */
+    unsigned size() const {return (unsigned)(m_uTail-m_uHead);}
+    /** returns true if the ring is empty. Exact only on the consumer thread. */
+    bool empty() const {return m_uTail == m_uHead;}
+
+    /**
+     * Adds an element. Producer thread only.
+     * @param element Element to add
+     * @retval true The element was added
+     * @retval false The ring is full
+     */
+    bool push(const T &element) {
+        unsigned long uTail=m_uTail;
+
+        if(uTail-m_uCachedHead >= m_uCapacity){
+            m_uCachedHead=m_uHead;
+            if(uTail-m_uCachedHead >= m_uCapacity){
+                return false;
+            }
+        }
+        m_pSlots[uTail&m_uMask]=element;
+        //the element must be visible before the index that publishes it
+        __sync_synchronize();
+        m_uTail=uTail+1;
+        __sync_synchronize();
+        if(m_bConsumerWaiting){
+            signal(m_nDataEvent);
+        }
+        return true;
+    }
+
+    /**
+     * Returns the oldest element without removing it. Consumer thread only.
+     * @return pointer to the element or NULL if the ring is empty. Valid until pop().
+     */
+    T *front() {
+        unsigned long uHead=m_uHead;
+
+        if(uHead == m_uCachedTail){
+            m_uCachedTail=m_uTail;
+            if(uHead == m_uCachedTail){
+                return NULL;
+            }
+        }
+        __sync_synchronize();
+        return &m_pSlots[uHead&m_uMask];
+    }
+
+    /**
+     * Removes the oldest element. Consumer thread only.
+     * @retval true An element was removed
+     * @retval false The ring is empty
+     */
+    bool pop() {
+        if(front() == NULL){
+            return false;
+        }
+        //done with the slot before handing it back to the producer
+        __sync_synchronize();
+        m_uHead=m_uHead+1;
+        __sync_synchronize();
+        if(m_bProducerWaiting){
+            signal(m_nSpaceEvent);
+        }
+        return true;
+    }
+
+    /**
+     * Removes the oldest element and returns it. Consumer thread only.
+     * @param[out] element receives the element
+     * @retval true An element was removed
+     * @retval false The ring is empty
+     */
+    bool pop(T &element) {
+        T *pFront=front();
+
+        if(pFront == NULL){
+            return false;
+        }
+        element=*pFront;
+        return pop();
+    }
+
+    /**
+     * Waits until there is an element to consume. Consumer thread only.
+     * @param nTimeoutMs Time to wait in milliseconds. -1 waits for ever.
+     * @retval true An element is available
+     * @retval false The wait timed out
+     */
+    bool waitForData(int nTimeoutMs) {
+        bool bResults;
+
+        if(front() != NULL){
+            return true;
+        }
+        m_bConsumerWaiting=1;
+        //announce the wait before looking again, so a push cannot slip by
+        __sync_synchronize();
+        //a wakeup left over from an earlier wait can end one wait early
+        while(!(bResults=(front() != NULL)) && wait(m_nDataEvent,nTimeoutMs));
+        m_bConsumerWaiting=0;
+        return bResults;
+    }
+
+    /**
+     * Waits until there is room for an element. Producer thread only.
+     * @param nTimeoutMs Time to wait in milliseconds. -1 waits for ever.
+     * @retval true There is room
+     * @retval false The wait timed out
+     */
+    bool waitForSpace(int nTimeoutMs) {
+        bool bResults;
+
+        if(m_uTail-m_uHead < m_uCapacity){
+            return true;
+        }
+        m_bProducerWaiting=1;
+        __sync_synchronize();
+        while(!(bResults=(m_uTail-m_uHead < m_uCapacity)) && wait(m_nSpaceEvent,nTimeoutMs));
+        m_bProducerWaiting=0;
+        return bResults;
+    }
+
+protected:
+    enum {CACHE_LINE=64};
+
+    T *             m_pSlots;
+    unsigned        m_uCapacity;
+    unsigned long   m_uMask;
+    int             m_nDataEvent;       /**< wakes the consumer */
+    int             m_nSpaceEvent;      /**< wakes the producer */
+    char            m_Pad0[CACHE_LINE];
+    //written by the consumer
+    volatile unsigned long m_uHead;     /**< next element to consume */
+    unsigned long   m_uCachedTail;      /**< last tail seen by the consumer */
+    volatile int    m_bConsumerWaiting; /**< the consumer sleeps on m_nDataEvent */
+    char            m_Pad1[CACHE_LINE];
+    //written by the producer
+    volatile unsigned long m_uTail;     /**< next free slot */
+    unsigned long   m_uCachedHead;      /**< last head seen by the producer */
+    volatile int    m_bProducerWaiting; /**< the producer sleeps on m_nSpaceEvent */
+    char            m_Pad2[CACHE_LINE];
+
+    /** wakes the other side */
+    static void signal(int nEvent) {
+        uint64_t uValue=1;
+
+        if(write(nEvent,&uValue,sizeof(uValue)) < 0){
+            //the counter is already set, the other side will wake anyway
+        }
+    }
+    /** sleeps until woken or timed out, then clears the wakeup */
+    static bool wait(int nEvent,int nTimeoutMs) {
+        struct pollfd fd;
+        uint64_t uValue;
+        int nResults;
+
+        fd.fd=nEvent;
+        fd.events=POLLIN;
+        fd.revents=0;
+        nResults=poll(&fd,1,nTimeoutMs);
+        if(nResults < 0){
+            PERROR("poll");
+            return false;
+        }
+        if(nResults == 0){
+            return false;
+        }
+        if(read(nEvent,&uValue,sizeof(uValue)) < 0){
+            //already cleared
+        }
+        return true;
+    }
+
+private:
+    CSpscRing(const CSpscRing &);
+    CSpscRing &operator=(const CSpscRing &);
+};
+
+#endif /* SPSCRING_H */
@@ -0,0 +1,395 @@
+/**
+ * @file stream_mux.cpp
+ *
+ * @date   Oct 18, 2026
+ */
+
+#include "stream_mux.h"
+#include "Timer.h"
+#include "TRACE.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * Class constructor. Takes over the mux frames of the connection.
+ * @param link Connection the streams run over. It must outlive the multiplexer.
+ * @param bInitiator true on the end that made the connection. The two ends
+ *        pick stream ids from different halves of the id space, so they can
+ *        open streams at the same time.
+ * @param uWindow Number of bytes each stream may have in flight towards
+ *        this end. At least INITIAL_CREDIT.
+ */
+CStreamMux::CStreamMux(CMessaging &link,bool bInitiator,unsigned uWindow):m_link(link) {
+    m_uNextId=bInitiator ? 1 : 2;
+    m_uWindow=(uWindow > (unsigned)INITIAL_CREDIT) ? uWindow : (unsigned)INITIAL_CREDIT;
+    m_pNotify=NULL;
+    m_pNotifyUser=NULL;
+    pthread_mutex_init(&m_mutex,NULL);
+    pthread_cond_init(&m_CreditCond,NULL);
+    m_link.registerMuxCallback(muxHelper,this);
+}
+
+/**
+ * Class destructor. The streams are dropped without telling the remote end.
+ */
+CStreamMux::~CStreamMux() {
+    m_link.registerMuxCallback(NULL,NULL);
+    pthread_mutex_lock(&m_mutex);
+    while(!m_Streams.empty()){
+        removeStream(m_Streams.begin());
+    }
+    pthread_mutex_unlock(&m_mutex);
+    pthread_cond_destroy(&m_CreditCond);
+    pthread_mutex_destroy(&m_mutex);
+}
+
+/**
+ * Registers the function told about stream events. It is called on the
+ * thread that processes the received data, without any lock held, so it
+ * can call receive() and send().
+ * @param pNotify Function to call
+ * @param pUser Pointer passed back to the function
+ */
+void CStreamMux::registerNotify(MuxNotify_t pNotify,void *pUser) {
+    pthread_mutex_lock(&m_mutex);
+    m_pNotify=pNotify;
+    m_pNotifyUser=pUser;
+    pthread_mutex_unlock(&m_mutex);
+}
+
+/**
+ * Opens a stream. Data can be sent on it right away.
+ * @return id of the stream, or INVALID_STREAM if the open frame could not
+ *         be sent
+ */
+unsigned CStreamMux::openStream() {
+    unsigned uStreamId;
+
+    pthread_mutex_lock(&m_mutex);
+    uStreamId=m_uNextId;
+    m_uNextId+=2;
+    addStream(uStreamId,0);
+    pthread_mutex_unlock(&m_mutex);
+
+    if(!sendCount(KIND_OPEN,uStreamId,m_uWindow-INITIAL_CREDIT)){
+        PTRACE("Failed to open a stream\n");
+        pthread_mutex_lock(&m_mutex);
+        if(m_Streams.find(uStreamId) != m_Streams.end()){
+            removeStream(m_Streams.find(uStreamId));
+        }
+        pthread_mutex_unlock(&m_mutex);
+        return INVALID_STREAM;
+    }
+    return uStreamId;
+}
+
+/**
+ * Closes a stream. The remote end is told unless it closed the stream
+ * first. Unread messages are dropped, and senders waiting for credit on
+ * the stream give up.
+ * @param uStreamId The stream
+ * @retval true The stream was closed
+ * @retval false There is no such stream
+ */
+bool CStreamMux::closeStream(unsigned uStreamId) {
+    StreamMap_t::iterator it;
+    bool bTell;
+
+    pthread_mutex_lock(&m_mutex);
+    it=m_Streams.find(uStreamId);
+    if(it == m_Streams.end()){
+        pthread_mutex_unlock(&m_mutex);
+        return false;
+    }
+    bTell=!it->second->bRemoteClosed;
+    removeStream(it);
+    pthread_cond_broadcast(&m_CreditCond);
+    pthread_mutex_unlock(&m_mutex);
+
+    if(bTell){
+        m_link.sendMuxFrame(KIND_CLOSE,uStreamId,NULL,0);
+    }
+    return true;
+}
+
+/**
+ * Sends a message on a stream. The message uses up credit; when there is
+ * not enough, this waits for the remote end to grant more.
+ * @param uStreamId The stream
+ * @param pBuffer Pointer to the message
+ * @param uLength Number of bytes in the message. Must fit in the window of
+ *        the remote end.
+ * @param nTimeoutMs Time to wait for credit in milliseconds. 0 does not
+ *        wait, -1 waits for ever.
+ * @retval true The message was sent
+ * @retval false There is no such stream, it was closed, the credit did not
+ *         come in time, or the message could not be sent
+ */
+bool CStreamMux::send(unsigned uStreamId,const unsigned char *pBuffer,unsigned uLength,int nTimeoutMs) {
+    StreamMap_t::iterator it;
+    struct timespec deadline;
+
+    if(nTimeoutMs > 0){
+        CTimer::getTime(deadline);
+        deadline.tv_sec+=nTimeoutMs/1000;
+        deadline.tv_nsec+=(nTimeoutMs%1000)*1000000L;
+        if(deadline.tv_nsec >= BILLION){
+            deadline.tv_sec++;
+            deadline.tv_nsec-=BILLION;
+        }
+    }
+
+    pthread_mutex_lock(&m_mutex);
+    for(;;){
+        //the stream can go away while we wait
+        it=m_Streams.find(uStreamId);
+        if(it == m_Streams.end() || it->second->bRemoteClosed){
+            pthread_mutex_unlock(&m_mutex);
+            PTRACE("Stream is closed\n");
+            return false;
+        }
+        if(it->second->uSendCredit >= uLength){
+            break;
+        }
+        if(nTimeoutMs == 0 ||
+           (nTimeoutMs > 0 && pthread_cond_timedwait(&m_CreditCond,&m_mutex,&deadline) == ETIMEDOUT)){
+            pthread_mutex_unlock(&m_mutex);
+            return false;
+        }
+        if(nTimeoutMs < 0){
+            pthread_cond_wait(&m_CreditCond,&m_mutex);
+        }
+    }
+    it->second->uSendCredit-=uLength;
+    pthread_mutex_unlock(&m_mutex);
+
+    return m_link.sendMuxFrame(KIND_DATA,uStreamId,pBuffer,uLength);
+}
+
+/**
+ * Takes the first message off a stream's queue. Once half the window has
+ * been taken, the remote end is granted that much more credit.
+ * @param uStreamId The stream
+ * @param[out] msg receives the message. The caller must delete[] msg.pData.
+ * @retval true A message was taken
+ * @retval false There is no such stream or no message on it
+ */
+bool CStreamMux::receive(unsigned uStreamId,CMessaging::Message_t &msg) {
+    StreamMap_t::iterator it;
+    unsigned long uGrant=0;
+    Stream_t *pStream;
+
+    pthread_mutex_lock(&m_mutex);
+    it=m_Streams.find(uStreamId);
+    if(it == m_Streams.end() || it->second->received.empty()){
+        pthread_mutex_unlock(&m_mutex);
+        return false;
+    }
+    pStream=it->second;
+    msg=pStream->received.front();
+    pStream->received.pop();
+    pStream->uConsumed+=msg.uMsgLength;
+    //grant in large steps, not a credit frame per message
+    if(pStream->uConsumed >= m_uWindow/2 && !pStream->bRemoteClosed){
+        uGrant=pStream->uConsumed;
+        pStream->uReceiveCredit+=uGrant;
+        pStream->uConsumed=0;
+    }
+    pthread_mutex_unlock(&m_mutex);
+
+    if(uGrant > 0){
+        sendCount(KIND_CREDIT,uStreamId,uGrant);
+    }
+    return true;
+}
+
+/**
+ * Returns the number of messages waiting on a stream
+ * @param uStreamId The stream
+ */
+unsigned CStreamMux::getMessageCount(unsigned uStreamId) {
+    StreamMap_t::iterator it;
+    unsigned uCount=0;
+
+    pthread_mutex_lock(&m_mutex);
+    it=m_Streams.find(uStreamId);
+    if(it != m_Streams.end()){
+        uCount=(unsigned)it->second->received.size();
+    }
+    pthread_mutex_unlock(&m_mutex);
+    return uCount;
+}
+
+/**
+ * Returns the number of bytes the stream may still send without waiting
+ * @param uStreamId The stream
+ */
+unsigned long CStreamMux::getSendCredit(unsigned uStreamId) {
+    StreamMap_t::iterator it;
+    unsigned long uCredit=0;
+
+    pthread_mutex_lock(&m_mutex);
+    it=m_Streams.find(uStreamId);
+    if(it != m_Streams.end()){
+        uCredit=it->second->uSendCredit;
+    }
+    pthread_mutex_unlock(&m_mutex);
+    return uCredit;
+}
+
+/**
+ * Returns true if the stream exists and the remote end did not close it
+ * @param uStreamId The stream
+ */
+bool CStreamMux::isOpen(unsigned uStreamId) {
+    StreamMap_t::iterator it;
+    bool bResults;
+
+    pthread_mutex_lock(&m_mutex);
+    it=m_Streams.find(uStreamId);
+    bResults=(it != m_Streams.end() && !it->second->bRemoteClosed);
+    pthread_mutex_unlock(&m_mutex);
+    return bResults;
+}
+
+/**
+ * Returns the number of streams, including the ones closed by the remote
+ * end that were not closed here yet
+ */
+unsigned CStreamMux::getStreamCount() {
+    unsigned uCount;
+
+    pthread_mutex_lock(&m_mutex);
+    uCount=(unsigned)m_Streams.size();
+    pthread_mutex_unlock(&m_mutex);
+    return uCount;
+}
+
+/**
+ * Creates the state of a stream
+ * @param uStreamId The stream
+ * @param uExtraCredit Credit granted by the remote end on top of INITIAL_CREDIT
+ * @return the new stream
+ */
+CStreamMux::Stream_t *CStreamMux::addStream(unsigned uStreamId,unsigned long uExtraCredit) {
+    Stream_t *pStream=new Stream_t;
+
+    pStream->uSendCredit=INITIAL_CREDIT+uExtraCredit;
+    pStream->uReceiveCredit=m_uWindow;
+    pStream->uConsumed=0;
+    pStream->bRemoteClosed=false;
+    m_Streams[uStreamId]=pStream;
+    return pStream;
+}
+
+/**
+ * Frees the state of a stream along with its unread messages
+ * @param it The stream
+ */
+void CStreamMux::removeStream(StreamMap_t::iterator it) {
+    Stream_t *pStream=it->second;
+
+    while(!pStream->received.empty()){
+        delete[] pStream->received.front().pData;
+        pStream->received.pop();
+    }
+    delete pStream;
+    m_Streams.erase(it);
+}
+
+/**
+ * Sends a mux frame whose body is a number of bytes
+ * @param uKind KIND_OPEN or KIND_CREDIT
+ * @param uStreamId The stream
+ * @param uCount Number of bytes of credit granted
+ * @retval true The frame was sent
+ * @retval false The frame could not be sent
+ */
+bool CStreamMux::sendCount(unsigned char uKind,unsigned uStreamId,unsigned long uCount) {
+    uint32_t uNetCount=htonl((uint32_t)uCount);
+
+    return m_link.sendMuxFrame(uKind,uStreamId,(const unsigned char*)&uNetCount,sizeof(uNetCount));
+}
+
+/**
+ * Handles a frame from the remote end
+ * @param uKind Kind of frame
+ * @param uStreamId Stream of the frame
+ * @param msg Body of the frame. Set to NULL when a stream queue keeps it.
+ */
+void CStreamMux::handleFrame(unsigned char uKind,unsigned uStreamId,CMessaging::Message_t &msg) {
+    StreamMap_t::iterator it;
+    Stream_t *pStream;
+    uint32_t uCount=0;
+    MuxNotify_t pNotify=NULL;
+    MuxEvent_t event=MuxReadable;
+    void *pNotifyUser;
+    bool bGrant=false;
+
+    if((uKind == KIND_OPEN || uKind == KIND_CREDIT) && msg.uMsgLength == sizeof(uCount)){
+        memcpy(&uCount,msg.pData,sizeof(uCount));
+        uCount=ntohl(uCount);
+    }
+
+    pthread_mutex_lock(&m_mutex);
+    pNotifyUser=m_pNotifyUser;
+    it=m_Streams.find(uStreamId);
+    if(uKind == KIND_OPEN){
+        if(it != m_Streams.end()){
+            PTRACE("Stream is open already\n");
+        } else {
+            addStream(uStreamId,uCount);
+            bGrant=(m_uWindow > INITIAL_CREDIT);
+            pNotify=m_pNotify;
+            event=MuxOpened;
+        }
+    } else if(it == m_Streams.end()){
+        //the stream was closed here while the frame was on its way
+    } else {
+        pStream=it->second;
+        switch(uKind){
+        case KIND_DATA:
+            if(msg.uMsgLength > pStream->uReceiveCredit){
+                PTRACE("Stream sent more than its credit\n");
+                break;
+            }
+            pStream->uReceiveCredit-=msg.uMsgLength;
+            pStream->received.push(msg);
+            msg.pData=NULL;
+            pNotify=m_pNotify;
+            event=MuxReadable;
+            break;
+        case KIND_CREDIT:
+            pStream->uSendCredit+=uCount;
+            pthread_cond_broadcast(&m_CreditCond);
+            break;
+        case KIND_CLOSE:
+            pStream->bRemoteClosed=true;
+            pthread_cond_broadcast(&m_CreditCond);
+            pNotify=m_pNotify;
+            event=MuxClosed;
+            break;
+        default:
+            PTRACE("Unknown mux frame\n");
+            break;
+        }
+    }
+    pthread_mutex_unlock(&m_mutex);
+
+    if(bGrant){
+        sendCount(KIND_CREDIT,uStreamId,m_uWindow-INITIAL_CREDIT);
+    }
+    if(pNotify != NULL){
+        pNotify(this,uStreamId,event,pNotifyUser);
+    }
+}
+
+/**
+ * Receives the mux frames of the connection
+ */
+void CStreamMux::muxHelper(unsigned char uKind,unsigned uTag,CMessaging::Message_t msg,void *pUser) {
+    ((CStreamMux*)pUser)->handleFrame(uKind,uTag,msg);
+    delete[] msg.pData;
+}
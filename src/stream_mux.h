@@ -0,0 +1,104 @@
+/**
+ * @file stream_mux.h
+ *
+ * @date   Oct 18, 2026
+ */
+
+#ifndef STREAMMUX_H
+#define STREAMMUX_H
+
+#include "Messaging.h"
+#include <pthread.h>
+#include <map>
+#include <queue>
+
+/**
+ * Runs any number of independent logical streams over one connection. Every
+ * frame carries the id of its stream (see CMessaging::sendMuxFrame()), every
+ * stream has its own receive queue, and every stream has its own credit
+ * based flow control: a sender may only have as many bytes in flight as
+ * the receiving end granted for that stream, and the receiver grants more
+ * as the application takes messages off the stream's queue. A stream whose
+ * reader falls behind therefore stalls its own sender only, and the
+ * connection keeps carrying the other streams.
+ *
+ * Opening a stream costs a single frame and no round trip: both ends start
+ * every stream with INITIAL_CREDIT bytes of credit, and a larger window is
+ * granted along with the open.
+ */
+class CStreamMux {
+public:
+    /** what happened on a stream */
+    typedef enum {MuxOpened,MuxReadable,MuxClosed} MuxEvent_t;
+    /**
+     * Called when the remote end opens a stream, when a message arrives on a
+     * stream and when the remote end closes a stream
+     *   pMux: multiplexer of the stream
+     *   uStreamId: the stream
+     *   event: what happened
+     *   pUser: pointer passed in during registration
+     **/
+    typedef void (*MuxNotify_t)(CStreamMux *pMux,unsigned uStreamId,MuxEvent_t event,void *pUser);
+    /** stream id that is never used */
+    enum {INVALID_STREAM=0};
+    /** credit every stream starts with, in both directions */
+    enum {INITIAL_CREDIT=16*1024};
+    /** default number of bytes a stream may have in flight */
+    enum {DEFAULT_WINDOW=64*1024};
+    /** kinds of mux frames */
+    enum {KIND_DATA=1,KIND_OPEN=2,KIND_CLOSE=3,KIND_CREDIT=4};
+
+    CStreamMux(CMessaging &link,bool bInitiator,unsigned uWindow=DEFAULT_WINDOW);
+    ~CStreamMux();
+
+    /** @brief registers the function told about stream events */
+    void registerNotify(MuxNotify_t pNotify,void *pUser);
+    /** @brief opens a stream */
+    unsigned openStream();
+    /** @brief closes a stream and drops its unread messages */
+    bool closeStream(unsigned uStreamId);
+    /** @brief sends a message on a stream once it has the credit for it */
+    bool send(unsigned uStreamId,const unsigned char *pBuffer,unsigned uLength,int nTimeoutMs=0);
+    /** @brief takes the first message off a stream's queue */
+    bool receive(unsigned uStreamId,CMessaging::Message_t &msg);
+    /** @brief returns the number of messages waiting on a stream */
+    unsigned getMessageCount(unsigned uStreamId);
+    /** @brief returns the number of bytes the stream may still send */
+    unsigned long getSendCredit(unsigned uStreamId);
+    /** @brief returns true if the stream exists and the remote end did not close it */
+    bool isOpen(unsigned uStreamId);
+    /** @brief returns the number of streams */
+    unsigned getStreamCount();
+
+protected:
+    /** state of one stream */
+    typedef struct {
+        std::queue<CMessaging::Message_t> received; /**< messages not taken yet */
+        unsigned long uSendCredit;    /**< bytes we may still send */
+        unsigned long uReceiveCredit; /**< bytes the remote end may still send */
+        unsigned long uConsumed;      /**< bytes taken off the queue and not granted again yet */
+        bool          bRemoteClosed;  /**< the remote end closed the stream */
+    } Stream_t;
+    typedef std::map<unsigned,Stream_t*> StreamMap_t;
+
+    CMessaging &    m_link;
+    StreamMap_t     m_Streams;
+    unsigned        m_uNextId;      /**< next id for a stream opened here */
+    unsigned long   m_uWindow;      /**< bytes each stream may have in flight towards us */
+    pthread_mutex_t m_mutex;        /**< protects the streams */
+    pthread_cond_t  m_CreditCond;   /**< signalled when credit comes in or a stream closes */
+    MuxNotify_t     m_pNotify;
+    void *          m_pNotifyUser;
+
+    /** @brief creates the state of a stream. Called with m_mutex held. */
+    Stream_t *addStream(unsigned uStreamId,unsigned long uExtraCredit);
+    /** @brief frees the state of a stream. Called with m_mutex held. */
+    void removeStream(StreamMap_t::iterator it);
+    /** @brief sends a credit or open frame carrying a number of bytes */
+    bool sendCount(unsigned char uKind,unsigned uStreamId,unsigned long uCount);
+    /** @brief handles a frame from the remote end */
+    void handleFrame(unsigned char uKind,unsigned uStreamId,CMessaging::Message_t &msg);
+    static void muxHelper(unsigned char uKind,unsigned uTag,CMessaging::Message_t msg,void *pUser);
+};
+
+#endif /* STREAMMUX_H */
@@ -0,0 +1,394 @@
+/**
+ * @file tcp_client_reactor.cpp
+ *
+ * @date   Oct 18, 2026
+ */
+
+#include "tcp_client_reactor.h"
+#include "Timer.h"
+#include "TRACE.h"
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+
+using namespace std;
+
+/**
+ * Class constructor
+ */
+CTcpClientReactor::CTcpClientReactor() {
+    pthread_mutexattr_t attr;
+
+    m_pConnectionCallback=NULL;
+    m_pConnectionUser=NULL;
+    m_bRunning=false;
+    m_bStop=false;
+
+    //callbacks run with the mutex held and may add or remove connections
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr,PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&m_mutex,&attr);
+    pthread_mutexattr_destroy(&attr);
+
+    if(pipe(m_WakeUpPipe) < 0){
+        PERROR1("Could not create wake up pipe. Reason: %s\n",strerror(errno));
+        m_WakeUpPipe[0]=m_WakeUpPipe[1]=-1;
+    } else {
+        fcntl(m_WakeUpPipe[0],F_SETFL,fcntl(m_WakeUpPipe[0],F_GETFL) | O_NONBLOCK);
+        fcntl(m_WakeUpPipe[1],F_SETFL,fcntl(m_WakeUpPipe[1],F_GETFL) | O_NONBLOCK);
+    }
+}
+
+/**
+ * Class destructor. The connections are not closed or deleted.
+ */
+CTcpClientReactor::~CTcpClientReactor() {
+    stop();
+    pthread_mutex_lock(&m_mutex);
+    for(unsigned i=0; i < m_Connections.size(); i++){
+        if(m_Connections[i].pConnection != NULL){
+            m_Connections[i].pConnection->setSendNotify(NULL,NULL);
+        }
+    }
+    m_Connections.clear();
+    pthread_mutex_unlock(&m_mutex);
+    if(m_WakeUpPipe[0] != -1){
+        close(m_WakeUpPipe[0]);
+        close(m_WakeUpPipe[1]);
+    }
+    pthread_mutex_destroy(&m_mutex);
+}
+
+/**
+ * Starts a non blocking connect and manages the connection once it is
+ * established. The outcome is reported through the connection callback.
+ * Messages sent before the connection is established are queued.
+ * @param pConnection connection to manage. It must stay valid until it is
+ *        removed or its ConnectFailed/Closed state is reported.
+ * @param sIpAddress Address of the server
+ * @param uPort Port address to connect to
+ * @param nTimeoutMs Number of milliseconds after which the connect is
+ *        given up (negative to let the kernel decide)
+ * @retval true The connect was started
+ * @retval false The connect failed right away
+ */
+bool CTcpClientReactor::connect(CTcpMessaging *pConnection,string sIpAddress,unsigned uPort,int nTimeoutMs) {
+    Entry_t entry;
+    struct timespec now,timeout;
+
+    pConnection->setQueuedSend(true);
+    if(!pConnection->startConnect(sIpAddress,uPort)){
+        return false;
+    }
+
+    entry.pConnection=pConnection;
+    entry.bConnecting=true;
+    entry.bDeadline=(nTimeoutMs >= 0);
+    if(entry.bDeadline){
+        CTimer::getTime(now);
+        timeout.tv_sec=nTimeoutMs/1000;
+        timeout.tv_nsec=(nTimeoutMs%1000)*MILLION;
+        entry.deadline=CTimer::add_timespec(now,timeout);
+    }
+
+    pthread_mutex_lock(&m_mutex);
+    pConnection->setSendNotify(sendNotify,this);
+    m_Connections.push_back(entry);
+    pthread_mutex_unlock(&m_mutex);
+    wakeUp();
+
+    return true;
+}
+
+/**
+ * Manages a connection that is already connected
+ * @param pConnection connection to manage. It must stay valid until it is
+ *        removed or its Closed state is reported.
+ * @retval true success
+ * @retval false the connection is not connected
+ */
+bool CTcpClientReactor::add(CTcpMessaging *pConnection) {
+    Entry_t entry;
+
+    if(!pConnection->isConnected()){
+        return false;
+    }
+    entry.pConnection=pConnection;
+    entry.bConnecting=false;
+    entry.bDeadline=false;
+
+    pConnection->setQueuedSend(true);
+    pthread_mutex_lock(&m_mutex);
+    pConnection->setSendNotify(sendNotify,this);
+    m_Connections.push_back(entry);
+    pthread_mutex_unlock(&m_mutex);
+    wakeUp();
+
+    return true;
+}
+
+/**
+ * Stops managing a connection. The connection is left open and the
+ * caller may delete it once this returns.
+ * @param pConnection connection to remove
+ */
+void CTcpClientReactor::remove(CTcpMessaging *pConnection) {
+    pthread_mutex_lock(&m_mutex);
+    for(unsigned i=0; i < m_Connections.size(); i++){
+        if(m_Connections[i].pConnection == pConnection){
+            pConnection->setSendNotify(NULL,NULL);
+            //the entry is dropped on the next iteration of the loop
+            m_Connections[i].pConnection=NULL;
+        }
+    }
+    pthread_mutex_unlock(&m_mutex);
+}
+
+/**
+ * Registers a callback function for connection state changes
+ * @param pCallback Pointer to Callback function
+ * @param pUser Pointer to user provided pointer passed back into the callback function
+ */
+void CTcpClientReactor::registerConnectionCallback(ConnectionCallback_t pCallback,void *pUser) {
+    m_pConnectionCallback=pCallback;
+    m_pConnectionUser=pUser;
+}
+
+/**
+ * Returns the number of managed connections
+ */
+unsigned CTcpClientReactor::getConnectionCount() {
+    unsigned uCount=0;
+
+    pthread_mutex_lock(&m_mutex);
+    for(unsigned i=0; i < m_Connections.size(); i++){
+        if(m_Connections[i].pConnection != NULL){
+            uCount++;
+        }
+    }
+    pthread_mutex_unlock(&m_mutex);
+
+    return uCount;
+}
+
+/**
+ * Stops managing a connection and reports its new state
+ * @param uIndex index of the connection
+ * @param state state to report
+ * @note must be called with the mutex held
+ */
+void CTcpClientReactor::closeEntry(unsigned uIndex,ConnectionState_t state) {
+    CTcpMessaging *pConnection=m_Connections[uIndex].pConnection;
+
+    m_Connections[uIndex].pConnection=NULL;
+    pConnection->setSendNotify(NULL,NULL);
+    pConnection->disconnect();
+    if(m_pConnectionCallback != NULL){
+        m_pConnectionCallback(pConnection,state,m_pConnectionUser);
+    }
+}
+
+/**
+ * Drops the removed entries from the connection list
+ * @note must be called with the mutex held
+ */
+void CTcpClientReactor::compact() {
+    unsigned uNext=0;
+
+    for(unsigned i=0; i < m_Connections.size(); i++){
+        if(m_Connections[i].pConnection != NULL){
+            m_Connections[uNext++]=m_Connections[i];
+        }
+    }
+    m_Connections.resize(uNext);
+}
+
+/**
+ * Runs a single iteration of the event loop: waits for any connection to
+ * become readable or writable, completes pending connects, writes queued
+ * send data and runs received data through the message processors.
+ * @param nTimeoutMs Number of milliseconds to wait for activity. Zero
+ *        polls without blocking and a negative value waits forever.
+ * @return Number of descriptors that had activity (zero on timeout)
+ * @retval -1 if error
+ */
+int CTcpClientReactor::runOnce(int nTimeoutMs) {
+    std::vector<struct pollfd> pollList;
+    struct pollfd pfd;
+    struct timespec now;
+    unsigned nPolled;
+    int nResults;
+    int nDeadlineMs;
+
+    pthread_mutex_lock(&m_mutex);
+    compact();
+    CTimer::getTime(now);
+
+    pfd.fd=m_WakeUpPipe[0];
+    pfd.events=POLLIN;
+    pfd.revents=0;
+    pollList.push_back(pfd);
+    for(unsigned i=0; i < m_Connections.size(); i++){
+        Entry_t &entry=m_Connections[i];
+        pfd.fd=entry.pConnection->getHandle();
+        if(entry.pConnection->isConnecting()){
+            pfd.events=POLLOUT;
+        } else {
+            pfd.events=POLLIN;
+            if(entry.pConnection->hasPendingSend()){
+                pfd.events|=POLLOUT;
+            }
+        }
+        //connections that finished connecting right away are reported now
+        if(entry.bConnecting && !entry.pConnection->isConnecting()){
+            nTimeoutMs=0;
+        }
+        //do not sleep past a connect deadline
+        if(entry.bConnecting && entry.bDeadline){
+            if(CTimer::comp_timespec(entry.deadline,now) <= 0){
+                nDeadlineMs=0;
+            } else {
+                nDeadlineMs=(int)CTimer::timespec2ms(CTimer::diff_timespec(entry.deadline,now))+1;
+            }
+            if(nTimeoutMs < 0 || nDeadlineMs < nTimeoutMs){
+                nTimeoutMs=nDeadlineMs;
+            }
+        }
+        pollList.push_back(pfd);
+    }
+    nPolled=m_Connections.size();
+    pthread_mutex_unlock(&m_mutex);
+
+    nResults=poll(&pollList[0],pollList.size(),nTimeoutMs);
+    if(nResults < 0){
+        if(errno == EINTR){
+            return 0;
+        }
+        PERROR1("poll failed. Reason: %s\n",strerror(errno));
+        return -1;
+    }
+
+    //drain the wake up pipe
+    if(pollList[0].revents & POLLIN){
+        char buffer[64];
+        while(read(m_WakeUpPipe[0],buffer,sizeof(buffer)) > 0);
+    }
+
+    pthread_mutex_lock(&m_mutex);
+    CTimer::getTime(now);
+    for(unsigned i=0; i < nPolled; i++){
+        short revents=pollList[i+1].revents;
+        CTcpMessaging *pConnection=m_Connections[i].pConnection;
+
+        //removed while we were waiting
+        if(pConnection == NULL){
+            continue;
+        }
+
+        if(m_Connections[i].bConnecting){
+            int nConnect=1;
+            if(pConnection->isConnecting()){
+                nConnect=(revents != 0) ? pConnection->finishConnect(0) : 0;
+            }
+            if(nConnect == 0 && m_Connections[i].bDeadline &&
+                    CTimer::comp_timespec(m_Connections[i].deadline,now) <= 0){
+                PTRACE1("Connect to %s timed out\n",pConnection->getSIpAddress().c_str());
+                nConnect=-1;
+            }
+            if(nConnect < 0){
+                closeEntry(i,ConnectFailed);
+            } else if(nConnect > 0){
+                m_Connections[i].bConnecting=false;
+                if(m_pConnectionCallback != NULL){
+                    m_pConnectionCallback(pConnection,Connected,m_pConnectionUser);
+                }
+            }
+            continue;
+        }
+
+        if(revents & (POLLIN|POLLHUP|POLLERR)){
+            if(pConnection->readAvailable() < 0){
+                closeEntry(i,Closed);
+                continue;
+            }
+        }
+        //the callbacks above may have removed the connection
+        if(m_Connections[i].pConnection == NULL){
+            continue;
+        }
+        if(revents & POLLOUT){
+            if(pConnection->flushSendQueue() < 0){
+                closeEntry(i,Closed);
+            }
+        }
+    }
+    pthread_mutex_unlock(&m_mutex);
+
+    return nResults;
+}
+
+/**
+ * Wakes up the event loop so that it picks up new connections or send data
+ */
+void CTcpClientReactor::wakeUp() {
+    char byte=0;
+
+    if(m_WakeUpPipe[1] != -1){
+        //a full pipe already guarantees a wake up
+        if(write(m_WakeUpPipe[1],&byte,sizeof(byte)) < 0){
+            return;
+        }
+    }
+}
+
+/**
+ * Called by the connections when data is placed on their send queue
+ */
+void CTcpClientReactor::sendNotify(CTcpMessaging *pConnection,void *pUser) {
+    CTcpClientReactor *pReactor=(CTcpClientReactor *)pUser;
+
+    UNUSED(pConnection);
+    pReactor->wakeUp();
+}
+
+/**
+ * Starts a thread that runs the event loop
+ * @retval true Success
+ * @retval false failure
+ */
+bool CTcpClientReactor::start() {
+    if(m_bRunning){
+        return true;
+    }
+    m_bStop=false;
+    m_bRunning=(pthread_create(&m_threadId,NULL,threadHelper,this) == 0);
+    return m_bRunning;
+}
+
+/**
+ * Stops the event loop thread and waits for it to exit
+ */
+void CTcpClientReactor::stop() {
+    if(!m_bRunning){
+        return;
+    }
+    m_bStop=true;
+    wakeUp();
+    pthread_join(m_threadId,NULL);
+    m_bRunning=false;
+}
+
+/**
+ * Helper function for running the event loop thread
+ */
+void *CTcpClientReactor::threadHelper(void *pUser) {
+    CTcpClientReactor *pReactor=(CTcpClientReactor *)pUser;
+
+    while(!pReactor->m_bStop){
+        if(pReactor->runOnce(-1) < 0){
+            break;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,82 @@
+/**
+ * @file tcp_client_reactor.h
+ *
+ * @date   Oct 18, 2026
+ */
+
+#ifndef TCPCLIENTREACTOR_H
+#define TCPCLIENTREACTOR_H
+
+#include "tcp_messaging.h"
+#include <pthread.h>
+#include <vector>
+
+/**
+ * Event loop that drives many outbound CTcpMessaging connections from a
+ * single thread. Connections are established without blocking, queued
+ * send data is written when the sockets become writable and received data
+ * is run through each connection's own message processor, which places
+ * complete messages on its queue or hands them to its message callback.
+ */
+class CTcpClientReactor {
+public:
+    /** connection state changes reported to the connection callback */
+    typedef enum {Connected,ConnectFailed,Closed} ConnectionState_t;
+    /**
+     *  pConnection: connection whose state changed
+     *  state: the new state. The connection is no longer managed by the
+     *         reactor after ConnectFailed and Closed.
+     *  pUser: pointer passed in during registration
+     **/
+    typedef void (*ConnectionCallback_t)(CTcpMessaging *pConnection,ConnectionState_t state,void *pUser);
+
+    CTcpClientReactor();
+    ~CTcpClientReactor();
+
+    /** @brief starts a non blocking connect and manages the connection */
+    bool connect(CTcpMessaging *pConnection,std::string sIpAddress,unsigned uPort,int nTimeoutMs=-1);
+    /** @brief manages a connection that is already connected */
+    bool add(CTcpMessaging *pConnection);
+    /** @brief stops managing a connection */
+    void remove(CTcpMessaging *pConnection);
+    /** @brief registers a callback function for connection state changes */
+    void registerConnectionCallback(ConnectionCallback_t pCallback,void *pUser);
+    /** @brief runs a single iteration of the event loop */
+    int  runOnce(int nTimeoutMs);
+    /** @brief wakes up the event loop */
+    void wakeUp();
+    /** @brief starts a thread that runs the event loop */
+    bool start();
+    /** @brief stops the event loop thread */
+    void stop();
+    /** @brief returns the number of managed connections */
+    unsigned getConnectionCount();
+
+protected:
+    /** managed connection */
+    typedef struct {
+        CTcpMessaging  *pConnection;  /**< NULL once the entry was removed */
+        struct timespec deadline;     /**< time at which a pending connect is given up */
+        bool            bDeadline;    /**< set if the connect has a deadline */
+        bool            bConnecting;  /**< set until the connect outcome was reported */
+    } Entry_t;
+
+    std::vector<Entry_t> m_Connections;
+    pthread_mutex_t      m_mutex;          /**< protects the connection list */
+    int                  m_WakeUpPipe[2];  /**< used to wake up the poll from other threads */
+    ConnectionCallback_t m_pConnectionCallback;
+    void *               m_pConnectionUser;
+    pthread_t            m_threadId;
+    bool                 m_bRunning;
+    volatile bool        m_bStop;
+
+    /** @brief removes an entry and reports the new state */
+    void closeEntry(unsigned uIndex,ConnectionState_t state);
+    /** @brief drops removed entries from the connection list */
+    void compact();
+
+    static void sendNotify(CTcpMessaging *pConnection,void *pUser);
+    static void *threadHelper(void *pUser);
+};
+
+#endif /* TCPCLIENTREACTOR_H */
@@ -0,0 +1,308 @@
+/**
+ * @file tcp_connection_pool.cpp
+ *
+ * @date   Oct 18, 2026
+ */
+
+#include "tcp_connection_pool.h"
+#include "Timer.h"
+#include "TRACE.h"
+#include <sys/socket.h>
+#include <poll.h>
+#include <errno.h>
+
+using namespace std;
+
+/**
+ * Class constructor. No connections are made until start() or maintain()
+ * is called.
+ * @param sIpAddress Address of the server
+ * @param uPort Port of the server
+ * @param uPoolSize Number of connections to keep open
+ * @param uConnectTimeoutMs Number of milliseconds to wait for a connection
+ * @param uHealthCheckIntervalMs Number of milliseconds between health checks
+ */
+CTcpConnectionPool::CTcpConnectionPool(string sIpAddress,unsigned uPort,unsigned uPoolSize,
+                                       unsigned uConnectTimeoutMs,unsigned uHealthCheckIntervalMs) {
+    Slot_t slot;
+
+    m_sIpAddress=sIpAddress;
+    m_uPort=uPort;
+    m_uConnectTimeoutMs=uConnectTimeoutMs;
+    m_uHealthCheckIntervalMs=uHealthCheckIntervalMs;
+    m_bRunning=false;
+    m_bStop=false;
+    m_bRepairPending=false;
+
+    pthread_mutex_init(&m_mutex,NULL);
+    pthread_cond_init(&m_wakeUp,NULL);
+
+    for(unsigned i=0; i < uPoolSize; i++){
+        slot.pConnection=new CTcpMessaging();
+        slot.state=Broken;
+        m_Slots.push_back(slot);
+    }
+}
+
+/**
+ * Class destructor
+ */
+CTcpConnectionPool::~CTcpConnectionPool() {
+    stop();
+    for(unsigned i=0; i < m_Slots.size(); i++){
+        delete m_Slots[i].pConnection;
+    }
+    m_Slots.clear();
+    pthread_cond_destroy(&m_wakeUp);
+    pthread_mutex_destroy(&m_mutex);
+}
+
+/**
+ * Starts the background thread which opens the connections and keeps
+ * them healthy
+ * @retval true Success
+ * @retval false failure
+ */
+bool CTcpConnectionPool::start() {
+    if(m_bRunning){
+        return true;
+    }
+    m_bStop=false;
+    m_bRunning=(pthread_create(&m_threadId,NULL,threadHelper,this) == 0);
+    return m_bRunning;
+}
+
+/**
+ * Stops the background thread and waits for it to exit
+ */
+void CTcpConnectionPool::stop() {
+    if(!m_bRunning){
+        return;
+    }
+    pthread_mutex_lock(&m_mutex);
+    m_bStop=true;
+    pthread_cond_signal(&m_wakeUp);
+    pthread_mutex_unlock(&m_mutex);
+    pthread_join(m_threadId,NULL);
+    m_bRunning=false;
+}
+
+/**
+ * Checks whether the server closed an idle connection
+ * @param pConnection connection to check
+ * @retval true The connection is usable
+ * @retval false The connection was closed or has an error
+ */
+bool CTcpConnectionPool::isHealthy(CTcpMessaging *pConnection) {
+    struct pollfd pfd;
+    unsigned char byte;
+
+    if(!pConnection->isConnected()){
+        return false;
+    }
+    pfd.fd=pConnection->getHandle();
+    pfd.events=POLLIN;
+    pfd.revents=0;
+    if(poll(&pfd,1,0) < 0){
+        return errno == EINTR;
+    }
+    if(pfd.revents & (POLLERR|POLLHUP|POLLNVAL)){
+        return false;
+    }
+    if(pfd.revents & POLLIN){
+        //a zero length read means the server closed the connection
+        int nResults=recv(pfd.fd,&byte,sizeof(byte),MSG_PEEK|MSG_DONTWAIT);
+        if(nResults == 0 || (nResults < 0 && errno != EAGAIN && errno != EWOULDBLOCK)){
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Runs one maintenance pass: idle connections closed by the server are
+ * marked as broken and all broken connections are re-established in
+ * parallel. This is called periodically by the background thread, but can
+ * also be called directly when the pool is driven without the thread.
+ */
+void CTcpConnectionPool::maintain() {
+    std::vector<unsigned> connecting;
+    struct timespec start,now;
+    int nRemainingMs;
+
+    pthread_mutex_lock(&m_mutex);
+    for(unsigned i=0; i < m_Slots.size(); i++){
+        if(m_Slots[i].state == Idle && !isHealthy(m_Slots[i].pConnection)){
+            PTRACE1("Connection %u to the server was lost\n",i);
+            m_Slots[i].state=Broken;
+        }
+        if(m_Slots[i].state == Broken){
+            m_Slots[i].state=Connecting;
+            connecting.push_back(i);
+        }
+    }
+    pthread_mutex_unlock(&m_mutex);
+
+    if(connecting.empty()){
+        return;
+    }
+
+    //the slots are marked as connecting, so nobody else touches them
+    for(unsigned i=0; i < connecting.size(); i++){
+        CTcpMessaging *pConnection=m_Slots[connecting[i]].pConnection;
+        pConnection->disconnect();
+        pConnection->startConnect(m_sIpAddress,m_uPort);
+    }
+    CTimer::getTime(start);
+    for(unsigned i=0; i < connecting.size(); i++){
+        CTcpMessaging *pConnection=m_Slots[connecting[i]].pConnection;
+        CTimer::getTime(now);
+        nRemainingMs=(int)m_uConnectTimeoutMs-(int)CTimer::timespec2ms(CTimer::diff_timespec(now,start));
+        if(nRemainingMs < 0){
+            nRemainingMs=0;
+        }
+        if(pConnection->isConnecting() && pConnection->finishConnect(nRemainingMs) != 1){
+            pConnection->disconnect();
+        }
+    }
+
+    pthread_mutex_lock(&m_mutex);
+    for(unsigned i=0; i < connecting.size(); i++){
+        Slot_t &slot=m_Slots[connecting[i]];
+        slot.state=slot.pConnection->isConnected() ? Idle : Broken;
+    }
+    pthread_mutex_unlock(&m_mutex);
+}
+
+/**
+ * Hands out an idle connection. This never waits for a connection to be
+ * established.
+ * @return connection to send on. It must be given back with release().
+ * @retval NULL if no connection is available
+ */
+CTcpMessaging *CTcpConnectionPool::acquire() {
+    CTcpMessaging *pConnection=NULL;
+
+    pthread_mutex_lock(&m_mutex);
+    for(unsigned i=0; i < m_Slots.size(); i++){
+        if(m_Slots[i].state == Idle){
+            m_Slots[i].state=InUse;
+            pConnection=m_Slots[i].pConnection;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&m_mutex);
+
+    return pConnection;
+}
+
+/**
+ * Gives a connection back to the pool
+ * @param pConnection connection returned by acquire()
+ * @param bHealthy set to false if the connection failed while in use, so
+ *        that the background thread re-establishes it right away
+ */
+void CTcpConnectionPool::release(CTcpMessaging *pConnection,bool bHealthy) {
+    pthread_mutex_lock(&m_mutex);
+    for(unsigned i=0; i < m_Slots.size(); i++){
+        if(m_Slots[i].pConnection == pConnection){
+            if(bHealthy && pConnection->isConnected()){
+                m_Slots[i].state=Idle;
+            } else {
+                m_Slots[i].state=Broken;
+                //the flag is seen even if the thread is in a pass right now
+                m_bRepairPending=true;
+                pthread_cond_signal(&m_wakeUp);
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&m_mutex);
+}
+
+/**
+ * Sends a message over one of the idle connections
+ * @param pMsg Pointer to the message
+ * @param uLength Number of bytes in the message
+ * @retval true Message was sent successfully
+ * @retval false No connection was available or the send failed
+ */
+bool CTcpConnectionPool::sendMessage(const unsigned char *pMsg,unsigned uLength) {
+    CTcpMessaging *pConnection=acquire();
+    bool bResults;
+
+    if(pConnection == NULL){
+        PTRACE2("No connection available to %s:%u\n",m_sIpAddress.c_str(),m_uPort);
+        return false;
+    }
+    bResults=pConnection->sendMessage(pMsg,uLength);
+    release(pConnection,bResults);
+
+    return bResults;
+}
+
+/**
+ * Returns the number of connections that are ready to be handed out
+ */
+unsigned CTcpConnectionPool::getIdleCount() {
+    unsigned uCount=0;
+
+    pthread_mutex_lock(&m_mutex);
+    for(unsigned i=0; i < m_Slots.size(); i++){
+        if(m_Slots[i].state == Idle){
+            uCount++;
+        }
+    }
+    pthread_mutex_unlock(&m_mutex);
+
+    return uCount;
+}
+
+/**
+ * Returns the number of connections that are handed out. A pool without an
+ * idle connection but with connections in use is busy, not broken.
+ */
+unsigned CTcpConnectionPool::getInUseCount() {
+    unsigned uCount=0;
+
+    pthread_mutex_lock(&m_mutex);
+    for(unsigned i=0; i < m_Slots.size(); i++){
+        if(m_Slots[i].state == InUse){
+            uCount++;
+        }
+    }
+    pthread_mutex_unlock(&m_mutex);
+
+    return uCount;
+}
+
+/**
+ * Background thread: runs a maintenance pass every health check interval,
+ * or right away when a connection is reported broken
+ */
+void *CTcpConnectionPool::threadHelper(void *pUser) {
+    CTcpConnectionPool *pPool=(CTcpConnectionPool *)pUser;
+    struct timespec now,interval,timeout;
+
+    interval.tv_sec=pPool->m_uHealthCheckIntervalMs/1000;
+    interval.tv_nsec=(pPool->m_uHealthCheckIntervalMs%1000)*MILLION;
+
+    for(;;){
+        pPool->maintain();
+
+        pthread_mutex_lock(&pPool->m_mutex);
+        if(!pPool->m_bStop && !pPool->m_bRepairPending){
+            clock_gettime(CLOCK_REALTIME,&now);
+            timeout=CTimer::add_timespec(now,interval);
+            pthread_cond_timedwait(&pPool->m_wakeUp,&pPool->m_mutex,&timeout);
+        }
+        //cleared before the next pass, so a report during that pass is kept
+        pPool->m_bRepairPending=false;
+        if(pPool->m_bStop){
+            pthread_mutex_unlock(&pPool->m_mutex);
+            break;
+        }
+        pthread_mutex_unlock(&pPool->m_mutex);
+    }
+    return NULL;
+}
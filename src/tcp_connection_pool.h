@@ -0,0 +1,79 @@
+/**
+ * @file tcp_connection_pool.h
+ *
+ * @date   Oct 18, 2026
+ */
+
+#ifndef TCPCONNECTIONPOOL_H
+#define TCPCONNECTIONPOOL_H
+
+#include "tcp_messaging.h"
+#include <pthread.h>
+#include <vector>
+
+/**
+ * Keeps a number of warm connections to a single server. Idle connections
+ * are handed out to senders and returned when done. A background thread
+ * checks the health of the idle connections and re-establishes broken ones,
+ * so senders never wait for a connection to be set up.
+ */
+class CTcpConnectionPool {
+public:
+    /** default number of milliseconds to wait for a connection */
+    enum {DEFAULT_CONNECT_TIMEOUT=1000};
+    /** default number of milliseconds between health checks */
+    enum {DEFAULT_HEALTH_CHECK_INTERVAL=1000};
+
+    CTcpConnectionPool(std::string sIpAddress,unsigned uPort,unsigned uPoolSize,
+                       unsigned uConnectTimeoutMs=DEFAULT_CONNECT_TIMEOUT,
+                       unsigned uHealthCheckIntervalMs=DEFAULT_HEALTH_CHECK_INTERVAL);
+    ~CTcpConnectionPool();
+
+    /** @brief starts the thread that keeps the connections warm */
+    bool start();
+    /** @brief stops the background thread */
+    void stop();
+    /** @brief checks the idle connections and re-establishes broken ones */
+    void maintain();
+    /** @brief returns an idle connection or NULL if none is available */
+    CTcpMessaging *acquire();
+    /** @brief returns a connection to the pool */
+    void release(CTcpMessaging *pConnection,bool bHealthy=true);
+    /** @brief sends a message over one of the idle connections */
+    bool sendMessage(const unsigned char *pMsg,unsigned uLength);
+    /** @brief returns the number of connections ready to be handed out */
+    unsigned getIdleCount();
+    /** @brief returns the number of connections handed out and not returned */
+    unsigned getInUseCount();
+
+    unsigned           getSize()      const {  return (unsigned)m_Slots.size(); }
+    const std::string& getIpAddress() const {  return m_sIpAddress;  }
+    unsigned           getPort()      const {  return m_uPort;       }
+
+protected:
+    /** state of a pooled connection */
+    typedef enum {Idle,InUse,Broken,Connecting} SlotState_t;
+    /** pooled connection */
+    typedef struct {
+        CTcpMessaging *pConnection;
+        SlotState_t    state;
+    } Slot_t;
+
+    std::string          m_sIpAddress;
+    unsigned             m_uPort;
+    unsigned             m_uConnectTimeoutMs;
+    unsigned             m_uHealthCheckIntervalMs;
+    std::vector<Slot_t>  m_Slots;
+    pthread_mutex_t      m_mutex;           /**< protects the slot list */
+    pthread_cond_t       m_wakeUp;          /**< wakes up the background thread */
+    pthread_t            m_threadId;
+    bool                 m_bRunning;        /**< set while the background thread is running */
+    bool                 m_bStop;           /**< tells the background thread to exit */
+    bool                 m_bRepairPending;  /**< a connection was reported broken since the last pass */
+
+    /** @brief returns false if the connection was closed by the server */
+    static bool isHealthy(CTcpMessaging *pConnection);
+    static void *threadHelper(void *pUser);
+};
+
+#endif /* TCPCONNECTIONPOOL_H */
@@ -0,0 +1,514 @@
+/**
+ * @file tcp_load_balancer.cpp
+ *
+ * @date   Oct 18, 2026
+ */
+
+#include "tcp_load_balancer.h"
+#include "Timer.h"
+#include "TRACE.h"
+#include <stdio.h>
+
+using namespace std;
+
+/**
+ * Class constructor
+ * @param uPoolSize Number of connections kept open to each server
+ * @param uVirtualNodes Number of points each server gets on the hash ring.
+ *        More points spread the keys more evenly.
+ * @param uConnectTimeoutMs Number of milliseconds to wait for a connection
+ * @param uHealthCheckIntervalMs Number of milliseconds between health
+ *        checks. A failed server is not tried again before this much time
+ *        has passed.
+ */
+CTcpLoadBalancer::CTcpLoadBalancer(unsigned uPoolSize,unsigned uVirtualNodes,
+                                   unsigned uConnectTimeoutMs,unsigned uHealthCheckIntervalMs) {
+    m_uPoolSize=uPoolSize;
+    m_uVirtualNodes=uVirtualNodes;
+    m_uConnectTimeoutMs=uConnectTimeoutMs;
+    m_uHealthCheckIntervalMs=uHealthCheckIntervalMs;
+    m_uNextEndpoint=0;
+    m_bRunning=false;
+    pthread_mutex_init(&m_mutex,NULL);
+}
+
+/**
+ * Class destructor
+ */
+CTcpLoadBalancer::~CTcpLoadBalancer() {
+    stop();
+    for(unsigned i=0; i < m_Endpoints.size(); i++){
+        if(m_Endpoints[i] != NULL){
+            delete m_Endpoints[i]->pPool;
+            delete m_Endpoints[i];
+        }
+    }
+    m_Endpoints.clear();
+    pthread_mutex_destroy(&m_mutex);
+}
+
+/**
+ * Hashes a key with the 32 bit FNV-1a hash followed by a final mix, so
+ * that similar keys end up far apart on the ring
+ * @param pKey Pointer to the key
+ * @param uKeyLength Number of bytes in the key
+ * @return hash of the key
+ */
+unsigned CTcpLoadBalancer::hashKey(const unsigned char *pKey,unsigned uKeyLength) {
+    unsigned uHash=2166136261u;
+
+    for(unsigned i=0; i < uKeyLength; i++){
+        uHash^=pKey[i];
+        uHash*=16777619u;
+    }
+    uHash^=uHash >> 16;
+    uHash*=0x85ebca6bu;
+    uHash^=uHash >> 13;
+    uHash*=0xc2b2ae35u;
+    uHash^=uHash >> 16;
+    return uHash;
+}
+
+/**
+ * Adds a server. Its points are placed on the hash ring right away, which
+ * moves only the keys that now belong to the new server. If the balancer
+ * is running, the pool of the new server is started as well.
+ * @param sIpAddress Address of the server
+ * @param uPort Port of the server
+ * @return endpoint number used by the other functions
+ */
+int CTcpLoadBalancer::addEndpoint(string sIpAddress,unsigned uPort) {
+    Endpoint_t *pEndpoint=new Endpoint_t;
+    char name[64];
+    int nEndpoint;
+
+    pEndpoint->sIpAddress=sIpAddress;
+    pEndpoint->uPort=uPort;
+    pEndpoint->pPool=new CTcpConnectionPool(sIpAddress,uPort,m_uPoolSize,
+                                            m_uConnectTimeoutMs,m_uHealthCheckIntervalMs);
+    pEndpoint->uOutstanding=0;
+    pEndpoint->bInRotation=true;
+    CTimer::getTime(pEndpoint->RetryTime);
+
+    pthread_mutex_lock(&m_mutex);
+    nEndpoint=(int)m_Endpoints.size();
+    m_Endpoints.push_back(pEndpoint);
+    for(unsigned i=0; i < m_uVirtualNodes; i++){
+        snprintf(name,sizeof(name),"%s:%u#%u",sIpAddress.c_str(),uPort,i);
+        //on a collision the point stays with the server that had it first
+        m_Ring.insert(Ring_t::value_type(hashKey((const unsigned char*)name,(unsigned)strlen(name)),nEndpoint));
+    }
+    if(m_bRunning){
+        pEndpoint->pPool->start();
+    }
+    pthread_mutex_unlock(&m_mutex);
+
+    return nEndpoint;
+}
+
+/**
+ * Removes a server from the ring and closes its connections. The keys of
+ * the server move to the next servers on the ring. Must not be called
+ * while maintain() runs on another thread.
+ * @param nEndpoint Endpoint number returned by addEndpoint()
+ * @retval true The server was removed
+ * @retval false The endpoint is invalid or has connections handed out
+ */
+bool CTcpLoadBalancer::removeEndpoint(int nEndpoint) {
+    Endpoint_t *pEndpoint;
+    Ring_t::iterator it;
+
+    pthread_mutex_lock(&m_mutex);
+    if(nEndpoint < 0 || nEndpoint >= (int)m_Endpoints.size() ||
+            m_Endpoints[nEndpoint] == NULL || m_Endpoints[nEndpoint]->uOutstanding > 0){
+        pthread_mutex_unlock(&m_mutex);
+        return false;
+    }
+    pEndpoint=m_Endpoints[nEndpoint];
+    m_Endpoints[nEndpoint]=NULL;
+    for(it=m_Ring.begin(); it != m_Ring.end(); ){
+        if(it->second == nEndpoint){
+            m_Ring.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+    pthread_mutex_unlock(&m_mutex);
+
+    delete pEndpoint->pPool;
+    delete pEndpoint;
+    return true;
+}
+
+/**
+ * Starts the pools of all the servers. Each pool keeps its connections
+ * warm from a background thread.
+ * @retval true Success
+ * @retval false At least one pool could not be started
+ */
+bool CTcpLoadBalancer::start() {
+    bool bResults=true;
+
+    pthread_mutex_lock(&m_mutex);
+    m_bRunning=true;
+    for(unsigned i=0; i < m_Endpoints.size(); i++){
+        if(m_Endpoints[i] != NULL && !m_Endpoints[i]->pPool->start()){
+            bResults=false;
+        }
+    }
+    pthread_mutex_unlock(&m_mutex);
+
+    return bResults;
+}
+
+/**
+ * Stops the pools of all the servers
+ */
+void CTcpLoadBalancer::stop() {
+    pthread_mutex_lock(&m_mutex);
+    m_bRunning=false;
+    for(unsigned i=0; i < m_Endpoints.size(); i++){
+        if(m_Endpoints[i] != NULL){
+            m_Endpoints[i]->pPool->stop();
+        }
+    }
+    pthread_mutex_unlock(&m_mutex);
+}
+
+/**
+ * Runs one maintenance pass on the pools of all the servers. Only needed
+ * when the balancer is driven without calling start().
+ */
+void CTcpLoadBalancer::maintain() {
+    vector<CTcpConnectionPool*> pools;
+
+    pthread_mutex_lock(&m_mutex);
+    for(unsigned i=0; i < m_Endpoints.size(); i++){
+        if(m_Endpoints[i] != NULL){
+            pools.push_back(m_Endpoints[i]->pPool);
+        }
+    }
+    pthread_mutex_unlock(&m_mutex);
+
+    //connecting can take a while, so senders are not held up
+    for(unsigned i=0; i < pools.size(); i++){
+        pools[i]->maintain();
+    }
+}
+
+/**
+ * Checks whether a server may take traffic. A failed server comes back
+ * into rotation once the retry time passed and its pool has connections.
+ * Must be called with the mutex held.
+ * @param nEndpoint Endpoint number
+ */
+bool CTcpLoadBalancer::isAvailable(int nEndpoint) {
+    Endpoint_t *pEndpoint=m_Endpoints[nEndpoint];
+    struct timespec now;
+
+    if(pEndpoint == NULL){
+        return false;
+    }
+    if(!pEndpoint->bInRotation){
+        CTimer::getTime(now);
+        if(CTimer::comp_timespec(now,pEndpoint->RetryTime) < 0 ||
+                pEndpoint->pPool->getIdleCount() == 0){
+            return false;
+        }
+        PTRACE2("%s:%u is back in rotation\n",pEndpoint->sIpAddress.c_str(),pEndpoint->uPort);
+        pEndpoint->bInRotation=true;
+    }
+    return true;
+}
+
+/**
+ * Takes a server out of rotation for at least one health check interval.
+ * Must be called with the mutex held.
+ * @param nEndpoint Endpoint number
+ */
+void CTcpLoadBalancer::failEndpoint(int nEndpoint) {
+    Endpoint_t *pEndpoint=m_Endpoints[nEndpoint];
+    struct timespec now,delay;
+
+    if(pEndpoint->bInRotation){
+        PTRACE2("%s:%u taken out of rotation\n",pEndpoint->sIpAddress.c_str(),pEndpoint->uPort);
+    }
+    pEndpoint->bInRotation=false;
+    CTimer::getTime(now);
+    delay.tv_sec=m_uHealthCheckIntervalMs/1000;
+    delay.tv_nsec=(m_uHealthCheckIntervalMs%1000)*MILLION;
+    pEndpoint->RetryTime=CTimer::add_timespec(now,delay);
+}
+
+/**
+ * Takes a connection from the pool of a server. A server whose pool has no
+ * connection at all is taken out of rotation. A server whose connections
+ * are all in use is only busy: it stays in rotation and keeps its keys.
+ * Must be called with the mutex held.
+ * @param nEndpoint Endpoint number
+ * @retval NULL if the pool had no idle connection
+ */
+CTcpMessaging *CTcpLoadBalancer::acquireFrom(int nEndpoint) {
+    Endpoint_t *pEndpoint=m_Endpoints[nEndpoint];
+    CTcpMessaging *pConnection=pEndpoint->pPool->acquire();
+
+    if(pConnection == NULL){
+        if(pEndpoint->pPool->getInUseCount() == 0){
+            failEndpoint(nEndpoint);
+        }
+        return NULL;
+    }
+    m_Acquired[pConnection]=nEndpoint;
+    pEndpoint->uOutstanding++;
+    return pConnection;
+}
+
+/**
+ * Walks the ring clockwise from a hash to the first server that is in
+ * rotation. Must be called with the mutex held.
+ * @param uHash Hash of the key
+ * @param excluded Servers that must be skipped
+ * @return endpoint number
+ * @retval INVALID_ENDPOINT if no server is available
+ */
+int CTcpLoadBalancer::findOnRing(unsigned uHash,const vector<bool> &excluded) {
+    vector<bool> checked(m_Endpoints.size(),false);
+    Ring_t::iterator it;
+    unsigned uRemaining=(unsigned)m_Endpoints.size();
+
+    if(m_Ring.empty()){
+        return INVALID_ENDPOINT;
+    }
+    it=m_Ring.lower_bound(uHash);
+    for(size_t i=0; i < m_Ring.size() && uRemaining > 0; i++, ++it){
+        if(it == m_Ring.end()){
+            it=m_Ring.begin();
+        }
+        if(checked[it->second]){
+            continue;
+        }
+        checked[it->second]=true;
+        uRemaining--;
+        if(!excluded[it->second] && isAvailable(it->second)){
+            return it->second;
+        }
+    }
+    return INVALID_ENDPOINT;
+}
+
+/**
+ * Returns the server a key is currently routed to
+ * @param pKey Pointer to the key
+ * @param uKeyLength Number of bytes in the key
+ * @return endpoint number
+ * @retval INVALID_ENDPOINT if no server is available
+ */
+int CTcpLoadBalancer::findEndpoint(const unsigned char *pKey,unsigned uKeyLength) {
+    int nEndpoint;
+
+    pthread_mutex_lock(&m_mutex);
+    nEndpoint=findOnRing(hashKey(pKey,uKeyLength),vector<bool>(m_Endpoints.size(),false));
+    pthread_mutex_unlock(&m_mutex);
+
+    return nEndpoint;
+}
+
+/**
+ * Hands out a connection to the server that owns the key. If that server
+ * has failed, or all its connections are in use, the next server on the
+ * ring takes the request. The request
+ * counts as outstanding until the connection is released.
+ * @param pKey Pointer to the key
+ * @param uKeyLength Number of bytes in the key
+ * @param[out] pnEndpoint receives the endpoint number when not NULL
+ * @return connection to send on. It must be given back with release().
+ * @retval NULL if no server is available
+ */
+CTcpMessaging *CTcpLoadBalancer::acquire(const unsigned char *pKey,unsigned uKeyLength,int *pnEndpoint) {
+    unsigned uHash=hashKey(pKey,uKeyLength);
+    CTcpMessaging *pConnection=NULL;
+    int nEndpoint;
+
+    pthread_mutex_lock(&m_mutex);
+    vector<bool> excluded(m_Endpoints.size(),false);
+    for(;;){
+        nEndpoint=findOnRing(uHash,excluded);
+        if(nEndpoint == INVALID_ENDPOINT){
+            break;
+        }
+        pConnection=acquireFrom(nEndpoint);
+        if(pConnection != NULL){
+            break;
+        }
+        excluded[nEndpoint]=true;
+    }
+    pthread_mutex_unlock(&m_mutex);
+
+    if(pnEndpoint != NULL){
+        *pnEndpoint=nEndpoint;
+    }
+    return pConnection;
+}
+
+/**
+ * Hands out a connection to the server with the fewest outstanding
+ * requests. Servers with the same load take turns.
+ * @param[out] pnEndpoint receives the endpoint number when not NULL
+ * @return connection to send on. It must be given back with release().
+ * @retval NULL if no server is available
+ */
+CTcpMessaging *CTcpLoadBalancer::acquire(int *pnEndpoint) {
+    CTcpMessaging *pConnection=NULL;
+    int nEndpoint=INVALID_ENDPOINT;
+    unsigned uCount;
+    int n;
+
+    pthread_mutex_lock(&m_mutex);
+    uCount=(unsigned)m_Endpoints.size();
+    vector<bool> excluded(uCount,false);
+    while(pConnection == NULL){
+        nEndpoint=INVALID_ENDPOINT;
+        for(unsigned i=0; i < uCount; i++){
+            n=(int)((m_uNextEndpoint+i)%uCount);
+            if(excluded[n] || !isAvailable(n)){
+                continue;
+            }
+            if(nEndpoint == INVALID_ENDPOINT ||
+                    m_Endpoints[n]->uOutstanding < m_Endpoints[nEndpoint]->uOutstanding){
+                nEndpoint=n;
+            }
+        }
+        if(nEndpoint == INVALID_ENDPOINT){
+            break;
+        }
+        m_uNextEndpoint=(unsigned)nEndpoint+1;
+        pConnection=acquireFrom(nEndpoint);
+        excluded[nEndpoint]=true;
+    }
+    pthread_mutex_unlock(&m_mutex);
+
+    if(pnEndpoint != NULL){
+        *pnEndpoint=nEndpoint;
+    }
+    return pConnection;
+}
+
+/**
+ * Gives a connection back to its pool and ends the outstanding request
+ * @param pConnection connection returned by acquire()
+ * @param bHealthy set to false if the connection failed while in use. The
+ *        server is then taken out of rotation.
+ */
+void CTcpLoadBalancer::release(CTcpMessaging *pConnection,bool bHealthy) {
+    AcquiredMap_t::iterator it;
+    int nEndpoint;
+
+    pthread_mutex_lock(&m_mutex);
+    it=m_Acquired.find(pConnection);
+    if(it != m_Acquired.end()){
+        nEndpoint=it->second;
+        m_Acquired.erase(it);
+        m_Endpoints[nEndpoint]->uOutstanding--;
+        m_Endpoints[nEndpoint]->pPool->release(pConnection,bHealthy);
+        if(!bHealthy){
+            failEndpoint(nEndpoint);
+        }
+    }
+    pthread_mutex_unlock(&m_mutex);
+}
+
+/**
+ * Sends a message to the server that owns the key. If the send fails, the
+ * server is taken out of rotation and the message goes to the server that
+ * takes over the key.
+ * @param pKey Pointer to the key
+ * @param uKeyLength Number of bytes in the key
+ * @param pMsg Pointer to the message
+ * @param uLength Number of bytes in the message
+ * @retval true Message was sent successfully
+ * @retval false No server could take the message
+ */
+bool CTcpLoadBalancer::sendMessage(const unsigned char *pKey,unsigned uKeyLength,const unsigned char *pMsg,unsigned uLength) {
+    CTcpMessaging *pConnection;
+    bool bResults=false;
+
+    for(unsigned uTries=getEndpointCount(); uTries > 0 && !bResults; uTries--){
+        pConnection=acquire(pKey,uKeyLength);
+        if(pConnection == NULL){
+            PTRACE("No server available for the key\n");
+            break;
+        }
+        bResults=pConnection->sendMessage(pMsg,uLength);
+        release(pConnection,bResults);
+    }
+    return bResults;
+}
+
+/**
+ * Sends a message to the server with the fewest outstanding requests. If
+ * the send fails, the server is taken out of rotation and the next one is
+ * tried.
+ * @param pMsg Pointer to the message
+ * @param uLength Number of bytes in the message
+ * @retval true Message was sent successfully
+ * @retval false No server could take the message
+ */
+bool CTcpLoadBalancer::sendMessage(const unsigned char *pMsg,unsigned uLength) {
+    CTcpMessaging *pConnection;
+    bool bResults=false;
+
+    for(unsigned uTries=getEndpointCount(); uTries > 0 && !bResults; uTries--){
+        pConnection=acquire();
+        if(pConnection == NULL){
+            PTRACE("No server available\n");
+            break;
+        }
+        bResults=pConnection->sendMessage(pMsg,uLength);
+        release(pConnection,bResults);
+    }
+    return bResults;
+}
+
+/**
+ * Returns the number of endpoint numbers handed out, removed endpoints
+ * included
+ */
+unsigned CTcpLoadBalancer::getEndpointCount() {
+    unsigned uCount;
+
+    pthread_mutex_lock(&m_mutex);
+    uCount=(unsigned)m_Endpoints.size();
+    pthread_mutex_unlock(&m_mutex);
+
+    return uCount;
+}
+
+/**
+ * Returns true if the server currently takes traffic
+ * @param nEndpoint Endpoint number
+ */
+bool CTcpLoadBalancer::isInRotation(int nEndpoint) {
+    bool bResults;
+
+    pthread_mutex_lock(&m_mutex);
+    bResults=nEndpoint >= 0 && nEndpoint < (int)m_Endpoints.size() && isAvailable(nEndpoint);
+    pthread_mutex_unlock(&m_mutex);
+
+    return bResults;
+}
+
+/**
+ * Returns the number of connections to a server that are handed out
+ * @param nEndpoint Endpoint number
+ */
+unsigned CTcpLoadBalancer::getOutstanding(int nEndpoint) {
+    unsigned uCount=0;
+
+    pthread_mutex_lock(&m_mutex);
+    if(nEndpoint >= 0 && nEndpoint < (int)m_Endpoints.size() && m_Endpoints[nEndpoint] != NULL){
+        uCount=m_Endpoints[nEndpoint]->uOutstanding;
+    }
+    pthread_mutex_unlock(&m_mutex);
+
+    return uCount;
+}
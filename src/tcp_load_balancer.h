@@ -0,0 +1,106 @@
+/**
+ * @file tcp_load_balancer.h
+ *
+ * @date   Oct 18, 2026
+ */
+
+#ifndef TCPLOADBALANCER_H
+#define TCPLOADBALANCER_H
+
+#include "tcp_connection_pool.h"
+#include <pthread.h>
+#include <time.h>
+#include <vector>
+#include <map>
+
+/**
+ * Spreads messages over a set of servers, each reached through its own
+ * connection pool. Keyed messages are routed with a consistent hash ring,
+ * so the same key always lands on the same server and adding a server
+ * only moves the keys that now belong to it. Messages without a key go to
+ * the server with the fewest outstanding requests. Servers that fail are
+ * taken out of rotation until their pool has connections again.
+ */
+class CTcpLoadBalancer {
+public:
+    /** default number of connections per server */
+    enum {DEFAULT_POOL_SIZE=2};
+    /** default number of points each server gets on the hash ring */
+    enum {DEFAULT_VIRTUAL_NODES=100};
+    /** returned by findEndpoint() when no server is in rotation */
+    enum {INVALID_ENDPOINT=-1};
+
+    CTcpLoadBalancer(unsigned uPoolSize=DEFAULT_POOL_SIZE,
+                     unsigned uVirtualNodes=DEFAULT_VIRTUAL_NODES,
+                     unsigned uConnectTimeoutMs=CTcpConnectionPool::DEFAULT_CONNECT_TIMEOUT,
+                     unsigned uHealthCheckIntervalMs=CTcpConnectionPool::DEFAULT_HEALTH_CHECK_INTERVAL);
+    ~CTcpLoadBalancer();
+
+    /** @brief adds a server and returns its endpoint number */
+    int  addEndpoint(std::string sIpAddress,unsigned uPort);
+    /** @brief removes a server from the hash ring and closes its connections */
+    bool removeEndpoint(int nEndpoint);
+    /** @brief starts the pools of all the servers */
+    bool start();
+    /** @brief stops the pools of all the servers */
+    void stop();
+    /** @brief runs a maintenance pass on all the pools */
+    void maintain();
+    /** @brief returns the server a key is routed to */
+    int  findEndpoint(const unsigned char *pKey,unsigned uKeyLength);
+    /** @brief returns a connection to the server that owns the key */
+    CTcpMessaging *acquire(const unsigned char *pKey,unsigned uKeyLength,int *pnEndpoint=NULL);
+    /** @brief returns a connection to the least loaded server */
+    CTcpMessaging *acquire(int *pnEndpoint=NULL);
+    /** @brief gives back a connection and ends the outstanding request */
+    void release(CTcpMessaging *pConnection,bool bHealthy=true);
+    /** @brief sends a message to the server that owns the key */
+    bool sendMessage(const unsigned char *pKey,unsigned uKeyLength,const unsigned char *pMsg,unsigned uLength);
+    /** @brief sends a message to the least loaded server */
+    bool sendMessage(const unsigned char *pMsg,unsigned uLength);
+    /** @brief returns the number of endpoint numbers handed out */
+    unsigned getEndpointCount();
+    /** @brief returns true if the server takes traffic */
+    bool isInRotation(int nEndpoint);
+    /** @brief returns the number of requests in progress on a server */
+    unsigned getOutstanding(int nEndpoint);
+    /** @brief 32 bit FNV-1a hash used for the ring */
+    static unsigned hashKey(const unsigned char *pKey,unsigned uKeyLength);
+
+protected:
+    /** a server and its connections */
+    typedef struct {
+        std::string         sIpAddress;
+        unsigned            uPort;
+        CTcpConnectionPool *pPool;
+        unsigned            uOutstanding; /**< connections handed out and not released */
+        bool                bInRotation;  /**< cleared when the server fails */
+        struct timespec     RetryTime;    /**< earliest time a failed server is tried again */
+    } Endpoint_t;
+    /** hash ring: point on the ring to endpoint number */
+    typedef std::map<unsigned,int> Ring_t;
+    /** connections handed out: connection to endpoint number */
+    typedef std::map<CTcpMessaging*,int> AcquiredMap_t;
+
+    unsigned                 m_uPoolSize;
+    unsigned                 m_uVirtualNodes;
+    unsigned                 m_uConnectTimeoutMs;
+    unsigned                 m_uHealthCheckIntervalMs;
+    std::vector<Endpoint_t*> m_Endpoints;   /**< removed endpoints are left as NULL */
+    Ring_t                   m_Ring;
+    AcquiredMap_t            m_Acquired;
+    unsigned                 m_uNextEndpoint; /**< breaks ties between equally loaded servers */
+    bool                     m_bRunning;
+    pthread_mutex_t          m_mutex;       /**< protects the endpoints, ring and counters */
+
+    /** @brief returns true if the endpoint may take traffic */
+    bool isAvailable(int nEndpoint);
+    /** @brief takes a failed endpoint out of rotation */
+    void failEndpoint(int nEndpoint);
+    /** @brief takes a connection from the endpoint's pool */
+    CTcpMessaging *acquireFrom(int nEndpoint);
+    /** @brief returns the endpoint owning the key, skipping the excluded ones */
+    int  findOnRing(unsigned uHash,const std::vector<bool> &excluded);
+};
+
+#endif /* TCPLOADBALANCER_H */
@@ -6,10 +6,18 @@
  */
 
 #include "tcp_messaging.h"
+#include "Timer.h"
 #include "TRACE.h"
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
 
 using namespace std;
 
@@ -17,13 +25,31 @@ CTcpMessaging::CTcpMessaging() {
     m_socket=-1;
     m_sIpAddress="127.0.0.1";
     m_uPortNumber=8080;
-
+    memset(&m_FastOpenStats,0,sizeof(m_FastOpenStats));
+    m_bConnecting=false;
+    m_bQueuedSend=false;
+    m_pSendNotify=NULL;
+    m_pSendNotifyUser=NULL;
+    pthread_mutex_init(&m_SendMutex,NULL);
+    memset(&m_ReconnectPolicy,0,sizeof(m_ReconnectPolicy));
+    m_bReconnectArmed=false;
+    m_uReconnectAttempts=0;
+    m_uReconnectCount=0;
+    m_NextReconnect.tv_sec=0;
+    m_NextReconnect.tv_nsec=0;
+    m_uRandomSeed=(unsigned)time(0) ^ (unsigned)(unsigned long)this;
+    m_uQueuedBytes=0;
 }
 
 CTcpMessaging::~CTcpMessaging() {
    if(m_socket != -1){
        disconnect();
    }
+   while(!m_ReconnectQueue.empty()){
+       delete[] m_ReconnectQueue.front().pData;
+       m_ReconnectQueue.pop();
+   }
+   pthread_mutex_destroy(&m_SendMutex);
 }
 
 
@@ -41,25 +67,162 @@ int CTcpMessaging::xmitMsg(const unsigned char *pBuffer, unsigned uLength){
         return -1;
     }
 
-    nResults=send(m_socket, pBuffer, uLength, 0);
+    if(m_bQueuedSend){
+        SendNotify_t pNotify=NULL;
+        void *pNotifyUser=NULL;
+        unsigned uSent=0;
+
+        pthread_mutex_lock(&m_SendMutex);
+        //keep the order: only write through when nothing is waiting
+        if(m_SendQueue.Size() == 0 && !m_bConnecting){
+            nResults=send(m_socket, pBuffer, uLength, MSG_DONTWAIT|MSG_NOSIGNAL);
+            if(nResults < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+                pthread_mutex_unlock(&m_SendMutex);
+                PERROR1("send socket failed. Reason: %s\n ",strerror(errno));
+                return -1;
+            }
+            uSent=(nResults > 0) ? (unsigned)nResults : 0;
+        }
+        if(uSent < uLength){
+            if(m_SendQueue.Size() == 0){
+                pNotify=m_pSendNotify;
+                pNotifyUser=m_pSendNotifyUser;
+            }
+            m_SendQueue.Append(pBuffer+uSent,uLength-uSent);
+        }
+        pthread_mutex_unlock(&m_SendMutex);
+
+        if(pNotify != NULL){
+            pNotify(this,pNotifyUser);
+        }
+        return (int)uLength;
+    }
+
+    //with a send deadline a full socket is waited on in waitWritable()
+    nResults=send(m_socket, pBuffer, uLength, MSG_NOSIGNAL|(m_uSendDeadlineMs ? MSG_DONTWAIT : 0));
     if(nResults <0){
+        if(m_uSendDeadlineMs && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)){
+            return 0;
+        }
         PERROR1("send socket failed. Reason: %s\n ",strerror(errno));
     }
 
     return nResults;
 }
 
+/** low level vectored transmit function. The whole list goes out with a
+ *  single sendmsg call; the caller continues after partial writes.
+ *  @param pVector list of buffers to be sent in order
+ *  @param uCount number of buffers in the list
+ *  @return number bytes that were successfully transmitted (can be zero)
+ *  @retval -1 if the data cannot be queued due to an error
+ **/
+int CTcpMessaging::xmitMsgV(const struct iovec *pVector, unsigned uCount){
+    struct msghdr msg;
+    unsigned long uLength=0;
+    int nResults;
+
+    if(m_socket < 0){
+        return -1;
+    }
+    //anything past the limit goes out on the next call
+    if(uCount > IOV_MAX){
+        uCount=IOV_MAX;
+    }
+    memset(&msg,0,sizeof(msg));
+    msg.msg_iov=(struct iovec *)pVector;
+    msg.msg_iovlen=uCount;
+
+    if(m_bQueuedSend){
+        SendNotify_t pNotify=NULL;
+        void *pNotifyUser=NULL;
+        unsigned long uSent=0;
+
+        for(unsigned i=0; i < uCount; i++){
+            uLength+=pVector[i].iov_len;
+        }
+        pthread_mutex_lock(&m_SendMutex);
+        //keep the order: only write through when nothing is waiting
+        if(m_SendQueue.Size() == 0 && !m_bConnecting){
+            nResults=sendmsg(m_socket, &msg, MSG_DONTWAIT|MSG_NOSIGNAL);
+            if(nResults < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+                pthread_mutex_unlock(&m_SendMutex);
+                PERROR1("sendmsg socket failed. Reason: %s\n ",strerror(errno));
+                return -1;
+            }
+            uSent=(nResults > 0) ? (unsigned long)nResults : 0;
+        }
+        if(uSent < uLength){
+            if(m_SendQueue.Size() == 0){
+                pNotify=m_pSendNotify;
+                pNotifyUser=m_pSendNotifyUser;
+            }
+            //queue whatever the socket did not take
+            for(unsigned i=0; i < uCount; i++){
+                if(uSent >= pVector[i].iov_len){
+                    uSent-=pVector[i].iov_len;
+                    continue;
+                }
+                m_SendQueue.Append((const unsigned char*)pVector[i].iov_base+uSent,(unsigned)(pVector[i].iov_len-uSent));
+                uSent=0;
+            }
+        }
+        pthread_mutex_unlock(&m_SendMutex);
+
+        if(pNotify != NULL){
+            pNotify(this,pNotifyUser);
+        }
+        return (int)uLength;
+    }
+
+    nResults=sendmsg(m_socket, &msg, MSG_NOSIGNAL|(m_uSendDeadlineMs ? MSG_DONTWAIT : 0));
+    if(nResults <0){
+        if(m_uSendDeadlineMs && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)){
+            return 0;
+        }
+        PERROR1("sendmsg socket failed. Reason: %s\n ",strerror(errno));
+    }
+
+    return nResults;
+}
+
 /**
- * Connects to a TCP server (blocking)
- * @param sIpAddress Address of the server
- * @param uPort Port address to connect to
- * @retval true Connections successful
- * @retval false Connection failed
+ * Waits until the socket has room in its send buffer
+ * @param uTimeoutMs Longest time to wait in milliseconds
+ * @retval 1 The socket is writable (or has an error that the next send reports)
+ * @retval 0 The wait timed out
+ * @retval -1 There is no socket
  */
-bool CTcpMessaging::connect(string sIpAddress, unsigned uPort) {
-    struct sockaddr_in serverAddr;
+int CTcpMessaging::waitWritable(unsigned uTimeoutMs){
+    struct pollfd fd;
     int nResults;
 
+    if(m_socket < 0){
+        return -1;
+    }
+    fd.fd=m_socket;
+    fd.events=POLLOUT;
+    fd.revents=0;
+    nResults=poll(&fd,1,(int)uTimeoutMs);
+    if(nResults < 0){
+        if(errno == EINTR){
+            return 0;
+        }
+        PERROR1("poll failed. Reason: %s\n ",strerror(errno));
+        return -1;
+    }
+    return nResults > 0 ? 1 : 0;
+}
+
+/**
+ * Creates the client socket and converts the server address
+ * @param sIpAddress Address of the server
+ * @param uPort Port address to connect to
+ * @param[out] serverAddr receives the network address of the server
+ * @retval true success
+ * @retval false the address is invalid or the socket cannot be created
+ */
+bool CTcpMessaging::openSocket(string sIpAddress,unsigned uPort,struct sockaddr_in &serverAddr) {
     m_sIpAddress=sIpAddress;
     m_uPortNumber=uPort;
 
@@ -77,6 +240,46 @@ bool CTcpMessaging::connect(string sIpAddress, unsigned uPort) {
         PTRACE("Failed to create socket\n");
         return false;
     }
+    //a new connection starts with a clean heartbeat history and an empty
+    //decoder, and the new peer has to announce what it supports and grant
+    //credit
+    resetHeartbeat();
+    resetReceiver();
+    resetPeerCapabilities();
+    resetCredit();
+    return true;
+}
+
+/**
+ * Connects to a TCP server
+ * @param sIpAddress Address of the server
+ * @param uPort Port address to connect to
+ * @param nTimeoutMs Maximum number of milliseconds to wait for the
+ *        connection to be established. A negative value blocks until the
+ *        kernel gives up on the connection.
+ * @retval true Connections successful
+ * @retval false Connection failed or timed out
+ */
+bool CTcpMessaging::connect(string sIpAddress, unsigned uPort, int nTimeoutMs) {
+    struct sockaddr_in serverAddr;
+    int nResults;
+
+    if(nTimeoutMs >= 0){
+        if(!startConnect(sIpAddress,uPort)){
+            return false;
+        }
+        if(finishConnect(nTimeoutMs) != 1){
+            PTRACE2("Failed to connect to %s:%u in time\n",sIpAddress.c_str(),uPort);
+            closeSocket();
+            return false;
+        }
+        m_bReconnectArmed=(m_ReconnectPolicy.uInitialDelayMs != 0);
+        return true;
+    }
+
+    if(!openSocket(sIpAddress,uPort,serverAddr)){
+        return false;
+    }
 
     nResults=::connect(m_socket,(struct sockaddr *)&serverAddr,sizeof(serverAddr));
     if(nResults < 0){
@@ -86,17 +289,628 @@ bool CTcpMessaging::connect(string sIpAddress, unsigned uPort) {
         return false;
     }
 
+    m_bReconnectArmed=(m_ReconnectPolicy.uInitialDelayMs != 0);
+    return true;
+
+}
+
+/**
+ * Starts connecting to a TCP server without waiting for the connection to
+ * be established. Use finishConnect() to wait for or poll the outcome; the
+ * handle returned by getHandle() becomes writable once the connect is done.
+ * @param sIpAddress Address of the server
+ * @param uPort Port address to connect to
+ * @retval true The connection is established or in progress
+ * @retval false Connection failed
+ */
+bool CTcpMessaging::startConnect(string sIpAddress,unsigned uPort) {
+    struct sockaddr_in serverAddr;
+    int opts;
+
+    if(!openSocket(sIpAddress,uPort,serverAddr)){
+        return false;
+    }
+
+    opts=fcntl(m_socket,F_GETFL);
+    if(opts < 0 || fcntl(m_socket,F_SETFL,opts|O_NONBLOCK) < 0){
+        PTRACE1("Failed to set non blocking mode. Reason:  %s\n", strerror(errno) );
+        close(m_socket);
+        m_socket=-1;
+        return false;
+    }
+
+    if(::connect(m_socket,(struct sockaddr *)&serverAddr,sizeof(serverAddr)) < 0){
+        if(errno != EINPROGRESS){
+            PTRACE1("Failed to connect to server. Reason:  %s\n", strerror(errno) );
+            close(m_socket);
+            m_socket=-1;
+            return false;
+        }
+        m_bConnecting=true;
+        return true;
+    }
+
+    //connected right away (loop back)
+    fcntl(m_socket,F_SETFL,opts);
     return true;
+}
+
+/**
+ * Waits for a connection started by startConnect() to complete. Once
+ * connected, the socket is put back in blocking mode.
+ * @param nTimeoutMs Number of milliseconds to wait. Zero polls without
+ *        blocking and a negative value waits forever.
+ * @retval 1 The connection is established
+ * @retval 0 The connection is still in progress
+ * @retval -1 The connection failed and the socket was closed
+ */
+int CTcpMessaging::finishConnect(int nTimeoutMs) {
+    struct pollfd pfd;
+    int nError=0;
+    socklen_t errorLength=sizeof(nError);
+    int nResults;
+
+    if(!m_bConnecting){
+        return isConnected() ? 1 : -1;
+    }
+
+    pfd.fd=m_socket;
+    pfd.events=POLLOUT;
+    pfd.revents=0;
+    nResults=poll(&pfd,1,nTimeoutMs);
+    if(nResults == 0 || (nResults < 0 && errno == EINTR)){
+        return 0;
+    }
+    if(nResults < 0 ||
+            getsockopt(m_socket,SOL_SOCKET,SO_ERROR,&nError,&errorLength) < 0 ||
+            nError != 0){
+        PTRACE1("Failed to connect to server. Reason:  %s\n", strerror(nError ? nError : errno) );
+        m_bConnecting=false;
+        close(m_socket);
+        m_socket=-1;
+        return -1;
+    }
+
+    m_bConnecting=false;
+    fcntl(m_socket,F_SETFL,fcntl(m_socket,F_GETFL) & ~O_NONBLOCK);
+    return 1;
+}
+
+/**
+ * Connects to a TCP server and sends the first message using TCP fast
+ * open, so the message travels with the SYN when the client holds a fast
+ * open cookie for the server. When there is no cookie the kernel performs a
+ * regular handshake and sends the message right after it. If fast open is
+ * not available at all, this falls back to connect() followed by
+ * sendMessage(). The counters returned by getFastOpenStats() show how often
+ * the message actually went out with the SYN.
+ * @param sIpAddress Address of the server
+ * @param uPort Port address to connect to
+ * @param pMsg First message to send
+ * @param uLength Number of bytes in the first message
+ * @retval true Connection successful and the message was sent
+ * @retval false Connection or send failed
+ */
+bool CTcpMessaging::connectFastOpen(string sIpAddress,unsigned uPort,const unsigned char *pMsg,unsigned uLength) {
+#if defined(MSG_FASTOPEN)
+    struct sockaddr_in serverAddr;
+    unsigned char header[HEADER_SIZE];
+    unsigned char trailer[TRAILER_SIZE]={ETX};
+    struct iovec iov[3];
+    struct msghdr msg;
+    unsigned uTotal=HEADER_SIZE+uLength+TRAILER_SIZE;
+    unsigned uSent;
+    int nResults;
+
+    if(!openSocket(sIpAddress,uPort,serverAddr)){
+        return false;
+    }
+
+    buildHeader(header,uLength);
+    iov[0].iov_base=header;
+    iov[0].iov_len=HEADER_SIZE;
+    iov[1].iov_base=(void *)pMsg;
+    iov[1].iov_len=uLength;
+    iov[2].iov_base=trailer;
+    iov[2].iov_len=TRAILER_SIZE;
+    memset(&msg,0,sizeof(msg));
+    msg.msg_name=&serverAddr;
+    msg.msg_namelen=sizeof(serverAddr);
+    msg.msg_iov=iov;
+    msg.msg_iovlen=3;
+
+    m_FastOpenStats.uAttempts++;
+    nResults=sendmsg(m_socket,&msg,MSG_FASTOPEN|MSG_NOSIGNAL);
+    if(nResults < 0){
+        if(errno != EOPNOTSUPP && errno != EINVAL){
+            PTRACE1("Failed to connect to server. Reason:  %s\n", strerror(errno) );
+            close(m_socket);
+            m_socket=-1;
+            return false;
+        }
+        //fast open is disabled on this host
+        close(m_socket);
+        m_socket=-1;
+        m_FastOpenStats.uFallbacks++;
+        return connect(sIpAddress,uPort) && sendMessage(pMsg,uLength);
+    }
+
+    m_bReconnectArmed=(m_ReconnectPolicy.uInitialDelayMs != 0);
+
+#   if defined(TCP_INFO) && defined(TCPI_OPT_SYN_DATA)
+    {
+        struct tcp_info info;
+        socklen_t infoLength=sizeof(info);
+        if(getsockopt(m_socket,IPPROTO_TCP,TCP_INFO,&info,&infoLength) == 0 &&
+                (info.tcpi_options & TCPI_OPT_SYN_DATA)){
+            m_FastOpenStats.uUsed++;
+        } else {
+            //no cookie yet, the data was sent after the handshake
+            m_FastOpenStats.uFallbacks++;
+        }
+    }
+#   endif
 
+    //send whatever did not fit in the first segment
+    uSent=(unsigned)nResults;
+    //the first segment carried part of the frame, so a failure cuts it short
+    if(uSent < HEADER_SIZE){
+        if(!xmitWithRetry(header+uSent,HEADER_SIZE-uSent)){
+            sendCutShort();
+            return false;
+        }
+        uSent=HEADER_SIZE;
+    }
+    if(uSent < HEADER_SIZE+uLength){
+        if(!xmitWithRetry(pMsg+uSent-HEADER_SIZE,HEADER_SIZE+uLength-uSent)){
+            sendCutShort();
+            return false;
+        }
+        uSent=HEADER_SIZE+uLength;
+    }
+    if(uSent < uTotal && !xmitWithRetry(trailer,TRAILER_SIZE)){
+        sendCutShort();
+        return false;
+    }
+    return true;
+#else
+    m_FastOpenStats.uAttempts++;
+    m_FastOpenStats.uFallbacks++;
+    return connect(sIpAddress,uPort) && sendMessage(pMsg,uLength);
+#endif
 }
 
 /**
- * Disconnects from the server
+ * Disconnects from the server. This also stops automatic reconnects until
+ * the next call to connect().
  */
 void CTcpMessaging::disconnect() {
+    m_bReconnectArmed=false;
+    if(m_socket >= 0){
+        flush();
+    }
+    closeSocket();
+}
+
+/**
+ * Called by serviceHeartbeat() when the server stopped responding. Shutting
+ * down the socket wakes up the reader, which then closes the connection or
+ * schedules a reconnect the same way it does when the server closes it.
+ */
+void CTcpMessaging::peerDead() {
+    if(m_socket != -1){
+        shutdown(m_socket,SHUT_RDWR);
+    }
+}
+
+/**
+ * Called when a send gave up after part of a frame went out. The server
+ * would take the next frame as the rest of that one, so the connection is
+ * shut down. Later sends fail, and the reader closes the connection or
+ * schedules a reconnect. Frames held for a reconnect go out whole.
+ */
+void CTcpMessaging::sendCutShort() {
+    PTRACE("Frame cut short. Shutting down the connection\n");
+    if(m_socket != -1){
+        shutdown(m_socket,SHUT_RDWR);
+    }
+}
+
+/**
+ * Closes the socket and drops any data on the send queue without
+ * changing the reconnect state
+ */
+void CTcpMessaging::closeSocket() {
+    m_bConnecting=false;
+    pthread_mutex_lock(&m_SendMutex);
+    m_SendQueue.Clear();
+    pthread_mutex_unlock(&m_SendMutex);
     if(m_socket != -1){
         shutdown(m_socket,SHUT_RDWR);
         close(m_socket);
         m_socket=-1;
     }
 }
+
+/**
+ * Waits for data from the server and runs it through the message
+ * processor. Complete messages are placed on the received queue (or handed
+ * to the message callback) and can be retrieved with getMsg(). This allows
+ * the connection to be driven from an external event loop using the handle
+ * returned by getHandle(). Frames gathered by the coalescing mode are
+ * sent when they are due, so the wait may end early to do that.
+ * @param nTimeoutMs Number of milliseconds to wait for data. Zero polls
+ *        without blocking and a negative value waits forever.
+ * @return Number of bytes processed (zero on timeout or while waiting to
+ *         reconnect)
+ * @retval -1 on error or if the server closed the connection
+ */
+int CTcpMessaging::runOnce(int nTimeoutMs) {
+    struct pollfd pfd;
+    long long llDueUs;
+    int nResults;
+
+    if(m_socket < 0 && m_bReconnectArmed){
+        //wait for the next reconnect attempt instead of the data
+        if(!serviceReconnect()){
+            nResults=getReconnectDelay();
+            if(nTimeoutMs >= 0 && nTimeoutMs < nResults){
+                nResults=nTimeoutMs;
+            }
+            poll(NULL,0,nResults);
+            return 0;
+        }
+    }
+    if(m_socket < 0){
+        return -1;
+    }
+
+    //wake up in time to send the gathered frames
+    llDueUs=getCoalesceTimeoutUs(CTimer::getMonotonicUs());
+    if(llDueUs >= 0){
+        nResults=(int)((llDueUs+999)/1000);
+        if(nTimeoutMs < 0 || nResults < nTimeoutMs){
+            nTimeoutMs=nResults;
+        }
+    }
+
+    pfd.fd=m_socket;
+    pfd.events=POLLIN;
+    pfd.revents=0;
+    nResults=poll(&pfd,1,nTimeoutMs);
+    if(!serviceCoalescing(CTimer::getMonotonicUs())){
+        return -1;
+    }
+    if(nResults <= 0){
+        if(nResults < 0 && errno != EINTR){
+            PERROR1("poll failed. Reason: %s\n",strerror(errno));
+            return -1;
+        }
+        return 0;
+    }
+
+    return readAvailable();
+}
+
+/**
+ * Reads whatever data is queued on the socket without waiting. The data
+ * is received straight into the message assembler, so it is not copied
+ * before the messages are extracted. Use this when an event loop already
+ * knows the handle is readable.
+ * @return Number of bytes processed (zero if nothing was available)
+ * @retval -1 on error or if the server closed the connection
+ */
+int CTcpMessaging::readAvailable() {
+    unsigned char *pBuffer;
+    int nResults;
+
+    if(m_socket < 0){
+        return -1;
+    }
+
+    pBuffer=getReceiveBuffer(RECEIVE_BUFFER_SIZE);
+    nResults=recv(m_socket,pBuffer,RECEIVE_BUFFER_SIZE,MSG_DONTWAIT);
+    if(nResults < 0){
+        if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR){
+            return 0;
+        }
+        PERROR1("recv socket failed. Reason: %s\n",strerror(errno));
+        return -1;
+    }
+    if(nResults == 0){
+        PTRACE("Server closed the connection\n");
+        if(m_bReconnectArmed){
+            connectionLost();
+        } else {
+            disconnect();
+        }
+        return -1;
+    }
+
+    processReceived((unsigned)nResults);
+    return nResults;
+}
+
+/**
+ * Waits for the next complete message from the server
+ * @param[out] msg receives the message. The caller must delete[] msg.pData.
+ * @param nTimeoutMs Maximum number of milliseconds to wait. Zero only
+ *        returns messages that are already available and a negative
+ *        value waits forever.
+ * @retval true A message was received
+ * @retval false Timed out, the connection failed or a message callback is registered
+ */
+bool CTcpMessaging::receiveMessage(Message_t &msg,int nTimeoutMs) {
+    struct timespec start,now;
+    int nRemainingMs=nTimeoutMs;
+    int nResults;
+
+    CTimer::getTime(start);
+    while(getMessageCount() == 0){
+        if(nTimeoutMs >= 0){
+            CTimer::getTime(now);
+            nRemainingMs=nTimeoutMs-(int)CTimer::timespec2ms(CTimer::diff_timespec(now,start));
+            if(nRemainingMs < 0){
+                nRemainingMs=0;
+            }
+        }
+        nResults=runOnce(nRemainingMs);
+        if(nResults < 0){
+            return false;
+        }
+        if(nResults == 0 && nRemainingMs == 0){
+            break;
+        }
+    }
+    if(getMessageCount() == 0){
+        return false;
+    }
+    msg=getMsg();
+    return true;
+}
+
+/**
+ * Enables or disables the queued send mode. In this mode sendMessage never
+ * blocks: data that the socket does not accept right away is placed on a
+ * send queue, which is drained by flushSendQueue() once the socket becomes
+ * writable. This is used when the connection is driven by an event loop.
+ * @param bQueued true to enable the queued send mode
+ */
+void CTcpMessaging::setQueuedSend(bool bQueued) {
+    m_bQueuedSend=bQueued;
+}
+
+/**
+ * Registers a function that is called whenever data is placed on an empty
+ * send queue, so an event loop knows to wait for the socket to become writable
+ * @param pNotify Pointer to the notification function (NULL to disable)
+ * @param pUser Pointer to user provided pointer passed back into the function
+ */
+void CTcpMessaging::setSendNotify(SendNotify_t pNotify,void *pUser) {
+    pthread_mutex_lock(&m_SendMutex);
+    m_pSendNotify=pNotify;
+    m_pSendNotifyUser=pUser;
+    pthread_mutex_unlock(&m_SendMutex);
+}
+
+/**
+ * Sends as much of the send queue as the socket accepts without blocking
+ * @return Number of bytes sent
+ * @retval -1 if the send failed
+ */
+int CTcpMessaging::flushSendQueue() {
+    const unsigned char *pData;
+    unsigned uLength;
+    int nResults;
+    int nSent=0;
+
+    pthread_mutex_lock(&m_SendMutex);
+    while(m_socket >= 0 && !m_bConnecting && (pData=m_SendQueue.Head(uLength)) != NULL){
+        nResults=send(m_socket, pData, uLength, MSG_DONTWAIT|MSG_NOSIGNAL);
+        if(nResults < 0){
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR){
+                break;
+            }
+            pthread_mutex_unlock(&m_SendMutex);
+            PERROR1("send socket failed. Reason: %s\n ",strerror(errno));
+            return -1;
+        }
+        m_SendQueue.Trim((unsigned)nResults);
+        nSent+=nResults;
+    }
+    pthread_mutex_unlock(&m_SendMutex);
+
+    return nSent;
+}
+
+/**
+ * Returns true if data is waiting on the send queue
+ */
+bool CTcpMessaging::hasPendingSend() {
+    bool bPending;
+
+    pthread_mutex_lock(&m_SendMutex);
+    bPending=(m_SendQueue.Size() > 0);
+    pthread_mutex_unlock(&m_SendMutex);
+
+    return bPending;
+}
+
+/**
+ * Enables automatic reconnects. Once connected, a lost connection is
+ * re-established with a jittered exponential backoff, so that many clients
+ * of a restarted server do not all come back at the same time. Messages
+ * sent while the connection is down are held (up to uMaxQueuedBytes) and
+ * replayed in order after reconnecting. Reconnect attempts are made from
+ * sendMessage() and runOnce(). A uInitialDelayMs of zero disables this.
+ * @param policy reconnect settings
+ */
+void CTcpMessaging::setReconnectPolicy(const ReconnectPolicy_t &policy) {
+    m_ReconnectPolicy=policy;
+    if(m_ReconnectPolicy.uMaxDelayMs < m_ReconnectPolicy.uInitialDelayMs){
+        m_ReconnectPolicy.uMaxDelayMs=m_ReconnectPolicy.uInitialDelayMs;
+    }
+    m_bReconnectArmed=(policy.uInitialDelayMs != 0) && (m_socket >= 0);
+}
+
+/**
+ * Closes the broken connection and schedules the next reconnect attempt.
+ * The delay doubles with every failed attempt up to the maximum, and a
+ * random part of up to half the delay is taken off to spread out clients.
+ */
+void CTcpMessaging::connectionLost() {
+    struct timespec now,delay;
+    unsigned long uDelayMs=m_ReconnectPolicy.uInitialDelayMs;
+
+    closeSocket();
+
+    for(unsigned i=0; i < m_uReconnectAttempts && uDelayMs < m_ReconnectPolicy.uMaxDelayMs; i++){
+        uDelayMs*=2;
+    }
+    if(uDelayMs > m_ReconnectPolicy.uMaxDelayMs){
+        uDelayMs=m_ReconnectPolicy.uMaxDelayMs;
+    }
+    uDelayMs-=rand_r(&m_uRandomSeed) % (uDelayMs/2+1);
+
+    CTimer::getTime(now);
+    delay.tv_sec=uDelayMs/1000;
+    delay.tv_nsec=(uDelayMs%1000)*MILLION;
+    m_NextReconnect=CTimer::add_timespec(now,delay);
+    PTRACE1("Connection lost. Reconnecting in %lu ms\n",uDelayMs);
+}
+
+/**
+ * Returns the number of milliseconds until the next reconnect attempt
+ */
+int CTcpMessaging::getReconnectDelay() {
+    struct timespec now;
+
+    CTimer::getTime(now);
+    if(CTimer::comp_timespec(m_NextReconnect,now) <= 0){
+        return 0;
+    }
+    return (int)CTimer::timespec2ms(CTimer::diff_timespec(m_NextReconnect,now));
+}
+
+/**
+ * Re-establishes a lost connection if an attempt is due and replays the
+ * frames that were held while the connection was down
+ * @retval true The connection is up and all held frames were sent
+ * @retval false The connection is still down
+ */
+bool CTcpMessaging::serviceReconnect() {
+    bool bReconnected=false;
+
+    if(m_socket < 0){
+        if(!m_bReconnectArmed || getReconnectDelay() > 0){
+            return false;
+        }
+        if(!connect(m_sIpAddress,m_uPortNumber,(int)m_ReconnectPolicy.uConnectTimeoutMs)){
+            m_uReconnectAttempts++;
+            connectionLost();
+            return false;
+        }
+        m_uReconnectAttempts=0;
+        m_uReconnectCount++;
+        if(m_bNegotiate){
+            advertiseCapabilities(CONTROL_CAPABILITIES);
+        }
+        if(m_uReceiveCreditMessages != 0){
+            enableReceiveCredit(m_uReceiveCreditMessages,m_uReceiveCreditBytes);
+        }
+        bReconnected=true;
+    }
+
+    //replay the held frames in order
+    while(!m_ReconnectQueue.empty()){
+        Message_t &frame=m_ReconnectQueue.front();
+        if(!xmitWithRetry(frame.pData,frame.uMsgLength)){
+            //the whole frame goes out again on the next connection
+            connectionLost();
+            return false;
+        }
+        m_uQueuedBytes-=frame.uMsgLength;
+        delete[] frame.pData;
+        m_ReconnectQueue.pop();
+    }
+    //messages that waited for the credit of the old peer follow the held frames
+    if(bReconnected){
+        sendCreditQueue();
+    }
+    return true;
+}
+
+/**
+ * Transmits a frame. When automatic reconnects are enabled and the
+ * connection is down, the frame is held and replayed after reconnecting.
+ * @param pHeader The frame header
+ * @param pPieces List of buffers that make up the message
+ * @param uPieces Number of buffers in the list
+ * @param pTrailer The frame trailer
+ * @retval true Frame was sent or held for later
+ * @retval false Frame was not sent and could not be held
+ */
+bool CTcpMessaging::xmitFrame(const unsigned char *pHeader,const struct iovec *pPieces,unsigned uPieces,const unsigned char *pTrailer) {
+    Message_t frame;
+    unsigned long uLength=0;
+    unsigned char *pNext;
+
+    if(!m_bReconnectArmed){
+        return CMessaging::xmitFrame(pHeader,pPieces,uPieces,pTrailer);
+    }
+
+    if(serviceReconnect()){
+        if(CMessaging::xmitFrame(pHeader,pPieces,uPieces,pTrailer)){
+            return true;
+        }
+        connectionLost();
+    }
+
+    //hold on to the frame until the connection is back
+    for(unsigned i=0; i < uPieces; i++){
+        uLength+=pPieces[i].iov_len;
+    }
+    frame.uMsgLength=HEADER_SIZE+uLength+TRAILER_SIZE;
+    if(m_uQueuedBytes+frame.uMsgLength > m_ReconnectPolicy.uMaxQueuedBytes){
+        PTRACE("Reconnect queue is full. Dropping message\n");
+        return false;
+    }
+    frame.pData=new unsigned char[frame.uMsgLength];
+    memcpy(frame.pData,pHeader,HEADER_SIZE);
+    pNext=frame.pData+HEADER_SIZE;
+    for(unsigned i=0; i < uPieces; i++){
+        memcpy(pNext,pPieces[i].iov_base,pPieces[i].iov_len);
+        pNext+=pPieces[i].iov_len;
+    }
+    memcpy(pNext,pTrailer,TRAILER_SIZE);
+    m_ReconnectQueue.push(frame);
+    m_uQueuedBytes+=frame.uMsgLength;
+
+    return true;
+}
+
+/**
+ * Transmits a batch of frames. Unlike single messages, a batch is never
+ * held while the connection is down: sendMessages() reports which messages
+ * went out and the caller keeps the rest. A failure still schedules the
+ * reconnect when automatic reconnects are enabled.
+ * @param pVector The gather list. It is updated as data goes out.
+ * @param uCount Number of buffers in the list
+ * @param[out] puSent receives the number of bytes sent
+ * @retval true All the frames were sent
+ * @retval false The connection is down or failed part way
+ */
+bool CTcpMessaging::xmitBatch(struct iovec *pVector,unsigned uCount,unsigned long *puSent) {
+    if(!m_bReconnectArmed){
+        return CMessaging::xmitBatch(pVector,uCount,puSent);
+    }
+    if(!serviceReconnect()){
+        *puSent=0;
+        return false;
+    }
+    if(CMessaging::xmitBatch(pVector,uCount,puSent)){
+        return true;
+    }
+    connectionLost();
+    return false;
+}
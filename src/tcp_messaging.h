@@ -10,26 +10,122 @@
 
 #include "Messaging.h"
 #include <string.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <time.h>
+#include <queue>
 
 class CTcpMessaging: public CMessaging {
+public:
+    /** TCP fast open counters */
+    typedef struct {
+        unsigned long uAttempts;  /**< number of connections that tried to send data with the SYN */
+        unsigned long uUsed;      /**< number of connections where the server accepted the SYN data */
+        unsigned long uFallbacks; /**< number of connections that fell back to a regular connect */
+    } FastOpenStats_t;
+    /**
+     * Called when data is placed on an empty send queue
+     *   pConnection: connection with data waiting to be sent
+     *   pUser: pointer passed in during registration
+     **/
+    typedef void (*SendNotify_t)(CTcpMessaging *pConnection,void *pUser);
+    /** automatic reconnect settings */
+    typedef struct {
+        unsigned uInitialDelayMs;   /**< delay before the first reconnect attempt (0 disables reconnecting) */
+        unsigned uMaxDelayMs;       /**< upper limit of the exponential backoff */
+        unsigned uConnectTimeoutMs; /**< time allowed for each reconnect attempt */
+        unsigned uMaxQueuedBytes;   /**< maximum number of bytes held while disconnected */
+    } ReconnectPolicy_t;
+
 protected:
+    enum {RECEIVE_BUFFER_SIZE=16*1024};
+    /** frames held while the connection is down */
+    typedef std::queue<Message_t> FrameQueue_t;
+
     std::string m_sIpAddress;
     unsigned    m_uPortNumber;
     int         m_socket;
+    FastOpenStats_t m_FastOpenStats;
+    bool        m_bConnecting;     /**< set while a non blocking connect is in progress */
+    bool        m_bQueuedSend;     /**< when set, data that cannot be sent right away is queued */
+    CAssembler  m_SendQueue;       /**< data waiting for the socket to become writable */
+    pthread_mutex_t m_SendMutex;   /**< protects the send queue */
+    SendNotify_t m_pSendNotify;    /**< called when data is placed on an empty send queue */
+    void *      m_pSendNotifyUser; /**< user pointer passed back to the send notification */
+    ReconnectPolicy_t m_ReconnectPolicy;
+    bool        m_bReconnectArmed; /**< set while the connection should be kept up */
+    unsigned    m_uReconnectAttempts; /**< failed attempts since the connection was lost */
+    unsigned long m_uReconnectCount;  /**< number of times the connection was re-established */
+    struct timespec m_NextReconnect;  /**< time of the next reconnect attempt */
+    unsigned    m_uRandomSeed;     /**< seed used to jitter the backoff */
+    FrameQueue_t m_ReconnectQueue; /**< frames waiting to be replayed after reconnecting */
+    unsigned long m_uQueuedBytes;  /**< number of bytes on the reconnect queue */
+
+    /** @brief creates the socket and resolves the server address */
+    bool openSocket(std::string sIpAddress,unsigned uPort,struct sockaddr_in &serverAddr);
 
     /** @brief low level messaging */
     virtual int xmitMsg(const unsigned char *pBuffer, unsigned uLength);
+    /** @brief low level vectored messaging */
+    virtual int xmitMsgV(const struct iovec *pVector, unsigned uCount);
+    /** @brief waits until the socket can take more data */
+    virtual int waitWritable(unsigned uTimeoutMs);
+    /** @brief transmits a frame or holds on to it while reconnecting */
+    virtual bool xmitFrame(const unsigned char *pHeader,const struct iovec *pPieces,unsigned uPieces,const unsigned char *pTrailer);
+    /** @brief transmits a batch of frames and reconnects on failure */
+    virtual bool xmitBatch(struct iovec *pVector,unsigned uCount,unsigned long *puSent);
+    /** @brief closes the socket without changing the reconnect state */
+    void closeSocket();
+    /** @brief closes the socket and schedules a reconnect */
+    void connectionLost();
+    /** @brief reconnects if an attempt is due and replays the held frames */
+    bool serviceReconnect();
+    /** @brief returns the number of ms until the next reconnect attempt */
+    int  getReconnectDelay();
+    /** @brief shuts down the connection when the server stops responding */
+    virtual void peerDead();
+    /** @brief shuts down the connection when a frame could not be sent completely */
+    virtual void sendCutShort();
 public:
     CTcpMessaging();
     ~CTcpMessaging();
     /** @brief connects to server on the client side*/
-    bool connect(std::string sIpAddress,unsigned uPort);
+    bool connect(std::string sIpAddress,unsigned uPort,int nTimeoutMs=-1);
+    /** @brief starts a non blocking connect to the server */
+    bool startConnect(std::string sIpAddress,unsigned uPort);
+    /** @brief waits for a connect started by startConnect to complete */
+    int  finishConnect(int nTimeoutMs);
+    /** @brief connects to server and sends the first message along with the SYN */
+    bool connectFastOpen(std::string sIpAddress,unsigned uPort,const unsigned char *pMsg,unsigned uLength);
     /** @brief disconnects from sever on the client side */
     void disconnect();
+    /** @brief waits for data and reads it into the message queue */
+    int runOnce(int nTimeoutMs);
+    /** @brief reads whatever is available on the socket without waiting */
+    int readAvailable();
+    /** @brief waits for the next complete message from the server */
+    bool receiveMessage(Message_t &msg,int nTimeoutMs);
+    /** @brief enables or disables queuing of data that cannot be sent right away */
+    void setQueuedSend(bool bQueued);
+    /** @brief registers a function to be called when send data gets queued */
+    void setSendNotify(SendNotify_t pNotify,void *pUser);
+    /** @brief sends as much of the send queue as the socket accepts */
+    int  flushSendQueue();
+    /** @brief returns true if data is waiting on the send queue */
+    bool hasPendingSend();
+    /** @brief enables automatic reconnects */
+    void setReconnectPolicy(const ReconnectPolicy_t &policy);
+    /** @brief returns the number of messages held until the connection is back */
+    unsigned getQueuedMessageCount() const { return (unsigned)m_ReconnectQueue.size(); }
+    /** @brief returns the number of times the connection was re-established */
+    unsigned long getReconnectCount() const { return m_uReconnectCount; }
 
     const std::string& getSIpAddress() const {  return m_sIpAddress;   }
     unsigned getUPortNumber()          const {  return m_uPortNumber;  }
-    bool     isConnected()             const {  return (m_socket>0);   }
+    bool     isConnected()             const {  return (m_socket>0 && !m_bConnecting); }
+    bool     isConnecting()            const {  return m_bConnecting;  }
+    int      getHandle()               const {  return m_socket;       }
+    const FastOpenStats_t& getFastOpenStats() const { return m_FastOpenStats; }
 };
 
 #endif /* TCPMESSAGING_H */
@@ -33,6 +33,7 @@
 #include <assert.h>
 #define _SUPRESS_TRACE
 #include "TRACE.h"
+#include "Timer.h"
 
 /** cygwin hack */
 #ifndef MSG_WAITALL
@@ -66,6 +67,12 @@ CTcpServer::CTcpServer(unsigned uPort) {
 #   endif
     m_uPort=uPort;
     m_ListenSocket=-1;
+    m_bListening=false;
+    m_uBusyPollSpinUs=0;
+    m_nBusyPollCpu=-1;
+    m_uSocketBusyPollUs=0;
+    m_uClientListVersion=0;
+    m_uBusyPollVersion=0;
     m_pConnectionCallback= NULL;
     m_pNewDataCallback=NULL;
 
@@ -124,20 +131,152 @@ CTcpServer::CTcpServer(unsigned uPort) {
  * @note this function blocks until a kill command is received
  */
 bool CTcpServer::start() {
-    int nFds=0;
-    int numSelected=0;
-    ClientList_t::iterator connection;
     std::time_t now=time(0);
-    std::list<Handle_t> close_list;
-    std::list<Handle_t> data_list;
-
 
     PTRACE1("Server started at %s\n",ctime(&now));
+    UNUSED(now);
+
+    if(!Listen()) {
+        return false;
+    }
+
+    if(m_uBusyPollSpinUs != 0) {
+        return BusyPollLoop();
+    }
+
+    while(  m_ListenSocket != -1) {
+        //This waits forever
+        if(RunOnce(-1) < 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Server loop used in busy poll mode. The connections are read without
+ * blocking for as long as there is activity (see BusyPollOnce()). Once
+ * nothing has arrived for the configured spin time the loop falls back to
+ * a blocking select and starts spinning again after the next wake up.
+ * @retval true if successful
+ * @retval false if error
+ */
+bool CTcpServer::BusyPollLoop() {
+    unsigned long long lastActivity;
+    int nResults;
+
+#ifdef __linux__
+    if(m_nBusyPollCpu >= 0) {
+        cpu_set_t cpuSet;
+        CPU_ZERO(&cpuSet);
+        CPU_SET(m_nBusyPollCpu,&cpuSet);
+        if(pthread_setaffinity_np(pthread_self(),sizeof(cpuSet),&cpuSet) != 0) {
+            PERROR1("Could not pin server thread to cpu %d\n",m_nBusyPollCpu);
+        }
+    }
+#endif
+
+    //make the first pass build the socket list
+    m_uBusyPollVersion=m_uClientListVersion-1;
+    lastActivity=CTimer::getMonotonicUs();
+    while(  m_ListenSocket != -1) {
+        nResults=BusyPollOnce();
+        if(nResults < 0) {
+            return false;
+        }
+        if(nResults > 0) {
+            lastActivity=CTimer::getMonotonicUs();
+            continue;
+        }
+        //nothing arrived for a while, go to sleep until something shows up
+        if(m_uBusyPollSpinUs != BUSY_POLL_FOREVER &&
+                CTimer::getMonotonicUs() - lastActivity >= m_uBusyPollSpinUs) {
+            if(RunOnce(-1) < 0) {
+                return false;
+            }
+            lastActivity=CTimer::getMonotonicUs();
+        }
+    }
+    return true;
+}
+
+/**
+ * Does one pass of the busy poll loop. Every connection is read once with
+ * a non blocking recv and a pending connection is accepted. The list of
+ * connections is only rebuilt after a connection was added or closed, so
+ * a pass costs one system call per connection and one for the listen
+ * socket.
+ * @return Number of sockets that had activity
+ * @retval -1 if error
+ */
+int CTcpServer::BusyPollOnce() {
+    unsigned char buffer[16*1024];
+    std::vector<Handle_t>::iterator it;
+    ClientList_t::iterator connection;
+    struct timeval timeout={0,0};
+    int nActivity=0;
+    int nResults;
+
+    if(m_uBusyPollVersion != m_uClientListVersion || !m_CloseList.empty()) {
+        ProcessCloseList();
+        m_BusyPollSockets.clear();
+        pthread_mutex_lock(&m_ClientListMutex);
+        for(connection=m_ClientList.begin(); connection != m_ClientList.end(); connection++) {
+            if(connection->second.bClosed == false) {
+                m_BusyPollSockets.push_back(connection->first);
+            }
+        }
+        m_uBusyPollVersion=m_uClientListVersion;
+        pthread_mutex_unlock(&m_ClientListMutex);
+    }
+
+    for(it=m_BusyPollSockets.begin(); it != m_BusyPollSockets.end(); it++) {
+        nResults=recv(*it,(char*)buffer,sizeof(buffer),MSG_DONTWAIT);
+        if(nResults > 0) {
+            if(m_pNewDataCallback != NULL) {
+                m_pNewDataCallback(*it,buffer,(unsigned)nResults,m_pNewDataUser);
+            }
+            nActivity++;
+        } else if(nResults == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            //the socket list is rebuilt once this is removed
+            PTRACE("Remote end closed the connection!\n");
+            m_CloseList.push_back(*it);
+            nActivity++;
+        }
+    }
+
+    //did we get a new connection (must do this after checking for data)
+    FD_ZERO(&m_ReadSocks);
+    FD_SET(m_ListenSocket,&m_ReadSocks);
+    nResults=select(m_ListenSocket+1,&m_ReadSocks,NULL,NULL,&timeout);
+    if(nResults == -1 && errno != EINTR) {
+        int err=errno;
+        PERROR1("Error Select: Errno: %d\n",err);
+        return -1;
+    }
+    if(nResults > 0) {
+        HandleConnection(m_ListenSocket);
+        nActivity++;
+    }
+
+    return nActivity;
+}
+
+/**
+ * Puts the listen socket in the listening state. Calling this function
+ * more than once has no effect.
+ * @retval true if successful
+ * @retval false if error
+ */
+bool CTcpServer::Listen() {
     //do we have good socket to listen over
     if(m_ListenSocket == -1) {
         //bad socket
         return false;
     }
+    if(m_bListening) {
+        return true;
+    }
     //wait for the connection
     if (listen(m_ListenSocket,MAX_CONNECTIONS) == -1) {
         int err=errno;
@@ -145,89 +284,204 @@ bool CTcpServer::start() {
         perror("listen");
         return false;
     }
+    m_bListening=true;
+    return true;
+}
 
-    while(  m_ListenSocket != -1) {
-        //need to build the FD list every time        
-        nFds=BuildSelectList();        
-        if(nFds < 1) {
-            return false;
+/**
+ * Runs a single iteration of the server loop: waits for activity on the
+ * listen socket or any of the client connections, dispatches the received
+ * data and accepts new connections. This allows the server to be driven
+ * from an external event loop instead of the server thread.
+ * @param nTimeoutMs Number of milliseconds to wait for activity. Zero
+ *        polls without blocking and a negative value waits forever.
+ * @return Number of descriptors that had activity (zero on timeout)
+ * @retval -1 if error
+ * @note Listen() must be called before the first call to this function
+ */
+int CTcpServer::RunOnce(int nTimeoutMs) {
+    int nFds=0;
+    int numSelected=0;
+    struct timeval timeout;
+    ClientList_t::iterator connection;
+    std::list<Handle_t> data_list;
+
+    if(!m_bListening && !Listen()) {
+        return -1;
+    }
+
+    //If there are any connections that need to be removed, now is a good time
+    ProcessCloseList();
+
+    //need to build the FD list every time
+    nFds=BuildSelectList();
+    if(nFds < 1) {
+        return -1;
+    }
+
+    timeout.tv_sec  = nTimeoutMs / 1000;
+    timeout.tv_usec = (nTimeoutMs % 1000) * 1000;
+    numSelected=select(nFds+1,&m_ReadSocks,NULL,&m_ErrorSocks,(nTimeoutMs < 0) ? NULL : &timeout);
+    //check for error
+    if(numSelected == -1) {
+        //if we get a bad file descriptor, just continue.
+        //This will probably mean that someone closed a socket we were receiving on
+        //This should not cause a problem and the socket will be removed from
+        //the client list by the close_list service routine
+        if(errno != EBADF && errno != EINTR) {
+            int err=errno;
+            PERROR1("Error Select: Errno: %d\n",err);
+            perror("select");
+            return -1;
         }
-        //If there are any connections that need to be removed, now is a good time
-        if(close_list.size() > 0) {
-            //Remove the connections marked for deletion
-            for(std::list<Handle_t>::iterator it=close_list.begin();
-                    it!= close_list.end();
-                    it++) {
-                now=time(0);
-                PTRACE1("Client disconnected at %s\n",ctime(&now));
-                CloseConnectionCallback(*it);
-                pthread_mutex_lock(&m_ClientListMutex);
-                m_ClientList.erase(*it);
-                pthread_mutex_unlock(&m_ClientListMutex);
-            }
-            //clear the list
-            close_list.clear();
+        return 0;
+    }
+
+
+    //Note: we cannot just erase elements as we find them because it will corrupt the iterator
+    //      so we make a list and delete them after we're done walking the list
+    //check for new data
+    pthread_mutex_lock(&m_ClientListMutex);
+    for(connection=m_ClientList.begin();
+            connection != m_ClientList.end();
+            connection++) {
+
+        //is the connection just marked for deletion?
+        if(connection->second.bClosed == true) {
+            m_CloseList.push_back(connection->first);
+            continue;
         }
-        //This waits forever        
-        numSelected=select(nFds+1,&m_ReadSocks,NULL,&m_ErrorSocks,NULL);        
-        //check for error
-        if(numSelected == -1) {
-            //if we get a bad file descriptor, just continue.
-            //This will probably mean that someone closed a socket we were receiving on
-            //This should not cause a problem and the socket will be removed from
-            //the client list by the close_list service routine
-            if(errno != EBADF) {
-                int err=errno;
-                PERROR1("Error Select: Errno: %d\n",err);
-                perror("select");
-                return false;
-            }
+        if(FD_ISSET(connection->first,&m_ErrorSocks)) {
+            m_CloseList.push_back(connection->first);
+        }
+        if(FD_ISSET(connection->first,&m_ReadSocks)) {
+            data_list.push_back(connection->first);
         }
+    }
+    pthread_mutex_unlock(&m_ClientListMutex);
 
+    //process data after walking the connection list.
+    //This because the connection list mutex may be locked and
+    //handle data callback may need to access the client list mutex (as in SendData)
+    //which would results in a deadlock
+    for(std::list<Handle_t>::iterator it=data_list.begin();
+                it!= data_list.end();
+                it++) {
+        if(!HandleData(*it)) {
+            //if there is an error in the handler, we'll close this connection
+            m_CloseList.push_back(*it);
+        }
+    }
 
-        //Note: we cannot just erase elements as we find them because it will corrupt the iterator
-        //      so we make a list and delete them after we're done walking the list
-        //check for new data        
-        pthread_mutex_lock(&m_ClientListMutex);        
-        for(connection=m_ClientList.begin();
-                connection != m_ClientList.end();
-                connection++) {
-            
-            if(FD_ISSET(connection->first,&m_ErrorSocks)) {
-                close_list.push_back(connection->first);
-            }
-            if(FD_ISSET(connection->first,&m_ReadSocks)) {                
-                data_list.push_back(connection->first);                                
-            }
-           
-            //is the connection just marked for deletion?
-            if(connection->second.bClosed == true) {
-                close_list.push_back(connection->first);          
-            }
+    //did we get a new connection (must do this after checking for data)
+    if(FD_ISSET(m_ListenSocket,&m_ReadSocks)) {
+        HandleConnection(m_ListenSocket);
+    }
+
+    return numSelected;
+}
 
+/**
+ * Enables TCP fast open on the listen socket. Clients that hold a fast
+ * open cookie from an earlier connection can then send their first message
+ * along with the SYN, saving a round trip before the request is seen.
+ * @param uQueueLength Maximum number of pending fast open requests
+ * @retval true if successful
+ * @retval false if fast open is not supported
+ */
+bool CTcpServer::EnableFastOpen(unsigned uQueueLength) {
+#ifdef TCP_FASTOPEN
+    int nQueueLength=(int)uQueueLength;
+
+    if(m_ListenSocket == -1) {
+        return false;
+    }
+    if(setsockopt(m_ListenSocket,IPPROTO_TCP,TCP_FASTOPEN,(char *)&nQueueLength,sizeof(nQueueLength)) == -1) {
+        int err=errno;
+        PERROR1("Could not enable TCP fast open. Errno: %d\n",err);
+        return false;
+    }
+    return true;
+#else
+    UNUSED(uQueueLength);
+    return false;
+#endif
+}
+
+/**
+ * Enables the busy poll mode of the server loop started by start() or
+ * StartSeverThread(). In this mode the server thread spins on non blocking
+ * polls of its sockets instead of sleeping in select, trading cpu time for
+ * wake up latency. Must be called before the server is started.
+ * @param uSpinUs Number of micro seconds without activity after which the
+ *        loop falls back to a blocking wait. Zero disables busy polling and
+ *        BUSY_POLL_FOREVER never blocks.
+ * @param nCpu Cpu to pin the server thread to (-1 leaves the affinity alone)
+ * @param uSocketBusyPollUs SO_BUSY_POLL value set on accepted connections so
+ *        the kernel also polls the device queue on reads (0 leaves it alone)
+ */
+void CTcpServer::SetBusyPoll(unsigned uSpinUs,int nCpu,unsigned uSocketBusyPollUs) {
+    m_uBusyPollSpinUs=uSpinUs;
+    m_nBusyPollCpu=nCpu;
+    m_uSocketBusyPollUs=uSocketBusyPollUs;
+}
+
+/**
+ * Removes the connections that were marked for deletion from the
+ * client list and notifies the user
+ */
+void CTcpServer::ProcessCloseList() {
+    std::time_t now;
+
+    //Remove the connections marked for deletion
+    for(std::list<Handle_t>::iterator it=m_CloseList.begin();
+            it!= m_CloseList.end();
+            it++) {
+        now=time(0);
+        PTRACE1("Client disconnected at %s\n",ctime(&now));
+        UNUSED(now);
+        pthread_mutex_lock(&m_ClientListMutex);
+        ClientList_t::iterator itClient=m_ClientList.find(*it);
+        if(itClient == m_ClientList.end()) {
+            //already removed
+            pthread_mutex_unlock(&m_ClientListMutex);
+            continue;
         }
-        pthread_mutex_unlock(&m_ClientListMutex);      
-        
-        //process data after walking the connection list.
-        //This because the connection list mutex may be locked and
-        //handle data callback may need to access the client list mutex (as in SendData)
-        //which would results in a deadlock
-        for(std::list<Handle_t>::iterator it=data_list.begin();
-                    it!= data_list.end();
-                    it++) {
-            if(!HandleData(*it)) {
-                //if there is an error in the handler, we'll close this connection
-                close_list.push_back(*it);
-            }
+        bool bClosedByUser=itClient->second.bClosed;
+        m_ClientList.erase(itClient);
+        m_uClientListVersion++;
+        pthread_mutex_unlock(&m_ClientListMutex);
+        //connections closed by the user have already been reported and closed
+        if(!bClosedByUser) {
+            CloseConnectionCallback(*it);
+            shutdown(*it,SHUT_RDWR);
+            close(*it);
         }
-        data_list.clear();
+    }
+    //clear the list
+    m_CloseList.clear();
+}
 
-        //did we get a new connection (must do this after checking for data)
-        if(FD_ISSET(m_ListenSocket,&m_ReadSocks)) {            
-            HandleConnection(m_ListenSocket);
-        }        
+/**
+ * Returns the descriptors used by the server so that they can be added
+ * to an external event loop. The listen handle is always the first entry.
+ * @param[out] handles receives the list of handles
+ */
+void CTcpServer::GetHandles(std::vector<Handle_t> &handles) {
+    ClientList_t::iterator connection;
+
+    handles.clear();
+    if(m_ListenSocket == -1) {
+        return;
     }
-    return true;
+    handles.push_back(m_ListenSocket);
+    pthread_mutex_lock(&m_ClientListMutex);
+    for(connection=m_ClientList.begin(); connection != m_ClientList.end(); connection++) {
+        if(connection->second.bClosed == false) {
+            handles.push_back(connection->first);
+        }
+    }
+    pthread_mutex_unlock(&m_ClientListMutex);
 }
 
 
@@ -256,6 +510,16 @@ bool CTcpServer::HandleConnection(SOCKET socket) {
     
     SOCKET NewSocket=accept(socket,(struct sockaddr *)&cin,&addrlen);
 
+#if defined(SO_BUSY_POLL)
+    if(m_uSocketBusyPollUs != 0 && NewSocket != -1) {
+        int nBusyPoll=(int)m_uSocketBusyPollUs;
+        if(setsockopt(NewSocket,SOL_SOCKET,SO_BUSY_POLL,(char *)&nBusyPoll,sizeof(nBusyPoll)) == -1) {
+            int err=errno;
+            PERROR1("Could not set SO_BUSY_POLL. Errno: %d\n",err);
+        }
+    }
+#endif
+
 #ifdef DISABLE_NAGLE
     nResults = setsockopt(
                    NewSocket,       /* socket affected */
@@ -290,6 +554,7 @@ bool CTcpServer::HandleConnection(SOCKET socket) {
         //add it to the list of sockets
         pthread_mutex_lock(&m_ClientListMutex);
         m_ClientList.insert(ClientList_t::value_type(NewSocket,clientInfo));
+        m_uClientListVersion++;
         pthread_mutex_unlock(&m_ClientListMutex);
     } else {
         int err=errno;        
@@ -326,7 +591,7 @@ bool CTcpServer::HandleData(SOCKET socket) {
                 m_pNewDataCallback(socket,buffer,(unsigned)length,m_pNewDataUser);                
             }
             //connection is being closed
-            if (m_pConnectionCallback != NULL && length == 0) {
+            if (length == 0) {
                 PTRACE("Remote end closed the connection!\n");
                 return false;
             }
@@ -418,6 +683,10 @@ int CTcpServer::BuildSelectList() {
     FD_SET(m_ListenSocket,&m_ReadSocks);
     pthread_mutex_lock(&m_ClientListMutex);
     for(connection=m_ClientList.begin(); connection != m_ClientList.end(); connection++) {
+        //closed sockets will be removed by the close list service routine
+        if(connection->second.bClosed) {
+            continue;
+        }
         FD_SET(connection->first,&m_ReadSocks);
         FD_SET(connection->first,&m_ErrorSocks);
         if(connection->first > highestFd) {
@@ -446,6 +715,7 @@ void CTcpServer::CloseAllConnections(){
         //connections, the iterator will be corrupted
         itClient->second.bClosed=true;
     }
+    m_uClientListVersion++;
     pthread_mutex_unlock(&m_ClientListMutex);
 }
 /**
@@ -468,6 +738,7 @@ bool CTcpServer::CloseConnection(Handle_t handle) {
         //this is called when we are handling data by going throught the list of
         //connections, the iterator will be corrupted
         itClient->second.bClosed=true;
+        m_uClientListVersion++;
     }
     pthread_mutex_unlock(&m_ClientListMutex);
 
@@ -534,6 +805,38 @@ bool CTcpServer::SendToClient(Handle_t handle,unsigned char *pData,unsigned uLen
     return true;
 }
 
+/**
+ * Sends data to the client without insisting that all of it goes out. This
+ * is the low level transmit of a CMessaging on a server connection (see
+ * CTcpServerLink), which retries with the rest of the data itself.
+ * @param handle Handle of the connection
+ * @param pData pointer to data buffer
+ * @param uLength Length of the data buffer
+ * @return number of bytes sent (0 if the socket is full) or -1 if the send
+ *         failed or if we are not connected
+ */
+int CTcpServer::WriteToClient(Handle_t handle,const unsigned char *pData,unsigned uLength) {
+    int nResults;
+
+    pthread_mutex_lock(&m_ClientListMutex);
+    if(m_ClientList.find(handle)== m_ClientList.end()) {
+        pthread_mutex_unlock(&m_ClientListMutex);
+        PERROR1("handle %d doesnot exist\n",handle);
+        return -1;
+    }
+    pthread_mutex_unlock(&m_ClientListMutex);
+    nResults=send(handle,(const char*)pData,uLength,MSG_NOSIGNAL);
+    if(nResults < 0) {
+        int err=errno;
+        if(err == EAGAIN || err == EWOULDBLOCK || err == EINTR){
+            return 0;
+        }
+        PERROR2("Failed to send data to handle %d. Errno: %d\n",handle,err);
+        return -1;
+    }
+    return nResults;
+}
+
 /** 
  * Starts a thread to run the server
  * @retval true Success
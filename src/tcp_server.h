@@ -10,6 +10,8 @@
 
 #include <pthread.h>
 #include <map>
+#include <list>
+#include <vector>
 
 extern "C" void * ThreadHelper(void *);
 
@@ -20,6 +22,10 @@ public:
     typedef enum {New,Close} ConnectionState_t;
     /** Bad connection handles */
     enum  {INVALID_HANDLE = -1};
+    /** busy poll spin time that never falls back to blocking */
+    enum  {BUSY_POLL_FOREVER = 0xFFFFFFFF};
+    /** default number of pending fast open requests */
+    enum  {DEFAULT_FASTOPEN_QUEUE = 64};
     /** connection handle type */
     typedef SOCKET Handle_t;
     /** connection info structure */
@@ -46,6 +52,18 @@ public:
     typedef void (*DataCallback_t)(Handle_t handle,unsigned char *pData, unsigned uLength,void *pUser);
     /** @brief starts the server */
     bool start();
+    /** @brief puts the listen socket in the listening state */
+    bool Listen();
+    /** @brief runs a single iteration of the server loop */
+    int RunOnce(int nTimeoutMs);
+    /** @brief returns the listen socket handle */
+    Handle_t GetListenHandle() const { return m_ListenSocket; }
+    /** @brief returns the listen handle followed by all the client handles */
+    void GetHandles(std::vector<Handle_t> &handles);
+    /** @brief enables TCP fast open on the listen socket */
+    bool EnableFastOpen(unsigned uQueueLength=DEFAULT_FASTOPEN_QUEUE);
+    /** @brief enables the busy poll mode of the server loop */
+    void SetBusyPoll(unsigned uSpinUs,int nCpu=-1,unsigned uSocketBusyPollUs=0);
     /** @brief Class constructor */
     CTcpServer(unsigned uPort);
     /** @brief class destructor */
@@ -59,6 +77,8 @@ public:
     void CloseAllConnections();
     /** @brief Sends dara back to client */
     bool SendToClient(Handle_t handle,unsigned char *pData,unsigned uLength);
+    /** @brief sends as much data to the client as the socket takes */
+    int  WriteToClient(Handle_t handle,const unsigned char *pData,unsigned uLength);
     /** @brief this function starts a thread and calls the start function */
     bool StartSeverThread();
     /** @brief this function stops the server thread */
@@ -78,6 +98,10 @@ protected:
     ClientList_t m_ClientList;
     /** listen socket */
     SOCKET m_ListenSocket;
+    /** set to true once listen has been called on the listen socket */
+    bool m_bListening;
+    /** connections waiting to be removed from the client list */
+    std::list<Handle_t> m_CloseList;
     /** descriptor list used for select */
     fd_set m_ReadSocks;
     fd_set m_ErrorSocks;
@@ -91,6 +115,18 @@ protected:
     void * m_pConntectionUser;
     /** thread id of the server thread */
     pthread_t m_threadId;
+    /** number of uS to spin on the sockets before blocking (0 disables busy polling) */
+    unsigned m_uBusyPollSpinUs;
+    /** cpu the server thread is pinned to in busy poll mode (-1 for no pinning) */
+    int m_nBusyPollCpu;
+    /** value of SO_BUSY_POLL set on accepted sockets (0 leaves the option alone) */
+    unsigned m_uSocketBusyPollUs;
+    /** changes every time a connection is added, closed or removed */
+    volatile unsigned m_uClientListVersion;
+    /** m_uClientListVersion when m_BusyPollSockets was built */
+    unsigned m_uBusyPollVersion;
+    /** connections read by the busy poll loop */
+    std::vector<Handle_t> m_BusyPollSockets;
 
     /** @brief Disable socket blocking*/
     bool SetNoBlocking(SOCKET socket);
@@ -102,6 +138,12 @@ protected:
     int BuildSelectList(void);
     /** @brief Calls the users close connection callback */
     void CloseConnectionCallback(Handle_t handle);
+    /** @brief removes the connections on the close list */
+    void ProcessCloseList();
+    /** @brief runs the server loop in busy poll mode */
+    bool BusyPollLoop();
+    /** @brief reads every connection once without blocking */
+    int BusyPollOnce();
 
     static void *threadHelper(void *);
 };
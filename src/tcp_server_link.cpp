@@ -0,0 +1,26 @@
+/**
+ * @file tcp_server_link.cpp
+ *
+ * @date   Oct 18, 2026
+ */
+
+#include "tcp_server_link.h"
+
+/**
+ * Class constructor
+ * @param server Server that accepted the connection. It must outlive the link.
+ * @param handle Handle of the connection
+ */
+CTcpServerLink::CTcpServerLink(CTcpServer &server,CTcpServer::Handle_t handle):m_server(server) {
+    m_handle=handle;
+}
+
+/**
+ * Sends data to the client
+ * @param pBuffer pointer to the data
+ * @param uLength number of bytes
+ * @return number of bytes sent (can be zero) or -1 on error
+ */
+int CTcpServerLink::xmitMsg(const unsigned char *pBuffer,unsigned uLength) {
+    return m_server.WriteToClient(m_handle,pBuffer,uLength);
+}
@@ -0,0 +1,35 @@
+/**
+ * @file tcp_server_link.h
+ *
+ * @date   Oct 18, 2026
+ */
+
+#ifndef TCPSERVERLINK_H
+#define TCPSERVERLINK_H
+
+#include "Messaging.h"
+#include "tcp_server.h"
+
+/**
+ * Messaging on one connection accepted by a CTcpServer. Frames go out
+ * through the server's socket for the connection; the server's data
+ * callback hands the received data to processChunk(). This gives the
+ * server end of a connection everything CTcpMessaging gives the client
+ * end, e.g. a CStreamMux.
+ */
+class CTcpServerLink: public CMessaging {
+public:
+    CTcpServerLink(CTcpServer &server,CTcpServer::Handle_t handle);
+
+    /** @brief returns the handle of the connection */
+    CTcpServer::Handle_t getHandle() const {return m_handle;}
+
+protected:
+    CTcpServer &         m_server;
+    CTcpServer::Handle_t m_handle;
+
+    /** @brief low level messaging */
+    virtual int xmitMsg(const unsigned char *pBuffer,unsigned uLength);
+};
+
+#endif /* TCPSERVERLINK_H */
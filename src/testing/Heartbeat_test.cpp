@@ -0,0 +1,107 @@
+/**
+ * @file Heartbeat_test.cpp
+ *
+ * Unit tests for the heartbeats and the dead peer detection
+ */
+
+#include "gtest.h"
+#include "heartbeat_monitor.h"
+#include <string.h>
+
+#define mSleep(x) (usleep(x*1000))
+
+/**
+ * Hands everything it transmits straight to the peer. A peer without a
+ * partner drops all the data, which looks like a half open connection.
+ */
+class linkedPeer: public CMessaging{
+protected:
+    linkedPeer *m_pPeer;
+    unsigned    m_uDelayMs; //emulated network delay
+
+    virtual int xmitMsg(const unsigned char *pBuffer, unsigned uLength){
+        if(m_pPeer != NULL){
+            unsigned char *pCopy=new unsigned char[uLength];
+            memcpy(pCopy,pBuffer,uLength);
+            mSleep(m_uDelayMs);
+            m_pPeer->processChunk(pCopy,uLength);
+            delete[] pCopy;
+        }
+        return (int)uLength;
+    }
+
+public:
+    linkedPeer(){
+        m_pPeer=NULL;
+        m_uDelayMs=0;
+    }
+    void link(linkedPeer *pPeer,unsigned uDelayMs=0){
+        m_pPeer=pPeer;
+        m_uDelayMs=uDelayMs;
+    }
+};
+
+/**
+ * Counts the dead peer notifications
+ */
+static void deadPeerFunction(CMessaging *pConnection,void *pUser){
+    UNUSED(pConnection);
+
+    (*(unsigned *)pUser)++;
+}
+
+/**
+ * Heartbeats are answered by the peer and never show up as messages
+ */
+TEST(Heartbeat,roundTrip){
+    linkedPeer a,b;
+    CHeartbeatMonitor monitor(20,3);
+    unsigned char msg[]="payload";
+    CMessaging::Message_t received;
+
+    a.link(&b);
+    b.link(&a,2);
+    monitor.add(&a);
+    ASSERT_TRUE(monitor.start());
+    mSleep(200);
+    monitor.stop();
+
+    EXPECT_FALSE(a.isPeerDead());
+    EXPECT_EQ(1u,monitor.getConnectionCount());
+    EXPECT_GE(a.getHeartbeatRtt(),2000ul);
+    EXPECT_GE(a.getSmoothedHeartbeatRtt(),2000ul);
+    EXPECT_EQ(0u,b.getMessageCount());
+
+    //user messages still go through
+    ASSERT_TRUE(a.sendMessage(msg,sizeof(msg)));
+    ASSERT_EQ(1u,b.getMessageCount());
+    received=b.getMsg();
+    ASSERT_EQ(sizeof(msg),received.uMsgLength);
+    EXPECT_EQ(0,memcmp(msg,received.pData,sizeof(msg)));
+    delete[] received.pData;
+}
+
+/**
+ * A peer that does not answer is reported after the missed heartbeats
+ */
+TEST(Heartbeat,deadPeer){
+    linkedPeer a,silent;
+    CHeartbeatMonitor monitor(10,3);
+    unsigned uDeadCount=0;
+
+    a.link(&silent);
+    monitor.registerDeadPeerCallback(deadPeerFunction,&uDeadCount);
+    monitor.add(&a);
+    ASSERT_TRUE(monitor.start());
+    mSleep(150);
+    monitor.stop();
+
+    EXPECT_TRUE(a.isPeerDead());
+    EXPECT_EQ(1u,uDeadCount);
+    EXPECT_EQ(0u,monitor.getConnectionCount());
+    EXPECT_EQ(0ul,a.getHeartbeatRtt());
+
+    //adding the connection back starts over
+    monitor.add(&a);
+    EXPECT_FALSE(a.isPeerDead());
+}
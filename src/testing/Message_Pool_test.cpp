@@ -0,0 +1,70 @@
+/**
+ * @file Message_Pool_test.cpp
+ *
+ * Unit test procedures for the buffer pool and message handles.
+ * @date   Oct 18, 2026
+ */
+
+#include "message_pool.h"
+#include <string.h>
+
+#include "gtest.h"
+
+/**
+ * Released buffers are handed out again instead of coming from the heap
+ */
+TEST(bufferPool,recycles){
+    CBufferPool pool;
+    unsigned char *pFirst;
+    unsigned char *pSecond;
+
+    pFirst=pool.allocate(100);
+    ASSERT_TRUE(pFirst != NULL);
+    EXPECT_GE(CBufferPool::getCapacity(pFirst),100UL);
+    EXPECT_EQ(pool.getHeapAllocations(),1UL);
+    CBufferPool::release(pFirst);
+
+    //same size class, so the buffer comes back
+    pSecond=pool.allocate(120);
+    EXPECT_EQ(pSecond,pFirst);
+    EXPECT_EQ(pool.getHeapAllocations(),1UL);
+    CBufferPool::release(pSecond);
+
+    //a different size class needs a new buffer
+    pSecond=pool.allocate(1000);
+    EXPECT_EQ(pool.getHeapAllocations(),2UL);
+    CBufferPool::release(pSecond);
+}
+
+/**
+ * Copies of a handle share the buffer, which is recycled with the last one
+ */
+TEST(bufferPool,handles){
+    CBufferPool pool;
+    unsigned char *pData;
+
+    {
+        CMessage msg(32,&pool);
+        CMessage copy;
+
+        ASSERT_FALSE(msg.empty());
+        EXPECT_TRUE(copy.empty());
+        pData=msg.data();
+        memset(pData,'x',msg.size());
+        copy=msg;
+        EXPECT_EQ(copy.data(),pData);
+        EXPECT_EQ(copy.size(),32UL);
+        msg.reset();
+        EXPECT_TRUE(msg.empty());
+
+        //still referenced by the copy
+        unsigned char *pOther=pool.allocate(32);
+        EXPECT_NE(pOther,pData);
+        CBufferPool::release(pOther);
+        EXPECT_EQ(copy.data()[31],'x');
+    }
+    //both handles are gone so the buffer is free again
+    pData=pool.allocate(32);
+    EXPECT_EQ(pool.getHeapAllocations(),2UL);
+    CBufferPool::release(pData);
+}
@@ -7,7 +7,10 @@
  */
 
 #include "Messaging.h"
+#include "Timer.h"
 #include <algorithm>
+#include <string>
+#include <vector>
 
 #include "gtest.h"
 
@@ -376,3 +379,1241 @@ TEST(partialTransmitter,expectedFailures){
 
 }
 
+
+/**
+ * Feed the data through the receive buffer in small pieces
+ */
+TEST(fullTransmiter,receiveBuffer){
+    transmitsAll t;
+    const unsigned messageLength=1000;
+    const unsigned pieceSize=7;
+    const char *szTestMsg="Hello world";
+    unsigned char transmitBuffer[messageLength];
+    unsigned char *pRawData;
+    unsigned char *pReceiveBuffer;
+    CMessaging::Message_t msg;
+    unsigned rawDataSize,offset,length;
+
+    strncpy((char*)transmitBuffer,szTestMsg,messageLength);
+    ASSERT_TRUE(t.sendMessage(transmitBuffer,messageLength));
+    ASSERT_TRUE(t.sendMessage(transmitBuffer,messageLength));
+    rawDataSize=t.getRawDataSize();
+    pRawData=t.getRawData();
+
+    for(offset=0; offset < rawDataSize; offset+=length){
+        length=std::min(pieceSize,rawDataSize-offset);
+        //pretend the receiver gives back less than the buffer size
+        pReceiveBuffer=t.getReceiveBuffer(64);
+        memcpy(pReceiveBuffer,pRawData+offset,length);
+        t.processReceived(length);
+    }
+    ASSERT_EQ(t.getMessageCount(), (unsigned)2);
+    for(unsigned i=0; i < 2; i++){
+        msg=t.getMsg();
+        ASSERT_EQ(strcmp((char*)msg.pData,szTestMsg),0);
+        ASSERT_EQ(msg.uMsgLength, messageLength);
+        delete[] msg.pData;
+    }
+    delete[] pRawData;
+}
+
+/**
+ * A message made of several pieces survives a medium that only takes a few
+ * bytes at a time
+ */
+TEST(partialTransmitter,pieces){
+    partialTransmitter t;
+    const char *pieces[]={"Major Tom ","to ","ground control"};
+    const char *szTestMsg="Major Tom to ground control";
+    struct iovec vector[3];
+    unsigned char *pRawData;
+    CMessaging::Message_t msg;
+    unsigned rawDataSize;
+
+    for(unsigned i=0; i < 3; i++){
+        vector[i].iov_base=(void*)pieces[i];
+        vector[i].iov_len=strlen(pieces[i])+(i == 2 ? 1 : 0);
+    }
+    t.setFailedPacketInterval(3);
+    ASSERT_TRUE(t.sendMessage(vector,3));
+
+    rawDataSize=t.getRawDataSize();
+    ASSERT_EQ(rawDataSize,(unsigned)strlen(szTestMsg)+1+6);
+    pRawData=t.getRawData();
+    ASSERT_TRUE(t.processChunk(pRawData,rawDataSize));
+    ASSERT_EQ(t.getMessageCount(), (unsigned)1);
+    msg=t.getMsg();
+    EXPECT_STREQ((char*)msg.pData,szTestMsg);
+    delete[] msg.pData;
+    delete[] pRawData;
+}
+
+/**
+ * Takes whole gather lists until its byte budget runs out
+ */
+class budgetTransmitter: public CMessaging{
+protected:
+    CAssembler m_transmittedData; //this holds the the data we get
+    unsigned m_uBudget;           //number of bytes accepted before failing
+
+    virtual int xmitMsg(const unsigned char *pBuffer, unsigned uLength){
+        struct iovec vector={(void*)pBuffer,uLength};
+        return xmitMsgV(&vector,1);
+    }
+    virtual int xmitMsgV(const struct iovec *pVector, unsigned uCount){
+        unsigned uSent=0;
+
+        m_uCalls++;
+        if(m_uBudget == 0){
+            return -1;
+        }
+        for(unsigned i=0; i < uCount && m_uBudget > 0; i++){
+            unsigned uLength=std::min((unsigned)pVector[i].iov_len,m_uBudget);
+            m_transmittedData.Append((const unsigned char*)pVector[i].iov_base,uLength);
+            m_uBudget-=uLength;
+            uSent+=uLength;
+        }
+        return (int)uSent;
+    }
+
+public:
+    unsigned m_uCalls; //number of calls to the vectored transmit function
+
+    budgetTransmitter(unsigned uBudget){
+        m_uBudget=uBudget;
+        m_uCalls=0;
+    }
+    //feeds everything sent so far back into the receiver
+    void loopBack(){
+        unsigned uSize=m_transmittedData.Size();
+        unsigned char *pData=new unsigned char[uSize];
+        m_transmittedData.Pop(pData,uSize);
+        processChunk(pData,uSize);
+        delete[] pData;
+    }
+};
+
+/**
+ * A batch is framed into a few gather lists and a failing link reports
+ * exactly which messages went out
+ */
+TEST(fullTransmiter,sendMessages){
+    const unsigned uCount=10;
+    const unsigned messageLength=20;
+    const unsigned frameLength=messageLength+6;
+    unsigned char buffers[uCount][messageLength];
+    CMessaging::Message_t messages[uCount];
+    CMessaging::Message_t msg;
+    unsigned uSent;
+
+    for(unsigned i=0; i < uCount; i++){
+        memset(buffers[i],'a'+i,messageLength);
+        messages[i].pData=buffers[i];
+        messages[i].uMsgLength=messageLength;
+    }
+
+    //three frames fit in the limit, so ten messages take four calls
+    budgetTransmitter t(1000000);
+    t.setBatchLimit(100);
+    ASSERT_TRUE(t.sendMessages(messages,uCount,&uSent));
+    EXPECT_EQ(uSent,uCount);
+    EXPECT_EQ(t.m_uCalls,(unsigned)4);
+    t.loopBack();
+    ASSERT_EQ(t.getMessageCount(),uCount);
+    for(unsigned i=0; i < uCount; i++){
+        msg=t.getMsg();
+        ASSERT_EQ(msg.uMsgLength,(unsigned long)messageLength);
+        EXPECT_EQ(memcmp(msg.pData,buffers[i],messageLength),0);
+        delete[] msg.pData;
+    }
+
+    //the link dies in the middle of the sixth message
+    budgetTransmitter failing(frameLength*5+10);
+    ASSERT_FALSE(failing.sendMessages(messages,uCount,&uSent));
+    EXPECT_EQ(uSent,(unsigned)5);
+    failing.loopBack();
+    EXPECT_EQ(failing.getMessageCount(),(unsigned)5);
+    while(failing.getMessageCount() > 0){
+        delete[] failing.getMsg().pData;
+    }
+}
+
+/**
+ * Hands everything it transmits straight to the peer
+ */
+class loopPeer: public CMessaging{
+protected:
+    loopPeer *m_pPeer;
+
+    virtual int xmitMsg(const unsigned char *pBuffer, unsigned uLength){
+        unsigned char *pCopy=new unsigned char[uLength];
+        memcpy(pCopy,pBuffer,uLength);
+        m_uBytes+=uLength;
+        m_pPeer->processChunk(pCopy,uLength);
+        delete[] pCopy;
+        return (int)uLength;
+    }
+
+public:
+    unsigned m_uBytes; //number of bytes sent to the peer
+
+    loopPeer(){
+        m_pPeer=NULL;
+        m_uBytes=0;
+    }
+    void link(loopPeer *pPeer){
+        m_pPeer=pPeer;
+    }
+};
+
+/**
+ * Batch frames are only used once both ends announced them
+ */
+TEST(fullTransmiter,batchFrames){
+    const unsigned uCount=10;
+    const unsigned messageLength=20;
+    unsigned char buffers[uCount][messageLength];
+    CMessaging::Message_t messages[uCount];
+    CMessaging::Message_t msg;
+    loopPeer a,b;
+    unsigned uSent;
+
+    a.link(&b);
+    b.link(&a);
+    for(unsigned i=0; i < uCount; i++){
+        memset(buffers[i],'a'+i,messageLength);
+        messages[i].pData=buffers[i];
+        messages[i].uMsgLength=messageLength;
+    }
+
+    a.enableCapabilityNegotiation(true);
+    b.enableCapabilityNegotiation(true);
+    //the peer does not support batch frames yet
+    a.enableBatchFrames(true);
+    EXPECT_FALSE(a.isBatchFramesActive());
+    EXPECT_EQ(b.getPeerCapabilities(),(unsigned)CMessaging::CAPABILITY_BATCH);
+    a.m_uBytes=0;
+    ASSERT_TRUE(a.sendMessages(messages,uCount,&uSent));
+    EXPECT_EQ(a.m_uBytes,uCount*(messageLength+6));
+    ASSERT_EQ(b.getMessageCount(),uCount);
+    while(b.getMessageCount() > 0){
+        delete[] b.getMsg().pData;
+    }
+
+    //now both ends agree and the batch goes out behind a single header
+    b.enableBatchFrames(true);
+    EXPECT_TRUE(a.isBatchFramesActive());
+    EXPECT_TRUE(b.isBatchFramesActive());
+    a.m_uBytes=0;
+    ASSERT_TRUE(a.sendMessages(messages,uCount,&uSent));
+    EXPECT_EQ(uSent,uCount);
+    EXPECT_EQ(a.m_uBytes,5+4+uCount*(messageLength+4)+1);
+    ASSERT_EQ(b.getMessageCount(),uCount);
+    for(unsigned i=0; i < uCount; i++){
+        msg=b.getMsg();
+        ASSERT_EQ(msg.uMsgLength,(unsigned long)messageLength);
+        EXPECT_EQ(memcmp(msg.pData,buffers[i],messageLength),0);
+        delete[] msg.pData;
+    }
+
+    //regular messages still work
+    ASSERT_TRUE(a.sendMessage(buffers[0],messageLength));
+    ASSERT_EQ(b.getMessageCount(),(unsigned)1);
+    delete[] b.getMsg().pData;
+}
+
+/**
+ * Receives like a peer that predates control frames: anything that does
+ * not start with STX makes it drop all the data it holds
+ */
+class baselinePeer{
+public:
+    CAssembler m_assembler;
+    std::vector<std::string> m_messages;
+
+    void processChunk(const unsigned char *pBuffer,unsigned uLength){
+        unsigned char header[5];
+        unsigned char trailer[1];
+        unsigned uMsgLength;
+
+        m_assembler.Append(pBuffer,uLength);
+        while(m_assembler.Size() >= sizeof(header)){
+            m_assembler.Peek(header,sizeof(header),0);
+            if(header[0] != 0x02){
+                m_assembler.Clear();
+                break;
+            }
+            uMsgLength=(unsigned)header[1] << 24 | (unsigned)header[2] << 16 | (unsigned)header[3] << 8 | header[4];
+            if(m_assembler.Size() < uMsgLength+sizeof(header)+sizeof(trailer)){
+                break;
+            }
+            std::vector<unsigned char> message(uMsgLength+1);
+            m_assembler.Trim(sizeof(header));
+            m_assembler.Pop(&message[0],uMsgLength);
+            m_assembler.Pop(trailer,sizeof(trailer));
+            if(trailer[0] == 0x03){
+                m_messages.push_back(std::string((const char*)&message[0],uMsgLength));
+            }
+        }
+    }
+};
+
+/**
+ * Capabilities are only announced once negotiation is enabled, so a peer
+ * that does not know about them only ever gets STX frames, and STX
+ * messages are never taken for announcements
+ */
+TEST(fullTransmiter,capabilityNegotiation){
+    transmitsAll sender,current;
+    baselinePeer old;
+    unsigned char lookalike[]={0x02, 0,0,0,12, 0x10,'C','A','P','S',0,0xFF,3, 0,0,0,1, 3};
+    unsigned char *pData;
+    unsigned uLength;
+
+    sender.enableBatchFrames(true);
+    sender.enableFragmentFrames(true);
+    sender.enableBatchFrames(false);
+    ASSERT_TRUE(sender.sendMessage((const unsigned char*)"data",4));
+    uLength=sender.getRawDataSize();
+    pData=sender.getRawData();
+    EXPECT_EQ(uLength,(unsigned)(4+6));
+    old.processChunk(pData,uLength);
+    delete[] pData;
+    ASSERT_EQ(old.m_messages.size(),(size_t)1);
+    EXPECT_EQ(old.m_messages[0],"data");
+
+    //any STX message is a message
+    EXPECT_TRUE(current.processChunk(lookalike,sizeof(lookalike)));
+    EXPECT_EQ(current.getPeerCapabilities(),(unsigned)0);
+    ASSERT_EQ(current.getMessageCount(),(unsigned)1);
+    CMessaging::Message_t msg=current.getMsg();
+    EXPECT_EQ(msg.uMsgLength,(unsigned long)12);
+    delete[] msg.pData;
+
+    //once enabled, the announcement is answered even without negotiation on the other end
+    current.enableBatchFrames(true);
+    EXPECT_EQ(current.getRawDataSize(),(unsigned)0);
+    sender.enableCapabilityNegotiation(true);
+    uLength=sender.getRawDataSize();
+    pData=sender.getRawData();
+    EXPECT_FALSE(current.processChunk(pData,uLength));
+    delete[] pData;
+    EXPECT_EQ(current.getPeerCapabilities(),(unsigned)CMessaging::CAPABILITY_FRAGMENTS);
+    EXPECT_EQ(current.getMessageCount(),(unsigned)0);
+    uLength=current.getRawDataSize();
+    pData=current.getRawData();
+    EXPECT_FALSE(sender.processChunk(pData,uLength));
+    delete[] pData;
+    EXPECT_EQ(sender.getPeerCapabilities(),(unsigned)CMessaging::CAPABILITY_BATCH);
+    EXPECT_FALSE(sender.isBatchFramesActive());
+
+    //only a new feature is announced, and disabling sends nothing
+    sender.enableBatchFrames(true);
+    EXPECT_TRUE(sender.isBatchFramesActive());
+    EXPECT_GT(sender.getRawDataSize(),(unsigned)0);
+    delete[] sender.getRawData();
+    sender.enableBatchFrames(true);
+    sender.enableBatchFrames(false);
+    EXPECT_EQ(sender.getRawDataSize(),(unsigned)0);
+}
+
+/**
+ * A batch frame whose lengths do not add up is dropped
+ */
+TEST(fullTransmiter,badBatchFrame){
+    transmitsAll t;
+    unsigned char frame[]={0x11, 0,0,0,19, 0,0,0,2, 0,0,0,3, 0,0,0,4, 'a','b','c','d','e','f','g',3};
+    CMessaging::Message_t msg;
+
+    //declared total is one byte short
+    frame[4]=18;
+    ASSERT_FALSE(t.processChunk(frame,sizeof(frame)-1));
+    EXPECT_EQ(t.getMessageCount(),(unsigned)0);
+
+    //a good frame to make sure the receiver recovered
+    frame[4]=19;
+    ASSERT_TRUE(t.processChunk(frame,sizeof(frame)));
+    ASSERT_EQ(t.getMessageCount(),(unsigned)2);
+    msg=t.getMsg();
+    EXPECT_EQ(msg.uMsgLength,(unsigned long)3);
+    EXPECT_EQ(memcmp(msg.pData,"abc",3),0);
+    delete[] msg.pData;
+    msg=t.getMsg();
+    EXPECT_EQ(msg.uMsgLength,(unsigned long)4);
+    EXPECT_EQ(memcmp(msg.pData,"defg",4),0);
+    delete[] msg.pData;
+}
+
+/**
+ * A frame over the size limit is passed over by its length, without
+ * allocating anything for it, and none of its payload is taken for frames.
+ * Splits the oversized frame at every byte.
+ */
+TEST(fullTransmiter,maxMessageSize){
+    transmitsAll t;
+    //the payload of the oversized frames holds what looks like a frame
+    unsigned char stream[]={0x02, 0,0,0,12, 0x02,0,0,0,3,'b','a','d',3, 'x','x','x',3,
+                            0x13, 0,0,0,14, 1,0,0,0,7, 0x02,0,0,0,3,'b','a','d',3, 3,
+                            0x02, 0,0,0,3, 'a','b','c',3};
+    unsigned char frame[]={0x02, 0,0,0,3, 'a','b','c',3};
+    CMessaging::Message_t msg;
+
+    //there is no limit unless one is set
+    EXPECT_EQ(t.getMaxMessageSize(),(unsigned long)0);
+    t.setMaxMessageSize(8);
+    for(unsigned uSplit=1; uSplit < sizeof(stream); uSplit++){
+        t.processChunk(stream,uSplit);
+        t.processChunk(stream+uSplit,sizeof(stream)-uSplit);
+        ASSERT_EQ(t.getMessageCount(),(unsigned)1) << uSplit;
+        msg=t.getMsg();
+        ASSERT_EQ(msg.uMsgLength,(unsigned long)3);
+        EXPECT_EQ(memcmp(msg.pData,"abc",3),0);
+        delete[] msg.pData;
+    }
+
+    //the limit is configurable
+    t.setMaxMessageSize(2);
+    EXPECT_FALSE(t.processChunk(frame,sizeof(frame)));
+    EXPECT_EQ(t.getMessageCount(),(unsigned)0);
+    t.setMaxMessageSize(3);
+    EXPECT_TRUE(t.processChunk(frame,sizeof(frame)));
+    ASSERT_EQ(t.getMessageCount(),(unsigned)1);
+    delete[] t.getMsg().pData;
+}
+
+/**
+ * Records the views handed out by the messaging class
+ */
+typedef struct {
+    std::vector<const unsigned char*> pointers;
+    std::vector<std::string> contents;
+} viewLog_t;
+
+static void viewFunction(const unsigned char *pData,unsigned long uLength,void *pUser){
+    viewLog_t *pLog=(viewLog_t*)pUser;
+
+    pLog->pointers.push_back(pData);
+    pLog->contents.push_back(std::string((const char*)pData,uLength));
+}
+
+/**
+ * Frames within a chunk are handed out in place, frames that span chunks
+ * are put together first
+ */
+TEST(fullTransmiter,messageViews){
+    transmitsAll t;
+    const char *szTestMsgs[]={"Hello world","I'm a traveler of both time and space","to be where I have been"};
+    unsigned char *pRawData;
+    unsigned rawDataSize,uSplit;
+    viewLog_t log;
+
+    for(unsigned i=0; i < 3; i++){
+        ASSERT_TRUE(t.sendMessage((const unsigned char*)szTestMsgs[i],(unsigned)strlen(szTestMsgs[i])));
+    }
+    for(unsigned i=0; i < 3; i++){
+        ASSERT_TRUE(t.sendMessage((const unsigned char*)szTestMsgs[i],(unsigned)strlen(szTestMsgs[i])));
+    }
+    rawDataSize=t.getRawDataSize()/2;
+    pRawData=t.getRawData();
+    t.registerMessageViewCallback(viewFunction,&log);
+
+    //everything in one chunk: all views point into the chunk
+    ASSERT_TRUE(t.processChunk(pRawData,rawDataSize));
+    ASSERT_EQ(log.contents.size(),(size_t)3);
+    for(unsigned i=0; i < 3; i++){
+        EXPECT_EQ(log.contents[i],szTestMsgs[i]);
+        EXPECT_TRUE(log.pointers[i] > pRawData && log.pointers[i] < pRawData+rawDataSize);
+    }
+    EXPECT_EQ(t.getMessageCount(),(unsigned)0);
+
+    //split in the middle of the second message
+    log.pointers.clear();
+    log.contents.clear();
+    uSplit=strlen(szTestMsgs[0])+6+10;
+    ASSERT_TRUE(t.processChunk(pRawData+rawDataSize,uSplit));
+    ASSERT_TRUE(t.processChunk(pRawData+rawDataSize+uSplit,rawDataSize-uSplit));
+    ASSERT_EQ(log.contents.size(),(size_t)3);
+    for(unsigned i=0; i < 3; i++){
+        EXPECT_EQ(log.contents[i],szTestMsgs[i]);
+    }
+    //only the message that spans the chunks was copied
+    EXPECT_TRUE(log.pointers[0] > pRawData+rawDataSize && log.pointers[0] < pRawData+rawDataSize+uSplit);
+    EXPECT_TRUE(log.pointers[1] < pRawData || log.pointers[1] >= pRawData+2*rawDataSize);
+    EXPECT_TRUE(log.pointers[2] > pRawData+rawDataSize+uSplit && log.pointers[2] < pRawData+2*rawDataSize);
+
+    //one byte at a time, every frame spans chunks
+    log.contents.clear();
+    for(unsigned i=0; i < rawDataSize; i++){
+        t.processChunk(pRawData+i,1);
+    }
+    ASSERT_EQ(log.contents.size(),(size_t)3);
+    for(unsigned i=0; i < 3; i++){
+        EXPECT_EQ(log.contents[i],szTestMsgs[i]);
+    }
+
+    //a bad trailer drops the rest of the chunk, whether the frame is in
+    //place or spans chunks, as in decode()
+    unsigned char bad[]={0x02, 0,0,0,1, 'x',0, 0x02, 0,0,0,1, 'y',3};
+    log.contents.clear();
+    EXPECT_FALSE(t.processChunk(bad,sizeof(bad)));
+    EXPECT_FALSE(t.processChunk(bad,3));
+    EXPECT_FALSE(t.processChunk(bad+3,sizeof(bad)-3));
+    EXPECT_EQ(log.contents.size(),(size_t)0);
+    ASSERT_TRUE(t.processChunk(pRawData,rawDataSize));
+    EXPECT_EQ(log.contents.size(),(size_t)3);
+
+    delete[] pRawData;
+}
+
+/**
+ * Views work on data received straight into the receive buffer, and the
+ * frames within one receive are handed out from that buffer
+ */
+TEST(fullTransmiter,receiveBufferViews){
+    transmitsAll t;
+    const char *szTestMsgs[]={"Hello world","I'm a traveler of both time and space","to be where I have been"};
+    unsigned char *pRawData;
+    unsigned char *pReceiveBuffer;
+    unsigned rawDataSize,uSplit;
+    viewLog_t log;
+
+    for(unsigned i=0; i < 3; i++){
+        ASSERT_TRUE(t.sendMessage((const unsigned char*)szTestMsgs[i],(unsigned)strlen(szTestMsgs[i])));
+    }
+    rawDataSize=t.getRawDataSize();
+    pRawData=t.getRawData();
+    t.registerMessageViewCallback(viewFunction,&log);
+
+    //split in the middle of the second message
+    uSplit=strlen(szTestMsgs[0])+6+10;
+    pReceiveBuffer=t.getReceiveBuffer(256);
+    memcpy(pReceiveBuffer,pRawData,uSplit);
+    ASSERT_TRUE(t.processReceived(uSplit));
+    ASSERT_EQ(log.contents.size(),(size_t)1);
+    EXPECT_TRUE(log.pointers[0] > pReceiveBuffer && log.pointers[0] < pReceiveBuffer+uSplit);
+
+    pReceiveBuffer=t.getReceiveBuffer(256);
+    memcpy(pReceiveBuffer,pRawData+uSplit,rawDataSize-uSplit);
+    ASSERT_TRUE(t.processReceived(rawDataSize-uSplit));
+    ASSERT_EQ(log.contents.size(),(size_t)3);
+    for(unsigned i=0; i < 3; i++){
+        EXPECT_EQ(log.contents[i],szTestMsgs[i]);
+    }
+    //only the message that spans the receives was copied
+    EXPECT_TRUE(log.pointers[1] < pReceiveBuffer || log.pointers[1] >= pReceiveBuffer+256);
+    EXPECT_TRUE(log.pointers[2] > pReceiveBuffer && log.pointers[2] < pReceiveBuffer+rawDataSize-uSplit);
+    EXPECT_EQ(t.getMessageCount(),(unsigned)0);
+
+    delete[] pRawData;
+}
+
+/**
+ * In view mode too, a frame over the size limit is passed over by its
+ * length wherever the chunks are split
+ */
+TEST(fullTransmiter,maxMessageSizeViews){
+    transmitsAll t;
+    unsigned char stream[]={0x02, 0,0,0,12, 0x02,0,0,0,3,'b','a','d',3, 'x','x','x',3,
+                            0x02, 0,0,0,3, 'a','b','c',3};
+    viewLog_t log;
+
+    t.registerMessageViewCallback(viewFunction,&log);
+    t.setMaxMessageSize(8);
+    for(unsigned uSplit=1; uSplit < sizeof(stream); uSplit++){
+        t.processChunk(stream,uSplit);
+        t.processChunk(stream+uSplit,sizeof(stream)-uSplit);
+        ASSERT_EQ(log.contents.size(),(size_t)1) << uSplit;
+        EXPECT_EQ(log.contents[0],"abc");
+        log.contents.clear();
+        log.pointers.clear();
+    }
+}
+
+/**
+ * The decoder picks up where it left off, even one byte at a time
+ */
+TEST(fullTransmiter,byteByByte){
+    transmitsAll t;
+    const unsigned messageLength=100000;
+    const char *szTestMsg="Hello world";
+    unsigned char batch[]={0x11, 0,0,0,23, 0,0,0,3, 0,0,0,3, 0,0,0,0, 0,0,0,4, 'a','b','c','d','e','f','g',3};
+    unsigned char *pTransmitBuffer=new unsigned char[messageLength];
+    unsigned char *pRawData;
+    CMessaging::Message_t msg;
+    unsigned rawDataSize;
+
+    memset(pTransmitBuffer,'x',messageLength);
+    strcpy((char*)pTransmitBuffer,szTestMsg);
+    ASSERT_TRUE(t.sendMessage(pTransmitBuffer,messageLength));
+    rawDataSize=t.getRawDataSize();
+    pRawData=t.getRawData();
+    for(unsigned i=0; i < rawDataSize-1; i++){
+        ASSERT_FALSE(t.processChunk(pRawData+i,1));
+    }
+    ASSERT_TRUE(t.processChunk(pRawData+rawDataSize-1,1));
+    ASSERT_EQ(t.getMessageCount(),(unsigned)1);
+    msg=t.getMsg();
+    ASSERT_EQ(msg.uMsgLength,(unsigned long)messageLength);
+    EXPECT_EQ(memcmp(msg.pData,pTransmitBuffer,messageLength),0);
+    delete[] msg.pData;
+    delete[] pRawData;
+    delete[] pTransmitBuffer;
+
+    //a batch frame with an empty message in the middle
+    for(unsigned i=0; i < sizeof(batch); i++){
+        t.processChunk(batch+i,1);
+    }
+    ASSERT_EQ(t.getMessageCount(),(unsigned)3);
+    msg=t.getMsg();
+    EXPECT_EQ(memcmp(msg.pData,"abc",3),0);
+    delete[] msg.pData;
+    msg=t.getMsg();
+    EXPECT_EQ(msg.uMsgLength,(unsigned long)0);
+    delete[] msg.pData;
+    msg=t.getMsg();
+    EXPECT_EQ(memcmp(msg.pData,"defg",4),0);
+    delete[] msg.pData;
+}
+
+/**
+ * With a pool set, receiving messages stops going to the heap once the
+ * pool is warm
+ */
+TEST(fullTransmiter,pooledMessages){
+    const unsigned messageLength=200;
+    unsigned char buffer[messageLength];
+    unsigned char received[messageLength];
+    unsigned long uLength;
+    unsigned long uWarm;
+    CBufferPool pool;
+    CMessage msg;
+    loopPeer a,b;
+
+    a.link(&b);
+    b.link(&a);
+    b.setMessagePool(&pool);
+    memset(buffer,'p',messageLength);
+
+    ASSERT_TRUE(a.sendMessage(buffer,messageLength));
+    ASSERT_TRUE(b.getMsgInto(received,messageLength,uLength));
+    EXPECT_EQ(uLength,(unsigned long)messageLength);
+    EXPECT_EQ(0,memcmp(received,buffer,messageLength));
+    uWarm=pool.getHeapAllocations();
+
+    for(unsigned i=0; i < 100; i++){
+        buffer[0]=(unsigned char)i;
+        ASSERT_TRUE(a.sendMessage(buffer,messageLength));
+        if(i%2){
+            ASSERT_TRUE(b.getMsgInto(received,messageLength,uLength));
+            EXPECT_EQ(received[0],(unsigned char)i);
+        } else {
+            ASSERT_TRUE(b.getMsg(msg));
+            EXPECT_EQ(msg.size(),(unsigned long)messageLength);
+            EXPECT_EQ(msg.data()[0],(unsigned char)i);
+            msg.reset();
+        }
+    }
+    EXPECT_EQ(pool.getHeapAllocations(),uWarm);
+
+    //too small a buffer leaves the message queued
+    ASSERT_TRUE(a.sendMessage(buffer,messageLength));
+    EXPECT_FALSE(b.getMsgInto(received,10,uLength));
+    EXPECT_EQ(uLength,(unsigned long)messageLength);
+    EXPECT_EQ(b.getMessageCount(),1U);
+
+    //the legacy interface still hands out a buffer for delete[]
+    CMessaging::Message_t legacy=b.getMsg();
+    EXPECT_EQ(legacy.uMsgLength,(unsigned long)messageLength);
+    delete[] legacy.pData;
+    EXPECT_FALSE(b.getMsgInto(received,messageLength,uLength));
+    EXPECT_EQ(uLength,0UL);
+}
+
+/**
+ * Collects what the batch callback is handed
+ */
+typedef struct {
+    unsigned uCalls;
+    std::vector<std::string> messages;
+    unsigned char *pKept;
+} batchLog_t;
+
+void batchFunction(CMessaging::Message_t *pMessages,unsigned uCount,void *pUser){
+    batchLog_t *pLog=(batchLog_t *)pUser;
+
+    pLog->uCalls++;
+    for(unsigned i=0; i < uCount; i++){
+        pLog->messages.push_back(std::string((const char *)pMessages[i].pData,pMessages[i].uMsgLength));
+    }
+    //keep the first message of the first span
+    if(pLog->pKept == NULL){
+        pLog->pKept=pMessages[0].pData;
+        pMessages[0].pData=NULL;
+    }
+}
+
+/**
+ * All the messages of a chunk are handed out in one call
+ */
+TEST(fullTransmiter,batchCallback){
+    const unsigned uCount=10;
+    const unsigned messageLength=20;
+    unsigned char buffers[uCount][messageLength];
+    CMessaging::Message_t messages[uCount];
+    batchLog_t log;
+    loopPeer a,b;
+
+    log.uCalls=0;
+    log.pKept=NULL;
+    a.link(&b);
+    b.link(&a);
+    a.enableCapabilityNegotiation(true);
+    b.enableCapabilityNegotiation(true);
+    a.enableBatchFrames(true);
+    b.enableBatchFrames(true);
+    ASSERT_TRUE(a.isBatchFramesActive());
+    b.registerMessageBatchCallback(batchFunction,&log);
+    for(unsigned i=0; i < uCount; i++){
+        memset(buffers[i],'a'+i,messageLength);
+        messages[i].pData=buffers[i];
+        messages[i].uMsgLength=messageLength;
+    }
+
+    //one batch frame is one chunk and one call
+    ASSERT_TRUE(a.sendMessages(messages,uCount));
+    EXPECT_EQ(log.uCalls,1U);
+    ASSERT_EQ(log.messages.size(),(size_t)uCount);
+    for(unsigned i=0; i < uCount; i++){
+        EXPECT_EQ(log.messages[i],std::string(messageLength,(char)('a'+i)));
+    }
+    EXPECT_EQ(b.getMessageCount(),0U);
+
+    //single messages still come through, one span each
+    ASSERT_TRUE(a.sendMessage(buffers[0],messageLength));
+    EXPECT_EQ(log.uCalls,2U);
+    EXPECT_EQ(log.messages.size(),(size_t)uCount+1);
+
+    //the kept message was not freed
+    ASSERT_TRUE(log.pKept != NULL);
+    EXPECT_EQ(0,memcmp(log.pKept,buffers[0],messageLength));
+    delete[] log.pKept;
+
+    //back to the queue
+    b.registerMessageBatchCallback(NULL,NULL);
+    ASSERT_TRUE(a.sendMessage(buffers[1],messageLength));
+    EXPECT_EQ(b.getMessageCount(),1U);
+    delete[] b.getMsg().pData;
+}
+
+/**
+ * Collects the frames it is given, which must never interleave
+ */
+class lockedReceiver: public CMessaging{
+protected:
+    volatile int m_nInside;
+
+    virtual int xmitMsg(const unsigned char *pBuffer, unsigned uLength){
+        //only one thread at a time may transmit
+        if(__sync_fetch_and_add(&m_nInside,1) != 0){
+            m_bOverlap=true;
+        }
+        m_receiver.processChunk((unsigned char *)pBuffer,uLength);
+        __sync_fetch_and_sub(&m_nInside,1);
+        return (int)uLength;
+    }
+
+public:
+    transmitsAll m_receiver;
+    bool m_bOverlap;
+
+    lockedReceiver(){
+        m_nInside=0;
+        m_bOverlap=false;
+    }
+};
+
+typedef struct {
+    lockedReceiver *pSender;
+    unsigned uThread;
+    unsigned uCount;
+    bool bResults;
+} concurrentSender_t;
+
+static void *concurrentSender(void *pArg){
+    concurrentSender_t *pSender=(concurrentSender_t *)pArg;
+    unsigned message[2];
+
+    pSender->bResults=true;
+    message[0]=pSender->uThread;
+    for(unsigned i=0; i < pSender->uCount; i++){
+        message[1]=i;
+        if(!pSender->pSender->sendMessageConcurrent((const unsigned char *)message,sizeof(message))){
+            pSender->bResults=false;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Frames sent from several threads arrive whole and in order per thread
+ */
+TEST(fullTransmiter,concurrentSenders){
+    const unsigned uThreads=4;
+    const unsigned uCount=5000;
+    lockedReceiver sender;
+    concurrentSender_t senders[uThreads];
+    pthread_t threads[uThreads];
+    unsigned next[uThreads]={0};
+    CMessaging::Message_t msg;
+
+    for(unsigned i=0; i < uThreads; i++){
+        senders[i].pSender=&sender;
+        senders[i].uThread=i;
+        senders[i].uCount=uCount;
+        ASSERT_EQ(pthread_create(&threads[i],NULL,concurrentSender,&senders[i]),0);
+    }
+    for(unsigned i=0; i < uThreads; i++){
+        pthread_join(threads[i],NULL);
+        EXPECT_TRUE(senders[i].bResults);
+    }
+    EXPECT_FALSE(sender.m_bOverlap);
+    ASSERT_EQ(sender.m_receiver.getMessageCount(),uThreads*uCount);
+    while(sender.m_receiver.getMessageCount() > 0){
+        msg=sender.m_receiver.getMsg();
+        ASSERT_EQ(msg.uMsgLength,2*sizeof(unsigned));
+        unsigned uThread=((unsigned *)msg.pData)[0];
+        ASSERT_LT(uThread,uThreads);
+        EXPECT_EQ(((unsigned *)msg.pData)[1],next[uThread]);
+        next[uThread]++;
+        delete[] msg.pData;
+    }
+}
+
+/**
+ * Counts the calls that hand data to the medium
+ */
+class countingTransmitter: public transmitsAll{
+protected:
+    virtual int xmitMsg(const unsigned char *pBuffer, unsigned uLength){
+        m_uCalls++;
+        return transmitsAll::xmitMsg(pBuffer,uLength);
+    }
+
+public:
+    unsigned m_uCalls;
+
+    countingTransmitter(){
+        m_uCalls=0;
+    }
+};
+
+/**
+ * Small frames are gathered until one of the limits is reached
+ */
+TEST(fullTransmiter,coalescing){
+    const unsigned messageLength=10;
+    const unsigned frameLength=messageLength+6;
+    unsigned char buffer[2000];
+    countingTransmitter sender;
+    transmitsAll receiver;
+    unsigned char *pData;
+    unsigned uSize;
+
+    memset(buffer,'c',sizeof(buffer));
+    sender.enableCoalescing(1000,10,1000000);
+
+    //the message count limit
+    for(unsigned i=0; i < 25; i++){
+        ASSERT_TRUE(sender.sendMessage(buffer,messageLength));
+    }
+    EXPECT_EQ(sender.m_uCalls,2U);
+    EXPECT_EQ(sender.getRawDataSize(),20*frameLength);
+    ASSERT_TRUE(sender.flush());
+    EXPECT_EQ(sender.m_uCalls,3U);
+    EXPECT_EQ(sender.getCoalesceFlushes(),3UL);
+    EXPECT_TRUE(sender.flush());
+    EXPECT_EQ(sender.m_uCalls,3U);
+
+    //a large message pushes out what was gathered and goes out on its own
+    ASSERT_TRUE(sender.sendMessage(buffer,messageLength));
+    ASSERT_TRUE(sender.sendMessage(buffer,sizeof(buffer)));
+    EXPECT_EQ(sender.getRawDataSize(),26*frameLength+sizeof(buffer)+6);
+
+    //the delay limit
+    sender.enableCoalescing(1000,10,1000);
+    ASSERT_TRUE(sender.sendMessage(buffer,messageLength));
+    EXPECT_GT(sender.getCoalesceTimeoutUs(CTimer::getMonotonicUs()),-1LL);
+    EXPECT_TRUE(sender.serviceCoalescing(CTimer::getMonotonicUs()+2000));
+    EXPECT_EQ(sender.getCoalesceTimeoutUs(CTimer::getMonotonicUs()),-1LL);
+    ASSERT_TRUE(sender.sendMessage(buffer,messageLength));
+    ASSERT_TRUE(sender.disableCoalescing());
+
+    //everything arrives as separate messages, in order
+    uSize=sender.getRawDataSize();
+    pData=sender.getRawData();
+    receiver.processChunk(pData,uSize);
+    delete[] pData;
+    ASSERT_EQ(receiver.getMessageCount(),29U);
+    for(unsigned i=0; i < 29; i++){
+        CMessaging::Message_t msg=receiver.getMsg();
+        EXPECT_EQ(msg.uMsgLength,(unsigned long)(i == 26 ? sizeof(buffer) : messageLength));
+        delete[] msg.pData;
+    }
+}
+
+/**
+ * Bulk messages are split into fragments and put back together, both by
+ * the decoder and in view mode
+ */
+TEST(fullTransmiter,fragments){
+    const unsigned messageLength=10000;
+    std::vector<unsigned char> buffer(messageLength);
+    CMessaging::Message_t msg;
+    viewLog_t log;
+    loopPeer a,b;
+
+    for(unsigned i=0; i < messageLength; i++){
+        buffer[i]=(unsigned char)(i*7);
+    }
+    a.link(&b);
+    b.link(&a);
+
+    a.enableCapabilityNegotiation(true);
+    b.enableCapabilityNegotiation(true);
+    //not agreed yet, so the message goes out whole
+    a.enableFragmentFrames(true,1000);
+    EXPECT_FALSE(a.isFragmentFramesActive());
+    a.m_uBytes=0;
+    ASSERT_TRUE(a.sendMessage(&buffer[0],messageLength,CMessaging::PriorityBulk));
+    EXPECT_EQ(a.m_uBytes,messageLength+6);
+    ASSERT_EQ(b.getMessageCount(),1U);
+    delete[] b.getMsg().pData;
+
+    b.enableFragmentFrames(true);
+    ASSERT_TRUE(a.isFragmentFramesActive());
+    a.m_uBytes=0;
+    ASSERT_TRUE(a.sendMessage(&buffer[0],messageLength,CMessaging::PriorityBulk));
+    EXPECT_EQ(a.m_uBytes,messageLength+10*(6+5));
+    ASSERT_EQ(b.getMessageCount(),1U);
+    msg=b.getMsg();
+    ASSERT_EQ(msg.uMsgLength,(unsigned long)messageLength);
+    EXPECT_EQ(0,memcmp(msg.pData,&buffer[0],messageLength));
+    delete[] msg.pData;
+
+    //small bulk messages are not fragmented
+    a.m_uBytes=0;
+    ASSERT_TRUE(a.sendMessage(&buffer[0],1000,CMessaging::PriorityBulk));
+    EXPECT_EQ(a.m_uBytes,1000U+6);
+    delete[] b.getMsg().pData;
+
+    b.registerMessageViewCallback(viewFunction,&log);
+    ASSERT_TRUE(a.sendMessage(&buffer[0],messageLength,CMessaging::PriorityBulk));
+    ASSERT_EQ(log.contents.size(),(size_t)1);
+    EXPECT_EQ(log.contents[0],std::string((const char *)&buffer[0],messageLength));
+}
+
+/**
+ * Takes a while for every transmit, like a slow link
+ */
+class slowPeer: public loopPeer{
+protected:
+    virtual int xmitMsg(const unsigned char *pBuffer, unsigned uLength){
+        usleep(2000);
+        return loopPeer::xmitMsg(pBuffer,uLength);
+    }
+};
+
+typedef struct {
+    slowPeer *pPeer;
+    std::vector<unsigned char> *pBuffer;
+    bool bResults;
+} bulkSender_t;
+
+static void *bulkSender(void *pArg){
+    bulkSender_t *pSender=(bulkSender_t *)pArg;
+
+    pSender->bResults=pSender->pPeer->sendMessage(&(*pSender->pBuffer)[0],(unsigned)pSender->pBuffer->size(),
+                                                  CMessaging::PriorityBulk);
+    return NULL;
+}
+
+/**
+ * A high priority message overtakes a bulk message that is being sent
+ */
+TEST(fullTransmiter,priorities){
+    std::vector<unsigned char> buffer(400*1024,'b');
+    const char *pUrgent="cancel";
+    bulkSender_t sender;
+    CMessaging::Message_t msg;
+    unsigned long long uStartUs;
+    pthread_t thread;
+    slowPeer a,b;
+
+    a.link(&b);
+    b.link(&a);
+    a.enableCapabilityNegotiation(true);
+    b.enableCapabilityNegotiation(true);
+    a.enableFragmentFrames(true,4096);
+    b.enableFragmentFrames(true);
+    ASSERT_TRUE(a.isFragmentFramesActive());
+
+    sender.pPeer=&a;
+    sender.pBuffer=&buffer;
+    ASSERT_EQ(pthread_create(&thread,NULL,bulkSender,&sender),0);
+    usleep(20*1000);
+    uStartUs=CTimer::getMonotonicUs();
+    ASSERT_TRUE(a.sendMessage((const unsigned char *)pUrgent,(unsigned)strlen(pUrgent),CMessaging::PriorityHigh));
+    //waited for at most a fragment or two, not for the whole bulk message
+    EXPECT_LT(CTimer::getMonotonicUs()-uStartUs,100000ULL);
+    pthread_join(thread,NULL);
+    EXPECT_TRUE(sender.bResults);
+
+    ASSERT_EQ(b.getMessageCount(),2U);
+    msg=b.getMsg();
+    EXPECT_EQ(std::string((const char *)msg.pData,msg.uMsgLength),pUrgent);
+    delete[] msg.pData;
+    msg=b.getMsg();
+    EXPECT_EQ(msg.uMsgLength,(unsigned long)buffer.size());
+    delete[] msg.pData;
+}
+
+/**
+ * Records the events of streamed messages
+ */
+typedef struct {
+    std::vector<CMessaging::StreamEvent_t> events; //every event but StreamData
+    std::string data;                              //the pieces, put together
+    unsigned long uTotal;                          //length announced by StreamBegin
+    unsigned uPieces;                              //number of StreamData events
+} streamLog_t;
+
+static void streamFunction(CMessaging::StreamEvent_t event,const unsigned char *pData,unsigned long uLength,void *pUser){
+    streamLog_t *pLog=(streamLog_t*)pUser;
+
+    if(event == CMessaging::StreamData){
+        pLog->data.append((const char*)pData,uLength);
+        pLog->uPieces++;
+        return;
+    }
+    if(event == CMessaging::StreamBegin){
+        pLog->data.clear();
+        pLog->uTotal=uLength;
+        pLog->uPieces=0;
+    }
+    pLog->events.push_back(event);
+}
+
+/**
+ * Large messages are handed out in pieces as they arrive, and a message
+ * can be sent in pieces
+ */
+TEST(fullTransmiter,streaming){
+    const unsigned messageLength=10000;
+    std::vector<unsigned char> buffer(messageLength);
+    std::string expected;
+    streamLog_t log;
+    viewLog_t viewLog;
+    transmitsAll t;
+    loopPeer r,a,b;
+    unsigned char *pRaw;
+    unsigned rawDataSize;
+
+    for(unsigned i=0; i < messageLength; i++){
+        buffer[i]=(unsigned char)(i*13);
+    }
+    expected.assign((const char*)&buffer[0],messageLength);
+
+    //a plain frame is streamed as it is decoded, small messages are not
+    r.registerStreamCallback(streamFunction,&log,1000);
+    ASSERT_TRUE(t.sendMessage(&buffer[0],messageLength));
+    ASSERT_TRUE(t.sendMessage((const unsigned char*)"abc",3));
+    rawDataSize=t.getRawDataSize();
+    pRaw=t.getRawData();
+    for(unsigned uOffset=0; uOffset < rawDataSize; uOffset+=700){
+        r.processChunk(pRaw+uOffset,std::min(700U,rawDataSize-uOffset));
+    }
+    ASSERT_EQ(log.events.size(),(size_t)2);
+    EXPECT_EQ(log.events[0],CMessaging::StreamBegin);
+    EXPECT_EQ(log.events[1],CMessaging::StreamEnd);
+    EXPECT_EQ(log.uTotal,(unsigned long)messageLength);
+    EXPECT_GT(log.uPieces,1U);
+    EXPECT_TRUE(log.data == expected);
+    ASSERT_EQ(r.getMessageCount(),1U);
+    delete[] r.getMsg().pData;
+
+    //a bad trailer aborts the message
+    pRaw[5+messageLength]=0;
+    r.processChunk(pRaw,6+messageLength);
+    ASSERT_EQ(log.events.size(),(size_t)4);
+    EXPECT_EQ(log.events[3],CMessaging::StreamAbort);
+    delete[] pRaw;
+
+    //a message sent in pieces is passed on piece by piece
+    log.events.clear();
+    a.link(&b);
+    b.link(&a);
+    a.enableCapabilityNegotiation(true);
+    b.enableCapabilityNegotiation(true);
+    a.enableFragmentFrames(true,1000);
+    b.enableFragmentFrames(true);
+    b.registerStreamCallback(streamFunction,&log,1000);
+    ASSERT_TRUE(a.beginStream(messageLength));
+    ASSERT_TRUE(a.sendStreamData(&buffer[0],2500));
+    EXPECT_EQ(log.data.size(),(size_t)2500);
+    ASSERT_TRUE(a.sendStreamData(&buffer[2500],7500));
+    ASSERT_TRUE(a.endStream());
+    ASSERT_EQ(log.events.size(),(size_t)2);
+    EXPECT_EQ(log.events[1],CMessaging::StreamEnd);
+    EXPECT_EQ(log.uPieces,11U); //pieces are split at the fragment size
+    EXPECT_TRUE(log.data == expected);
+    EXPECT_EQ(b.getMessageCount(),0U);
+
+    //a short message is aborted, an overrun is refused
+    ASSERT_TRUE(a.beginStream(messageLength));
+    ASSERT_TRUE(a.sendStreamData(&buffer[0],1000));
+    EXPECT_FALSE(a.endStream());
+    ASSERT_EQ(log.events.size(),(size_t)4);
+    EXPECT_EQ(log.events[3],CMessaging::StreamAbort);
+    ASSERT_TRUE(a.beginStream(10));
+    EXPECT_FALSE(a.sendStreamData(&buffer[0],11));
+    EXPECT_FALSE(a.endStream());
+    EXPECT_EQ(log.events.size(),(size_t)4);
+
+    //bulk messages are streamed in view mode too
+    b.registerMessageViewCallback(viewFunction,&viewLog);
+    ASSERT_TRUE(a.sendMessage(&buffer[0],messageLength,CMessaging::PriorityBulk));
+    ASSERT_EQ(log.events.size(),(size_t)6);
+    EXPECT_EQ(log.events[5],CMessaging::StreamEnd);
+    EXPECT_TRUE(log.data == expected);
+    EXPECT_TRUE(viewLog.contents.empty());
+}
+
+/**
+ * Sends a numbered test message
+ */
+static bool sendNumbered(CMessaging &peer,unsigned uNumber){
+    char message[16];
+
+    sprintf(message,"m%u",uNumber);
+    return peer.sendMessage((const unsigned char *)message,(unsigned)strlen(message));
+}
+
+/**
+ * Takes a message off the receive queue as a string
+ */
+static std::string getString(CMessaging &peer){
+    CMessaging::Message_t msg=peer.getMsg();
+    std::string results((const char *)msg.pData,msg.uMsgLength);
+
+    delete[] msg.pData;
+    return results;
+}
+
+/**
+ * The receiver bounds what the sender has in flight, and the sender fails,
+ * queues or waits without credit
+ */
+TEST(fullTransmiter,credit){
+    unsigned long long uStartUs;
+    loopPeer a,b;
+
+    a.link(&b);
+    b.link(&a);
+    EXPECT_FALSE(a.isCreditLimited());
+    ASSERT_TRUE(b.enableReceiveCredit(4,1000));
+    ASSERT_TRUE(a.isCreditLimited());
+
+    a.setCreditPolicy(CMessaging::CreditFail);
+    for(unsigned i=0; i < 4; i++){
+        ASSERT_TRUE(sendNumbered(a,i));
+    }
+    EXPECT_FALSE(sendNumbered(a,4));
+    //consuming half the messages grants them again
+    EXPECT_EQ(getString(b),"m0");
+    EXPECT_EQ(getString(b),"m1");
+    EXPECT_TRUE(sendNumbered(a,4));
+    EXPECT_TRUE(sendNumbered(a,5));
+    EXPECT_FALSE(sendNumbered(a,6));
+
+    a.setCreditPolicy(CMessaging::CreditQueue);
+    for(unsigned i=6; i < 9; i++){
+        ASSERT_TRUE(sendNumbered(a,i));
+    }
+    EXPECT_EQ(a.getCreditQueueSize(),3U);
+    EXPECT_EQ(b.getMessageCount(),4U);
+    EXPECT_EQ(getString(b),"m2");
+    EXPECT_EQ(getString(b),"m3");
+    EXPECT_EQ(a.getCreditQueueSize(),1U);
+
+    //a blocked send does not overtake the queue and gives up after its timeout
+    a.setCreditPolicy(CMessaging::CreditBlock,50);
+    uStartUs=CTimer::getMonotonicUs();
+    EXPECT_FALSE(sendNumbered(a,9));
+    EXPECT_GE(CTimer::getMonotonicUs()-uStartUs,40000ULL);
+    EXPECT_EQ(getString(b),"m4");
+    EXPECT_EQ(getString(b),"m5");
+    EXPECT_EQ(a.getCreditQueueSize(),0U);
+    EXPECT_TRUE(sendNumbered(a,9));
+    for(unsigned i=6; i < 10; i++){
+        char message[16];
+        sprintf(message,"m%u",i);
+        EXPECT_EQ(getString(b),message);
+    }
+
+    //the bytes are limited as well
+    loopPeer c,d;
+    std::vector<unsigned char> buffer(60,'d');
+    c.link(&d);
+    d.link(&c);
+    ASSERT_TRUE(d.enableReceiveCredit(10,100));
+    c.setCreditPolicy(CMessaging::CreditFail);
+    EXPECT_TRUE(c.sendMessage(&buffer[0],(unsigned)buffer.size()));
+    EXPECT_FALSE(c.sendMessage(&buffer[0],(unsigned)buffer.size()));
+    EXPECT_TRUE(c.sendMessage(&buffer[0],40));
+}
+
+/**
+ * Peer that moves to a new remote end, like a connection that reconnects
+ */
+class relinkedPeer: public loopPeer{
+public:
+    void relink(loopPeer *pPeer){
+        link(pPeer);
+        resetCredit();
+    }
+};
+
+/**
+ * The credit of the old remote end is forgotten after moving to a new one,
+ * and the messages that waited for it go out first
+ */
+TEST(fullTransmiter,creditReset){
+    relinkedPeer a;
+    loopPeer b,c;
+
+    a.link(&b);
+    b.link(&a);
+    ASSERT_TRUE(b.enableReceiveCredit(2,1000));
+    a.setCreditPolicy(CMessaging::CreditQueue);
+    for(unsigned i=0; i < 4; i++){
+        ASSERT_TRUE(sendNumbered(a,i));
+    }
+    EXPECT_EQ(a.getCreditQueueSize(),2U);
+    EXPECT_EQ(b.getMessageCount(),2U);
+
+    a.relink(&c);
+    c.link(&a);
+    EXPECT_FALSE(a.isCreditLimited());
+    EXPECT_EQ(a.getCreditQueueSize(),2U);
+    ASSERT_TRUE(sendNumbered(a,4));
+    EXPECT_EQ(a.getCreditQueueSize(),0U);
+    ASSERT_EQ(c.getMessageCount(),3U);
+    for(unsigned i=2; i < 5; i++){
+        char message[16];
+        sprintf(message,"m%u",i);
+        EXPECT_EQ(getString(c),message);
+    }
+    //our own grant is withdrawn and can be given to the new remote end
+    ASSERT_TRUE(a.enableReceiveCredit(2,1000));
+    EXPECT_TRUE(c.isCreditLimited());
+}
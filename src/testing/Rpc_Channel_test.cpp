@@ -0,0 +1,246 @@
+/**
+ * @file Rpc_Channel_test.cpp
+ *
+ * Unit tests for the request/response channel
+ */
+
+#include "gtest.h"
+#include "rpc_channel.h"
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#define mSleep(x) (usleep(x*1000))
+
+/**
+ * Hands everything it transmits straight to the peer
+ */
+class rpcPeer: public CMessaging{
+protected:
+    rpcPeer *m_pPeer;
+
+    virtual int xmitMsg(const unsigned char *pBuffer, unsigned uLength){
+        if(m_pPeer != NULL){
+            unsigned char *pCopy=new unsigned char[uLength];
+            memcpy(pCopy,pBuffer,uLength);
+            m_pPeer->processChunk(pCopy,uLength);
+            delete[] pCopy;
+        }
+        return (int)uLength;
+    }
+
+public:
+    rpcPeer(){
+        m_pPeer=NULL;
+    }
+    void link(rpcPeer *pPeer){
+        m_pPeer=pPeer;
+    }
+};
+
+/**
+ * Collects the outcome of the calls
+ */
+typedef struct {
+    std::vector<unsigned> ids;
+    std::vector<CRpcChannel::Status_t> status;
+    std::vector<std::string> responses;
+} Results_t;
+
+static void responseFunction(unsigned uId,CRpcChannel::Status_t status,const unsigned char *pData,unsigned long uLength,void *pUser){
+    Results_t *pResults=(Results_t*)pUser;
+
+    pResults->ids.push_back(uId);
+    pResults->status.push_back(status);
+    pResults->responses.push_back(std::string((const char*)pData,uLength));
+}
+
+/**
+ * Answers every request with the request itself
+ */
+static void echoFunction(CRpcChannel *pChannel,unsigned uId,const unsigned char *pData,unsigned long uLength,void *pUser){
+    UNUSED(pUser);
+
+    pChannel->reply(uId,pData,(unsigned)uLength);
+}
+
+/**
+ * Keeps the ids of the requests to answer them later
+ */
+static void deferFunction(CRpcChannel *pChannel,unsigned uId,const unsigned char *pData,unsigned long uLength,void *pUser){
+    UNUSED(pChannel);
+    UNUSED(pData);
+    UNUSED(uLength);
+
+    ((std::vector<unsigned>*)pUser)->push_back(uId);
+}
+
+/**
+ * A response makes it back to its call
+ */
+TEST(RpcChannel,echo){
+    rpcPeer a,b;
+    a.link(&b);
+    b.link(&a);
+    CRpcChannel client(a),server(b);
+    Results_t results;
+    unsigned uId;
+
+    server.registerRequestHandler(echoFunction,NULL);
+    EXPECT_TRUE(client.call((const unsigned char*)"hello",5,1000,responseFunction,&results,&uId));
+    ASSERT_EQ(1u,results.ids.size());
+    EXPECT_EQ(uId,results.ids[0]);
+    EXPECT_EQ(CRpcChannel::RpcOk,results.status[0]);
+    EXPECT_EQ("hello",results.responses[0]);
+    EXPECT_EQ(0u,client.getPendingCount());
+
+    //data messages still flow next to the calls
+    EXPECT_TRUE(a.sendMessage((const unsigned char*)"plain",5));
+    EXPECT_EQ(1u,b.getMessageCount());
+}
+
+/**
+ * Many calls are in flight at once and the responses come back in any order
+ */
+TEST(RpcChannel,pipelining){
+    rpcPeer a,b;
+    a.link(&b);
+    b.link(&a);
+    CRpcChannel client(a),server(b);
+    std::vector<unsigned> requests;
+    std::vector<unsigned> ids;
+    Results_t results;
+    char request[16];
+
+    server.registerRequestHandler(deferFunction,&requests);
+    for(unsigned i=0; i < 100; i++){
+        unsigned uId;
+
+        sprintf(request,"%u",i);
+        ASSERT_TRUE(client.call((const unsigned char*)request,strlen(request),0,responseFunction,&results,&uId));
+        ids.push_back(uId);
+    }
+    EXPECT_EQ(100u,client.getPendingCount());
+    ASSERT_EQ(100u,requests.size());
+
+    for(unsigned i=requests.size(); i > 0; i--){
+        sprintf(request,"%u",i-1);
+        EXPECT_TRUE(server.reply(requests[i-1],(const unsigned char*)request,strlen(request)));
+    }
+    EXPECT_EQ(0u,client.getPendingCount());
+    ASSERT_EQ(100u,results.ids.size());
+    for(unsigned i=0; i < 100; i++){
+        sprintf(request,"%u",99-i);
+        EXPECT_EQ(ids[99-i],results.ids[i]);
+        EXPECT_EQ(request,results.responses[i]);
+    }
+
+    //an answer to a call that is gone is dropped
+    EXPECT_TRUE(server.reply(requests[0],(const unsigned char*)"late",4));
+    EXPECT_EQ(100u,results.ids.size());
+}
+
+/**
+ * Unanswered calls time out, errors and cancels are reported
+ */
+TEST(RpcChannel,deadlines){
+    rpcPeer a,b;
+    a.link(&b);
+    b.link(&a);
+    CRpcChannel client(a),server(b);
+    std::vector<unsigned> requests;
+    Results_t results;
+    unsigned uId;
+
+    server.registerRequestHandler(deferFunction,&requests);
+    ASSERT_TRUE(client.start(5));
+    EXPECT_TRUE(client.call((const unsigned char*)"slow",4,50,responseFunction,&results));
+    EXPECT_TRUE(client.call((const unsigned char*)"never",5,0,responseFunction,&results,&uId));
+    mSleep(200);
+    ASSERT_EQ(1u,results.ids.size());
+    EXPECT_EQ(CRpcChannel::RpcTimeout,results.status[0]);
+    EXPECT_EQ(1u,client.getPendingCount());
+
+    EXPECT_TRUE(client.cancel(uId));
+    EXPECT_FALSE(client.cancel(uId));
+    ASSERT_EQ(2u,results.ids.size());
+    EXPECT_EQ(CRpcChannel::RpcCancelled,results.status[1]);
+
+    EXPECT_TRUE(client.call((const unsigned char*)"bad",3,1000,responseFunction,&results));
+    ASSERT_EQ(3u,requests.size());
+    EXPECT_TRUE(server.replyError(requests[2],(const unsigned char*)"no",2));
+    ASSERT_EQ(3u,results.ids.size());
+    EXPECT_EQ(CRpcChannel::RpcError,results.status[2]);
+    EXPECT_EQ("no",results.responses[2]);
+    client.stop();
+}
+
+/**
+ * Blocking calls get their response or time out without a timer
+ */
+TEST(RpcChannel,callAndWait){
+    rpcPeer a,b;
+    a.link(&b);
+    b.link(&a);
+    CRpcChannel client(a),server(b);
+    std::vector<unsigned char> response;
+
+    EXPECT_EQ(CRpcChannel::RpcError,client.callAndWait((const unsigned char*)"x",1,1000,response));
+    server.registerRequestHandler(echoFunction,NULL);
+    EXPECT_EQ(CRpcChannel::RpcOk,client.callAndWait((const unsigned char*)"ping",4,1000,response));
+    EXPECT_EQ("ping",std::string(response.begin(),response.end()));
+
+    std::vector<unsigned> requests;
+    server.registerRequestHandler(deferFunction,&requests);
+    EXPECT_EQ(CRpcChannel::RpcTimeout,client.callAndWait((const unsigned char*)"ping",4,30,response));
+    EXPECT_EQ(0u,client.getPendingCount());
+}
+
+/**
+ * Exposes the id counter and the deadline heap
+ */
+class inspectedChannel: public CRpcChannel{
+public:
+    inspectedChannel(CMessaging &link):CRpcChannel(link){
+    }
+    void setNextId(unsigned uId){
+        m_uNextId=uId;
+    }
+    size_t getDeadlineCount(){
+        return m_Deadlines.size();
+    }
+};
+
+/**
+ * Ids of pending calls are not handed out again, and the deadlines of
+ * answered calls do not pile up
+ */
+TEST(RpcChannel,bookkeeping){
+    rpcPeer a,b;
+    a.link(&b);
+    b.link(&a);
+    inspectedChannel client(a);
+    CRpcChannel server(b);
+    std::vector<unsigned> requests;
+    Results_t results;
+    unsigned uFirst,uSecond;
+
+    server.registerRequestHandler(deferFunction,&requests);
+    ASSERT_TRUE(client.call((const unsigned char*)"one",3,0,responseFunction,&results,&uFirst));
+    //the counter wraps onto the pending call
+    client.setNextId(uFirst);
+    ASSERT_TRUE(client.call((const unsigned char*)"two",3,0,responseFunction,&results,&uSecond));
+    EXPECT_NE(uFirst,uSecond);
+    EXPECT_EQ(2u,client.getPendingCount());
+    client.cancelAll();
+
+    //the earliest deadline stays pending under all the answered calls
+    ASSERT_TRUE(client.call((const unsigned char*)"held",4,1000,responseFunction,&results));
+    server.registerRequestHandler(echoFunction,NULL);
+    for(unsigned i=0; i < 10000; i++){
+        ASSERT_TRUE(client.call((const unsigned char*)"quick",5,60000,responseFunction,&results));
+    }
+    EXPECT_EQ(1u,client.getPendingCount());
+    EXPECT_LT(client.getDeadlineCount(),(size_t)1000);
+    client.cancelAll();
+}
@@ -0,0 +1,83 @@
+/**
+ * @file Spsc_Ring_test.cpp
+ *
+ * Unit tests for the single producer, single consumer ring
+ * @date   Oct 18, 2026
+ */
+
+#include "gtest.h"
+#include "spsc_ring.h"
+#include <pthread.h>
+
+typedef struct {
+    CSpscRing<unsigned> *pRing;
+    unsigned uCount;
+} producer_t;
+
+/**
+ * Pushes uCount numbers, waiting whenever the ring is full
+ */
+static void *producerThread(void *pArg){
+    producer_t *pProducer=(producer_t *)pArg;
+
+    for(unsigned i=0; i < pProducer->uCount; i++){
+        while(!pProducer->pRing->push(i)){
+            pProducer->pRing->waitForSpace(-1);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Single threaded behaviour
+ */
+TEST(spscRing,basic){
+    CSpscRing<unsigned> ring(3);
+    unsigned uValue;
+
+    EXPECT_EQ(ring.capacity(),4U);
+    EXPECT_TRUE(ring.empty());
+    EXPECT_FALSE(ring.pop(uValue));
+    EXPECT_FALSE(ring.waitForData(10));
+    for(unsigned i=0; i < 4; i++){
+        EXPECT_TRUE(ring.push(i));
+    }
+    EXPECT_FALSE(ring.push(4));
+    EXPECT_FALSE(ring.waitForSpace(10));
+    EXPECT_EQ(ring.size(),4U);
+    ASSERT_TRUE(ring.front() != NULL);
+    EXPECT_EQ(*ring.front(),0U);
+    EXPECT_TRUE(ring.pop());
+    EXPECT_TRUE(ring.waitForSpace(0));
+    EXPECT_TRUE(ring.push(4));
+    for(unsigned i=1; i <= 4; i++){
+        ASSERT_TRUE(ring.pop(uValue));
+        EXPECT_EQ(uValue,i);
+    }
+    EXPECT_TRUE(ring.empty());
+}
+
+/**
+ * Everything a producer thread pushes comes out in order on the consumer
+ * thread, with both sides sleeping on the ring when they have to
+ */
+TEST(spscRing,threads){
+    CSpscRing<unsigned> ring(64);
+    producer_t producer;
+    pthread_t thread;
+    unsigned uValue;
+    unsigned uExpected=0;
+
+    producer.pRing=&ring;
+    producer.uCount=200000;
+    ASSERT_EQ(pthread_create(&thread,NULL,producerThread,&producer),0);
+    while(uExpected < producer.uCount){
+        ASSERT_TRUE(ring.waitForData(5000));
+        while(ring.pop(uValue)){
+            ASSERT_EQ(uValue,uExpected);
+            uExpected++;
+        }
+    }
+    pthread_join(thread,NULL);
+    EXPECT_TRUE(ring.empty());
+}
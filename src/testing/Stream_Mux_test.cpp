@@ -0,0 +1,250 @@
+/**
+ * @file Stream_Mux_test.cpp
+ *
+ * Unit tests for the logical streams multiplexed over one connection
+ */
+
+#include "gtest.h"
+#include "stream_mux.h"
+#include "tcp_messaging.h"
+#include "tcp_server.h"
+#include "tcp_server_link.h"
+#include "Timer.h"
+#include <string.h>
+#include <string>
+#include <vector>
+
+/**
+ * Hands everything it transmits straight to the peer
+ */
+class muxPeer: public CMessaging{
+protected:
+    muxPeer *m_pPeer;
+
+    virtual int xmitMsg(const unsigned char *pBuffer, unsigned uLength){
+        unsigned char *pCopy=new unsigned char[uLength];
+        memcpy(pCopy,pBuffer,uLength);
+        m_pPeer->processChunk(pCopy,uLength);
+        delete[] pCopy;
+        return (int)uLength;
+    }
+
+public:
+    muxPeer(){
+        m_pPeer=NULL;
+    }
+    void link(muxPeer *pPeer){
+        m_pPeer=pPeer;
+    }
+};
+
+/**
+ * Records the stream events
+ */
+typedef struct {
+    std::vector<unsigned> ids;
+    std::vector<CStreamMux::MuxEvent_t> events;
+} muxLog_t;
+
+static void notifyFunction(CStreamMux *pMux,unsigned uStreamId,CStreamMux::MuxEvent_t event,void *pUser){
+    muxLog_t *pLog=(muxLog_t*)pUser;
+
+    UNUSED(pMux);
+
+    pLog->ids.push_back(uStreamId);
+    pLog->events.push_back(event);
+}
+
+/**
+ * Takes a message off a stream as a string
+ */
+static std::string receiveString(CStreamMux &mux,unsigned uStreamId){
+    CMessaging::Message_t msg;
+    std::string results;
+
+    if(mux.receive(uStreamId,msg)){
+        results.assign((const char*)msg.pData,msg.uMsgLength);
+        delete[] msg.pData;
+    }
+    return results;
+}
+
+/**
+ * Streams are opened from either end and keep their messages apart
+ */
+TEST(StreamMux,openSendClose){
+    muxPeer a,b;
+    a.link(&b);
+    b.link(&a);
+    CStreamMux client(a,true),server(b,false);
+    muxLog_t log;
+    unsigned uFirst,uSecond,uThird;
+
+    server.registerNotify(notifyFunction,&log);
+    uFirst=client.openStream();
+    uSecond=client.openStream();
+    uThird=server.openStream();
+    ASSERT_NE(uFirst,(unsigned)CStreamMux::INVALID_STREAM);
+    EXPECT_NE(uFirst,uSecond);
+    EXPECT_NE(uFirst,uThird);
+    EXPECT_NE(uSecond,uThird);
+    EXPECT_EQ(client.getStreamCount(),3U);
+    ASSERT_EQ(log.events.size(),(size_t)2);
+    EXPECT_EQ(log.events[0],CStreamMux::MuxOpened);
+    EXPECT_EQ(log.ids[1],uSecond);
+
+    EXPECT_TRUE(client.send(uFirst,(const unsigned char*)"one",3));
+    EXPECT_TRUE(client.send(uSecond,(const unsigned char*)"two",3));
+    EXPECT_TRUE(server.send(uThird,(const unsigned char*)"three",5));
+    EXPECT_TRUE(client.send(uFirst,(const unsigned char*)"four",4));
+    EXPECT_EQ(server.getMessageCount(uFirst),2U);
+    EXPECT_EQ(server.getMessageCount(uSecond),1U);
+    EXPECT_EQ(receiveString(server,uSecond),"two");
+    EXPECT_EQ(receiveString(server,uFirst),"one");
+    EXPECT_EQ(receiveString(server,uFirst),"four");
+    EXPECT_EQ(receiveString(client,uThird),"three");
+    EXPECT_EQ(log.events.back(),CStreamMux::MuxReadable);
+
+    //the remote end learns about the close and can no longer send
+    EXPECT_TRUE(client.closeStream(uFirst));
+    EXPECT_FALSE(client.closeStream(uFirst));
+    EXPECT_EQ(log.events.back(),CStreamMux::MuxClosed);
+    EXPECT_EQ(log.ids.back(),uFirst);
+    EXPECT_FALSE(server.isOpen(uFirst));
+    EXPECT_FALSE(server.send(uFirst,(const unsigned char*)"late",4));
+    EXPECT_TRUE(server.closeStream(uFirst));
+    EXPECT_EQ(server.getStreamCount(),2U);
+    EXPECT_FALSE(client.send(uFirst,(const unsigned char*)"gone",4));
+}
+
+/**
+ * A stream whose reader falls behind stalls its own sender, not the others
+ */
+TEST(StreamMux,credit){
+    const unsigned uWindow=32*1024;
+    std::vector<unsigned char> buffer(4096,'c');
+    muxPeer a,b;
+    a.link(&b);
+    b.link(&a);
+    CStreamMux client(a,true,uWindow),server(b,false,uWindow);
+    unsigned uSlow,uFast,uSent=0;
+    CMessaging::Message_t msg;
+
+    uSlow=client.openStream();
+    uFast=client.openStream();
+    EXPECT_EQ(client.getSendCredit(uSlow),(unsigned long)uWindow);
+
+    while(client.send(uSlow,&buffer[0],(unsigned)buffer.size())){
+        uSent+=(unsigned)buffer.size();
+    }
+    EXPECT_EQ(uSent,uWindow);
+    //the other stream still flows
+    for(unsigned i=0; i < 20; i++){
+        ASSERT_TRUE(client.send(uFast,&buffer[0],(unsigned)buffer.size()));
+        ASSERT_TRUE(server.receive(uFast,msg));
+        delete[] msg.pData;
+    }
+
+    //reading half the window grants it again
+    for(unsigned i=0; i < 4; i++){
+        ASSERT_TRUE(server.receive(uSlow,msg));
+        delete[] msg.pData;
+    }
+    EXPECT_EQ(client.getSendCredit(uSlow),(unsigned long)uWindow/2);
+    EXPECT_TRUE(client.send(uSlow,&buffer[0],(unsigned)buffer.size()));
+
+    //a blocked sender gives up after its timeout
+    while(client.send(uSlow,&buffer[0],(unsigned)buffer.size()));
+    unsigned long long uStartUs=CTimer::getMonotonicUs();
+    EXPECT_FALSE(client.send(uSlow,&buffer[0],(unsigned)buffer.size(),50));
+    EXPECT_GE(CTimer::getMonotonicUs()-uStartUs,40000ULL);
+}
+
+/**
+ * Connection and stream objects of the server end of the test
+ */
+typedef struct {
+    CTcpServer *pServer;
+    CTcpServerLink *pLink;
+    CStreamMux *pMux;
+} muxServer_t;
+
+/**
+ * Echoes every message back on the stream it came in on
+ */
+static void echoNotify(CStreamMux *pMux,unsigned uStreamId,CStreamMux::MuxEvent_t event,void *pUser){
+    CMessaging::Message_t msg;
+
+    UNUSED(pUser);
+
+    if(event == CStreamMux::MuxReadable && pMux->receive(uStreamId,msg)){
+        pMux->send(uStreamId,msg.pData,(unsigned)msg.uMsgLength,1000);
+        delete[] msg.pData;
+    }
+}
+
+static bool muxConnection(CTcpServer::ConnectionState_t state,const struct sockaddr_in &clientAddr,CTcpServer::Handle_t handle,void *pUser){
+    muxServer_t *pState=(muxServer_t*)pUser;
+
+    UNUSED(clientAddr);
+
+    if(state == CTcpServer::New && pState->pLink == NULL){
+        pState->pLink=new CTcpServerLink(*pState->pServer,handle);
+        pState->pMux=new CStreamMux(*pState->pLink,false);
+        pState->pMux->registerNotify(echoNotify,NULL);
+    }
+    return true;
+}
+
+static void muxData(CTcpServer::Handle_t handle,unsigned char *pData,unsigned uLength,void *pUser){
+    muxServer_t *pState=(muxServer_t*)pUser;
+
+    UNUSED(handle);
+
+    if(pState->pLink != NULL){
+        pState->pLink->processChunk(pData,uLength);
+    }
+}
+
+/**
+ * Streams run between a CTcpMessaging client and a CTcpServer
+ */
+TEST(StreamMux,tcp){
+    const unsigned uPort=9482;
+    CTcpServer server(uPort);
+    muxServer_t state={&server,NULL,NULL};
+    CTcpMessaging client;
+    CStreamMux mux(client,true);
+    unsigned streams[3];
+    char message[32];
+
+    server.RegisterConnectionCallback(muxConnection,&state);
+    server.RegisterDataCallback(muxData,&state);
+    ASSERT_TRUE(server.StartSeverThread());
+    usleep(100*1000);
+    ASSERT_TRUE(client.connect("127.0.0.1",uPort,1000));
+
+    for(unsigned i=0; i < 3; i++){
+        streams[i]=mux.openStream();
+        ASSERT_NE(streams[i],(unsigned)CStreamMux::INVALID_STREAM);
+    }
+    for(unsigned i=0; i < 3; i++){
+        sprintf(message,"stream %u",i);
+        ASSERT_TRUE(mux.send(streams[i],(const unsigned char*)message,(unsigned)strlen(message)));
+    }
+    unsigned long long uStartUs=CTimer::getMonotonicUs();
+    while(CTimer::getMonotonicUs()-uStartUs < 5000000ULL &&
+          mux.getMessageCount(streams[0])+mux.getMessageCount(streams[1])+mux.getMessageCount(streams[2]) < 3){
+        client.runOnce(100);
+    }
+    for(unsigned i=0; i < 3; i++){
+        sprintf(message,"stream %u",i);
+        EXPECT_EQ(receiveString(mux,streams[i]),message);
+    }
+    EXPECT_TRUE(mux.closeStream(streams[1]));
+
+    server.StopSeverThread();
+    client.disconnect();
+    delete state.pMux;
+    delete state.pLink;
+}
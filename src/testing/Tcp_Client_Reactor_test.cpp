@@ -0,0 +1,120 @@
+/**
+ * @file Tcp_Client_Reactor_test.cpp
+ *
+ * Unit tests for the client event loop
+ */
+
+#include <algorithm>
+#include "gtest.h"
+#include "tcp_server.h"
+#include "tcp_client_reactor.h"
+
+/** counts the connection state changes */
+typedef struct {
+    unsigned uConnected;
+    unsigned uFailed;
+    unsigned uClosed;
+} StateCounts_t;
+
+/**
+ * Echoes received data back to the client that sent it
+ */
+static void echoFunction(CTcpServer::Handle_t handle,unsigned char *pData, unsigned uLength,void *pUser){
+    CTcpServer *pServer=(CTcpServer *) pUser;
+
+    pServer->SendToClient(handle,pData,uLength);
+}
+
+/**
+ * Counts the connection state changes
+ */
+static void stateFunction(CTcpMessaging *pConnection,CTcpClientReactor::ConnectionState_t state,void *pUser){
+    StateCounts_t *pCounts=(StateCounts_t *) pUser;
+
+    UNUSED(pConnection);
+
+    switch(state){
+    case CTcpClientReactor::Connected:     pCounts->uConnected++; break;
+    case CTcpClientReactor::ConnectFailed: pCounts->uFailed++;    break;
+    case CTcpClientReactor::Closed:        pCounts->uClosed++;    break;
+    }
+}
+
+/**
+ * Many connections driven from a single thread
+ */
+TEST(TcpClientReactor,general){
+    const unsigned uPort=9456;
+    const unsigned uConnections=100;
+    const char *pTestMessage="Sending out an SOS";
+    CTcpServer server(uPort);
+    CTcpClientReactor reactor;
+    std::vector<CTcpMessaging*> connections;
+    CMessaging::Message_t message;
+    StateCounts_t counts={0,0,0};
+    unsigned counter,received;
+
+    server.RegisterDataCallback(echoFunction,&server);
+    ASSERT_TRUE(server.Listen());
+    ASSERT_TRUE(server.StartSeverThread());
+    reactor.registerConnectionCallback(stateFunction,&counts);
+
+    //messages sent before the connection is up are queued
+    for(counter=0; counter < uConnections; counter++){
+        connections.push_back(new CTcpMessaging());
+        ASSERT_TRUE(reactor.connect(connections[counter],"127.0.0.1",uPort,1000));
+        ASSERT_TRUE(connections[counter]->sendMessage((const unsigned char*)pTestMessage,(unsigned)strlen(pTestMessage)+1));
+    }
+    EXPECT_EQ(reactor.getConnectionCount(),uConnections);
+
+    received=0;
+    for(counter=0; counter < 500 && received < uConnections; counter++){
+        ASSERT_GE(reactor.runOnce(10),0);
+        received=0;
+        for(unsigned i=0; i < uConnections; i++){
+            received+=connections[i]->getMessageCount();
+        }
+    }
+    EXPECT_EQ(counts.uConnected,uConnections);
+    ASSERT_EQ(received,uConnections);
+    for(unsigned i=0; i < uConnections; i++){
+        message=connections[i]->getMsg();
+        EXPECT_STREQ((char*)message.pData,pTestMessage);
+        delete[] message.pData;
+    }
+
+    //the server going away closes all the connections
+    server.StopSeverThread();
+    server.CloseAllConnections();
+    for(counter=0; counter < 100 && counts.uClosed < uConnections; counter++){
+        reactor.runOnce(10);
+    }
+    EXPECT_EQ(counts.uClosed,uConnections);
+    EXPECT_EQ(reactor.getConnectionCount(),(unsigned)0);
+
+    for(unsigned i=0; i < uConnections; i++){
+        delete connections[i];
+    }
+}
+
+/**
+ * Connects that do not complete are reported as failed
+ */
+TEST(TcpClientReactor,connectTimeout){
+    CTcpClientReactor reactor;
+    CTcpMessaging connection;
+    StateCounts_t counts={0,0,0};
+    unsigned counter;
+
+    reactor.registerConnectionCallback(stateFunction,&counts);
+    ASSERT_TRUE(reactor.start());
+    //non routable address, either fails right away or times out
+    if(reactor.connect(&connection,"10.255.255.1",9457,100)){
+        for(counter=0; counter < 100 && counts.uFailed == 0; counter++){
+            usleep(10*1000);
+        }
+        EXPECT_EQ(counts.uFailed,(unsigned)1);
+    }
+    reactor.stop();
+    EXPECT_EQ(reactor.getConnectionCount(),(unsigned)0);
+}
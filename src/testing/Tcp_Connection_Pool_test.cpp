@@ -0,0 +1,103 @@
+/**
+ * @file Tcp_Connection_Pool_test.cpp
+ *
+ * Unit tests for the connection pool and the connect timeout
+ */
+
+#include <algorithm>
+#include "gtest.h"
+#include "tcp_server.h"
+#include "tcp_connection_pool.h"
+#include "Timer.h"
+
+#define mSleep(x) (usleep(x*1000))
+
+/**
+ * Forwards received data to the message handler
+ */
+static void forwardFunction(CTcpServer::Handle_t handle,unsigned char *pData, unsigned uLength,void *pUser){
+    CTcpMessaging *pDest=(CTcpMessaging *) pUser;
+
+    UNUSED(handle);
+
+    pDest->processChunk(pData,uLength);
+}
+
+/**
+ * A connect to an address that does not answer must give up after the timeout
+ */
+TEST(TcpConnectionPool,connectTimeout){
+    CTcpMessaging client;
+    struct timespec start,end;
+
+    CTimer::getTime(start);
+    //non routable address
+    EXPECT_FALSE(client.connect("10.255.255.1",9453,200));
+    CTimer::getTime(end);
+    EXPECT_LT(CTimer::timespec2ms(CTimer::diff_timespec(end,start)),(unsigned long)1000);
+    EXPECT_FALSE(client.isConnected());
+}
+
+/**
+ * Hand out connections and recover from a server restart
+ */
+TEST(TcpConnectionPool,general){
+    const unsigned uPort=9454;
+    const unsigned uPoolSize=3;
+    const char *pTestMessage="Is this the real life? Is this just fantasy?";
+    CTcpMessaging dest;
+    CTcpMessaging *connections[uPoolSize];
+    CMessaging::Message_t message;
+    CTcpConnectionPool pool("127.0.0.1",uPort,uPoolSize,500,50);
+    unsigned counter;
+
+    {
+        CTcpServer server(uPort);
+        server.RegisterDataCallback(forwardFunction,&dest);
+        ASSERT_TRUE(server.Listen());
+
+        //nothing is connected until the pool is started
+        EXPECT_TRUE(pool.acquire() == NULL);
+        ASSERT_TRUE(pool.start());
+        for(counter=0; counter < 100 && pool.getIdleCount() < uPoolSize; counter++){
+            server.RunOnce(10);
+        }
+        ASSERT_EQ(pool.getIdleCount(),uPoolSize);
+
+        //all the connections can be handed out but no more
+        for(counter=0; counter < uPoolSize; counter++){
+            connections[counter]=pool.acquire();
+            ASSERT_TRUE(connections[counter] != NULL);
+        }
+        EXPECT_TRUE(pool.acquire() == NULL);
+        EXPECT_FALSE(pool.sendMessage((const unsigned char*)pTestMessage,(unsigned)strlen(pTestMessage)+1));
+        for(counter=0; counter < uPoolSize; counter++){
+            pool.release(connections[counter]);
+        }
+
+        ASSERT_TRUE(pool.sendMessage((const unsigned char*)pTestMessage,(unsigned)strlen(pTestMessage)+1));
+        for(counter=0; counter < 10 && dest.getMessageCount() == 0; counter++){
+            server.RunOnce(10);
+        }
+        ASSERT_EQ(dest.getMessageCount(),(unsigned)1);
+        message=dest.getMsg();
+        EXPECT_STREQ((char*)message.pData,pTestMessage);
+        delete[] message.pData;
+    }
+
+    //the server went away, the health check should notice
+    for(counter=0; counter < 100 && pool.getIdleCount() > 0; counter++){
+        mSleep(10);
+    }
+    EXPECT_EQ(pool.getIdleCount(),(unsigned)0);
+
+    //bring the server back, the pool reconnects on its own
+    CTcpServer server(uPort);
+    server.RegisterDataCallback(forwardFunction,&dest);
+    ASSERT_TRUE(server.Listen());
+    for(counter=0; counter < 200 && pool.getIdleCount() < uPoolSize; counter++){
+        server.RunOnce(10);
+    }
+    EXPECT_EQ(pool.getIdleCount(),uPoolSize);
+    pool.stop();
+}
@@ -0,0 +1,159 @@
+/**
+ * @file Tcp_Load_Balancer_test.cpp
+ *
+ * Unit tests for the load balancing client
+ */
+
+#include "gtest.h"
+#include "tcp_server.h"
+#include "tcp_load_balancer.h"
+#include <stdio.h>
+
+#define mSleep(x) (usleep(x*1000))
+
+/**
+ * Forwards received data to the message handler
+ */
+static void forwardFunction(CTcpServer::Handle_t handle,unsigned char *pData, unsigned uLength,void *pUser){
+    CTcpMessaging *pDest=(CTcpMessaging *) pUser;
+
+    UNUSED(handle);
+
+    pDest->processChunk(pData,uLength);
+}
+
+/**
+ * Keys are spread evenly and adding a server only moves keys to it
+ */
+TEST(TcpLoadBalancer,consistentHashing){
+    const unsigned uKeyCount=2000;
+    const unsigned uServers=4;
+    CTcpLoadBalancer balancer;
+    std::vector<int> owners;
+    unsigned counts[uServers+1]={0};
+    unsigned uMoved=0;
+    char key[32];
+    int nEndpoint;
+
+    //nothing to route to yet
+    EXPECT_EQ((int)CTcpLoadBalancer::INVALID_ENDPOINT,balancer.findEndpoint((const unsigned char*)"key",3));
+
+    for(unsigned i=0; i < uServers; i++){
+        EXPECT_EQ((int)i,balancer.addEndpoint("127.0.0.1",9470+i));
+    }
+    for(unsigned i=0; i < uKeyCount; i++){
+        snprintf(key,sizeof(key),"key%u",i);
+        nEndpoint=balancer.findEndpoint((const unsigned char*)key,(unsigned)strlen(key));
+        ASSERT_GE(nEndpoint,0);
+        owners.push_back(nEndpoint);
+        counts[nEndpoint]++;
+    }
+    for(unsigned i=0; i < uServers; i++){
+        EXPECT_GT(counts[i],uKeyCount/uServers/2);
+        EXPECT_LT(counts[i],uKeyCount/uServers*3/2);
+    }
+
+    //a new server only takes keys, it never shuffles them between the others
+    EXPECT_EQ((int)uServers,balancer.addEndpoint("127.0.0.1",9470+uServers));
+    for(unsigned i=0; i < uKeyCount; i++){
+        snprintf(key,sizeof(key),"key%u",i);
+        nEndpoint=balancer.findEndpoint((const unsigned char*)key,(unsigned)strlen(key));
+        if(nEndpoint != owners[i]){
+            EXPECT_EQ((int)uServers,nEndpoint);
+            uMoved++;
+        }
+    }
+    EXPECT_GT(uMoved,uKeyCount/(uServers+1)/2);
+    EXPECT_LT(uMoved,uKeyCount/(uServers+1)*3/2);
+
+    //and removing it puts everything back
+    ASSERT_TRUE(balancer.removeEndpoint(uServers));
+    for(unsigned i=0; i < uKeyCount; i++){
+        snprintf(key,sizeof(key),"key%u",i);
+        EXPECT_EQ(owners[i],balancer.findEndpoint((const unsigned char*)key,(unsigned)strlen(key)));
+    }
+}
+
+/**
+ * Route by key and by load, then take a failed server out of rotation
+ */
+TEST(TcpLoadBalancer,failover){
+    const unsigned uPorts[2]={9474,9475};
+    const unsigned char key[]="customer-42";
+    const char *pTestMessage="Open your eyes, look up to the skies and see";
+    CTcpLoadBalancer balancer(1,CTcpLoadBalancer::DEFAULT_VIRTUAL_NODES,500,50);
+    CTcpServer *servers[2];
+    CTcpMessaging dest[2];
+    CTcpMessaging *pFirst,*pSecond;
+    CMessaging::Message_t message;
+    int nOwner,nFirst,nSecond;
+    unsigned counter;
+
+    for(unsigned i=0; i < 2; i++){
+        servers[i]=new CTcpServer(uPorts[i]);
+        servers[i]->RegisterDataCallback(forwardFunction,&dest[i]);
+        ASSERT_TRUE(servers[i]->Listen());
+        balancer.addEndpoint("127.0.0.1",uPorts[i]);
+    }
+    ASSERT_TRUE(balancer.start());
+    for(counter=0; counter < 20; counter++){
+        servers[0]->RunOnce(5);
+        servers[1]->RunOnce(5);
+    }
+
+    //keyed messages go to the owner of the key
+    nOwner=balancer.findEndpoint(key,sizeof(key));
+    ASSERT_GE(nOwner,0);
+    ASSERT_TRUE(balancer.sendMessage(key,sizeof(key),(const unsigned char*)pTestMessage,(unsigned)strlen(pTestMessage)+1));
+    for(counter=0; counter < 10 && dest[nOwner].getMessageCount() == 0; counter++){
+        servers[nOwner]->RunOnce(10);
+    }
+    ASSERT_EQ((unsigned)1,dest[nOwner].getMessageCount());
+    message=dest[nOwner].getMsg();
+    EXPECT_STREQ((char*)message.pData,pTestMessage);
+    delete[] message.pData;
+
+    //keyless requests go to the server with the fewest outstanding requests
+    pFirst=balancer.acquire(&nFirst);
+    pSecond=balancer.acquire(&nSecond);
+    ASSERT_TRUE(pFirst != NULL);
+    ASSERT_TRUE(pSecond != NULL);
+    EXPECT_NE(nFirst,nSecond);
+    EXPECT_EQ((unsigned)1,balancer.getOutstanding(nFirst));
+    EXPECT_TRUE(balancer.acquire() == NULL);
+    //busy servers are not failed servers
+    EXPECT_TRUE(balancer.isInRotation(nFirst));
+    EXPECT_TRUE(balancer.isInRotation(nSecond));
+    balancer.release(pFirst);
+    balancer.release(pSecond);
+    EXPECT_EQ((unsigned)0,balancer.getOutstanding(nFirst));
+
+    //a busy owner hands the request on but keeps its keys
+    pFirst=balancer.acquire(key,sizeof(key),&nFirst);
+    pSecond=balancer.acquire(key,sizeof(key),&nSecond);
+    ASSERT_TRUE(pFirst != NULL);
+    ASSERT_TRUE(pSecond != NULL);
+    EXPECT_EQ(nOwner,nFirst);
+    EXPECT_EQ(1-nOwner,nSecond);
+    EXPECT_TRUE(balancer.isInRotation(nOwner));
+    balancer.release(pFirst);
+    balancer.release(pSecond);
+    EXPECT_EQ(nOwner,balancer.findEndpoint(key,sizeof(key)));
+
+    //the owner goes away and the other server takes over the key
+    delete servers[nOwner];
+    servers[nOwner]=NULL;
+    mSleep(200);
+    ASSERT_TRUE(balancer.sendMessage(key,sizeof(key),(const unsigned char*)pTestMessage,(unsigned)strlen(pTestMessage)+1));
+    EXPECT_FALSE(balancer.isInRotation(nOwner));
+    for(counter=0; counter < 10 && dest[1-nOwner].getMessageCount() == 0; counter++){
+        servers[1-nOwner]->RunOnce(10);
+    }
+    ASSERT_EQ((unsigned)1,dest[1-nOwner].getMessageCount());
+    message=dest[1-nOwner].getMsg();
+    EXPECT_STREQ((char*)message.pData,pTestMessage);
+    delete[] message.pData;
+
+    balancer.stop();
+    delete servers[1-nOwner];
+}
@@ -6,9 +6,12 @@
  */
 
 #include <algorithm>
+#include <string>
+#include <vector>
 #include "gtest.h"
 #include "tcp_server.h"
 #include "tcp_messaging.h"
+#include "Timer.h"
 
 
 /**
@@ -31,6 +34,8 @@ TEST(TcpMessaging,general){
     CTcpServer server(uPort);
     CMessaging::Message_t message;
 
+    //messages arrive on the server thread
+    ASSERT_TRUE(dest.enableReceiveRing());
     //start the server
     server.RegisterDataCallback(helperFunction,&dest);
     ASSERT_TRUE(server.StartSeverThread());
@@ -40,7 +45,7 @@ TEST(TcpMessaging,general){
     EXPECT_TRUE(src.connect("127.0.0.1",uPort));
     //send a message to the destination
     src.sendMessage((const unsigned char*)pTestMessage,(unsigned)strlen(pTestMessage)+1);
-    sleep(1);
+    EXPECT_TRUE(dest.waitForMessage(5000));
     EXPECT_TRUE(dest.getMessageCount());
     message=dest.getMsg();
     EXPECT_STREQ((char*)message.pData,pTestMessage);
@@ -49,3 +54,443 @@ TEST(TcpMessaging,general){
     server.StopSeverThread();
 }
 
+
+/**
+ * Echoes received data back to the client that sent it
+ */
+static void echoFunction(CTcpServer::Handle_t handle,unsigned char *pData, unsigned uLength,void *pUser){
+    CTcpServer *pServer=(CTcpServer *) pUser;
+
+    pServer->SendToClient(handle,pData,uLength);
+}
+
+/**
+ * Drive the server and the client from a single thread
+ * using the run once interface
+ */
+TEST(TcpMessaging,runOnce){
+    const unsigned uPort=9451;
+    const char *pTestMessage="Some of them want to use you, some of them want to be used by you";
+    CTcpMessaging client;
+    CTcpServer server(uPort);
+    CMessaging::Message_t message;
+    std::vector<CTcpServer::Handle_t> handles;
+    unsigned counter;
+
+    server.RegisterDataCallback(echoFunction,&server);
+    ASSERT_TRUE(server.Listen());
+    //nothing is pending
+    ASSERT_EQ(server.RunOnce(0),0);
+
+    ASSERT_TRUE(client.connect("127.0.0.1",uPort));
+    ASSERT_GT(client.getHandle(),0);
+    //accept the connection
+    for(counter=0; counter < 10 && server.RunOnce(100) == 0; counter++);
+    server.GetHandles(handles);
+    ASSERT_EQ(handles.size(),(size_t)2);
+    ASSERT_EQ(handles[0],server.GetListenHandle());
+
+    ASSERT_TRUE(client.sendMessage((const unsigned char*)pTestMessage,(unsigned)strlen(pTestMessage)+1));
+    //let the server echo the message back and pick it up on the client side
+    for(counter=0; counter < 10 && client.getMessageCount() == 0; counter++){
+        server.RunOnce(10);
+        ASSERT_GE(client.runOnce(10),0);
+    }
+    ASSERT_EQ(client.getMessageCount(),(unsigned)1);
+    message=client.getMsg();
+    EXPECT_STREQ((char*)message.pData,pTestMessage);
+    delete[] message.pData;
+
+    //the server should notice the client going away
+    client.disconnect();
+    for(counter=0; counter < 10 && handles.size() > 1; counter++){
+        server.RunOnce(10);
+        server.GetHandles(handles);
+    }
+    EXPECT_EQ(handles.size(),(size_t)1);
+}
+
+/**
+ * Connect using TCP fast open. The first connection has no cookie, so the
+ * message may only go out with the SYN on later connections.
+ */
+TEST(TcpMessaging,fastOpen){
+    const unsigned uPort=9452;
+    const char *pTestMessage="Ground control to major Tom";
+    CTcpMessaging dest;
+    CTcpServer server(uPort);
+    CMessaging::Message_t message;
+    unsigned counter,attempt;
+
+    server.RegisterDataCallback(helperFunction,&dest);
+    server.EnableFastOpen();
+    ASSERT_TRUE(server.Listen());
+
+    for(attempt=0; attempt < 2; attempt++){
+        CTcpMessaging src;
+        ASSERT_TRUE(src.connectFastOpen("127.0.0.1",uPort,(const unsigned char*)pTestMessage,(unsigned)strlen(pTestMessage)+1));
+        for(counter=0; counter < 10 && dest.getMessageCount() == 0; counter++){
+            server.RunOnce(10);
+        }
+        ASSERT_EQ(dest.getMessageCount(),(unsigned)1);
+        message=dest.getMsg();
+        EXPECT_STREQ((char*)message.pData,pTestMessage);
+        delete[] message.pData;
+
+        EXPECT_EQ(src.getFastOpenStats().uAttempts,(unsigned long)1);
+        EXPECT_EQ(src.getFastOpenStats().uUsed+src.getFastOpenStats().uFallbacks,(unsigned long)1);
+    }
+}
+
+/** collects the messages handed to the message callback */
+static void collectFunction(CMessaging::Message_t msg,void *pUser){
+    std::vector<std::string> *pMessages=(std::vector<std::string> *) pUser;
+
+    pMessages->push_back(std::string((char*)msg.pData));
+    delete[] msg.pData;
+}
+
+/**
+ * Receive replies on the client side
+ */
+TEST(TcpMessaging,receive){
+    const unsigned uPort=9455;
+    const char *pTestMessage="Hey Jude, don't make it bad";
+    CTcpMessaging client;
+    CTcpServer server(uPort);
+    CMessaging::Message_t message;
+    std::vector<std::string> messages;
+    unsigned counter;
+
+    server.RegisterDataCallback(echoFunction,&server);
+    ASSERT_TRUE(server.Listen());
+    ASSERT_TRUE(server.StartSeverThread());
+    ASSERT_TRUE(client.connect("127.0.0.1",uPort,1000));
+
+    //nothing to receive
+    EXPECT_FALSE(client.receiveMessage(message,50));
+
+    //blocking receive
+    ASSERT_TRUE(client.sendMessage((const unsigned char*)pTestMessage,(unsigned)strlen(pTestMessage)+1));
+    ASSERT_TRUE(client.receiveMessage(message,1000));
+    EXPECT_STREQ((char*)message.pData,pTestMessage);
+    delete[] message.pData;
+
+    //callback mode
+    client.registerMessageCallback(collectFunction,&messages);
+    for(counter=0; counter < 3; counter++){
+        ASSERT_TRUE(client.sendMessage((const unsigned char*)pTestMessage,(unsigned)strlen(pTestMessage)+1));
+    }
+    for(counter=0; counter < 100 && messages.size() < 3; counter++){
+        ASSERT_GE(client.runOnce(10),0);
+    }
+    ASSERT_EQ(messages.size(),(size_t)3);
+    EXPECT_EQ(messages[2],pTestMessage);
+    EXPECT_EQ(client.getMessageCount(),(unsigned)0);
+
+    server.StopSeverThread();
+}
+
+/**
+ * Messages sent while the server is down are replayed after reconnecting
+ */
+TEST(TcpMessaging,autoReconnect){
+    const unsigned uPort=9458;
+    const char *pTestMessages[]={"one","two","three"};
+    CTcpMessaging client,dest;
+    CTcpMessaging::ReconnectPolicy_t policy={10,100,500,64*1024};
+    CMessaging::Message_t message;
+    unsigned counter;
+
+    client.setReconnectPolicy(policy);
+    {
+        CTcpServer server(uPort);
+        server.RegisterDataCallback(helperFunction,&dest);
+        ASSERT_TRUE(server.Listen());
+        ASSERT_TRUE(client.connect("127.0.0.1",uPort));
+        ASSERT_TRUE(client.sendMessage((const unsigned char*)pTestMessages[0],(unsigned)strlen(pTestMessages[0])+1));
+        for(counter=0; counter < 10 && dest.getMessageCount() == 0; counter++){
+            server.RunOnce(10);
+        }
+        ASSERT_EQ(dest.getMessageCount(),(unsigned)1);
+        message=dest.getMsg();
+        delete[] message.pData;
+    }
+
+    //the client notices the server is gone
+    EXPECT_EQ(client.runOnce(100),-1);
+    EXPECT_FALSE(client.isConnected());
+
+    //these are held until the server is back
+    for(counter=1; counter < 3; counter++){
+        ASSERT_TRUE(client.sendMessage((const unsigned char*)pTestMessages[counter],(unsigned)strlen(pTestMessages[counter])+1));
+    }
+    EXPECT_EQ(client.getQueuedMessageCount(),(unsigned)2);
+
+    //too much data for the queue
+    {
+        std::vector<unsigned char> bigMessage(policy.uMaxQueuedBytes);
+        EXPECT_FALSE(client.sendMessage(&bigMessage[0],(unsigned)bigMessage.size()));
+    }
+
+    CTcpServer server(uPort);
+    server.RegisterDataCallback(helperFunction,&dest);
+    ASSERT_TRUE(server.Listen());
+    for(counter=0; counter < 100 && dest.getMessageCount() < 2; counter++){
+        client.runOnce(10);
+        server.RunOnce(10);
+    }
+    EXPECT_TRUE(client.isConnected());
+    EXPECT_EQ(client.getReconnectCount(),(unsigned long)1);
+    EXPECT_EQ(client.getQueuedMessageCount(),(unsigned)0);
+    ASSERT_EQ(dest.getMessageCount(),(unsigned)2);
+    for(counter=1; counter < 3; counter++){
+        message=dest.getMsg();
+        EXPECT_STREQ((char*)message.pData,pTestMessages[counter]);
+        delete[] message.pData;
+    }
+}
+
+/**
+ * Writes a canned frame, or the first part of it, to every new client
+ */
+typedef struct {
+    const unsigned char *pData;
+    unsigned uLength;
+} cannedFrame_t;
+
+static bool cannedConnection(CTcpServer::ConnectionState_t state,const struct sockaddr_in &clientAddr,CTcpServer::Handle_t handle,void *pUser){
+    cannedFrame_t *pFrame=(cannedFrame_t*)pUser;
+
+    UNUSED(clientAddr);
+    if(state == CTcpServer::New){
+        //the server lists the connection after this returns, so write to the socket directly
+        send(handle,pFrame->pData,pFrame->uLength,MSG_NOSIGNAL);
+    }
+    return true;
+}
+
+/**
+ * A frame cut off by a lost connection does not eat into the first frame
+ * received after reconnecting
+ */
+TEST(TcpMessaging,reconnectMidFrame){
+    const unsigned uPort=9483;
+    const unsigned char frame[]={0x02,0,0,0,5,'h','e','l','l','o',0x03};
+    CTcpMessaging client;
+    CTcpMessaging::ReconnectPolicy_t policy={10,100,500,64*1024};
+    CMessaging::Message_t message;
+    unsigned counter;
+
+    client.setReconnectPolicy(policy);
+    {
+        CTcpServer server(uPort);
+        cannedFrame_t half={frame,7};
+        server.RegisterConnectionCallback(cannedConnection,&half);
+        ASSERT_TRUE(server.Listen());
+        ASSERT_TRUE(client.connect("127.0.0.1",uPort));
+        for(counter=0; counter < 10; counter++){
+            server.RunOnce(10);
+            client.runOnce(10);
+        }
+        EXPECT_EQ(client.getMessageCount(),(unsigned)0);
+    }
+    EXPECT_EQ(client.runOnce(100),-1);
+
+    CTcpServer server(uPort);
+    cannedFrame_t whole={frame,sizeof(frame)};
+    server.RegisterConnectionCallback(cannedConnection,&whole);
+    ASSERT_TRUE(server.Listen());
+    for(counter=0; counter < 100 && client.getMessageCount() == 0; counter++){
+        client.runOnce(10);
+        server.RunOnce(10);
+    }
+    EXPECT_EQ(client.getReconnectCount(),(unsigned long)1);
+    ASSERT_EQ(client.getMessageCount(),(unsigned)1);
+    message=client.getMsg();
+    EXPECT_EQ(std::string((const char*)message.pData,message.uMsgLength),"hello");
+    delete[] message.pData;
+}
+
+/**
+ * Counts the calls to the vectored transmit function
+ */
+class countingMessaging: public CTcpMessaging{
+protected:
+    virtual int xmitMsgV(const struct iovec *pVector, unsigned uCount){
+        m_uCalls++;
+        return CTcpMessaging::xmitMsgV(pVector,uCount);
+    }
+public:
+    unsigned m_uCalls;
+    countingMessaging(){
+        m_uCalls=0;
+    }
+};
+
+/**
+ * A message made of several pieces goes out as one frame in one call
+ */
+TEST(TcpMessaging,vectoredSend){
+    const unsigned uPort=9462;
+    const char *pieces[]={"Is there ","life ","on Mars?"};
+    const char *pTestMessage="Is there life on Mars?";
+    struct iovec vector[3];
+    countingMessaging client;
+    CTcpMessaging dest;
+    CTcpServer server(uPort);
+    CMessaging::Message_t message;
+    unsigned counter;
+
+    server.RegisterDataCallback(helperFunction,&dest);
+    ASSERT_TRUE(server.Listen());
+    ASSERT_TRUE(client.connect("127.0.0.1",uPort));
+
+    for(unsigned i=0; i < 3; i++){
+        vector[i].iov_base=(void*)pieces[i];
+        vector[i].iov_len=strlen(pieces[i])+(i == 2 ? 1 : 0);
+    }
+    ASSERT_TRUE(client.sendMessage(vector,3));
+    EXPECT_EQ(client.m_uCalls,(unsigned)1);
+    //an empty message is a valid frame
+    ASSERT_TRUE(client.sendMessage((const unsigned char*)pTestMessage,0));
+    EXPECT_EQ(client.m_uCalls,(unsigned)2);
+
+    for(counter=0; counter < 20 && dest.getMessageCount() < 2; counter++){
+        server.RunOnce(10);
+    }
+    ASSERT_EQ(dest.getMessageCount(),(unsigned)2);
+    message=dest.getMsg();
+    EXPECT_STREQ((char*)message.pData,pTestMessage);
+    delete[] message.pData;
+    message=dest.getMsg();
+    EXPECT_EQ(message.uMsgLength,(unsigned long)0);
+    delete[] message.pData;
+}
+
+/**
+ * Messages received on the server thread are picked up on this thread
+ * through the receive ring
+ */
+TEST(TcpMessaging,receiveRing){
+    const unsigned uPort=9480;
+    const unsigned uCount=1000;
+    CTcpMessaging src,dest;
+    CTcpServer server(uPort);
+    CMessaging::Message_t message;
+    unsigned uReceived=0;
+
+    ASSERT_TRUE(dest.enableReceiveRing(16));
+    server.RegisterDataCallback(helperFunction,&dest);
+    ASSERT_TRUE(server.StartSeverThread());
+    sleep(1);
+
+    ASSERT_TRUE(src.connect("127.0.0.1",uPort));
+    for(unsigned i=0; i < uCount; i++){
+        ASSERT_TRUE(src.sendMessage((const unsigned char*)&i,sizeof(i)));
+    }
+    while(uReceived < uCount && dest.waitForMessage(5000)){
+        message=dest.getMsg();
+        ASSERT_EQ(message.uMsgLength,sizeof(unsigned));
+        EXPECT_EQ(*(unsigned *)message.pData,uReceived);
+        delete[] message.pData;
+        uReceived++;
+    }
+    EXPECT_EQ(uReceived,uCount);
+    EXPECT_FALSE(dest.waitForMessage(10));
+
+    server.StopSeverThread();
+}
+
+/**
+ * Lets the server read again after a while
+ */
+static void *drainThread(void *pUser){
+    CTcpServer *pServer=(CTcpServer *) pUser;
+
+    usleep(100*1000);
+    for(unsigned i=0; i < 300; i++){
+        pServer->RunOnce(10);
+    }
+    return NULL;
+}
+
+/**
+ * Checks that every received message is one of the frames that were sent
+ */
+static void expectIntact(CMessaging &dest,const std::vector<unsigned char> &buffer,unsigned uCount){
+    CMessaging::Message_t message;
+
+    ASSERT_EQ(dest.getMessageCount(),uCount);
+    for(unsigned i=0; i < uCount; i++){
+        message=dest.getMsg();
+        EXPECT_EQ(message.uMsgLength,buffer.size());
+        EXPECT_TRUE(message.uMsgLength == buffer.size() && memcmp(message.pData,&buffer[0],buffer.size()) == 0);
+        delete[] message.pData;
+    }
+}
+
+/**
+ * With a send deadline a full socket is waited on until the deadline
+ * passes, and the send picks up as soon as the peer reads again. A send
+ * that gives up part way through a frame takes the connection down, so the
+ * peer never sees a broken frame.
+ */
+TEST(TcpMessaging,sendDeadline){
+    const unsigned uPort=9481;
+    const unsigned uDeadlineMs=200;
+    const unsigned messageLength=64*1024;
+    std::vector<unsigned char> buffer(messageLength,'d');
+    CTcpMessaging client,dest;
+    CTcpServer server(uPort);
+    unsigned long long uStartUs=0;
+    unsigned counter,uSent=0;
+    bool bSent=true;
+    pthread_t thread;
+
+    server.RegisterDataCallback(helperFunction,&dest);
+    ASSERT_TRUE(server.Listen());
+    ASSERT_TRUE(client.connect("127.0.0.1",uPort));
+    for(counter=0; counter < 10 && server.RunOnce(100) == 0; counter++);
+
+    //nobody reads, so the socket fills up and a send runs into the deadline
+    client.setSendDeadline(uDeadlineMs);
+    for(counter=0; counter < 4096 && bSent; counter++){
+        uStartUs=CTimer::getMonotonicUs();
+        bSent=client.sendMessage(&buffer[0],messageLength);
+        uSent+=bSent ? 1 : 0;
+    }
+    ASSERT_FALSE(bSent);
+    EXPECT_GE((CTimer::getMonotonicUs()-uStartUs)/1000,(unsigned long long)uDeadlineMs-10);
+    EXPECT_LT((CTimer::getMonotonicUs()-uStartUs)/1000,(unsigned long long)uDeadlineMs*5);
+
+    //a send that follows either fails or arrives whole
+    client.setSendDeadline(5000);
+    ASSERT_EQ(pthread_create(&thread,NULL,drainThread,&server),0);
+    uSent+=client.sendMessage(&buffer[0],messageLength) ? 1 : 0;
+    pthread_join(thread,NULL);
+    while(server.RunOnce(100) > 0);
+    expectIntact(dest,buffer,uSent);
+    client.disconnect();
+
+    //the peer starts reading again while a send waits on the full socket
+    CTcpMessaging waiter,waiterDest;
+    CTcpServer waiterServer(uPort+3);
+    unsigned long long uLongestUs=0;
+
+    waiterServer.RegisterDataCallback(helperFunction,&waiterDest);
+    ASSERT_TRUE(waiterServer.Listen());
+    ASSERT_TRUE(waiter.connect("127.0.0.1",uPort+3));
+    for(counter=0; counter < 10 && waiterServer.RunOnce(100) == 0; counter++);
+    waiter.setSendDeadline(5000);
+    ASSERT_EQ(pthread_create(&thread,NULL,drainThread,&waiterServer),0);
+    for(counter=0; counter < 4096 && uLongestUs < 50000; counter++){
+        uStartUs=CTimer::getMonotonicUs();
+        ASSERT_TRUE(waiter.sendMessage(&buffer[0],messageLength));
+        uLongestUs=std::max(uLongestUs,CTimer::getMonotonicUs()-uStartUs);
+    }
+    pthread_join(thread,NULL);
+    while(waiterServer.RunOnce(100) > 0);
+    EXPECT_GE(uLongestUs,50000ULL);
+    expectIntact(waiterDest,buffer,counter);
+}
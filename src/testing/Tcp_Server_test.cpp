@@ -0,0 +1,90 @@
+/**
+ * @file Tcp_Server_test.cpp
+ *
+ * Unit tests for the CTcpServer class. The latency of the busy poll loop is
+ * measured by benchmarks/busy_poll_latency.cpp.
+ */
+
+#include "gtest.h"
+#include "tcp_server.h"
+#include "tcp_messaging.h"
+
+#define uSleep(x) (usleep(x))
+
+/** what the server saw */
+typedef struct {
+    unsigned uBytes;
+    unsigned uConnected;
+    unsigned uClosed;
+} ServerLog_t;
+
+/**
+ * Counts the received bytes
+ */
+static void countFunction(CTcpServer::Handle_t handle,unsigned char *pData, unsigned uLength,void *pUser){
+    ServerLog_t *pLog=(ServerLog_t *) pUser;
+
+    UNUSED(handle);
+    UNUSED(pData);
+
+    __sync_fetch_and_add(&pLog->uBytes,uLength);
+}
+
+/**
+ * Counts the connection state changes
+ */
+static bool stateFunction(CTcpServer::ConnectionState_t state,const struct sockaddr_in &clientAddr,CTcpServer::Handle_t handle,void *pUser){
+    ServerLog_t *pLog=(ServerLog_t *) pUser;
+
+    UNUSED(clientAddr);
+    UNUSED(handle);
+
+    if(state == CTcpServer::New){
+        __sync_fetch_and_add(&pLog->uConnected,1);
+    } else {
+        __sync_fetch_and_add(&pLog->uClosed,1);
+    }
+    return true;
+}
+
+/**
+ * Waits up to a second for a counter to reach a value
+ */
+static bool waitFor(volatile unsigned *pCounter,unsigned uValue){
+    for(unsigned wait=0; wait < 1000 && *pCounter < uValue; wait++){
+        uSleep(1000);
+    }
+    return *pCounter >= uValue;
+}
+
+/**
+ * The busy poll loop picks up new connections, their data and their
+ * close, both while it spins and after it fell back to blocking
+ */
+TEST(TcpServer,busyPoll){
+    CTcpServer server(9460);
+    ServerLog_t log={0,0,0};
+    const char *szData="ping";
+
+    server.RegisterDataCallback(countFunction,&log);
+    server.RegisterConnectionCallback(stateFunction,&log);
+    //spin for 20ms after the last activity
+    server.SetBusyPoll(20*1000);
+    ASSERT_TRUE(server.Listen());
+    ASSERT_TRUE(server.StartSeverThread());
+
+    for(unsigned i=0; i < 2; i++){
+        {
+            CTcpMessaging client;
+            ASSERT_TRUE(client.connect("127.0.0.1",9460));
+            ASSERT_TRUE(waitFor(&log.uConnected,i+1));
+            send(client.getHandle(),szData,strlen(szData),0);
+            ASSERT_TRUE(waitFor(&log.uBytes,(i+1)*strlen(szData)));
+        }
+        ASSERT_TRUE(waitFor(&log.uClosed,i+1));
+        //let the loop go back to blocking before the next client
+        uSleep(50*1000);
+    }
+    server.StopSeverThread();
+    EXPECT_EQ(log.uBytes,(unsigned)(2*strlen(szData)));
+}
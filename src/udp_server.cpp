@@ -213,9 +213,6 @@ void CUdpServer::RegisterDataCallback(DataCallback_t pCallback,void *pUser){
  */
 bool CUdpServer::start(){
     std::time_t now=time(0);
-    unsigned char buffer[64*1024];
-    int buffer_length=sizeof(buffer);
-    int nResults=0;
     UNUSED(now);
 
     PTRACE2("Server on port %u started at %s",m_uPort,ctime(&now));
@@ -224,30 +221,80 @@ bool CUdpServer::start(){
         //bad socket
         return false;
     }
-    do{
-        nResults=recv(m_Socket,(char*)buffer,buffer_length,0);
-        //check the results
+    while(m_Socket != -1){
+        if(RunOnce(-1) < 0){
+            close(m_Socket);
+            m_Socket = -1;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Runs a single iteration of the receive loop. Waits for the socket to
+ * become readable and then hands the queued datagrams to the data
+ * callback without blocking, at most MAX_DATAGRAMS_PER_RUN of them, so a
+ * steady sender cannot keep the call from returning. This allows the
+ * server to be driven from an external event loop instead of the server
+ * thread.
+ * @param nTimeoutMs Number of milliseconds to wait for data. Zero polls
+ *        without blocking and a negative value waits forever.
+ * @return Number of datagrams delivered (zero on timeout)
+ * @retval -1 if error
+ */
+int CUdpServer::RunOnce(int nTimeoutMs){
+    unsigned char buffer[64*1024];
+    int buffer_length=sizeof(buffer);
+    int nResults=0;
+    int nDelivered=0;
+    fd_set readSocks;
+    struct timeval timeout;
+
+    if(m_Socket == -1) {
+        return -1;
+    }
+
+    FD_ZERO(&readSocks);
+    FD_SET(m_Socket,&readSocks);
+    timeout.tv_sec  = nTimeoutMs / 1000;
+    timeout.tv_usec = (nTimeoutMs % 1000) * 1000;
+    nResults=select(m_Socket+1,&readSocks,NULL,NULL,(nTimeoutMs < 0) ? NULL : &timeout);
+    if(nResults <= 0){
+        if(nResults < 0 && errno != EINTR){
+            int err=errno;
+            PERROR1("Error Select: Errno: %d\n",err);
+            perror("select");
+            return -1;
+        }
+        return 0;
+    }
+
+    //drain what is queued on the socket, up to the limit
+    while(nDelivered < MAX_DATAGRAMS_PER_RUN){
+        nResults=recv(m_Socket,(char*)buffer,buffer_length,MSG_DONTWAIT);
+        if(nResults < 0){
+#           ifndef WIN32
+                int err=errno;
+#           else
+                int err=WSAGetLastError();
+#           endif
+            if(err == EAGAIN || err == EWOULDBLOCK || err == EINTR){
+                break;
+            }
+            PERROR1("Error during recv: Errno: %d\n",err);
+            perror("recv");
+            return -1;
+        }
+        nDelivered++;
+        //give the data to the user
         if(nResults > 0 && m_pNewDataCallback != NULL){
-            //give the data to the user
             m_pNewDataCallback(buffer,nResults,m_pNewDataUser);
         }
-    }while(1);
-    
-    //shut downs are ok.. that's how we stop the receive
-    if(nResults < 0){
-#       ifndef WIN32
-            int err=errno;
-#       else
-            int err=WSAGetLastError();
-#       endif
-        PERROR1("Error during recv: Errno: %d\n",err);
-        perror("recv");
-        close(m_Socket);
-        m_Socket = -1;
-        return false;
     }
 
-    return true;
+    return nDelivered;
 }
 
 /** 
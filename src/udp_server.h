@@ -38,6 +38,12 @@ public:
     bool StartServerThread();
     /** @brief this function stops the server thread */
     bool StopServerThread();
+    /** most datagrams delivered by one call to RunOnce() */
+    enum {MAX_DATAGRAMS_PER_RUN = 64};
+    /** @brief runs a single iteration of the receive loop */
+    int RunOnce(int nTimeoutMs);
+    /** @brief returns the receive socket handle */
+    SOCKET GetHandle() const { return m_Socket; }
 protected:
 	/** @brief starts the server (will not return)*/
     bool start();